@@ -0,0 +1,1604 @@
+/*
+  BCn texture compression and decompression
+  Copyright © 2019-2022 VitaSmith
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <float.h>
+
+#include "util.h"
+#include "bcn.h"
+
+// Interpolation weights of the 2, 3 and 4-bit BC6H/BC7 indices
+static const int bc7_weights2[4] = { 0, 21, 43, 64 };
+static const int bc7_weights3[8] = { 0, 9, 18, 27, 37, 46, 55, 64 };
+static const int bc7_weights4[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+static const int* const bc7_weights[5] = { NULL, NULL, bc7_weights2, bc7_weights3, bc7_weights4 };
+
+// Subset of each pixel for the 2-subset partitions (one bit per pixel)
+static const uint16_t bc7_partitions2[64] = {
+    0xcccc, 0x8888, 0xeeee, 0xecc8, 0xc880, 0xfeec, 0xfec8, 0xec80,
+    0xc800, 0xffec, 0xfe80, 0xe800, 0xffe8, 0xff00, 0xfff0, 0xf000,
+    0xf710, 0x008e, 0x7100, 0x08ce, 0x008c, 0x7310, 0x3100, 0x8cce,
+    0x088c, 0x3110, 0x6666, 0x366c, 0x17e8, 0x0ff0, 0x718e, 0x399c,
+    0xaaaa, 0xf0f0, 0x5a5a, 0x33cc, 0x3c3c, 0x55aa, 0x9696, 0xa55a,
+    0x73ce, 0x13c8, 0x324c, 0x3bdc, 0x6996, 0xc33c, 0x9966, 0x0660,
+    0x0272, 0x04e4, 0x4e40, 0x2720, 0xc936, 0x936c, 0x39c6, 0x639c,
+    0x9336, 0x9cc6, 0x817e, 0xe718, 0xccf0, 0x0fcc, 0x7744, 0xee22
+};
+
+// Index of the anchor pixel of the second subset, for 2-subset partitions
+static const uint8_t bc7_anchors2[64] = {
+    15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+    15,  2,  8,  2,  2,  8,  8, 15,  2,  8,  2,  2,  8,  8,  2,  2,
+    15, 15,  6,  8,  2,  8, 15, 15,  2,  8,  2,  2,  2, 15, 15,  6,
+     6,  2,  6,  8, 15, 15,  2,  2, 15, 15, 15, 15, 15,  2,  2, 15
+};
+
+// Read a 4x4 block, replicating the edge pixels for blocks that go past the image
+static void read_block(const uint8_t* rgba, uint32_t width, uint32_t height,
+                       uint32_t bx, uint32_t by, uint8_t block[16][4])
+{
+    for (uint32_t y = 0; y < 4; y++) {
+        uint32_t sy = min(by * 4 + y, height - 1);
+        for (uint32_t x = 0; x < 4; x++) {
+            uint32_t sx = min(bx * 4 + x, width - 1);
+            memcpy(block[y * 4 + x], &rgba[((size_t)sy * width + sx) * 4], 4);
+        }
+    }
+}
+
+static __inline float clamp_255(float v)
+{
+    return (v < 0.0f) ? 0.0f : ((v > 255.0f) ? 255.0f : v);
+}
+
+#if defined(USE_SSE2)
+// Load a pixel as 4 floats, with the channels that aren't set in channels zeroed
+static __inline __m128 load_pixel(const uint8_t pixel[4], __m128 channels)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i v = _mm_cvtsi32_si128((int)getle32(pixel));
+    v = _mm_unpacklo_epi16(_mm_unpacklo_epi8(v, zero), zero);
+    return _mm_and_ps(_mm_cvtepi32_ps(v), channels);
+}
+
+static __inline __m128 get_channel_mask(uint32_t nb_channels)
+{
+    return _mm_castsi128_ps(_mm_cmplt_epi32(_mm_setr_epi32(0, 1, 2, 3), _mm_set1_epi32((int)nb_channels)));
+}
+#endif
+
+// Get initial endpoints for the pixels selected by mask, over the first nb_channels
+// channels, as the extremes of the pixels projected onto their principal axis.
+// The axis is obtained with a few power iterations on the covariance matrix.
+static void get_endpoints(const uint8_t block[16][4], uint32_t mask, uint32_t nb_channels,
+                          float e0[4], float e1[4])
+{
+    float mean[4] = { 0 }, cov[4][4] = { { 0 } }, axis[4] = { 0 }, v[4];
+    uint32_t n = 0;
+
+#if defined(USE_SSE2)
+    // The sums are done in the same order as the C code, so the results are the same
+    const __m128 channels = get_channel_mask(nb_channels);
+    __m128 px[16], vmean = _mm_setzero_ps(), vcov[4];
+    for (uint32_t i = 0; i < 16; i++) {
+        if (!(mask & (1 << i)))
+            continue;
+        px[i] = load_pixel(block[i], channels);
+        vmean = _mm_add_ps(vmean, px[i]);
+        n++;
+    }
+    assert(n != 0);
+    vmean = _mm_div_ps(vmean, _mm_set1_ps((float)n));
+    _mm_storeu_ps(mean, vmean);
+    for (uint32_t a = 0; a < 4; a++)
+        vcov[a] = _mm_setzero_ps();
+    for (uint32_t i = 0; i < 16; i++) {
+        if (!(mask & (1 << i)))
+            continue;
+        const __m128 d = _mm_sub_ps(px[i], vmean);
+        _mm_storeu_ps(v, d);
+        for (uint32_t a = 0; a < nb_channels; a++)
+            vcov[a] = _mm_add_ps(vcov[a], _mm_mul_ps(_mm_set1_ps(v[a]), d));
+    }
+    for (uint32_t a = 0; a < 4; a++)
+        _mm_storeu_ps(cov[a], vcov[a]);
+#else
+    for (uint32_t i = 0; i < 16; i++) {
+        if (!(mask & (1 << i)))
+            continue;
+        for (uint32_t c = 0; c < nb_channels; c++)
+            mean[c] += block[i][c];
+        n++;
+    }
+    assert(n != 0);
+    for (uint32_t c = 0; c < nb_channels; c++)
+        mean[c] /= (float)n;
+    for (uint32_t i = 0; i < 16; i++) {
+        if (!(mask & (1 << i)))
+            continue;
+        for (uint32_t c = 0; c < nb_channels; c++)
+            v[c] = block[i][c] - mean[c];
+        for (uint32_t a = 0; a < nb_channels; a++)
+            for (uint32_t b = 0; b < nb_channels; b++)
+                cov[a][b] += v[a] * v[b];
+    }
+#endif
+
+    // Start from the channel with the largest variance
+    uint32_t k = 0;
+    for (uint32_t c = 1; c < nb_channels; c++)
+        if (cov[c][c] > cov[k][k])
+            k = c;
+    if (cov[k][k] == 0.0f) {
+        // All the pixels are the same
+        memcpy(e0, mean, sizeof(mean));
+        memcpy(e1, mean, sizeof(mean));
+        return;
+    }
+    for (uint32_t c = 0; c < nb_channels; c++)
+        axis[c] = cov[k][c];
+    for (uint32_t iter = 0; iter < 8; iter++) {
+        float m = 0.0f;
+        for (uint32_t a = 0; a < nb_channels; a++) {
+            v[a] = 0.0f;
+            for (uint32_t b = 0; b < nb_channels; b++)
+                v[a] += cov[a][b] * axis[b];
+            m = max(m, (v[a] < 0.0f) ? -v[a] : v[a]);
+        }
+        for (uint32_t c = 0; c < nb_channels; c++)
+            axis[c] = v[c] / m;
+    }
+
+    float len2 = 0.0f, t_min = FLT_MAX, t_max = -FLT_MAX;
+    for (uint32_t c = 0; c < nb_channels; c++)
+        len2 += axis[c] * axis[c];
+#if defined(USE_SSE2)
+    const __m128 vaxis = _mm_loadu_ps(axis);
+#endif
+    for (uint32_t i = 0; i < 16; i++) {
+        if (!(mask & (1 << i)))
+            continue;
+        float t = 0.0f;
+#if defined(USE_SSE2)
+        _mm_storeu_ps(v, _mm_mul_ps(_mm_sub_ps(px[i], vmean), vaxis));
+        for (uint32_t c = 0; c < nb_channels; c++)
+            t += v[c];
+#else
+        for (uint32_t c = 0; c < nb_channels; c++)
+            t += (block[i][c] - mean[c]) * axis[c];
+#endif
+        t /= len2;
+        t_min = min(t_min, t);
+        t_max = max(t_max, t);
+    }
+    for (uint32_t c = 0; c < nb_channels; c++) {
+        e0[c] = clamp_255(mean[c] + t_min * axis[c]);
+        e1[c] = clamp_255(mean[c] + t_max * axis[c]);
+    }
+}
+
+// Replace the endpoints with the least squares fit of the pixels selected by mask,
+// given their current indices and the interpolation factor t[] of each index.
+static bool refine_endpoints(const uint8_t block[16][4], uint32_t mask, const uint8_t indices[16],
+                             const float* t, uint32_t nb_channels, float e0[4], float e1[4])
+{
+    float aa = 0.0f, ab = 0.0f, bb = 0.0f, x[4] = { 0 }, y[4] = { 0 };
+#if defined(USE_SSE2)
+    const __m128 channels = get_channel_mask(nb_channels);
+    __m128 vx = _mm_setzero_ps(), vy = _mm_setzero_ps();
+#endif
+    for (uint32_t i = 0; i < 16; i++) {
+        if (!(mask & (1 << i)))
+            continue;
+        const float b = t[indices[i]], a = 1.0f - b;
+        aa += a * a;
+        ab += a * b;
+        bb += b * b;
+#if defined(USE_SSE2)
+        const __m128 px = load_pixel(block[i], channels);
+        vx = _mm_add_ps(vx, _mm_mul_ps(_mm_set1_ps(a), px));
+        vy = _mm_add_ps(vy, _mm_mul_ps(_mm_set1_ps(b), px));
+#else
+        for (uint32_t c = 0; c < nb_channels; c++) {
+            x[c] += a * block[i][c];
+            y[c] += b * block[i][c];
+        }
+#endif
+    }
+#if defined(USE_SSE2)
+    _mm_storeu_ps(x, vx);
+    _mm_storeu_ps(y, vy);
+#endif
+    const float det = aa * bb - ab * ab;
+    if (det > -1e-3f && det < 1e-3f)
+        return false;
+    for (uint32_t c = 0; c < nb_channels; c++) {
+        e0[c] = clamp_255((x[c] * bb - y[c] * ab) / det);
+        e1[c] = clamp_255((y[c] * aa - x[c] * ab) / det);
+    }
+    return true;
+}
+
+// Split a block into channel planes
+static void get_planes(const uint8_t block[16][4], int16_t planes[4][16])
+{
+    for (uint32_t c = 0; c < 4; c++)
+        for (uint32_t i = 0; i < 16; i++)
+            planes[c][i] = block[i][c];
+}
+
+// Pick the closest of the nb_colors palette entries for each pixel, over the first
+// nb_channels channels, and store its index and squared error. Ties go to the lowest index.
+static void get_closest_colors(const int16_t planes[4][16], uint32_t nb_channels, const int palette[][4],
+                               uint32_t nb_colors, uint8_t indices[16], uint32_t errors[16])
+{
+#if defined(USE_SSE2)
+    // The differences fit in 16 bits, so _mm_madd_epi16() can add the squares of two channels
+    // into 32 bits, which gives the errors of 4 pixels per register.
+    __m128i p[4][2], best[4], best_index[4];
+    for (uint32_t c = 0; c < nb_channels; c++) {
+        p[c][0] = _mm_loadu_si128((const __m128i*)&planes[c][0]);
+        p[c][1] = _mm_loadu_si128((const __m128i*)&planes[c][8]);
+    }
+    for (uint32_t j = 0; j < 4; j++) {
+        best[j] = _mm_set1_epi32(INT32_MAX);
+        best_index[j] = _mm_setzero_si128();
+    }
+    for (uint32_t k = 0; k < nb_colors; k++) {
+        const __m128i vk = _mm_set1_epi32((int)k);
+        __m128i d[4][2], e[4];
+        for (uint32_t c = 0; c < 4; c++) {
+            if (c < nb_channels) {
+                const __m128i v = _mm_set1_epi16((short)palette[k][c]);
+                d[c][0] = _mm_sub_epi16(p[c][0], v);
+                d[c][1] = _mm_sub_epi16(p[c][1], v);
+            } else {
+                d[c][0] = d[c][1] = _mm_setzero_si128();
+            }
+        }
+        for (uint32_t h = 0; h < 2; h++) {
+            __m128i rg = _mm_unpacklo_epi16(d[0][h], d[1][h]), ba = _mm_unpacklo_epi16(d[2][h], d[3][h]);
+            e[2 * h] = _mm_madd_epi16(rg, rg);
+            if (nb_channels > 2)
+                e[2 * h] = _mm_add_epi32(e[2 * h], _mm_madd_epi16(ba, ba));
+            rg = _mm_unpackhi_epi16(d[0][h], d[1][h]);
+            ba = _mm_unpackhi_epi16(d[2][h], d[3][h]);
+            e[2 * h + 1] = _mm_madd_epi16(rg, rg);
+            if (nb_channels > 2)
+                e[2 * h + 1] = _mm_add_epi32(e[2 * h + 1], _mm_madd_epi16(ba, ba));
+        }
+        for (uint32_t j = 0; j < 4; j++) {
+            const __m128i m = _mm_cmplt_epi32(e[j], best[j]);
+            best[j] = _mm_or_si128(_mm_and_si128(m, e[j]), _mm_andnot_si128(m, best[j]));
+            best_index[j] = _mm_or_si128(_mm_and_si128(m, vk), _mm_andnot_si128(m, best_index[j]));
+        }
+    }
+    int32_t idx[16];
+    for (uint32_t j = 0; j < 4; j++) {
+        _mm_storeu_si128((__m128i*)&errors[4 * j], best[j]);
+        _mm_storeu_si128((__m128i*)&idx[4 * j], best_index[j]);
+    }
+    for (uint32_t i = 0; i < 16; i++)
+        indices[i] = (uint8_t)idx[i];
+#else
+    for (uint32_t i = 0; i < 16; i++) {
+        errors[i] = UINT32_MAX;
+        for (uint32_t k = 0; k < nb_colors; k++) {
+            uint32_t d = 0;
+            for (uint32_t c = 0; c < nb_channels; c++)
+                d += (uint32_t)((planes[c][i] - palette[k][c]) * (planes[c][i] - palette[k][c]));
+            if (d < errors[i]) {
+                errors[i] = d;
+                indices[i] = (uint8_t)k;
+            }
+        }
+    }
+#endif
+}
+
+static __inline uint16_t pack_565(const float c[4])
+{
+    return (uint16_t)(((uint32_t)(c[0] * 31.0f / 255.0f + 0.5f) << 11) |
+        ((uint32_t)(c[1] * 63.0f / 255.0f + 0.5f) << 5) | (uint32_t)(c[2] * 31.0f / 255.0f + 0.5f));
+}
+
+static __inline void unpack_565(uint16_t v, int c[3])
+{
+    const int r = (v >> 11) & 0x1f, g = (v >> 5) & 0x3f, b = v & 0x1f;
+    c[0] = (r << 3) | (r >> 2);
+    c[1] = (g << 2) | (g >> 4);
+    c[2] = (b << 3) | (b >> 2);
+}
+
+// Pick the closest palette entry for each pixel selected by mask (the others get index 3)
+// and return the total squared error.
+static uint32_t get_color_indices(const uint8_t block[16][4], uint32_t mask, uint16_t c0,
+                                  uint16_t c1, bool three_colors, uint8_t indices[16])
+{
+    int palette[4][4];
+    int16_t planes[4][16];
+    uint32_t errors[16];
+    unpack_565(c0, palette[0]);
+    unpack_565(c1, palette[1]);
+    for (uint32_t c = 0; c < 3; c++) {
+        if (three_colors) {
+            palette[2][c] = (palette[0][c] + palette[1][c]) / 2;
+            palette[3][c] = 0;
+        } else {
+            palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+            palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+        }
+    }
+    get_planes(block, planes);
+    get_closest_colors(planes, 3, palette, three_colors ? 3 : 4, indices, errors);
+    uint32_t error = 0;
+    for (uint32_t i = 0; i < 16; i++) {
+        if (mask & (1 << i))
+            error += errors[i];
+        else
+            indices[i] = 3;
+    }
+    return error;
+}
+
+// Encode the BC1 color part of a block. Pixels with alpha < 128 are made transparent
+// when punch_through is set, which is only valid for actual BC1 (DXT1) blocks.
+static void encode_color_block(const uint8_t block[16][4], uint8_t* out, bool punch_through,
+                               bool high_quality)
+{
+    static const float t4[4] = { 0.0f, 1.0f, 1.0f / 3.0f, 2.0f / 3.0f };
+    static const float t3[4] = { 0.0f, 1.0f, 0.5f, 0.0f };
+    uint32_t mask = 0xffff;
+    uint16_t c0 = 0, c1 = 0;
+    uint8_t indices[16], tmp[16];
+
+    if (punch_through)
+        for (uint32_t i = 0; i < 16; i++)
+            if (block[i][3] < 128)
+                mask &= ~(1 << i);
+    const bool three_colors = (mask != 0xffff);
+
+    if (mask == 0) {
+        memset(indices, 3, sizeof(indices));
+    } else {
+        float e0[4], e1[4];
+        get_endpoints(block, mask, 3, e0, e1);
+        c0 = pack_565(e0);
+        c1 = pack_565(e1);
+        uint32_t error = get_color_indices(block, mask, c0, c1, three_colors, indices);
+        for (uint32_t iter = 0; high_quality && error != 0 && iter < 2; iter++) {
+            if (!refine_endpoints(block, mask, indices, three_colors ? t3 : t4, 3, e0, e1))
+                break;
+            uint16_t n0 = pack_565(e0), n1 = pack_565(e1);
+            uint32_t e = get_color_indices(block, mask, n0, n1, three_colors, tmp);
+            if (e >= error)
+                break;
+            error = e;
+            c0 = n0;
+            c1 = n1;
+            memcpy(indices, tmp, sizeof(indices));
+        }
+    }
+
+    // The order of the endpoints selects the mode: c0 > c1 for 4 colors, c0 <= c1 for
+    // 3 colors + transparent, so swap them as needed, along with the indices.
+    if (three_colors) {
+        if (c0 > c1) {
+            uint16_t t = c0; c0 = c1; c1 = t;
+            for (uint32_t i = 0; i < 16; i++)
+                if (indices[i] < 2)
+                    indices[i] ^= 1;
+        }
+    } else if (c0 < c1) {
+        uint16_t t = c0; c0 = c1; c1 = t;
+        for (uint32_t i = 0; i < 16; i++)
+            indices[i] ^= 1;
+    } else if (c0 == c1) {
+        // Decoded as 3 colors + black, but all the colors are the same
+        memset(indices, 0, sizeof(indices));
+    }
+
+    uint32_t bits = 0;
+    for (uint32_t i = 0; i < 16; i++)
+        bits |= (uint32_t)indices[i] << (2 * i);
+    setle16(&out[0], c0);
+    setle16(&out[2], c1);
+    setle32(&out[4], bits);
+}
+
+static void get_single_channel_palette(int a0, int a1, int palette[8])
+{
+    palette[0] = a0;
+    palette[1] = a1;
+    if (a0 > a1) {
+        for (int k = 2; k < 8; k++)
+            palette[k] = ((8 - k) * a0 + (k - 1) * a1 + 3) / 7;
+    } else {
+        for (int k = 2; k < 6; k++)
+            palette[k] = ((6 - k) * a0 + (k - 1) * a1 + 2) / 5;
+        palette[6] = 0;
+        palette[7] = 255;
+    }
+}
+
+static uint32_t get_single_channel_indices(const uint8_t v[16], int a0, int a1, uint8_t indices[16])
+{
+    int values[8], palette[8][4];
+    int16_t planes[4][16];
+    uint32_t errors[16], error = 0;
+    get_single_channel_palette(a0, a1, values);
+    for (uint32_t k = 0; k < 8; k++)
+        palette[k][0] = values[k];
+    for (uint32_t i = 0; i < 16; i++)
+        planes[0][i] = v[i];
+    get_closest_colors(planes, 1, palette, 8, indices, errors);
+    for (uint32_t i = 0; i < 16; i++)
+        error += errors[i];
+    return error;
+}
+
+// Encode a BC4 block, which is also the alpha part of a BC3 (DXT5) block
+static void encode_single_channel_block(const uint8_t v[16], uint8_t* out, bool high_quality)
+{
+    uint8_t indices[16], tmp[16];
+    int lo = 255, hi = 0, a0, a1;
+    for (uint32_t i = 0; i < 16; i++) {
+        lo = min(lo, v[i]);
+        hi = max(hi, v[i]);
+    }
+    // 8 interpolated values between the extremes
+    a0 = hi;
+    a1 = lo;
+    uint32_t error = get_single_channel_indices(v, a0, a1, indices);
+
+    if (high_quality && error != 0) {
+        // Try insetting the endpoints, which helps with values clustered near them
+        for (int d0 = 0; d0 < 4; d0++) {
+            for (int d1 = 0; d1 < 4; d1++) {
+                if (hi - d0 <= lo + d1)
+                    continue;
+                uint32_t e = get_single_channel_indices(v, hi - d0, lo + d1, tmp);
+                if (e < error) {
+                    error = e;
+                    a0 = hi - d0;
+                    a1 = lo + d1;
+                    memcpy(indices, tmp, sizeof(indices));
+                }
+            }
+        }
+        // Try 6 interpolated values, with 0 and 255 available as is
+        int lo6 = 255, hi6 = 0;
+        for (uint32_t i = 0; i < 16; i++) {
+            if (v[i] != 0 && v[i] != 255) {
+                lo6 = min(lo6, v[i]);
+                hi6 = max(hi6, v[i]);
+            }
+        }
+        if (lo6 > hi6)
+            lo6 = hi6 = 0;
+        uint32_t e = get_single_channel_indices(v, lo6, hi6, tmp);
+        if (e < error) {
+            a0 = lo6;
+            a1 = hi6;
+            memcpy(indices, tmp, sizeof(indices));
+        }
+    }
+
+    uint64_t bits = 0;
+    for (uint32_t i = 0; i < 16; i++)
+        bits |= (uint64_t)indices[i] << (3 * i);
+    out[0] = (uint8_t)a0;
+    out[1] = (uint8_t)a1;
+    for (uint32_t i = 0; i < 6; i++)
+        out[2 + i] = (uint8_t)(bits >> (8 * i));
+}
+
+// Encode the explicit alpha part of a BC2 (DXT3) block. BC2 is needed, along with the other
+// formats, to recreate the textures whose g1t.json format is DXT3 from uncompressed images.
+static void encode_explicit_alpha_block(const uint8_t block[16][4], uint8_t* out)
+{
+    uint64_t bits = 0;
+    for (uint32_t i = 0; i < 16; i++)
+        bits |= (uint64_t)((block[i][3] * 15 + 127) / 255) << (4 * i);
+    setle64(out, bits);
+}
+
+static void quantize_bc7_endpoint(const float e[4], uint32_t p, uint8_t q[4])
+{
+    for (uint32_t c = 0; c < 4; c++) {
+        int v = (int)((e[c] - (float)p) / 2.0f + 0.5f);
+        q[c] = (uint8_t)((v < 0) ? 0 : ((v > 127) ? 127 : v));
+    }
+}
+
+static uint32_t get_bc7_indices(const uint8_t block[16][4], const uint8_t q0[4], uint32_t p0,
+                                const uint8_t q1[4], uint32_t p1, uint8_t indices[16])
+{
+    int palette[16][4];
+    int16_t planes[4][16];
+    uint32_t errors[16], error = 0;
+    for (uint32_t c = 0; c < 4; c++) {
+        const int e0 = (q0[c] << 1) | p0, e1 = (q1[c] << 1) | p1;
+        for (uint32_t k = 0; k < 16; k++)
+            palette[k][c] = ((64 - bc7_weights4[k]) * e0 + bc7_weights4[k] * e1 + 32) >> 6;
+    }
+    get_planes(block, planes);
+    get_closest_colors(planes, 4, palette, 16, indices, errors);
+    for (uint32_t i = 0; i < 16; i++)
+        error += errors[i];
+    return error;
+}
+
+static void put_bits(uint8_t* out, uint32_t* pos, uint32_t v, uint32_t nb_bits)
+{
+    for (uint32_t i = 0; i < nb_bits; i++, (*pos)++)
+        if (v & (1U << i))
+            out[*pos / 8] |= (uint8_t)(1 << (*pos % 8));
+}
+
+// Try the p-bits for a pair of endpoints, and keep the best encoding.
+// In fast mode, each p-bit is picked on the quantization error of its endpoint alone.
+// Opaque blocks must decode to an alpha of 255, which requires both p-bits to be set.
+static void try_bc7_endpoints(const uint8_t block[16][4], const float e0[4], const float e1[4],
+                              bool opaque, bool high_quality, uint32_t* error, uint8_t q[2][4],
+                              uint32_t p[2], uint8_t indices[16])
+{
+    uint8_t cq[2][2][4], tmp[16];
+    uint32_t qe[2][2];
+    for (uint32_t j = 0; j < 2; j++) {
+        for (uint32_t pb = 0; pb < 2; pb++) {
+            const float* e = (j == 0) ? e0 : e1;
+            quantize_bc7_endpoint(e, pb, cq[j][pb]);
+            float d = 0.0f;
+            for (uint32_t c = 0; c < 4; c++) {
+                const float r = e[c] - (float)((cq[j][pb][c] << 1) | pb);
+                d += r * r;
+            }
+            qe[j][pb] = (uint32_t)d;
+        }
+    }
+    for (uint32_t p0 = 0; p0 < 2; p0++) {
+        for (uint32_t p1 = 0; p1 < 2; p1++) {
+            if (opaque && (p0 == 0 || p1 == 0))
+                continue;
+            if (!opaque && !high_quality && (qe[0][p0] > qe[0][p0 ^ 1] || qe[1][p1] > qe[1][p1 ^ 1]))
+                continue;
+            uint32_t e = get_bc7_indices(block, cq[0][p0], p0, cq[1][p1], p1, tmp);
+            if (e < *error) {
+                *error = e;
+                memcpy(q[0], cq[0][p0], 4);
+                memcpy(q[1], cq[1][p1], 4);
+                p[0] = p0;
+                p[1] = p1;
+                memcpy(indices, tmp, 16);
+            }
+        }
+    }
+}
+
+// Expand a BC7 endpoint component of bits bits, p-bit included, to 8 bits
+static __inline int expand_bc7(uint32_t v, uint32_t bits)
+{
+    return (bits >= 8) ? (int)v : (int)((v << (8 - bits)) | (v >> (2 * bits - 8)));
+}
+
+// Quantize an endpoint component to bits bits, which get followed by pbit unless it is
+// negative, picking the value that expands the closest to v
+static uint8_t quantize_bc7(float v, uint32_t bits, int pbit)
+{
+    const uint32_t total_bits = bits + ((pbit >= 0) ? 1 : 0);
+    const int max_q = (1 << bits) - 1, q0 = (int)(v * (float)max_q / 255.0f + 0.5f);
+    float best = FLT_MAX;
+    int q = 0;
+    for (int k = max(q0 - 2, 0); k <= min(q0 + 2, max_q); k++) {
+        const uint32_t x = (pbit >= 0) ? (((uint32_t)k << 1) | (uint32_t)pbit) : (uint32_t)k;
+        const float d = (float)expand_bc7(x, total_bits) - v;
+        if (d * d < best) {
+            best = d * d;
+            q = k;
+        }
+    }
+    return (uint8_t)q;
+}
+
+// Pick the indices of the pixels selected by mask, for a pair of expanded endpoints,
+// over the first nb_channels channels, and return the error of these pixels
+static uint32_t get_bc7_subset_indices(const int16_t planes[4][16], uint32_t mask, const int e[2][4],
+                                       uint32_t nb_channels, uint32_t index_bits, uint8_t indices[16])
+{
+    const int* w = bc7_weights[index_bits];
+    int palette[16][4];
+    uint8_t closest[16];
+    uint32_t errors[16], error = 0;
+    for (uint32_t k = 0; k < (1U << index_bits); k++)
+        for (uint32_t c = 0; c < nb_channels; c++)
+            palette[k][c] = ((64 - w[k]) * e[0][c] + w[k] * e[1][c] + 32) >> 6;
+    get_closest_colors(planes, nb_channels, palette, 1 << index_bits, closest, errors);
+    for (uint32_t i = 0; i < 16; i++) {
+        if (mask & (1 << i)) {
+            error += errors[i];
+            indices[i] = closest[i];
+        }
+    }
+    return error;
+}
+
+// Encode the RGB endpoints of the pixels selected by mask, with color_bits bits and either
+// a shared p-bit (mode 1) or a p-bit per endpoint (mode 3), and return their error.
+// The p-bits are searched exhaustively, and the endpoints refined with least squares.
+static uint32_t encode_bc7_subset(const uint8_t block[16][4], const int16_t planes[4][16],
+                                  uint32_t mask, uint32_t color_bits, bool shared_pbit,
+                                  uint32_t index_bits, uint8_t q[2][3], uint32_t p[2],
+                                  uint8_t indices[16])
+{
+    float e0[4], e1[4], t[16];
+    uint8_t tmp[16];
+    uint32_t error = UINT32_MAX;
+    for (uint32_t k = 0; k < (1U << index_bits); k++)
+        t[k] = (float)bc7_weights[index_bits][k] / 64.0f;
+    get_endpoints(block, mask, 3, e0, e1);
+    for (uint32_t iter = 0; iter < 3; iter++) {
+        const uint32_t previous_error = error;
+        if (iter > 0 && !refine_endpoints(block, mask, indices, t, 3, e0, e1))
+            break;
+        for (uint32_t pb = 0; pb < 4; pb++) {
+            const uint32_t p0 = pb & 1, p1 = pb >> 1;
+            if (shared_pbit && p0 != p1)
+                continue;
+            uint8_t cq[2][3];
+            int ep[2][4];
+            for (uint32_t c = 0; c < 3; c++) {
+                cq[0][c] = quantize_bc7(e0[c], color_bits, (int)p0);
+                cq[1][c] = quantize_bc7(e1[c], color_bits, (int)p1);
+                ep[0][c] = expand_bc7(((uint32_t)cq[0][c] << 1) | p0, color_bits + 1);
+                ep[1][c] = expand_bc7(((uint32_t)cq[1][c] << 1) | p1, color_bits + 1);
+            }
+            const uint32_t e = get_bc7_subset_indices(planes, mask, ep, 3, index_bits, tmp);
+            if (e < error) {
+                error = e;
+                memcpy(q, cq, sizeof(cq));
+                p[0] = p0;
+                p[1] = p1;
+                for (uint32_t i = 0; i < 16; i++)
+                    if (mask & (1 << i))
+                        indices[i] = tmp[i];
+            }
+        }
+        if (error == 0 || error >= previous_error)
+            break;
+    }
+    return error;
+}
+
+// Encode an opaque block with mode 1 (6-bit RGB endpoints, shared p-bits, 3-bit indices)
+// or mode 3 (7-bit RGB endpoints, p-bit per endpoint, 2-bit indices), using the given
+// 2-subset partition, and return its error
+static uint32_t encode_bc7_mode13(const uint8_t block[16][4], const int16_t planes[4][16],
+                                  uint32_t mode, uint32_t partition, uint8_t* out)
+{
+    const uint32_t color_bits = (mode == 1) ? 6 : 7, index_bits = (mode == 1) ? 3 : 2;
+    const uint32_t anchors[2] = { 0, bc7_anchors2[partition] };
+    uint8_t q[2][2][3], indices[16];
+    uint32_t p[2][2], error = 0;
+
+    for (uint32_t s = 0; s < 2; s++) {
+        const uint32_t mask = (s == 0) ? (~bc7_partitions2[partition] & 0xffff) : bc7_partitions2[partition];
+        error += encode_bc7_subset(block, planes, mask, color_bits, mode == 1, index_bits,
+            q[s], p[s], indices);
+        // The msb of the index of the anchor pixel of each subset is implicitly zero
+        if (indices[anchors[s]] & (1 << (index_bits - 1))) {
+            uint8_t tq[3];
+            memcpy(tq, q[s][0], 3);
+            memcpy(q[s][0], q[s][1], 3);
+            memcpy(q[s][1], tq, 3);
+            uint32_t tp = p[s][0]; p[s][0] = p[s][1]; p[s][1] = tp;
+            for (uint32_t i = 0; i < 16; i++)
+                if (mask & (1 << i))
+                    indices[i] = (uint8_t)((1 << index_bits) - 1 - indices[i]);
+        }
+    }
+
+    uint32_t pos = 0;
+    memset(out, 0, 16);
+    put_bits(out, &pos, 1 << mode, mode + 1);
+    put_bits(out, &pos, partition, 6);
+    for (uint32_t c = 0; c < 3; c++)
+        for (uint32_t s = 0; s < 2; s++)
+            for (uint32_t j = 0; j < 2; j++)
+                put_bits(out, &pos, q[s][j][c], color_bits);
+    for (uint32_t s = 0; s < 2; s++) {
+        put_bits(out, &pos, p[s][0], 1);
+        if (mode == 3)
+            put_bits(out, &pos, p[s][1], 1);
+    }
+    for (uint32_t i = 0; i < 16; i++)
+        put_bits(out, &pos, indices[i], index_bits - ((i == anchors[0] || i == anchors[1]) ? 1 : 0));
+    assert(pos == 128);
+    return error;
+}
+
+// Encode a block with mode 5 (7-bit RGB and 8-bit alpha endpoints, each with their own
+// 2-bit indices), after swapping the alpha channel with the one selected by rotation,
+// and return its error
+static uint32_t encode_bc7_mode5(const uint8_t block[16][4], uint32_t rotation, uint8_t* out)
+{
+    static const float t[4] = { 0.0f, 21.0f / 64.0f, 43.0f / 64.0f, 1.0f };
+    uint8_t rb[16][4], q[2][3] = { { 0 } }, a[2] = { 0 }, indices[16], alpha_indices[16], tmp[16];
+    int16_t planes[4][16], alpha_plane[4][16];
+    float e0[4], e1[4];
+    uint32_t error = UINT32_MAX, alpha_error = UINT32_MAX;
+
+    memcpy(rb, block, sizeof(rb));
+    for (uint32_t i = 0; rotation != 0 && i < 16; i++) {
+        rb[i][3] = block[i][rotation - 1];
+        rb[i][rotation - 1] = block[i][3];
+    }
+    get_planes(rb, planes);
+
+    get_endpoints(rb, 0xffff, 3, e0, e1);
+    for (uint32_t iter = 0; iter < 3; iter++) {
+        const uint32_t previous_error = error;
+        if (iter > 0 && !refine_endpoints(rb, 0xffff, indices, t, 3, e0, e1))
+            break;
+        uint8_t cq[2][3];
+        int ep[2][4];
+        for (uint32_t c = 0; c < 3; c++) {
+            cq[0][c] = quantize_bc7(e0[c], 7, -1);
+            cq[1][c] = quantize_bc7(e1[c], 7, -1);
+            ep[0][c] = expand_bc7(cq[0][c], 7);
+            ep[1][c] = expand_bc7(cq[1][c], 7);
+        }
+        const uint32_t e = get_bc7_subset_indices(planes, 0xffff, ep, 3, 2, tmp);
+        if (e < error) {
+            error = e;
+            memcpy(q, cq, sizeof(cq));
+            memcpy(indices, tmp, sizeof(indices));
+        }
+        if (error == 0 || error >= previous_error)
+            break;
+    }
+
+    // The alpha endpoints are stored as is, so just try a few insets from the extremes
+    int lo = 255, hi = 0;
+    for (uint32_t i = 0; i < 16; i++) {
+        alpha_plane[0][i] = rb[i][3];
+        lo = min(lo, rb[i][3]);
+        hi = max(hi, rb[i][3]);
+    }
+    for (int d0 = 0; d0 < 4; d0++) {
+        for (int d1 = 0; d1 < 4; d1++) {
+            if (lo + d0 > hi - d1 || (d0 + d1 != 0 && alpha_error == 0))
+                continue;
+            const int ep[2][4] = { { lo + d0 }, { hi - d1 } };
+            const uint32_t e = get_bc7_subset_indices(alpha_plane, 0xffff, ep, 1, 2, tmp);
+            if (e < alpha_error) {
+                alpha_error = e;
+                a[0] = (uint8_t)(lo + d0);
+                a[1] = (uint8_t)(hi - d1);
+                memcpy(alpha_indices, tmp, sizeof(alpha_indices));
+            }
+        }
+    }
+
+    // The msb of the color and alpha indices of the first pixel is implicitly zero
+    if (indices[0] & 2) {
+        uint8_t tq[3];
+        memcpy(tq, q[0], 3);
+        memcpy(q[0], q[1], 3);
+        memcpy(q[1], tq, 3);
+        for (uint32_t i = 0; i < 16; i++)
+            indices[i] = 3 - indices[i];
+    }
+    if (alpha_indices[0] & 2) {
+        uint8_t ta = a[0]; a[0] = a[1]; a[1] = ta;
+        for (uint32_t i = 0; i < 16; i++)
+            alpha_indices[i] = 3 - alpha_indices[i];
+    }
+
+    uint32_t pos = 0;
+    memset(out, 0, 16);
+    put_bits(out, &pos, 1 << 5, 6);
+    put_bits(out, &pos, rotation, 2);
+    for (uint32_t c = 0; c < 3; c++) {
+        put_bits(out, &pos, q[0][c], 7);
+        put_bits(out, &pos, q[1][c], 7);
+    }
+    put_bits(out, &pos, a[0], 8);
+    put_bits(out, &pos, a[1], 8);
+    put_bits(out, &pos, indices[0], 1);
+    for (uint32_t i = 1; i < 16; i++)
+        put_bits(out, &pos, indices[i], 2);
+    put_bits(out, &pos, alpha_indices[0], 1);
+    for (uint32_t i = 1; i < 16; i++)
+        put_bits(out, &pos, alpha_indices[i], 2);
+    assert(pos == 128);
+    // Swapping channels doesn't change the error
+    return error + alpha_error;
+}
+
+// Estimate how well each 2-subset partition fits an opaque block, from the principal
+// axis of its subsets with 3-bit indices, and return the nb_best ones that fit best
+static void get_best_bc7_partitions(const uint8_t block[16][4], const int16_t planes[4][16],
+                                    uint32_t* best, uint32_t nb_best)
+{
+    uint32_t errors[64];
+    uint8_t indices[16];
+    for (uint32_t partition = 0; partition < 64; partition++) {
+        errors[partition] = 0;
+        for (uint32_t s = 0; s < 2; s++) {
+            const uint32_t mask = (s == 0) ? (~bc7_partitions2[partition] & 0xffff) : bc7_partitions2[partition];
+            float e0[4], e1[4];
+            int ep[2][4];
+            get_endpoints(block, mask, 3, e0, e1);
+            for (uint32_t c = 0; c < 3; c++) {
+                ep[0][c] = (int)(e0[c] + 0.5f);
+                ep[1][c] = (int)(e1[c] + 0.5f);
+            }
+            errors[partition] += get_bc7_subset_indices(planes, mask, ep, 3, 3, indices);
+        }
+    }
+    for (uint32_t n = 0; n < nb_best; n++) {
+        best[n] = 0;
+        for (uint32_t partition = 1; partition < 64; partition++)
+            if (errors[partition] < errors[best[n]])
+                best[n] = partition;
+        errors[best[n]] = UINT32_MAX;
+    }
+}
+
+// Encode a BC7 block. Fast mode only uses mode 6 (single subset, RGBA endpoints with 4-bit
+// indices), which handles both opaque and transparent content reasonably well. High quality
+// mode also tries modes 1 and 3, with the partitions that fit best, for opaque blocks, as
+// well as mode 5, with all of its rotations, and keeps the encoding with the lowest error.
+// Modes 0, 2, 4 and 7 are never used.
+static void encode_bc7_block(const uint8_t block[16][4], uint8_t* out, bool high_quality)
+{
+    float e0[4], e1[4], t[16];
+    uint8_t q[2][4], indices[16];
+    uint32_t p[2] = { 0, 0 }, error = UINT32_MAX;
+
+    bool opaque = true;
+    for (uint32_t i = 0; i < 16; i++)
+        opaque &= (block[i][3] == 0xff);
+    for (uint32_t k = 0; k < 16; k++)
+        t[k] = (float)bc7_weights4[k] / 64.0f;
+    get_endpoints(block, 0xffff, 4, e0, e1);
+    try_bc7_endpoints(block, e0, e1, opaque, high_quality, &error, q, p, indices);
+    for (uint32_t iter = 0; high_quality && error != 0 && iter < 2; iter++) {
+        uint32_t previous_error = error;
+        if (!refine_endpoints(block, 0xffff, indices, t, 4, e0, e1))
+            break;
+        try_bc7_endpoints(block, e0, e1, opaque, high_quality, &error, q, p, indices);
+        if (error >= previous_error)
+            break;
+    }
+
+    // The msb of the index of the first pixel is implicitly zero
+    if (indices[0] & 8) {
+        uint8_t tq[4];
+        memcpy(tq, q[0], 4);
+        memcpy(q[0], q[1], 4);
+        memcpy(q[1], tq, 4);
+        uint32_t tp = p[0]; p[0] = p[1]; p[1] = tp;
+        for (uint32_t i = 0; i < 16; i++)
+            indices[i] = 15 - indices[i];
+    }
+
+    uint32_t pos = 0;
+    memset(out, 0, 16);
+    put_bits(out, &pos, 1 << 6, 7);
+    for (uint32_t c = 0; c < 4; c++) {
+        put_bits(out, &pos, q[0][c], 7);
+        put_bits(out, &pos, q[1][c], 7);
+    }
+    put_bits(out, &pos, p[0], 1);
+    put_bits(out, &pos, p[1], 1);
+    put_bits(out, &pos, indices[0], 3);
+    for (uint32_t i = 1; i < 16; i++)
+        put_bits(out, &pos, indices[i], 4);
+    assert(pos == 128);
+
+    if (!high_quality || error == 0)
+        return;
+    uint8_t candidate[16];
+    int16_t planes[4][16];
+    get_planes(block, planes);
+    if (opaque) {
+        uint32_t partitions[4];
+        get_best_bc7_partitions(block, planes, partitions, array_size(partitions));
+        for (uint32_t n = 0; n < array_size(partitions); n++) {
+            for (uint32_t mode = 1; mode <= 3; mode += 2) {
+                const uint32_t e = encode_bc7_mode13(block, planes, mode, partitions[n], candidate);
+                if (e < error) {
+                    error = e;
+                    memcpy(out, candidate, 16);
+                }
+            }
+        }
+    }
+    for (uint32_t rotation = 0; rotation < 4; rotation++) {
+        const uint32_t e = encode_bc7_mode5(block, rotation, candidate);
+        if (e < error) {
+            error = e;
+            memcpy(out, candidate, 16);
+        }
+    }
+}
+
+bool bcn_can_encode(enum DDS_FORMAT format)
+{
+    switch (format) {
+    case DDS_FORMAT_DXT1:
+    case DDS_FORMAT_DXT3:
+    case DDS_FORMAT_DXT5:
+    case DDS_FORMAT_BC4:
+    case DDS_FORMAT_BC7:
+        return true;
+    default:
+        return false;
+    }
+}
+
+typedef struct {
+    enum DDS_FORMAT format;
+    const uint8_t* rgba;
+    uint32_t width;
+    uint32_t height;
+    uint8_t* dst;
+    bool high_quality;
+} encode_job;
+
+// Encode one row of blocks
+static void encode_row(void* ctx, uint32_t by)
+{
+    const encode_job* job = (const encode_job*)ctx;
+    const uint32_t nb_blocks = (job->width + 3) / 4;
+    const uint32_t bpb = dds_bpb(job->format);
+    uint8_t block[16][4], v[16];
+
+    for (uint32_t bx = 0; bx < nb_blocks; bx++) {
+        uint8_t* out = &job->dst[((size_t)by * nb_blocks + bx) * bpb];
+        read_block(job->rgba, job->width, job->height, bx, by, block);
+        switch (job->format) {
+        case DDS_FORMAT_DXT1:
+            encode_color_block(block, out, true, job->high_quality);
+            break;
+        case DDS_FORMAT_DXT3:
+            encode_explicit_alpha_block(block, out);
+            encode_color_block(block, &out[8], false, job->high_quality);
+            break;
+        case DDS_FORMAT_DXT5:
+            for (uint32_t i = 0; i < 16; i++)
+                v[i] = block[i][3];
+            encode_single_channel_block(v, out, job->high_quality);
+            encode_color_block(block, &out[8], false, job->high_quality);
+            break;
+        case DDS_FORMAT_BC4:
+            for (uint32_t i = 0; i < 16; i++)
+                v[i] = block[i][0];
+            encode_single_channel_block(v, out, job->high_quality);
+            break;
+        case DDS_FORMAT_BC7:
+            encode_bc7_block(block, out, job->high_quality);
+            break;
+        default:
+            assert(false);
+            break;
+        }
+    }
+}
+
+void bcn_encode(enum DDS_FORMAT format, const uint8_t* rgba, uint32_t width,
+                uint32_t height, uint8_t* dst, bool high_quality, uint32_t nb_threads)
+{
+    assert(bcn_can_encode(format));
+    encode_job job = { format, rgba, width, height, dst, high_quality };
+    run_jobs(encode_row, &job, (height + 3) / 4, nb_threads);
+}
+
+// Decompression
+
+// Subset of each pixel for the 3-subset partitions
+static const uint8_t bc7_partitions3[64][16] = {
+    { 0, 0, 1, 1, 0, 0, 1, 1, 0, 2, 2, 1, 2, 2, 2, 2 }, { 0, 0, 0, 1, 0, 0, 1, 1, 2, 2, 1, 1, 2, 2, 2, 1 },
+    { 0, 0, 0, 0, 2, 0, 0, 1, 2, 2, 1, 1, 2, 2, 1, 1 }, { 0, 2, 2, 2, 0, 0, 2, 2, 0, 0, 1, 1, 0, 1, 1, 1 },
+    { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 2, 2, 1, 1, 2, 2 }, { 0, 0, 1, 1, 0, 0, 1, 1, 0, 0, 2, 2, 0, 0, 2, 2 },
+    { 0, 0, 2, 2, 0, 0, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1 }, { 0, 0, 1, 1, 0, 0, 1, 1, 2, 2, 1, 1, 2, 2, 1, 1 },
+    { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2 }, { 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 2, 2 },
+    { 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 2, 2, 2, 2 }, { 0, 0, 1, 2, 0, 0, 1, 2, 0, 0, 1, 2, 0, 0, 1, 2 },
+    { 0, 1, 1, 2, 0, 1, 1, 2, 0, 1, 1, 2, 0, 1, 1, 2 }, { 0, 1, 2, 2, 0, 1, 2, 2, 0, 1, 2, 2, 0, 1, 2, 2 },
+    { 0, 0, 1, 1, 0, 1, 1, 2, 1, 1, 2, 2, 1, 2, 2, 2 }, { 0, 0, 1, 1, 2, 0, 0, 1, 2, 2, 0, 0, 2, 2, 2, 0 },
+    { 0, 0, 0, 1, 0, 0, 1, 1, 0, 1, 1, 2, 1, 1, 2, 2 }, { 0, 1, 1, 1, 0, 0, 1, 1, 2, 0, 0, 1, 2, 2, 0, 0 },
+    { 0, 0, 0, 0, 1, 1, 2, 2, 1, 1, 2, 2, 1, 1, 2, 2 }, { 0, 0, 2, 2, 0, 0, 2, 2, 0, 0, 2, 2, 1, 1, 1, 1 },
+    { 0, 1, 1, 1, 0, 1, 1, 1, 0, 2, 2, 2, 0, 2, 2, 2 }, { 0, 0, 0, 1, 0, 0, 0, 1, 2, 2, 2, 1, 2, 2, 2, 1 },
+    { 0, 0, 0, 0, 0, 0, 1, 1, 0, 1, 2, 2, 0, 1, 2, 2 }, { 0, 0, 0, 0, 1, 1, 0, 0, 2, 2, 1, 0, 2, 2, 1, 0 },
+    { 0, 1, 2, 2, 0, 1, 2, 2, 0, 0, 1, 1, 0, 0, 0, 0 }, { 0, 0, 1, 2, 0, 0, 1, 2, 1, 1, 2, 2, 2, 2, 2, 2 },
+    { 0, 1, 1, 0, 1, 2, 2, 1, 1, 2, 2, 1, 0, 1, 1, 0 }, { 0, 0, 0, 0, 0, 1, 1, 0, 1, 2, 2, 1, 1, 2, 2, 1 },
+    { 0, 0, 2, 2, 1, 1, 0, 2, 1, 1, 0, 2, 0, 0, 2, 2 }, { 0, 1, 1, 0, 0, 1, 1, 0, 2, 0, 0, 2, 2, 2, 2, 2 },
+    { 0, 0, 1, 1, 0, 1, 2, 2, 0, 1, 2, 2, 0, 0, 1, 1 }, { 0, 0, 0, 0, 2, 0, 0, 0, 2, 2, 1, 1, 2, 2, 2, 1 },
+    { 0, 0, 0, 0, 0, 0, 0, 2, 1, 1, 2, 2, 1, 2, 2, 2 }, { 0, 2, 2, 2, 0, 0, 2, 2, 0, 0, 1, 2, 0, 0, 1, 1 },
+    { 0, 0, 1, 1, 0, 0, 1, 2, 0, 0, 2, 2, 0, 2, 2, 2 }, { 0, 1, 2, 0, 0, 1, 2, 0, 0, 1, 2, 0, 0, 1, 2, 0 },
+    { 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 0, 0, 0, 0 }, { 0, 1, 2, 0, 1, 2, 0, 1, 2, 0, 1, 2, 0, 1, 2, 0 },
+    { 0, 1, 2, 0, 2, 0, 1, 2, 1, 2, 0, 1, 0, 1, 2, 0 }, { 0, 0, 1, 1, 2, 2, 0, 0, 1, 1, 2, 2, 0, 0, 1, 1 },
+    { 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 0, 0, 0, 0, 1, 1 }, { 0, 1, 0, 1, 0, 1, 0, 1, 2, 2, 2, 2, 2, 2, 2, 2 },
+    { 0, 0, 0, 0, 0, 0, 0, 0, 2, 1, 2, 1, 2, 1, 2, 1 }, { 0, 0, 2, 2, 1, 1, 2, 2, 0, 0, 2, 2, 1, 1, 2, 2 },
+    { 0, 0, 2, 2, 0, 0, 1, 1, 0, 0, 2, 2, 0, 0, 1, 1 }, { 0, 2, 2, 0, 1, 2, 2, 1, 0, 2, 2, 0, 1, 2, 2, 1 },
+    { 0, 1, 0, 1, 2, 2, 2, 2, 2, 2, 2, 2, 0, 1, 0, 1 }, { 0, 0, 0, 0, 2, 1, 2, 1, 2, 1, 2, 1, 2, 1, 2, 1 },
+    { 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 2, 2, 2, 2 }, { 0, 2, 2, 2, 0, 1, 1, 1, 0, 2, 2, 2, 0, 1, 1, 1 },
+    { 0, 0, 0, 2, 1, 1, 1, 2, 0, 0, 0, 2, 1, 1, 1, 2 }, { 0, 0, 0, 0, 2, 1, 1, 2, 2, 1, 1, 2, 2, 1, 1, 2 },
+    { 0, 2, 2, 2, 0, 1, 1, 1, 0, 1, 1, 1, 0, 2, 2, 2 }, { 0, 0, 0, 2, 1, 1, 1, 2, 1, 1, 1, 2, 0, 0, 0, 2 },
+    { 0, 1, 1, 0, 0, 1, 1, 0, 0, 1, 1, 0, 2, 2, 2, 2 }, { 0, 0, 0, 0, 0, 0, 0, 0, 2, 1, 1, 2, 2, 1, 1, 2 },
+    { 0, 1, 1, 0, 0, 1, 1, 0, 2, 2, 2, 2, 2, 2, 2, 2 }, { 0, 0, 2, 2, 0, 0, 1, 1, 0, 0, 1, 1, 0, 0, 2, 2 },
+    { 0, 0, 2, 2, 1, 1, 2, 2, 1, 1, 2, 2, 0, 0, 2, 2 }, { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 1, 1, 2 },
+    { 0, 0, 0, 2, 0, 0, 0, 1, 0, 0, 0, 2, 0, 0, 0, 1 }, { 0, 2, 2, 2, 1, 2, 2, 2, 0, 2, 2, 2, 1, 2, 2, 2 },
+    { 0, 1, 0, 1, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2 }, { 0, 1, 1, 1, 2, 0, 1, 1, 2, 2, 0, 1, 2, 2, 2, 0 }
+};
+
+// Index of the anchor pixels of the second and third subsets, for 3-subset partitions
+static const uint8_t bc7_anchors3[2][64] = {
+    {
+         3,  3, 15, 15,  8,  3, 15, 15,  8,  8,  6,  6,  6,  5,  3,  3,
+         3,  3,  8, 15,  3,  3,  6, 10,  5,  8,  8,  6,  8,  5, 15, 15,
+         8, 15,  3,  5,  6, 10,  8, 15, 15,  3, 15,  5, 15, 15, 15, 15,
+         3, 15,  5,  5,  5,  8,  5, 10,  5, 10,  8, 13, 15, 12,  3,  3
+    }, {
+        15,  8,  8,  3, 15, 15,  3,  8, 15, 15, 15, 15, 15, 15, 15,  8,
+        15,  8, 15,  3, 15,  8, 15,  8,  3, 15,  6, 10, 15, 15, 10,  8,
+        15,  3, 15, 10, 10,  8,  9, 10,  6, 15,  8, 15,  3,  6,  6,  8,
+        15,  3, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,  3, 15, 15,  8
+    }
+};
+
+// Read the bits of a 128-bit block, from the least significant ones
+typedef struct {
+    uint64_t lo;
+    uint64_t hi;
+} bit_reader;
+
+static __inline uint32_t read_bits(bit_reader* br, uint32_t nb_bits)
+{
+    if (nb_bits == 0)
+        return 0;
+    uint32_t v = (uint32_t)(br->lo & ((1ULL << nb_bits) - 1));
+    br->lo = (br->lo >> nb_bits) | (br->hi << (64 - nb_bits));
+    br->hi >>= nb_bits;
+    return v;
+}
+
+// Get the subset of each pixel of a partition, as well as the anchor of each subset
+static void get_partition(uint32_t nb_subsets, uint32_t partition, uint8_t subsets[16], uint8_t anchors[3])
+{
+    anchors[0] = 0;
+    for (uint32_t i = 0; i < 16; i++) {
+        if (nb_subsets == 2)
+            subsets[i] = (bc7_partitions2[partition] >> i) & 1;
+        else if (nb_subsets == 3)
+            subsets[i] = bc7_partitions3[partition][i];
+        else
+            subsets[i] = 0;
+    }
+    if (nb_subsets == 2) {
+        anchors[1] = bc7_anchors2[partition];
+    } else if (nb_subsets == 3) {
+        anchors[1] = bc7_anchors3[0][partition];
+        anchors[2] = bc7_anchors3[1][partition];
+    }
+}
+
+// Write a decoded block, leaving out the pixels that go past the image
+static void write_block(const uint8_t block[16][4], uint8_t* rgba, uint32_t width,
+                        uint32_t height, uint32_t bx, uint32_t by)
+{
+    const uint32_t n = min(4, width - bx * 4);
+    for (uint32_t y = 0; y < 4 && by * 4 + y < height; y++)
+        memcpy(&rgba[((size_t)(by * 4 + y) * width + bx * 4) * 4], block[y * 4], n * 4);
+}
+
+static void decode_color_block(const uint8_t* in, uint8_t block[16][4], bool punch_through)
+{
+    int palette[4][4];
+    const uint16_t c0 = getle16(&in[0]), c1 = getle16(&in[2]);
+    const uint32_t bits = getle32(&in[4]);
+    const bool three_colors = punch_through && (c0 <= c1);
+    unpack_565(c0, palette[0]);
+    unpack_565(c1, palette[1]);
+    for (uint32_t c = 0; c < 3; c++) {
+        if (three_colors) {
+            palette[2][c] = (palette[0][c] + palette[1][c]) / 2;
+            palette[3][c] = 0;
+        } else {
+            palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+            palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+        }
+    }
+    palette[0][3] = palette[1][3] = palette[2][3] = 255;
+    palette[3][3] = three_colors ? 0 : 255;
+    for (uint32_t i = 0; i < 16; i++) {
+        const int* p = palette[(bits >> (2 * i)) & 3];
+        for (uint32_t c = 0; c < 4; c++)
+            block[i][c] = (uint8_t)p[c];
+    }
+}
+
+// Decode a BC4 block, or the alpha part of a BC3 block, into channel c
+static void decode_single_channel_block(const uint8_t* in, uint8_t block[16][4], uint32_t c)
+{
+    int palette[8];
+    get_single_channel_palette(in[0], in[1], palette);
+    const uint64_t bits = getle64(in) >> 16;
+    for (uint32_t i = 0; i < 16; i++)
+        block[i][c] = (uint8_t)palette[(bits >> (3 * i)) & 7];
+}
+
+static void decode_explicit_alpha_block(const uint8_t* in, uint8_t block[16][4])
+{
+    const uint64_t bits = getle64(in);
+    for (uint32_t i = 0; i < 16; i++)
+        block[i][3] = (uint8_t)(((bits >> (4 * i)) & 0xf) * 17);
+}
+
+typedef struct {
+    uint8_t nb_subsets;
+    uint8_t partition_bits;
+    uint8_t rotation_bits;
+    uint8_t index_selection_bits;
+    uint8_t color_bits;
+    uint8_t alpha_bits;
+    uint8_t endpoint_pbits;
+    uint8_t shared_pbits;
+    uint8_t index_bits;
+    uint8_t index_bits2;
+} bc7_mode;
+
+static const bc7_mode bc7_modes[8] = {
+    { 3, 4, 0, 0, 4, 0, 1, 0, 3, 0 },
+    { 2, 6, 0, 0, 6, 0, 0, 1, 3, 0 },
+    { 3, 6, 0, 0, 5, 0, 0, 0, 2, 0 },
+    { 2, 6, 0, 0, 7, 0, 1, 0, 2, 0 },
+    { 1, 0, 2, 1, 5, 6, 0, 0, 2, 3 },
+    { 1, 0, 2, 0, 7, 8, 0, 0, 2, 2 },
+    { 1, 0, 0, 0, 7, 7, 1, 0, 4, 0 },
+    { 2, 6, 0, 0, 5, 5, 1, 0, 2, 0 },
+};
+
+static void decode_bc7_block(const uint8_t* in, uint8_t block[16][4])
+{
+    bit_reader br = { getle64(in), getle64(&in[8]) };
+    uint32_t mode = 0;
+    while (mode < 8 && read_bits(&br, 1) == 0)
+        mode++;
+    if (mode >= 8) {
+        // Reserved mode, which decodes to transparent black
+        memset(block, 0, 16 * 4);
+        return;
+    }
+    const bc7_mode* m = &bc7_modes[mode];
+    const uint32_t partition = read_bits(&br, m->partition_bits);
+    const uint32_t rotation = read_bits(&br, m->rotation_bits);
+    const uint32_t index_selection = read_bits(&br, m->index_selection_bits);
+    const uint32_t nb_endpoints = 2 * m->nb_subsets;
+    const uint32_t nb_channels = (m->alpha_bits != 0) ? 4 : 3;
+    int e[6][4];
+    uint32_t p[6] = { 0 };
+
+    for (uint32_t c = 0; c < nb_channels; c++)
+        for (uint32_t i = 0; i < nb_endpoints; i++)
+            e[i][c] = (int)read_bits(&br, (c < 3) ? m->color_bits : m->alpha_bits);
+    if (m->endpoint_pbits) {
+        for (uint32_t i = 0; i < nb_endpoints; i++)
+            p[i] = read_bits(&br, 1);
+    } else if (m->shared_pbits) {
+        for (uint32_t s = 0; s < m->nb_subsets; s++)
+            p[2 * s] = p[2 * s + 1] = read_bits(&br, 1);
+    }
+    // Expand the endpoints to 8 bits
+    for (uint32_t i = 0; i < nb_endpoints; i++) {
+        for (uint32_t c = 0; c < nb_channels; c++) {
+            uint32_t bits = (c < 3) ? m->color_bits : m->alpha_bits;
+            if (m->endpoint_pbits || m->shared_pbits) {
+                e[i][c] = (e[i][c] << 1) | (int)p[i];
+                bits++;
+            }
+            e[i][c] = (e[i][c] << (8 - bits)) | (e[i][c] >> (2 * bits - 8));
+        }
+        if (nb_channels == 3)
+            e[i][3] = 255;
+    }
+
+    uint8_t subsets[16], anchors[3], indices[16], indices2[16];
+    get_partition(m->nb_subsets, partition, subsets, anchors);
+    for (uint32_t i = 0; i < 16; i++)
+        indices[i] = (uint8_t)read_bits(&br, m->index_bits - (anchors[subsets[i]] == i ? 1 : 0));
+    if (m->index_bits2) {
+        for (uint32_t i = 0; i < 16; i++)
+            indices2[i] = (uint8_t)read_bits(&br, m->index_bits2 - (i == 0 ? 1 : 0));
+    }
+
+    // Modes 4 and 5 have separate indices for color and alpha
+    int wc[16], wa[16];
+    for (uint32_t i = 0; i < 16; i++) {
+        wc[i] = wa[i] = bc7_weights[m->index_bits][indices[i]];
+        if (m->index_bits2) {
+            if (index_selection) {
+                wc[i] = bc7_weights[m->index_bits2][indices2[i]];
+            } else {
+                wa[i] = bc7_weights[m->index_bits2][indices2[i]];
+            }
+        }
+    }
+
+#if defined(USE_SSE2)
+    // Interpolate the 4 channels of a pixel at once, from (e0, e1) and (64 - w, w) pairs
+    __m128i ev[3];
+    for (uint32_t s = 0; s < m->nb_subsets; s++)
+        ev[s] = _mm_setr_epi16((int16_t)e[2 * s][0], (int16_t)e[2 * s + 1][0],
+                               (int16_t)e[2 * s][1], (int16_t)e[2 * s + 1][1],
+                               (int16_t)e[2 * s][2], (int16_t)e[2 * s + 1][2],
+                               (int16_t)e[2 * s][3], (int16_t)e[2 * s + 1][3]);
+    const __m128i round = _mm_set1_epi32(32);
+    for (uint32_t i = 0; i < 16; i += 4) {
+        __m128i v[4];
+        for (uint32_t j = 0; j < 4; j++) {
+            const int pc = (64 - wc[i + j]) | (wc[i + j] << 16);
+            const int pa = (64 - wa[i + j]) | (wa[i + j] << 16);
+            v[j] = _mm_madd_epi16(ev[subsets[i + j]], _mm_setr_epi32(pc, pc, pc, pa));
+            v[j] = _mm_srai_epi32(_mm_add_epi32(v[j], round), 6);
+        }
+        _mm_storeu_si128((__m128i*)block[i],
+            _mm_packus_epi16(_mm_packs_epi32(v[0], v[1]), _mm_packs_epi32(v[2], v[3])));
+    }
+#else
+    for (uint32_t i = 0; i < 16; i++) {
+        const int* e0 = e[2 * subsets[i]];
+        const int* e1 = e[2 * subsets[i] + 1];
+        for (uint32_t c = 0; c < 4; c++) {
+            const int w = (c < 3) ? wc[i] : wa[i];
+            block[i][c] = (uint8_t)((e0[c] * (64 - w) + e1[c] * w + 32) >> 6);
+        }
+    }
+#endif
+    if (rotation != 0) {
+        for (uint32_t i = 0; i < 16; i++) {
+            uint8_t tmp = block[i][3];
+            block[i][3] = block[i][rotation - 1];
+            block[i][rotation - 1] = tmp;
+        }
+    }
+}
+
+// BC6H endpoint components: base endpoint (w), then second endpoint of the first
+// subset (x) and endpoints of the second subset (y, z), plus the partition (d).
+enum { BC6H_END, RW, GW, BW, RX, GX, BX, RY, GY, BY, RZ, GZ, BZ, D };
+
+// A run of consecutive bits from a component, listed from the high bit to the
+// low bit as in the specs. A high bit that is lower than the low one denotes a
+// run that is stored in reverse order.
+typedef struct {
+    uint8_t component;
+    uint8_t high;
+    uint8_t low;
+} bc6h_bits;
+
+typedef struct {
+    uint8_t mode;
+    bool transformed;
+    uint8_t nb_subsets;
+    uint8_t endpoint_bits;
+    uint8_t delta_bits[3];
+    bc6h_bits layout[25];
+} bc6h_mode;
+
+static const bc6h_mode bc6h_modes[14] = {
+    { 0x00, true, 2, 10, { 5, 5, 5 }, {
+        { GY, 4, 4 }, { BY, 4, 4 }, { BZ, 4, 4 }, { RW, 9, 0 }, { GW, 9, 0 }, { BW, 9, 0 },
+        { RX, 4, 0 }, { GZ, 4, 4 }, { GY, 3, 0 }, { GX, 4, 0 }, { BZ, 0, 0 }, { GZ, 3, 0 },
+        { BX, 4, 0 }, { BZ, 1, 1 }, { BY, 3, 0 }, { RY, 4, 0 }, { BZ, 2, 2 }, { RZ, 4, 0 },
+        { BZ, 3, 3 }, { D, 4, 0 } } },
+    { 0x01, true, 2, 7, { 6, 6, 6 }, {
+        { GY, 5, 5 }, { GZ, 4, 4 }, { GZ, 5, 5 }, { RW, 6, 0 }, { BZ, 0, 0 }, { BZ, 1, 1 },
+        { BY, 4, 4 }, { GW, 6, 0 }, { BY, 5, 5 }, { BZ, 2, 2 }, { GY, 4, 4 }, { BW, 6, 0 },
+        { BZ, 3, 3 }, { BZ, 5, 5 }, { BZ, 4, 4 }, { RX, 5, 0 }, { GY, 3, 0 }, { GX, 5, 0 },
+        { GZ, 3, 0 }, { BX, 5, 0 }, { BY, 3, 0 }, { RY, 5, 0 }, { RZ, 5, 0 }, { D, 4, 0 } } },
+    { 0x02, true, 2, 11, { 5, 4, 4 }, {
+        { RW, 9, 0 }, { GW, 9, 0 }, { BW, 9, 0 }, { RX, 4, 0 }, { RW, 10, 10 }, { GY, 3, 0 },
+        { GX, 3, 0 }, { GW, 10, 10 }, { BZ, 0, 0 }, { GZ, 3, 0 }, { BX, 3, 0 }, { BW, 10, 10 },
+        { BZ, 1, 1 }, { BY, 3, 0 }, { RY, 4, 0 }, { BZ, 2, 2 }, { RZ, 4, 0 }, { BZ, 3, 3 },
+        { D, 4, 0 } } },
+    { 0x06, true, 2, 11, { 4, 5, 4 }, {
+        { RW, 9, 0 }, { GW, 9, 0 }, { BW, 9, 0 }, { RX, 3, 0 }, { RW, 10, 10 }, { GZ, 4, 4 },
+        { GY, 3, 0 }, { GX, 4, 0 }, { GW, 10, 10 }, { GZ, 3, 0 }, { BX, 3, 0 }, { BW, 10, 10 },
+        { BZ, 1, 1 }, { BY, 3, 0 }, { RY, 3, 0 }, { BZ, 0, 0 }, { BZ, 2, 2 }, { RZ, 3, 0 },
+        { GY, 4, 4 }, { BZ, 3, 3 }, { D, 4, 0 } } },
+    { 0x0a, true, 2, 11, { 4, 4, 5 }, {
+        { RW, 9, 0 }, { GW, 9, 0 }, { BW, 9, 0 }, { RX, 3, 0 }, { RW, 10, 10 }, { BY, 4, 4 },
+        { GY, 3, 0 }, { GX, 3, 0 }, { GW, 10, 10 }, { BZ, 0, 0 }, { GZ, 3, 0 }, { BX, 4, 0 },
+        { BW, 10, 10 }, { BY, 3, 0 }, { RY, 3, 0 }, { BZ, 1, 1 }, { BZ, 2, 2 }, { RZ, 3, 0 },
+        { BZ, 4, 4 }, { BZ, 3, 3 }, { D, 4, 0 } } },
+    { 0x0e, true, 2, 9, { 5, 5, 5 }, {
+        { RW, 8, 0 }, { BY, 4, 4 }, { GW, 8, 0 }, { GY, 4, 4 }, { BW, 8, 0 }, { BZ, 4, 4 },
+        { RX, 4, 0 }, { GZ, 4, 4 }, { GY, 3, 0 }, { GX, 4, 0 }, { BZ, 0, 0 }, { GZ, 3, 0 },
+        { BX, 4, 0 }, { BZ, 1, 1 }, { BY, 3, 0 }, { RY, 4, 0 }, { BZ, 2, 2 }, { RZ, 4, 0 },
+        { BZ, 3, 3 }, { D, 4, 0 } } },
+    { 0x12, true, 2, 8, { 6, 5, 5 }, {
+        { RW, 7, 0 }, { GZ, 4, 4 }, { BY, 4, 4 }, { GW, 7, 0 }, { BZ, 2, 2 }, { GY, 4, 4 },
+        { BW, 7, 0 }, { BZ, 3, 3 }, { BZ, 4, 4 }, { RX, 5, 0 }, { GY, 3, 0 }, { GX, 4, 0 },
+        { BZ, 0, 0 }, { GZ, 3, 0 }, { BX, 4, 0 }, { BZ, 1, 1 }, { BY, 3, 0 }, { RY, 5, 0 },
+        { RZ, 5, 0 }, { D, 4, 0 } } },
+    { 0x16, true, 2, 8, { 5, 6, 5 }, {
+        { RW, 7, 0 }, { BZ, 0, 0 }, { BY, 4, 4 }, { GW, 7, 0 }, { GY, 5, 5 }, { GY, 4, 4 },
+        { BW, 7, 0 }, { GZ, 5, 5 }, { BZ, 4, 4 }, { RX, 4, 0 }, { GZ, 4, 4 }, { GY, 3, 0 },
+        { GX, 5, 0 }, { GZ, 3, 0 }, { BX, 4, 0 }, { BZ, 1, 1 }, { BY, 3, 0 }, { RY, 4, 0 },
+        { BZ, 2, 2 }, { RZ, 4, 0 }, { BZ, 3, 3 }, { D, 4, 0 } } },
+    { 0x1a, true, 2, 8, { 5, 5, 6 }, {
+        { RW, 7, 0 }, { BZ, 1, 1 }, { BY, 4, 4 }, { GW, 7, 0 }, { BY, 5, 5 }, { GY, 4, 4 },
+        { BW, 7, 0 }, { BZ, 5, 5 }, { BZ, 4, 4 }, { RX, 4, 0 }, { GZ, 4, 4 }, { GY, 3, 0 },
+        { GX, 4, 0 }, { BZ, 0, 0 }, { GZ, 3, 0 }, { BX, 5, 0 }, { BY, 3, 0 }, { RY, 4, 0 },
+        { BZ, 2, 2 }, { RZ, 4, 0 }, { BZ, 3, 3 }, { D, 4, 0 } } },
+    { 0x1e, false, 2, 6, { 6, 6, 6 }, {
+        { RW, 5, 0 }, { GZ, 4, 4 }, { BZ, 0, 0 }, { BZ, 1, 1 }, { BY, 4, 4 }, { GW, 5, 0 },
+        { GY, 5, 5 }, { BY, 5, 5 }, { BZ, 2, 2 }, { GY, 4, 4 }, { BW, 5, 0 }, { GZ, 5, 5 },
+        { BZ, 3, 3 }, { BZ, 5, 5 }, { BZ, 4, 4 }, { RX, 5, 0 }, { GY, 3, 0 }, { GX, 5, 0 },
+        { GZ, 3, 0 }, { BX, 5, 0 }, { BY, 3, 0 }, { RY, 5, 0 }, { RZ, 5, 0 }, { D, 4, 0 } } },
+    { 0x03, false, 1, 10, { 10, 10, 10 }, {
+        { RW, 9, 0 }, { GW, 9, 0 }, { BW, 9, 0 }, { RX, 9, 0 }, { GX, 9, 0 }, { BX, 9, 0 } } },
+    { 0x07, true, 1, 11, { 9, 9, 9 }, {
+        { RW, 9, 0 }, { GW, 9, 0 }, { BW, 9, 0 }, { RX, 8, 0 }, { RW, 10, 10 }, { GX, 8, 0 },
+        { GW, 10, 10 }, { BX, 8, 0 }, { BW, 10, 10 } } },
+    { 0x0b, true, 1, 12, { 8, 8, 8 }, {
+        { RW, 9, 0 }, { GW, 9, 0 }, { BW, 9, 0 }, { RX, 7, 0 }, { RW, 10, 11 }, { GX, 7, 0 },
+        { GW, 10, 11 }, { BX, 7, 0 }, { BW, 10, 11 } } },
+    { 0x0f, true, 1, 16, { 4, 4, 4 }, {
+        { RW, 9, 0 }, { GW, 9, 0 }, { BW, 9, 0 }, { RX, 3, 0 }, { RW, 10, 15 }, { GX, 3, 0 },
+        { GW, 10, 15 }, { BX, 3, 0 }, { BW, 10, 15 } } },
+};
+
+static __inline int sign_extend(int v, uint32_t bits)
+{
+    return (v & (1 << (bits - 1))) ? (v | -(1 << bits)) : v;
+}
+
+// Scale a quantized BC6H endpoint to 16 bits
+static int bc6h_unquantize(int v, uint32_t bits, bool is_signed)
+{
+    if (!is_signed) {
+        if (bits >= 15 || v == 0)
+            return v;
+        if (v == (1 << bits) - 1)
+            return 0xffff;
+        return ((v << 16) + 0x8000) >> bits;
+    }
+    if (bits >= 16)
+        return v;
+    const bool negative = (v < 0);
+    if (negative)
+        v = -v;
+    if (v != 0)
+        v = (v >= (1 << (bits - 1)) - 1) ? 0x7fff : ((v << 15) + 0x4000) >> (bits - 1);
+    return negative ? -v : v;
+}
+
+#if defined(USE_SSE2)
+// Turn 4 interpolated BC6H values into 8 bits, by clamping them to [0, 1]. Denormal
+// halves are converted as if they were normal ones, which is fine since both end up as 0.
+static __inline __m128i bc6h_to_8_bits(__m128i v, bool is_signed)
+{
+    __m128i h = _mm_sub_epi32(_mm_slli_epi32(v, 5), v);
+    h = is_signed ? _mm_srai_epi32(h, 5) : _mm_srai_epi32(h, 6);
+    __m128 f = _mm_castsi128_ps(_mm_add_epi32(_mm_slli_epi32(h, 13), _mm_set1_epi32(112 << 23)));
+    f = _mm_min_ps(_mm_max_ps(f, _mm_setzero_ps()), _mm_set1_ps(1.0f));
+    __m128i r = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(f, _mm_set1_ps(255.0f)), _mm_set1_ps(0.5f)));
+    // Negative values always end up as 0
+    return is_signed ? _mm_andnot_si128(_mm_cmplt_epi32(v, _mm_setzero_si128()), r) : r;
+}
+#else
+static float half_to_float(uint16_t h)
+{
+    const uint32_t e = (h >> 10) & 0x1f, m = h & 0x3ff;
+    float f;
+    if (e == 0) {
+        f = (float)m / 16777216.0f;
+    } else {
+        uint32_t bits = ((e + 112) << 23) | (m << 13);
+        memcpy(&f, &bits, sizeof(f));
+    }
+    return (h & 0x8000) ? -f : f;
+}
+
+// Turn an interpolated BC6H value into 8 bits, by clamping it to [0, 1]
+static uint8_t bc6h_to_8_bits(int v, bool is_signed)
+{
+    uint16_t h;
+    if (!is_signed)
+        h = (uint16_t)((v * 31) >> 6);
+    else
+        h = (uint16_t)((v < 0) ? (0x8000 | ((-v * 31) >> 5)) : ((v * 31) >> 5));
+    const float f = half_to_float(h);
+    return (uint8_t)((f <= 0.0f) ? 0.0f : ((f >= 1.0f) ? 255.0f : f * 255.0f + 0.5f));
+}
+#endif
+
+static void decode_bc6h_block(const uint8_t* in, uint8_t block[16][4], bool is_signed)
+{
+    bit_reader br = { getle64(in), getle64(&in[8]) };
+    uint32_t mode = read_bits(&br, 2);
+    if (mode >= 2)
+        mode |= read_bits(&br, 3) << 2;
+    const bc6h_mode* m = NULL;
+    for (uint32_t i = 0; i < array_size(bc6h_modes) && m == NULL; i++)
+        if (bc6h_modes[i].mode == mode)
+            m = &bc6h_modes[i];
+    if (m == NULL) {
+        // Reserved mode, which decodes to black
+        for (uint32_t i = 0; i < 16; i++) {
+            block[i][0] = block[i][1] = block[i][2] = 0;
+            block[i][3] = 255;
+        }
+        return;
+    }
+
+    int v[D + 1] = { 0 };
+    for (const bc6h_bits* b = m->layout; b->component != BC6H_END; b++) {
+        if (b->high >= b->low) {
+            v[b->component] |= (int)(read_bits(&br, b->high - b->low + 1) << b->low);
+        } else {
+            for (int i = b->low; i >= b->high; i--)
+                v[b->component] |= (int)(read_bits(&br, 1) << i);
+        }
+    }
+
+    // Endpoints are stored as RGB in [w, x, y, z] order
+    int e[4][3];
+    const uint32_t nb_endpoints = 2 * m->nb_subsets;
+    for (uint32_t c = 0; c < 3; c++) {
+        for (uint32_t i = 0; i < nb_endpoints; i++)
+            e[i][c] = v[RW + 3 * i + c];
+        if (is_signed)
+            e[0][c] = sign_extend(e[0][c], m->endpoint_bits);
+        for (uint32_t i = 1; i < nb_endpoints; i++) {
+            if (m->transformed) {
+                e[i][c] = (e[0][c] + sign_extend(e[i][c], m->delta_bits[c])) & ((1 << m->endpoint_bits) - 1);
+                if (is_signed)
+                    e[i][c] = sign_extend(e[i][c], m->endpoint_bits);
+            } else if (is_signed) {
+                e[i][c] = sign_extend(e[i][c], m->endpoint_bits);
+            }
+        }
+        for (uint32_t i = 0; i < nb_endpoints; i++)
+            e[i][c] = bc6h_unquantize(e[i][c], m->endpoint_bits, is_signed);
+    }
+
+    uint8_t subsets[16], anchors[3];
+    const uint32_t index_bits = (m->nb_subsets == 2) ? 3 : 4;
+    get_partition(m->nb_subsets, (uint32_t)v[D], subsets, anchors);
+    int w[16];
+    for (uint32_t i = 0; i < 16; i++)
+        w[i] = bc7_weights[index_bits][read_bits(&br, index_bits - (anchors[subsets[i]] == i ? 1 : 0))];
+
+#if defined(USE_SSE2)
+    // Interpolate the 3 channels of a pixel at once, from (e0, e1) and (64 - w, w) pairs.
+    // Unsigned endpoints don't fit in signed 16-bit lanes, so they are biased by -0x8000,
+    // and 0x8000 * 64 is added back after interpolation.
+    const int bias = is_signed ? 0 : 0x8000;
+    __m128i ev[2];
+    for (uint32_t s = 0; s < m->nb_subsets; s++)
+        ev[s] = _mm_setr_epi16((int16_t)(e[2 * s][0] - bias), (int16_t)(e[2 * s + 1][0] - bias),
+                               (int16_t)(e[2 * s][1] - bias), (int16_t)(e[2 * s + 1][1] - bias),
+                               (int16_t)(e[2 * s][2] - bias), (int16_t)(e[2 * s + 1][2] - bias), 0, 0);
+    const __m128i round = _mm_set1_epi32(bias * 64 + 32);
+    const __m128i rgb_mask = _mm_setr_epi32(-1, -1, -1, 0), alpha = _mm_setr_epi32(0, 0, 0, 255);
+    for (uint32_t i = 0; i < 16; i += 4) {
+        __m128i v[4];
+        for (uint32_t j = 0; j < 4; j++) {
+            v[j] = _mm_madd_epi16(ev[subsets[i + j]], _mm_set1_epi32((64 - w[i + j]) | (w[i + j] << 16)));
+            v[j] = bc6h_to_8_bits(_mm_srai_epi32(_mm_add_epi32(v[j], round), 6), is_signed);
+            v[j] = _mm_or_si128(_mm_and_si128(v[j], rgb_mask), alpha);
+        }
+        _mm_storeu_si128((__m128i*)block[i],
+            _mm_packus_epi16(_mm_packs_epi32(v[0], v[1]), _mm_packs_epi32(v[2], v[3])));
+    }
+#else
+    for (uint32_t i = 0; i < 16; i++) {
+        const int* e0 = e[2 * subsets[i]];
+        const int* e1 = e[2 * subsets[i] + 1];
+        for (uint32_t c = 0; c < 3; c++)
+            block[i][c] = bc6h_to_8_bits((e0[c] * (64 - w[i]) + e1[c] * w[i] + 32) >> 6, is_signed);
+        block[i][3] = 255;
+    }
+#endif
+}
+
+bool bcn_can_decode(enum DDS_FORMAT format)
+{
+    switch (format) {
+    case DDS_FORMAT_DXT1:
+    case DDS_FORMAT_DXT2:
+    case DDS_FORMAT_DXT3:
+    case DDS_FORMAT_DXT4:
+    case DDS_FORMAT_DXT5:
+    case DDS_FORMAT_BC4:
+    case DDS_FORMAT_ATI1:
+    case DDS_FORMAT_BC5:
+    case DDS_FORMAT_ATI2:
+    case DDS_FORMAT_BC6H:
+    case DDS_FORMAT_BC7:
+        return true;
+    default:
+        return false;
+    }
+}
+
+void bcn_decode(enum DDS_FORMAT format, const uint8_t* src, uint32_t width,
+                uint32_t height, uint8_t* rgba, bool is_signed)
+{
+    assert(bcn_can_decode(format));
+    const uint32_t bpb = dds_bpb(format);
+    const uint32_t nb_blocks_x = (width + 3) / 4, nb_blocks_y = (height + 3) / 4;
+    uint8_t block[16][4];
+
+    for (uint32_t by = 0; by < nb_blocks_y; by++) {
+        for (uint32_t bx = 0; bx < nb_blocks_x; bx++, src += bpb) {
+            switch (format) {
+            case DDS_FORMAT_DXT1:
+                decode_color_block(src, block, true);
+                break;
+            case DDS_FORMAT_DXT2:
+            case DDS_FORMAT_DXT3:
+                decode_color_block(&src[8], block, false);
+                decode_explicit_alpha_block(src, block);
+                break;
+            case DDS_FORMAT_DXT4:
+            case DDS_FORMAT_DXT5:
+                decode_color_block(&src[8], block, false);
+                decode_single_channel_block(src, block, 3);
+                break;
+            case DDS_FORMAT_BC4:
+            case DDS_FORMAT_ATI1:
+                // Single channel textures are decoded to grayscale
+                decode_single_channel_block(src, block, 0);
+                for (uint32_t i = 0; i < 16; i++) {
+                    block[i][1] = block[i][2] = block[i][0];
+                    block[i][3] = 255;
+                }
+                break;
+            case DDS_FORMAT_BC5:
+            case DDS_FORMAT_ATI2:
+                decode_single_channel_block(src, block, 0);
+                decode_single_channel_block(&src[8], block, 1);
+                for (uint32_t i = 0; i < 16; i++) {
+                    block[i][2] = 0;
+                    block[i][3] = 255;
+                }
+                break;
+            case DDS_FORMAT_BC6H:
+                decode_bc6h_block(src, block, is_signed);
+                break;
+            case DDS_FORMAT_BC7:
+                decode_bc7_block(src, block);
+                break;
+            default:
+                assert(false);
+                break;
+            }
+            write_block(block, rgba, width, height, bx, by);
+        }
+    }
+}
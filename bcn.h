@@ -0,0 +1,44 @@
+/*
+  BCn texture compression and decompression
+  Copyright © 2019-2022 VitaSmith
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "dds.h"
+
+#pragma once
+
+// Images are exchanged as 8-bit R, G, B, A pixels, in that order in memory.
+
+// Returns true if we can compress images into format
+bool bcn_can_encode(enum DDS_FORMAT format);
+
+// Compress a width x height image into dst, which must be able to hold
+// MIPMAP_SIZE(format, 0, width, height) bytes. Compression is split across
+// up to nb_threads threads.
+void bcn_encode(enum DDS_FORMAT format, const uint8_t* rgba, uint32_t width,
+                uint32_t height, uint8_t* dst, bool high_quality, uint32_t nb_threads);
+
+// Returns true if we can decompress images from format
+bool bcn_can_decode(enum DDS_FORMAT format);
+
+// Decompress a width x height image from src into rgba, which must be able to hold
+// width * height * 4 bytes. Single channel formats are decoded to grayscale and
+// BC6H is clamped to [0, 1], with is_signed telling whether its values are signed.
+void bcn_decode(enum DDS_FORMAT format, const uint8_t* src, uint32_t width,
+                uint32_t height, uint8_t* rgba, bool is_signed);
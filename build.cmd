@@ -26,7 +26,7 @@ if not "%1"=="" goto out
 
 :g1t
 set APP_NAME=gust_g1t
-cl.exe %APP_NAME%.c util.c parson.c /Fe%APP_NAME%
+cl.exe %APP_NAME%.c bcn.c util.c parson.c /Fe%APP_NAME%
 if %ERRORLEVEL% neq 0 goto out
 echo =^> %APP_NAME%
 echo.
@@ -34,6 +34,10 @@ if not "%1"=="" goto out
 
 :enc
 set APP_NAME=gust_enc
+cl.exe /DGENERATE_SEEDS /wd4505 %APP_NAME%.c util.c parson.c /Fe%APP_NAME%_gen.exe
+if %ERRORLEVEL% neq 0 goto out
+%APP_NAME%_gen.exe %APP_NAME%.json %APP_NAME%_seeds.h
+if %ERRORLEVEL% neq 0 goto out
 cl.exe %APP_NAME%.c util.c parson.c /Fe%APP_NAME%.exe
 if %ERRORLEVEL% neq 0 goto out
 echo =^> %APP_NAME%.exe
@@ -50,7 +54,10 @@ if not "%1"=="" goto out
 
 :gmpk
 set APP_NAME=gust_gmpk
-cl.exe %APP_NAME%.c util.c parson.c /Fe%APP_NAME%.exe
+rem gust_g1t.c is only used for --deep here, so it's compiled without its main()
+cl.exe /c /DG1T_LIBRARY gust_g1t.c /Fogust_g1t_lib.obj
+if %ERRORLEVEL% neq 0 goto out
+cl.exe %APP_NAME%.c gust_g1t_lib.obj bcn.c util.c parson.c /Fe%APP_NAME%.exe
 if %ERRORLEVEL% neq 0 goto out
 echo =^> %APP_NAME%.exe
 echo.
@@ -64,6 +71,16 @@ echo =^> %APP_NAME%.exe
 echo.
 if not "%1"=="" goto out
 
+:bench
+rem The gust_enc checksum benchmark is only built on request
+if "%1"=="" goto out
+set APP_NAME=gust_enc
+cl.exe /DBENCHMARK_CHECKSUMS /wd4505 %APP_NAME%.c util.c parson.c /Fe%APP_NAME%_bench.exe
+if %ERRORLEVEL% neq 0 goto out
+echo =^> %APP_NAME%_bench.exe
+echo.
+goto out
+
 :out
 endlocal
 if %ERRORLEVEL% neq 0 pause
@@ -439,6 +439,7 @@ static __inline uint32_t get_fourCC(enum DDS_FORMAT format)
     case DDS_FORMAT_BC4:
         return MAKEFOURCC('A', 'T', 'I', '1');
     case DDS_FORMAT_ATI2:
+    case DDS_FORMAT_BC5:
         return MAKEFOURCC('A', 'T', 'I', '2');
     case DDS_FORMAT_A2XY:
         return MAKEFOURCC('A', '2', 'X', 'Y');
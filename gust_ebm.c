@@ -47,209 +47,607 @@
 uint32_t duration1_length[] = { 0, 2 };
 uint32_t duration2_length[] = { 0, 1, 2 };
 
-int main_utf8(int argc, char** argv)
+typedef struct {
+    uint8_t*    data;
+    uint32_t    size;
+    uint32_t    max_size;
+} ebm_buffer;
+
+static bool append_data(ebm_buffer* ebm, const void* data, uint32_t size)
+{
+    if (ebm->size + size > ebm->max_size) {
+        const uint32_t max_size = max(2 * ebm->max_size, ebm->size + size);
+        uint8_t* new_data = realloc(ebm->data, max_size);
+        if (new_data == NULL)
+            return false;
+        ebm->data = new_data;
+        ebm->max_size = max_size;
+    }
+    memcpy(&ebm->data[ebm->size], data, size);
+    ebm->size += size;
+    return true;
+}
+
+// Build the .ebm data from its JSON. On error, the data is freed.
+static int build_ebm(JSON_Value* json, job_log* log, ebm_buffer* ebm)
 {
     int r = -1;
-    uint8_t* buf = NULL;
-    char *ebm_message, path[PATH_MAX];
-    FILE* file = NULL;
-    JSON_Value* json = NULL;
 
-    if (argc != 2) {
-        printf("%s %s (c) 2019-2022 VitaSmith\n\n"
-            "Usage: %s <file>\n\n"
-            "Convert a .ebm file to or from an editable JSON file.\n\n",
-            _appname(argv[0]), GUST_TOOLS_VERSION_STR, _appname(argv[0]));
-        return 0;
+    const uint32_t json_version = json_object_get_uint32(json_object(json), "json_version");
+    if (json_version != JSON_VERSION) {
+        log_printf(log, stderr, "ERROR: This utility is not compatible with the JSON file provided.\n"
+            "You need to (re)extract the '.ebm' using this application.\n");
+        goto out;
     }
-
-    if (strstr(argv[argc - 1], ".json") != NULL) {
-        json = json_parse_file_with_comments(argv[argc - 1]);
-        if (json == NULL) {
-            fprintf(stderr, "ERROR: Can't parse JSON data from '%s'\n", argv[argc - 1]);
+    int32_t nb_messages = (int32_t)json_object_get_uint32(json_object(json), "nb_messages");
+    if (!append_data(ebm, &nb_messages, sizeof(int32_t))) {
+        log_printf(log, stderr, "ERROR: Can't write number of messages\n");
+        goto out;
+    }
+    JSON_Array* json_messages = json_object_get_array(json_object(json), "messages");
+    if (json_array_get_count(json_messages) != (size_t)abs(nb_messages)) {
+        log_printf(log, stderr, "ERROR: Number of messages doesn't match the array size\n");
+        goto out;
+    }
+    uint32_t ebm_header[11];
+    assert(array_size(ebm_header) >= 9 + duration1_length[array_size(duration1_length) - 1]);
+    assert(array_size(ebm_header) >= duration2_length[array_size(duration2_length) - 1]);
+    for (size_t i = 0; i < abs(nb_messages); i++) {
+        JSON_Object* json_message = json_array_get_object(json_messages, i);
+        memset(ebm_header, 0, sizeof(ebm_header));
+        uint32_t j = 0;
+        size_t x;
+        ebm_header[j] = json_object_get_uint32(json_message, "type");
+        ebm_header[++j] = json_object_get_uint32(json_message, "voice_id");
+        ebm_header[++j] = json_object_get_uint32(json_message, "unknown1");
+        ebm_header[++j] = json_object_get_uint32(json_message, "name_id");
+        ebm_header[++j] = json_object_get_uint32(json_message, "extra_id");
+        ebm_header[++j] = json_object_get_uint32(json_message, "expr_id");
+        JSON_Array* json_duration_array = json_object_get_array(json_message, "duration1");
+        for (x = 0; x < json_array_get_count(json_duration_array); x++)
+            ebm_header[++j] = json_array_get_uint32(json_duration_array, x);
+        ebm_header[++j] = json_object_get_uint32(json_message, "msg_id");
+        ebm_header[++j] = json_object_get_uint32(json_message, "unknown2");
+        const char* msg_string = json_object_get_string(json_message, "msg_string");
+        ebm_header[++j] = (uint32_t)strlen(msg_string) + 1;
+        if (!append_data(ebm, ebm_header, (j + 1) * sizeof(uint32_t))) {
+            log_printf(log, stderr, "ERROR: Can't write message header\n");
             goto out;
         }
-        const uint32_t json_version = json_object_get_uint32(json_object(json), "json_version");
-        if (json_version != JSON_VERSION) {
-            fprintf(stderr, "ERROR: This utility is not compatible with the JSON file provided.\n"
-                "You need to (re)extract the '.ebm' using this application.\n");
+        if (!append_data(ebm, msg_string, ebm_header[j])) {
+            log_printf(log, stderr, "ERROR: Can't write message data\n");
             goto out;
         }
-        snprintf(path, sizeof(path), "%s%c%s", _dirname(argv[argc - 1]), PATH_SEP,
-            json_object_get_string(json_object(json), "name"));
-        printf("Creating '%s' from JSON...\n", path);
-        create_backup(path);
-        file = fopen_utf8(path, "wb");
-        if (file == NULL) {
-            fprintf(stderr, "ERROR: Cannot create file '%s'\n", path);
-            goto out;
-        }
-        int32_t nb_messages = (int32_t)json_object_get_uint32(json_object(json), "nb_messages");
-        if (fwrite(&nb_messages, sizeof(int32_t), 1, file) != 1) {
-            fprintf(stderr, "ERROR: Can't write number of messages\n");
-            goto out;
+        json_duration_array = json_object_get_array(json_message, "duration2");
+        for (x = 0; x < json_array_get_count(json_duration_array); x++)
+            ebm_header[x] = json_array_get_uint32(json_duration_array, x);
+        if (x != 0) {
+            if (!append_data(ebm, ebm_header, (uint32_t)x * sizeof(uint32_t))) {
+                log_printf(log, stderr, "ERROR: Can't write duration data\n");
+                goto out;
+            }
         }
-        JSON_Array* json_messages = json_object_get_array(json_object(json), "messages");
-        if (json_array_get_count(json_messages) != (size_t)abs(nb_messages)) {
-            fprintf(stderr, "ERROR: Number of messages doesn't match the array size\n");
+    }
+    JSON_Array* json_extra_data = json_object_get_array(json_object(json), "extra_data");
+    for (size_t i = 0; i < json_array_get_count(json_extra_data); i++) {
+        uint32_t val = json_array_get_uint32(json_extra_data, i);
+        if (!append_data(ebm, &val, sizeof(uint32_t))) {
+            log_printf(log, stderr, "ERROR: Can't write extra data\n");
             goto out;
         }
-        uint32_t ebm_header[11];
-        assert(array_size(ebm_header) >= 9 + duration1_length[array_size(duration1_length) - 1]);
-        assert(array_size(ebm_header) >= duration2_length[array_size(duration2_length) - 1]);
-        for (size_t i = 0; i < abs(nb_messages); i++) {
-            JSON_Object* json_message = json_array_get_object(json_messages, i);
-            memset(ebm_header, 0, sizeof(ebm_header));
-            uint32_t j = 0;
-            size_t x;
-            ebm_header[j] = json_object_get_uint32(json_message, "type");
-            ebm_header[++j] = json_object_get_uint32(json_message, "voice_id");
-            ebm_header[++j] = json_object_get_uint32(json_message, "unknown1");
-            ebm_header[++j] = json_object_get_uint32(json_message, "name_id");
-            ebm_header[++j] = json_object_get_uint32(json_message, "extra_id");
-            ebm_header[++j] = json_object_get_uint32(json_message, "expr_id");
-            JSON_Array* json_duration_array = json_object_get_array(json_message, "duration1");
-            for (x = 0; x < json_array_get_count(json_duration_array); x++)
-                ebm_header[++j] = json_array_get_uint32(json_duration_array, x);
-            ebm_header[++j] = json_object_get_uint32(json_message, "msg_id");
-            ebm_header[++j] = json_object_get_uint32(json_message, "unknown2");
-            const char* msg_string = json_object_get_string(json_message, "msg_string");
-            ebm_header[++j] = (uint32_t)strlen(msg_string) + 1;
-            if (fwrite(ebm_header, sizeof(uint32_t), j + 1, file) != j + 1) {
-                fprintf(stderr, "ERROR: Can't write message header\n");
-                goto out;
-            }
-            if (fwrite(msg_string, 1, ebm_header[j], file) != ebm_header[j]) {
-                fprintf(stderr, "ERROR: Can't write message data\n");
-                goto out;
-            }
-            json_duration_array = json_object_get_array(json_message, "duration2");
-            for (x = 0; x < json_array_get_count(json_duration_array); x++)
-                ebm_header[x] = json_array_get_uint32(json_duration_array, x);
-            if (x != 0) {
-                if (fwrite(ebm_header, sizeof(uint32_t), x, file) != x) {
-                    fprintf(stderr, "ERROR: Can't write duration data\n");
-                    goto out;
-                }
+    }
+    r = 0;
+
+out:
+    if (r != 0) {
+        free(ebm->data);
+        ebm->data = NULL;
+        ebm->size = 0;
+    }
+    return r;
+}
+
+// Recreate an .ebm, in dir, from its JSON data
+static int create_ebm(JSON_Value* json, const char* dir)
+{
+    char path[PATH_MAX];
+    ebm_buffer ebm = { 0 };
+
+    if (build_ebm(json, NULL, &ebm) != 0)
+        return -1;
+    snprintf(path, sizeof(path), "%s%c%s", dir, PATH_SEP,
+        json_object_get_string(json_object(json), "name"));
+    printf("Creating '%s' from JSON...\n", path);
+    const bool r = write_file(ebm.data, ebm.size, path, true);
+    free(ebm.data);
+    return r ? 0 : -1;
+}
+
+// Detect the length of the message structure of an .ebm, as indexes into duration1_length[]
+// and duration2_length[]
+static bool detect_ebm_layout(const uint8_t* buf, uint32_t buf_size, uint32_t* d1, uint32_t* d2)
+{
+    const int32_t nb_messages = (int32_t)getle32(buf);
+    const uint8_t* end = &buf[buf_size];
+    for (*d1 = 0; *d1 < array_size(duration1_length); (*d1)++) {
+        for (*d2 = 0; *d2 < array_size(duration2_length); (*d2)++) {
+            uint32_t* p = (uint32_t*)&buf[sizeof(uint32_t)];
+            bool good_candidate = true;
+            for (size_t i = 0; i < abs(nb_messages) && good_candidate; i++) {
+                good_candidate = ((uint8_t*)&p[9 + duration1_length[*d1]] <= end);
+                if (!good_candidate)
+                    break;
+                uint32_t len = p[8 + duration1_length[*d1]];
+                char* str = (char*)&p[9 + duration1_length[*d1]];
+                good_candidate = (len != 0 && len <= MAX_STRING_SIZE &&
+                    (uint8_t*)&str[len + duration2_length[*d2] * sizeof(uint32_t)] <= end);
+                for (uint32_t j = 0; (j < len - 1) && good_candidate; j++)
+                    good_candidate = (str[j] != 0);
+                p = (uint32_t*)(&str[len]);
+                p = &p[duration2_length[*d2]];
             }
+            if (good_candidate)
+                return true;
         }
-        JSON_Array* json_extra_data = json_object_get_array(json_object(json), "extra_data");
-        for (size_t i = 0; i < json_array_get_count(json_extra_data); i++) {
-            uint32_t val = json_array_get_uint32(json_extra_data, i);
-            if (fwrite(&val, sizeof(uint32_t), 1, file) != 1) {
-                fprintf(stderr, "ERROR: Can't write extra data\n");
-                goto out;
-            }
+    }
+    return false;
+}
+
+// Return the offsets of the messages of an .ebm, followed by the offset of its extra data
+static uint32_t* get_message_offsets(const uint8_t* buf, uint32_t buf_size)
+{
+    uint32_t d1, d2;
+    if (buf_size < sizeof(uint32_t) || !detect_ebm_layout(buf, buf_size, &d1, &d2))
+        return NULL;
+    const uint32_t nb_messages = (uint32_t)abs((int32_t)getle32(buf));
+    uint32_t* offsets = malloc(((size_t)nb_messages + 1) * sizeof(uint32_t));
+    if (offsets == NULL)
+        return NULL;
+    offsets[0] = sizeof(uint32_t);
+    for (uint32_t i = 0; i < nb_messages; i++) {
+        const uint32_t len = getle32(&buf[offsets[i] + (8 + duration1_length[d1]) * sizeof(uint32_t)]);
+        offsets[i + 1] = offsets[i] + (9 + duration1_length[d1] + duration2_length[d2]) *
+            sizeof(uint32_t) + len;
+    }
+    return offsets;
+}
+
+// Compare a recreated .ebm with the existing one at path, message by message, and report its
+// creation along with the messages that differ. Returns false if both are identical, in which
+// case the .ebm can be left alone.
+static bool diff_ebm(const ebm_buffer* ebm, const char* path, job_log* log)
+{
+    uint8_t* buf = NULL;
+    uint32_t *old_offsets = NULL, *new_offsets = NULL;
+
+    const uint32_t size = is_file(path) ? read_file(path, &buf) : UINT32_MAX;
+    if (size == ebm->size && memcmp(buf, ebm->data, size) == 0) {
+        free(buf);
+        return false;
+    }
+    log_printf(log, stdout, "Creating '%s' from JSON...\n", path);
+    if (size == UINT32_MAX)
+        return true;
+    old_offsets = get_message_offsets(buf, size);
+    new_offsets = get_message_offsets(ebm->data, ebm->size);
+    const uint32_t nb_messages = (uint32_t)abs((int32_t)getle32(ebm->data));
+    if (old_offsets == NULL || new_offsets == NULL || getle32(buf) != getle32(ebm->data)) {
+        log_printf(log, stdout, "  Number of messages changed from %d to %d\n",
+            (int32_t)getle32(buf), (int32_t)getle32(ebm->data));
+        goto out;
+    }
+    uint32_t nb_changed = 0;
+    for (uint32_t i = 0; i <= nb_messages; i++) {
+        // The last entry is the extra data, that runs up to the end of the file
+        const uint32_t old_end = (i == nb_messages) ? size : old_offsets[i + 1];
+        const uint32_t new_end = (i == nb_messages) ? ebm->size : new_offsets[i + 1];
+        if (old_end - old_offsets[i] == new_end - new_offsets[i] &&
+            memcmp(&buf[old_offsets[i]], &ebm->data[new_offsets[i]], old_end - old_offsets[i]) == 0)
+            continue;
+        if (nb_changed++ == 0)
+            log_printf(log, stdout, "  Changed:");
+        if (nb_changed > 16)
+            continue;
+        if (i == nb_messages)
+            log_printf(log, stdout, " extra data");
+        else
+            log_printf(log, stdout, " #%d", i);
+    }
+    if (nb_changed > 16)
+        log_printf(log, stdout, " (and %d more)", nb_changed - 16);
+    log_printf(log, stdout, "\n");
+
+out:
+    free(old_offsets);
+    free(new_offsets);
+    free(buf);
+    return true;
+}
+
+// Convert an .ebm, which is called name, to the JSON file json_path
+static int convert_ebm(const char* ebm_path, const char* name, const char* json_path, job_log* log)
+{
+    int r = -1;
+    uint8_t* buf = NULL;
+    char* ebm_message;
+    JSON_Value* json = NULL;
+
+    log_printf(log, stdout, "Converting '%s' to JSON...\n", name);
+    uint32_t buf_size = read_file(ebm_path, &buf);
+    if (buf_size == UINT32_MAX)
+        goto out;
+    int32_t nb_messages = (int32_t)getle32(buf);
+    if (buf_size < sizeof(uint32_t) + abs(nb_messages) * sizeof(ebm_message)) {
+        log_printf(log, stderr, "ERROR: Invalid number of entries\n");
+        goto out;
+    }
+
+    uint32_t d1, d2;
+    if (!detect_ebm_layout(buf, buf_size, &d1, &d2)) {
+        log_printf(log, stderr, "ERROR: Failed to detect EBM record structure (Unsupported?)\n");
+        goto out;
+    }
+    JSON_Value* json_messages = NULL;
+    JSON_Value* json_message = NULL;
+    // Store the data we'll need to reconstruct the archive to a JSON file
+    json = json_value_init_object();
+    json_object_set_number(json_object(json), "json_version", JSON_VERSION);
+    json_object_set_string(json_object(json), "name", name);
+    json_object_set_number(json_object(json), "nb_messages", nb_messages & 0xffffffff);
+    json_messages = json_value_init_array();
+    uint32_t* ebm_header = (uint32_t*)&buf[sizeof(uint32_t)];
+    for (size_t i = 0; i < abs(nb_messages); i++) {
+        uint32_t j = 0;
+        json_message = json_value_init_object();
+        json_object_set_number(json_object(json_message), "type", (double)ebm_header[j]);
+        if (ebm_header[j] > 0x10)
+                log_printf(log, stderr, "WARNING: Unexpected header type 0x%08x\n", ebm_header[j]);
+        json_object_set_number(json_object(json_message), "voice_id", (double)ebm_header[++j]);
+        if (ebm_header[++j] != 0)
+            json_object_set_number(json_object(json_message), "unknown1", (double)ebm_header[j]);
+        json_object_set_number(json_object(json_message), "name_id", (double)ebm_header[++j]);
+        if (ebm_header[++j] != 0)
+            json_object_set_number(json_object(json_message), "extra_id", (double)ebm_header[j]);
+        json_object_set_number(json_object(json_message), "expr_id", (double)ebm_header[++j]);
+        if (duration1_length[d1] > 0) {
+            JSON_Value* json_duration_array = json_value_init_array();
+            for (uint32_t x = 0; x < duration1_length[d1]; x++)
+                json_array_append_number(json_array(json_duration_array), ebm_header[++j]);
+            json_object_set_value(json_object(json_message), "duration1", json_duration_array);
         }
-        r = 0;
-    } else if (strstr(argv[argc - 1], ".ebm") != NULL) {
-        printf("Converting '%s' to JSON...\n", _basename(argv[argc - 1]));
-        uint32_t buf_size = read_file(argv[argc - 1], &buf);
-        if (buf_size == UINT32_MAX)
-            goto out;
-        int32_t nb_messages = (int32_t)getle32(buf);
-        if (buf_size < sizeof(uint32_t) + abs(nb_messages) * sizeof(ebm_message)) {
-            fprintf(stderr, "ERROR: Invalid number of entries\n");
+        json_object_set_number(json_object(json_message), "msg_id", (double)ebm_header[++j]);
+        if (ebm_header[++j] != 0)
+            json_object_set_number(json_object(json_message), "unknown2", (double)ebm_header[j]);
+        // Don't store str_length since we'll reconstruct it
+        uint32_t str_length = ebm_header[++j];
+        if (str_length > MAX_STRING_SIZE) {
+            log_printf(log, stderr, "ERROR: Unexpected string size\n");
             goto out;
         }
+        char* str = (char*)&ebm_header[++j];
+        json_object_set_string(json_object(json_message), "msg_string", str);
+        ebm_header = (uint32_t*)&str[str_length];
+        if (duration2_length[d2] > 0) {
+            JSON_Value* json_duration_array = json_value_init_array();
+            for (uint32_t x = 0; x < duration2_length[d2]; x++)
+                json_array_append_number(json_array(json_duration_array), *ebm_header++);
+            json_object_set_value(json_object(json_message), "duration2", json_duration_array);
+        }
+        json_array_append_value(json_array(json_messages), json_message);
+    }
+    JSON_Value* json_extra_data = json_value_init_array();
+    while ((uintptr_t)ebm_header < (uintptr_t)&buf[buf_size])
+        json_array_append_number(json_array(json_extra_data), *ebm_header++);
+    json_object_set_value(json_object(json), "messages", json_messages);
+    if (json_array_get_count(json_array(json_extra_data)) > 0)
+        json_object_set_value(json_object(json), "extra_data", json_extra_data);
+    else
+        json_value_free(json_extra_data);
+    log_printf(log, stdout, "Creating '%s'\n", json_path);
+    json_serialize_to_file_pretty(json, json_path);
+    r = 0;
+
+out:
+    json_value_free(json);
+    free(buf);
+    return r;
+}
+
+// Batch conversion of all the .ebm found under a directory. The paths are all worked
+// out beforehand, since _basename(), _dirname() and change_extension() aren't reentrant.
+#define MANIFEST_NAME           "ebm_manifest.json"
+#define MANIFEST_VERSION        1
+
+typedef enum {
+    EBM_FAILED = 0,
+    EBM_CONVERTED,
+    EBM_RECREATED,
+    EBM_UNCHANGED,
+} ebm_status;
+
+typedef struct {
+    char*       ebm_path;
+    char*       json_path;
+    char*       dir;
+    char*       name;
+    char*       ebm_out;        // .ebm to recreate, as named by the JSON
+    bool        recreate;       // .ebm gets recreated from an existing JSON
+    bool        in_manifest;
+    uint64_t    hash;           // hash of the JSON file, from the manifest then from the job
+    ebm_buffer  ebm;            // recreated .ebm, that the main thread writes
+    job_log     log;
+    ebm_status  status;
+} ebm_item;
+
+typedef struct {
+    ebm_item*   items;
+    bool        only_changed;
+    bool        diff;
+} ebm_batch;
+
+static uint64_t hash_json_file(const char* path, uint8_t** buf, uint32_t* size)
+{
+    *size = read_file(path, buf);
+    if (*size == UINT32_MAX)
+        return 0;
+    return hash64(*buf, *size, 0);
+}
+
+static void process_ebm(void* ctx, uint32_t index)
+{
+    ebm_batch* b = (ebm_batch*)ctx;
+    ebm_item* item = &b->items[index];
+    uint8_t* buf = NULL;
+    uint32_t size;
+
+    if (!item->recreate) {
+        if (convert_ebm(item->ebm_path, item->name, item->json_path, &item->log) != 0)
+            return;
+        item->hash = hash_json_file(item->json_path, &buf, &size);
+        if (size != UINT32_MAX)
+            item->status = EBM_CONVERTED;
+        free(buf);
+        return;
+    }
+
+    const uint64_t hash = hash_json_file(item->json_path, &buf, &size);
+    if (size == UINT32_MAX)
+        return;
+    // Unmodified JSON files don't need to be parsed at all
+    if (b->only_changed && item->in_manifest && hash == item->hash) {
+        item->status = EBM_UNCHANGED;
+        free(buf);
+        return;
+    }
+    item->hash = hash;
+    uint8_t* str = realloc(buf, (size_t)size + 1);
+    if (str == NULL) {
+        log_printf(&item->log, stderr, "ERROR: Alloc error\n");
+        free(buf);
+        return;
+    }
+    str[size] = 0;
+    JSON_Value* json = json_parse_string_with_comments((const char*)str);
+    free(str);
+    if (json == NULL) {
+        log_printf(&item->log, stderr, "ERROR: Can't parse JSON data from '%s'\n", item->json_path);
+        return;
+    }
+    if (build_ebm(json, &item->log, &item->ebm) == 0) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s%c%s", item->dir, PATH_SEP,
+            json_object_get_string(json_object(json), "name"));
+        if (b->diff && !diff_ebm(&item->ebm, path, &item->log)) {
+            // The messages are the same as the ones of the existing .ebm
+            item->status = EBM_UNCHANGED;
+            free(item->ebm.data);
+            item->ebm.data = NULL;
+        } else {
+            item->ebm_out = strdup(path);
+            if (item->ebm_out == NULL)
+                log_printf(&item->log, stderr, "ERROR: Alloc error\n");
+            else if (!b->diff)
+                log_printf(&item->log, stdout, "Creating '%s' from JSON...\n", path);
+        }
+    }
+    json_value_free(json);
+}
 
-        // Detect the length of the structure we will work with
-        uint32_t d1, d2;
-        for (d1 = 0; d1 < array_size(duration1_length); d1++) {
-            for (d2 = 0; d2 < array_size(duration2_length); d2++) {
-                uint32_t* p = (uint32_t*)&buf[sizeof(uint32_t)];
-                bool good_candidate = true;
-                for (size_t i = 0; i < abs(nb_messages) && good_candidate; i++) {
-                    uint32_t len = p[8 + duration1_length[d1]];
-                    good_candidate = (len != 0 && len <= MAX_STRING_SIZE);
-                    if (!good_candidate)
-                        break;
-                    char* str = (char*)&p[9 + duration1_length[d1]];
-                    for (uint32_t j = 0; (j < len - 1) && good_candidate; j++)
-                        good_candidate = (str[j] != 0);
-                    p = (uint32_t*)(&str[len]);
-                    p = &p[duration2_length[d2]];
-                }
-                if (good_candidate)
-                    goto detected;
+// Recreate all the .ebm under root that have a JSON alongside them, and convert the other
+// ones. The hashes of the JSON files get recorded in a manifest, so that, with only_changed,
+// we can skip the .ebm whose JSON hasn't been modified since. With diff, the .ebm that are
+// recreated are compared with the existing ones, and only get written if they differ.
+static int process_tree(const char* root, bool only_changed, bool diff, uint32_t nb_threads)
+{
+    int r = -1;
+    char manifest_path[PATH_MAX];
+    char** files = NULL;
+    uint32_t nb_files = 0, count[EBM_UNCHANGED + 1] = { 0 };
+    ebm_item* items = NULL;
+    JSON_Value* manifest = NULL;
+    const double start = get_time();
 
-            }
+    if (!is_directory(root)) {
+        fprintf(stderr, "ERROR: '%s' is not a directory\n", root);
+        return -1;
+    }
+    // The manifest uses paths that are relative to root
+    size_t root_len = strlen(root);
+    if (get_trailing_slash(root) == root_len) {
+        snprintf(manifest_path, sizeof(manifest_path), "%s%s", root, MANIFEST_NAME);
+    } else {
+        snprintf(manifest_path, sizeof(manifest_path), "%s%c%s", root, PATH_SEP, MANIFEST_NAME);
+        root_len++;
+    }
+    nb_files = find_files(root, ".ebm", &files);
+    if (nb_files == UINT32_MAX)
+        goto out;
+    if (nb_files == 0) {
+        fprintf(stderr, "ERROR: No .ebm file found in '%s'\n", root);
+        goto out;
+    }
+    items = calloc(nb_files, sizeof(ebm_item));
+    if (items == NULL) {
+        fprintf(stderr, "ERROR: Alloc error\n");
+        goto out;
+    }
+
+    JSON_Object* manifest_files = NULL;
+    if (only_changed && is_file(manifest_path)) {
+        manifest = json_parse_file(manifest_path);
+        if (manifest == NULL || json_object_get_uint32(json_object(manifest), "json_version") != MANIFEST_VERSION)
+            fprintf(stderr, "WARNING: Ignoring invalid manifest '%s'\n", manifest_path);
+        else
+            manifest_files = json_object_get_object(json_object(manifest), "files");
+    }
+
+    for (uint32_t i = 0; i < nb_files; i++) {
+        ebm_item* item = &items[i];
+        char json_path[PATH_MAX];
+        item->ebm_path = files[i];
+        files[i] = NULL;
+        item->name = strdup(_basename(item->ebm_path));
+        item->dir = strdup(_dirname(item->ebm_path));
+        if (item->name == NULL || item->dir == NULL) {
+            fprintf(stderr, "ERROR: Alloc error\n");
+            goto out;
         }
-detected:
-        if (d1 >= array_size(duration1_length) || d2 >= array_size(duration2_length)) {
-            fprintf(stderr, "ERROR: Failed to detect EBM record structure (Unsupported?)\n");
+        snprintf(json_path, sizeof(json_path), "%s%c%s", item->dir, PATH_SEP,
+            change_extension(item->name, ".json"));
+        item->json_path = strdup(json_path);
+        if (item->json_path == NULL) {
+            fprintf(stderr, "ERROR: Alloc error\n");
             goto out;
         }
-        JSON_Value* json_messages = NULL;
-        JSON_Value* json_message = NULL;
-        // Store the data we'll need to reconstruct the archive to a JSON file
-        json = json_value_init_object();
-        json_object_set_number(json_object(json), "json_version", JSON_VERSION);
-        json_object_set_string(json_object(json), "name", _basename(argv[argc - 1]));
-        json_object_set_number(json_object(json), "nb_messages", nb_messages & 0xffffffff);
-        json_messages = json_value_init_array();
-        uint32_t* ebm_header = (uint32_t*)&buf[sizeof(uint32_t)];
-        for (size_t i = 0; i < abs(nb_messages); i++) {
-            uint32_t j = 0;
-            json_message = json_value_init_object();
-            json_object_set_number(json_object(json_message), "type", (double)ebm_header[j]);
-            if (ebm_header[j] > 0x10)
-                    fprintf(stderr, "WARNING: Unexpected header type 0x%08x\n", ebm_header[j]);
-            json_object_set_number(json_object(json_message), "voice_id", (double)ebm_header[++j]);
-            if (ebm_header[++j] != 0)
-                json_object_set_number(json_object(json_message), "unknown1", (double)ebm_header[j]);
-            json_object_set_number(json_object(json_message), "name_id", (double)ebm_header[++j]);
-            if (ebm_header[++j] != 0)
-                json_object_set_number(json_object(json_message), "extra_id", (double)ebm_header[j]);
-            json_object_set_number(json_object(json_message), "expr_id", (double)ebm_header[++j]);
-            if (duration1_length[d1] > 0) {
-                JSON_Value* json_duration_array = json_value_init_array();
-                for (uint32_t x = 0; x < duration1_length[d1]; x++)
-                    json_array_append_number(json_array(json_duration_array), ebm_header[++j]);
-                json_object_set_value(json_object(json_message), "duration1", json_duration_array);
-            }
-            json_object_set_number(json_object(json_message), "msg_id", (double)ebm_header[++j]);
-            if (ebm_header[++j] != 0)
-                json_object_set_number(json_object(json_message), "unknown2", (double)ebm_header[j]);
-            // Don't store str_length since we'll reconstruct it
-            uint32_t str_length = ebm_header[++j];
-            if (str_length > MAX_STRING_SIZE) {
-                fprintf(stderr, "ERROR: Unexpected string size\n");
-                goto out;
-            }
-            char* str = (char*)&ebm_header[++j];
-            json_object_set_string(json_object(json_message), "msg_string", str);
-            ebm_header = (uint32_t*)&str[str_length];
-            if (duration2_length[d2] > 0) {
-                JSON_Value* json_duration_array = json_value_init_array();
-                for (uint32_t x = 0; x < duration2_length[d2]; x++)
-                    json_array_append_number(json_array(json_duration_array), *ebm_header++);
-                json_object_set_value(json_object(json_message), "duration2", json_duration_array);
-            }
-            json_array_append_value(json_array(json_messages), json_message);
+        item->recreate = is_file(item->json_path);
+        const char* hash = json_object_get_string(manifest_files, &item->ebm_path[root_len]);
+        if (item->recreate && hash != NULL) {
+            unsigned long long v;
+            item->in_manifest = (sscanf(hash, "%llx", &v) == 1);
+            item->hash = (uint64_t)v;
+        }
+    }
+
+    ebm_batch batch = { items, only_changed, diff };
+    run_jobs(process_ebm, &batch, nb_files, nb_threads);
+
+    // The output of the jobs, as well as the writing of the .ebm, which may create a backup
+    // and report it, is left to this thread, so that the messages of each file are kept in order
+    for (uint32_t i = 0; i < nb_files; i++) {
+        ebm_item* item = &items[i];
+        print_log(&item->log);
+        if (item->ebm_out != NULL && item->ebm.data != NULL &&
+            write_file(item->ebm.data, item->ebm.size, item->ebm_out, true))
+            item->status = EBM_RECREATED;
+        free(item->ebm.data);
+        item->ebm.data = NULL;
+    }
+
+    // Record the JSON files we know the .ebm are up to date with
+    json_value_free(manifest);
+    manifest = json_value_init_object();
+    json_object_set_number(json_object(manifest), "json_version", MANIFEST_VERSION);
+    JSON_Value* json_files = json_value_init_object();
+    r = 0;
+    for (uint32_t i = 0; i < nb_files; i++) {
+        char hash[17];
+        count[items[i].status]++;
+        if (items[i].status == EBM_FAILED) {
+            r = -1;
+            continue;
         }
-        JSON_Value* json_extra_data = json_value_init_array();
-        while ((uintptr_t)ebm_header < (uintptr_t)&buf[buf_size])
-            json_array_append_number(json_array(json_extra_data), *ebm_header++);
-        json_object_set_value(json_object(json), "messages", json_messages);
-        if (json_array_get_count(json_array(json_extra_data)) > 0)
-            json_object_set_value(json_object(json), "extra_data", json_extra_data);
+        snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)items[i].hash);
+        json_object_set_string(json_object(json_files), &items[i].ebm_path[root_len], hash);
+    }
+    json_object_set_value(json_object(manifest), "files", json_files);
+    if (json_serialize_to_file_pretty(manifest, manifest_path) != JSONSuccess) {
+        fprintf(stderr, "ERROR: Can't write '%s'\n", manifest_path);
+        r = -1;
+    }
+
+    printf("\nConverted %d, recreated %d and skipped %d unchanged .ebm file(s) in %.2f s\n",
+        count[EBM_CONVERTED], count[EBM_RECREATED], count[EBM_UNCHANGED], get_time() - start);
+    if (count[EBM_FAILED] != 0)
+        fprintf(stderr, "ERROR: %d .ebm file(s) could not be processed\n", count[EBM_FAILED]);
+
+out:
+    json_value_free(manifest);
+    for (uint32_t i = 0; items != NULL && i < nb_files; i++) {
+        free(items[i].ebm_path);
+        free(items[i].json_path);
+        free(items[i].dir);
+        free(items[i].name);
+        free(items[i].ebm_out);
+        free(items[i].ebm.data);
+        free(items[i].log.out);
+        free(items[i].log.err);
+    }
+    free(items);
+    for (uint32_t i = 0; nb_files != UINT32_MAX && i < nb_files; i++)
+        free(files[i]);
+    free(files);
+    return r;
+}
+
+int main_utf8(int argc, char** argv)
+{
+    int r = -1;
+    char path[PATH_MAX];
+    JSON_Value* json = NULL;
+    bool recursive = false, only_changed = false, diff = false;
+    uint32_t nb_threads = 1;
+    int argi;
+
+    for (argi = 1; argi < argc - 1 && argv[argi][0] == '-'; argi++) {
+        if (strcmp(argv[argi], "--only-changed") == 0)
+            only_changed = true;
+        else if (strcmp(argv[argi], "--diff") == 0)
+            diff = true;
+        else if (argv[argi][1] == 'r')
+            recursive = true;
+        else if (argv[argi][1] == 'j' && argi + 1 < argc - 1)
+            nb_threads = (uint32_t)atoi(argv[++argi]);
         else
-            json_value_free(json_extra_data);
+            break;
+    }
+    if (nb_threads == 0)
+        nb_threads = get_nb_cpus();
+
+    if (argc < 2 || argi != argc - 1 || ((only_changed || diff) && !recursive)) {
+        printf("%s %s (c) 2019-2022 VitaSmith\n\n"
+            "Usage: %s [-r [-j N] [--only-changed] [--diff]] <file or directory>\n\n"
+            "Convert a .ebm file to or from an editable JSON file.\n"
+            "-r recreates all the .ebm found in a directory that have a JSON alongside them,\n"
+            "and converts all the other ones, without prompting. Every .ebm that has a JSON\n"
+            "gets rewritten, unless --only-changed or --diff is specified.\n"
+            "-j N processes up to N files in parallel (0 = one per CPU).\n"
+            "--only-changed skips the .ebm whose JSON hasn't changed since the last -r, as\n"
+            "recorded in the " MANIFEST_NAME " of the directory.\n"
+            "--diff compares each recreated .ebm with the existing one, lists the messages\n"
+            "that differ, and leaves the .ebm alone if none does.\n\n",
+            _appname(argv[0]), GUST_TOOLS_VERSION_STR, _appname(argv[0]));
+        return 0;
+    }
+
+    if (recursive) {
+        return process_tree(argv[argc - 1], only_changed, diff, nb_threads);
+    } else if (strstr(argv[argc - 1], ".json") != NULL) {
+        json = json_parse_file_with_comments(argv[argc - 1]);
+        if (json == NULL) {
+            fprintf(stderr, "ERROR: Can't parse JSON data from '%s'\n", argv[argc - 1]);
+            goto out;
+        }
+        r = create_ebm(json, _dirname(argv[argc - 1]));
+    } else if (strstr(argv[argc - 1], ".ebm") != NULL) {
         snprintf(path, sizeof(path), "%s%c%s", _dirname(argv[argc - 1]), PATH_SEP,
             change_extension(_basename(argv[argc - 1]), ".json"));
-        printf("Creating '%s'\n", path);
-        json_serialize_to_file_pretty(json, path);
-        r = 0;
+        r = convert_ebm(argv[argc - 1], _basename(argv[argc - 1]), path, NULL);
     } else {
         fprintf(stderr, "ERROR: You must specify a .ebm or .json file");
     }
 
 out:
     json_value_free(json);
-    free(buf);
-    if (file != NULL)
-        fclose(file);
 
     if (r != 0) {
         fflush(stdin);
@@ -347,10 +347,21 @@ increase_buf_size:
                 goto out;
             }
         } else {
-            buf = malloc(file_size);
+            // The files get copied straight from the elixir, so we only need the header and table
+            lxr_header uhdr;
+            if (fread(&uhdr, sizeof(uhdr), 1, file) != 1) {
+                fprintf(stderr, "ERROR: Can't read uncompressed data");
+                goto out;
+            }
+            if (sizeof(lxr_header) + (size_t)uhdr.table_size > file_size) {
+                fprintf(stderr, "ERROR: File size mismatch\n");
+                goto out;
+            }
+            buf = malloc(sizeof(lxr_header) + uhdr.table_size);
             if (buf == NULL)
                 goto out;
-            if (fread(buf, 1, file_size, file) != file_size) {
+            memcpy(buf, &uhdr, sizeof(uhdr));
+            if (fread(&buf[sizeof(lxr_header)], 1, uhdr.table_size, file) != uhdr.table_size) {
                 fprintf(stderr, "ERROR: Can't read uncompressed data");
                 goto out;
             }
@@ -411,8 +422,12 @@ increase_buf_size:
             // No need to extract data for dummy entries
             if ((entry->size == 0) && (strcmp(entry->filename, "dummy") == 0))
                 continue;
-            if (!write_file(&buf[entry->offset], entry->size, path, false))
+            if (gz_pos != NULL) {
+                if (!write_file(&buf[entry->offset], entry->size, path, false))
+                    goto out;
+            } else if (!copy_to_file(file, entry->offset, entry->size, path)) {
                 goto out;
+            }
         }
 
         json_object_set_value(json_object(json), "files", json_files_array);
@@ -1,7 +1,6 @@
 /*
   gust_enc - Encoder/Decoder for Gust (Koei/Tecmo) .e files
   Copyright © 2019-2021 - VitaSmith
-  Prime number computation copyright © 2001-2003 - Stephane Carrez
 
   This program is free software: you can redistribute it and/or modify
   it under the terms of the GNU General Public License as published by
@@ -41,6 +40,9 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#if defined(BENCHMARK_CHECKSUMS)
+#include <time.h>
+#endif
 
 #include "utf8.h"
 #include "util.h"
@@ -48,6 +50,14 @@
 
 #define E_HEADER_SIZE       0x10
 #define E_FOOTER_SIZE       0x10
+// Maximum size of the data that scramble() appends to the payload (end marker,
+// 16-byte alignment and footer). Payload buffers must have this much extra room.
+#define E_TRAILER_MAX       (0x10 + E_FOOTER_SIZE)
+// Size of the blocks the scramblers and checksums are applied to in a single pass.
+// This should be small enough for a block to remain in the L2 cache.
+#define SCRAMBLE_BLOCK_SIZE (256 * 1024)
+// Number of keystream values that are precomputed at once for the sequential scramblers
+#define KEYSTREAM_SIZE      2048
 
 // Both of these are prime numbers
 #define RANDOM_CONSTANT     0x3b9a73c9
@@ -70,9 +80,43 @@ typedef struct {
     uint16_t fence;
 } seed_data;
 
-// Bitmap list prime numbers below a specific value
-static uint8_t* prime_list = NULL;
-static uint32_t random_seed[2];
+typedef struct {
+    const char* id;
+    const char* name;
+    uint32_t version;
+    seed_data seeds;
+} seed_entry;
+
+#if !defined(GENERATE_SEEDS)
+// Built-in seeds, compiled from gust_enc.json
+#include "gust_enc_seeds.h"
+#else
+// The generator doesn't have any built-in seeds
+#define DEFAULT_SEEDS_ID    ""
+#define SEEDS_HASH_SEED     0
+static const seed_entry builtin_seeds[1] = { 0 };
+static const uint8_t builtin_seeds_hash[1] = { 0 };
+#endif
+
+typedef struct {
+    uint32_t mul;
+    uint32_t inc;
+} lcg_jump;
+
+typedef struct {
+    uint32_t seed[2];
+    // Jump-ahead values for 1 to 4 steps of the generator
+    lcg_jump jump[4];
+} random_ctx;
+
+typedef struct {
+    random_ctx rnd;
+    uint32_t table[3];
+    uint32_t index;
+    uint32_t fudge;
+    uint32_t processed;
+} rotating_ctx;
+
 // TODO: Use endianness handling from util.[h/c]
 static bool is_big_endian = true;
 #define getdata16(x) (is_big_endian ? getbe16(x) : getle16(x))
@@ -83,24 +127,61 @@ static bool is_big_endian = true;
 /*
  * Helper functions to generate predictible semirandom numbers
  */
-static __inline void init_random(uint32_t r0, uint32_t r1)
+static __inline void init_random(random_ctx* rnd, uint32_t r0, uint32_t r1)
 {
-    random_seed[0] = RANDOM_CONSTANT + r0;
-    random_seed[1] = r1;
+    rnd->seed[0] = RANDOM_CONSTANT + r0;
+    rnd->seed[1] = r1;
+    // Since seed[1] is updated by a linear congruential generator, applying n steps
+    // at once is the same as computing seed[1] = A(n) * seed[1] + C(n), with
+    // A(n) = seed[0]^n and C(n) = (seed[0]^(n-1) + ... + seed[0] + 1) * 0x2f09.
+    rnd->jump[0].mul = rnd->seed[0];
+    rnd->jump[0].inc = RANDOM_INCREMENT;
+    for (size_t i = 1; i < array_size(rnd->jump); i++) {
+        rnd->jump[i].mul = rnd->seed[0] * rnd->jump[i - 1].mul;
+        rnd->jump[i].inc = rnd->seed[0] * rnd->jump[i - 1].inc + RANDOM_INCREMENT;
+    }
 }
 
-static __inline uint16_t get_random_u15(void)
+static __inline uint16_t get_random_u15(random_ctx* rnd)
 {
-    random_seed[1] = random_seed[0] * random_seed[1] + RANDOM_INCREMENT;
-    return (random_seed[1] >> 16) & 0x7fff;
+    rnd->seed[1] = rnd->seed[0] * rnd->seed[1] + RANDOM_INCREMENT;
+    return (rnd->seed[1] >> 16) & 0x7fff;
 }
 
-static __inline uint16_t get_random_u16(void)
+static __inline uint16_t get_random_u16(random_ctx* rnd)
 {
-    random_seed[1] = random_seed[0] * random_seed[1] + RANDOM_INCREMENT;
-    return random_seed[1] >> 16;
+    rnd->seed[1] = rnd->seed[0] * rnd->seed[1] + RANDOM_INCREMENT;
+    return rnd->seed[1] >> 16;
 }
 
+/*
+ * The values used by the sequential scramblers only depend on the seeds and on the
+ * position in the stream, never on the data, so they can be precomputed into a
+ * keystream, which turns the scramblers into data parallel passes. To generate the
+ * keystream, we use jump-ahead to compute 4 values at once from the same seed,
+ * which breaks the dependency chain between consecutive values.
+ */
+#define RANDOM_STREAM(name, type, mask)                                             \
+static void name(random_ctx* rnd, type* key, uint32_t n)                            \
+{                                                                                   \
+    uint32_t i, s = rnd->seed[1];                                                   \
+    for (i = 0; i + 4 <= n; i += 4) {                                               \
+        key[i] = (type)(((rnd->jump[0].mul * s + rnd->jump[0].inc) >> 16) & mask);  \
+        key[i + 1] = (type)(((rnd->jump[1].mul * s + rnd->jump[1].inc) >> 16) & mask); \
+        key[i + 2] = (type)(((rnd->jump[2].mul * s + rnd->jump[2].inc) >> 16) & mask); \
+        s = rnd->jump[3].mul * s + rnd->jump[3].inc;                                \
+        key[i + 3] = (type)((s >> 16) & mask);                                      \
+    }                                                                               \
+    for (; i < n; i++) {                                                            \
+        s = rnd->seed[0] * s + RANDOM_INCREMENT;                                    \
+        key[i] = (type)((s >> 16) & mask);                                          \
+    }                                                                               \
+    rnd->seed[1] = s;                                                               \
+}
+
+RANDOM_STREAM(get_random_stream_u8, uint8_t, 0xff)
+RANDOM_STREAM(get_random_stream_u15, uint16_t, 0x7fff)
+
 /*
  * Stupid sexy scramblers ("Feels like I'm reading nothing at all!")
  *
@@ -109,11 +190,14 @@ static __inline uint16_t get_random_u16(void)
  * (or a variation thereof) and seed[1] another 16-bit prime number.
  *
  * From there, they only differ in the manner with which they use the updated seed.
+ *
+ * Since each scrambler carries its own random context, the sequential ones can be
+ * applied block by block, and interleaved with one another, in a single data pass.
  */
 
 // Scramble individual bits between two semi-random bit positions within a slice.
-static bool bit_scrambler(uint8_t* chunk, uint32_t chunk_size, uint32_t slice_size,
-                          bool descramble)
+static bool bit_scrambler(random_ctx* rnd, uint8_t* chunk, uint32_t chunk_size,
+                          uint32_t slice_size, bool descramble)
 {
     // Table_size needs to be 8 * slice_size, to encompass all individual bit positions
     uint32_t x, table_size = slice_size << 3;
@@ -138,7 +222,7 @@ static bool bit_scrambler(uint8_t* chunk, uint32_t chunk_size, uint32_t slice_si
         // Now create a scrambled table from the above
         for (uint32_t i = 0; i < table_size; i++) {
             // Translate this semi-random value to a base_table index we haven't used yet
-            x = get_random_u15() % (table_size - i);
+            x = get_random_u15(rnd) % (table_size - i);
             scrambling_table[i] = base_table[x];
             // Now remove the value we used from base_table
             memmove(&base_table[x], &base_table[x + 1], (size_t)(table_size - i - x) * 2);
@@ -180,49 +264,116 @@ static bool bit_scrambler(uint8_t* chunk, uint32_t chunk_size, uint32_t slice_si
     return true;
 }
 
+// Compute the values to add and XOR for the next n words of the fenced scrambler.
+static void fenced_keystream(random_ctx* rnd, uint16_t* add_key, uint16_t* xor_key,
+                             uint32_t n, uint16_t fence, bool extra_fudge)
+{
+    // The fence is a 12-bit prime number
+    if (extra_fudge) {
+        // The number of values we consume per word varies, so we can't jump ahead
+        for (uint32_t i = 0; i < n; i++) {
+            add_key[i] = get_random_u15(rnd);
+            xor_key[i] = (add_key[i] % (fence * 2) >= fence) ? get_random_u15(rnd) : 0;
+        }
+    } else {
+        get_random_stream_u15(rnd, add_key, n);
+        for (uint32_t i = 0; i < n; i++)
+            xor_key[i] = (add_key[i] % (fence * 2) >= fence) ? add_key[i] : 0;
+    }
+}
+
+// Apply a fenced keystream to n 16-bit data words
+static void fenced_apply(uint8_t* buf, const uint16_t* add_key, const uint16_t* xor_key,
+                         uint32_t n, bool descramble)
+{
+    uint32_t i = 0;
+#if defined(USE_SSE2)
+    for (; i + 8 <= n; i += 8) {
+        __m128i w = _mm_loadu_si128((const __m128i*)&buf[2 * i]);
+        __m128i a = _mm_loadu_si128((const __m128i*)&add_key[i]);
+        __m128i x = _mm_loadu_si128((const __m128i*)&xor_key[i]);
+        if (is_big_endian)
+            w = _mm_or_si128(_mm_slli_epi16(w, 8), _mm_srli_epi16(w, 8));
+        w = descramble ? _mm_sub_epi16(_mm_xor_si128(w, x), a) : _mm_xor_si128(_mm_add_epi16(w, a), x);
+        if (is_big_endian)
+            w = _mm_or_si128(_mm_slli_epi16(w, 8), _mm_srli_epi16(w, 8));
+        _mm_storeu_si128((__m128i*)&buf[2 * i], w);
+    }
+#endif
+    for (; i < n; i++) {
+        uint16_t w = getdata16(&buf[2 * i]);
+        w = descramble ? (w ^ xor_key[i]) - add_key[i] : (w + add_key[i]) ^ xor_key[i];
+        setdata16(&buf[2 * i], w);
+    }
+}
+
 // Sequentially scramble bytes by adding the updated seed and, depending on whether
 // the modulo with the current seed falls above or below a "fence", XORing the seed.
-static bool fenced_scrambler(uint8_t* buf, uint32_t buf_size, uint16_t fence,
-                             bool descramble, bool extra_fudge)
-{
-    for (uint32_t i = 0; i < buf_size; i += 2) {
-        uint16_t x = get_random_u15();
-        uint16_t w = getdata16(&buf[i]);
-        // The fence is a 12-bit prime number
-        if (descramble) {
-            if (x % (fence * 2) >= fence)
-                w ^= extra_fudge ? get_random_u15() : x;
-            w -= x;
-        } else {
-            w += x;
-            if (x % (fence * 2) >= fence)
-                w ^= extra_fudge ? get_random_u15() : x;
-        }
-        setdata16(&buf[i], w);
+static bool fenced_scrambler(random_ctx* rnd, uint8_t* buf, uint32_t buf_size,
+                             uint16_t fence, bool descramble, bool extra_fudge)
+{
+    uint16_t add_key[KEYSTREAM_SIZE], xor_key[KEYSTREAM_SIZE];
+    // We process 16-bit words, with an odd buffer size counting as an extra word
+    for (uint32_t i = 0, n = (buf_size + 1) / 2; i < n; i += KEYSTREAM_SIZE) {
+        uint32_t nb_words = min(n - i, KEYSTREAM_SIZE);
+        fenced_keystream(rnd, add_key, xor_key, nb_words, fence, extra_fudge);
+        fenced_apply(&buf[2 * i], add_key, xor_key, nb_words, descramble);
     }
     return true;
 }
 
-// Sequentially scramble bytes by XORing them with a set of 3 rotated seeds.
-static bool rotating_scrambler(uint8_t* buf, uint32_t buf_size, const seed_data* seeds)
+static void init_rotating(rotating_ctx* ctx, uint32_t r0, const seed_data* seeds)
 {
     // We're updating seed values in the table, so make sure we work on a copy
-    uint32_t seed_table[3] = { seeds->table[0], seeds->table[1], seeds->table[2] };
-    uint32_t seed_index = 0;
-    uint32_t seed_switch_fudge = 0;
-    uint32_t processed_for_this_seed = 0;
-    for (uint32_t i = 0; i < buf_size; i++) {
-        buf[i] ^= get_random_u16();
-        if (++processed_for_this_seed >= seeds->length[seed_index] + seed_switch_fudge) {
-            seed_table[seed_index++] = random_seed[1];
-            if (seed_index >= array_size(seed_table)) {
-                seed_index = 0;
-                seed_switch_fudge++;
+    for (size_t i = 0; i < array_size(ctx->table); i++)
+        ctx->table[i] = seeds->table[i];
+    ctx->index = 0;
+    ctx->fudge = 0;
+    ctx->processed = 0;
+    init_random(&ctx->rnd, r0, ctx->table[0]);
+}
+
+// Compute the next n bytes of the rotating scrambler keystream. Each of the 3 seeds
+// is used for an increasing number of bytes, before switching to the next one.
+static void rotating_keystream(rotating_ctx* ctx, uint8_t* key, uint32_t n,
+                               const seed_data* seeds)
+{
+    while (n > 0) {
+        uint32_t seed_length = seeds->length[ctx->index] + ctx->fudge;
+        uint32_t len = min(n, seed_length - ctx->processed);
+        get_random_stream_u8(&ctx->rnd, key, len);
+        key = &key[len];
+        n -= len;
+        ctx->processed += len;
+        if (ctx->processed >= seed_length) {
+            ctx->table[ctx->index++] = ctx->rnd.seed[1];
+            if (ctx->index >= array_size(ctx->table)) {
+                ctx->index = 0;
+                ctx->fudge++;
             }
-            random_seed[1] = seed_table[seed_index];
-            processed_for_this_seed = 0;
+            ctx->rnd.seed[1] = ctx->table[ctx->index];
+            ctx->processed = 0;
         }
     }
+}
+
+// Sequentially scramble bytes by XORing them with a set of 3 rotated seeds.
+// The context is preserved between calls, so that a buffer can be processed in blocks.
+static bool rotating_scrambler(rotating_ctx* ctx, uint8_t* buf, uint32_t buf_size,
+                               const seed_data* seeds)
+{
+    uint8_t key[KEYSTREAM_SIZE];
+    for (uint32_t i = 0; i < buf_size; i += KEYSTREAM_SIZE) {
+        uint32_t n = min(buf_size - i, KEYSTREAM_SIZE), j = 0;
+        rotating_keystream(ctx, key, n, seeds);
+#if defined(USE_SSE2)
+        for (; j + 16 <= n; j += 16)
+            _mm_storeu_si128((__m128i*)&buf[i + j], _mm_xor_si128(
+                _mm_loadu_si128((const __m128i*)&buf[i + j]), _mm_loadu_si128((const __m128i*)&key[j])));
+#endif
+        for (; j < n; j++)
+            buf[i + j] ^= key[j];
+    }
     return true;
 }
 
@@ -450,7 +601,8 @@ static uint32_t glaze(uint8_t* src, uint32_t src_size, uint8_t** dst)
     // [decompressed_size] [bistream_size] [bytecode_size] <...bitstream...>
     // [dictionary_size] <...dictionary...> [length_table_size] <...length_table...>
     uint32_t compressed_size = 3 * sizeof(uint32_t) + bitstream_size + sizeof(uint32_t) + src_size + sizeof(uint32_t) + num_blocks;
-    *dst = malloc(compressed_size);
+    // Leave room for the trailer, so that the output can be scrambled in place
+    *dst = malloc((size_t)compressed_size + E_TRAILER_MAX);
     if (*dst == NULL)
         return 0;
     uint8_t* pos = *dst;
@@ -514,47 +666,165 @@ static uint32_t adler32(const uint8_t* data, size_t size)
     return (b << 16) | a;
 }
 
-static uint32_t checksum_sub(uint8_t* buf, uint32_t buf_size)
+static uint32_t checksum_sub_scalar(const uint8_t* buf, uint32_t buf_size)
 {
     uint32_t checksum = 0;
-    for (uint32_t i = 0; i < (buf_size & ~3); i += sizeof(uint32_t))
-        checksum -= getdata32(&buf[i]);
+    if (is_big_endian) {
+        for (uint32_t i = 0; i < (buf_size & ~3); i += sizeof(uint32_t))
+            checksum -= getbe32(&buf[i]);
+    } else {
+        for (uint32_t i = 0; i < (buf_size & ~3); i += sizeof(uint32_t))
+            checksum -= getle32(&buf[i]);
+    }
     return checksum;
 }
 
-static uint32_t checksum_xor(uint8_t* buf, uint32_t buf_size)
+static uint32_t checksum_xor_scalar(const uint8_t* buf, uint32_t buf_size)
 {
     uint32_t checksum = 0;
-    for (uint32_t i = 0; i < (buf_size & ~3); i += sizeof(uint32_t))
-        checksum ^= ~getdata32(&buf[i]);
+    if (is_big_endian) {
+        for (uint32_t i = 0; i < (buf_size & ~3); i += sizeof(uint32_t))
+            checksum ^= ~getbe32(&buf[i]);
+    } else {
+        for (uint32_t i = 0; i < (buf_size & ~3); i += sizeof(uint32_t))
+            checksum ^= ~getle32(&buf[i]);
+    }
     return checksum;
 }
 
+#if defined(USE_SSE2)
+// Byte swap each of the 32-bit lanes of a vector
+static __inline __m128i bswap_m128i_32(__m128i v)
+{
+    // Swap the 16-bit halves, then the bytes within each 16-bit half
+    v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0xb1), 0xb1);
+    return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+}
+
+static __inline uint32_t hsum_m128i_32(__m128i v)
+{
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, 0x4e));
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, 0xb1));
+    return (uint32_t)_mm_cvtsi128_si32(v);
+}
+
+static __inline uint32_t hxor_m128i_32(__m128i v)
+{
+    v = _mm_xor_si128(v, _mm_shuffle_epi32(v, 0x4e));
+    v = _mm_xor_si128(v, _mm_shuffle_epi32(v, 0xb1));
+    return (uint32_t)_mm_cvtsi128_si32(v);
+}
+
+static uint32_t checksum_sub(const uint8_t* buf, uint32_t buf_size)
+{
+    __m128i acc[2] = { _mm_setzero_si128(), _mm_setzero_si128() };
+    uint32_t i, simd_size = buf_size & ~0x1f;
+
+    if (is_big_endian) {
+        for (i = 0; i < simd_size; i += 32) {
+            acc[0] = _mm_sub_epi32(acc[0], bswap_m128i_32(_mm_loadu_si128((const __m128i*)&buf[i])));
+            acc[1] = _mm_sub_epi32(acc[1], bswap_m128i_32(_mm_loadu_si128((const __m128i*)&buf[i + 16])));
+        }
+    } else {
+        for (i = 0; i < simd_size; i += 32) {
+            acc[0] = _mm_sub_epi32(acc[0], _mm_loadu_si128((const __m128i*)&buf[i]));
+            acc[1] = _mm_sub_epi32(acc[1], _mm_loadu_si128((const __m128i*)&buf[i + 16]));
+        }
+    }
+    return hsum_m128i_32(_mm_add_epi32(acc[0], acc[1])) +
+        checksum_sub_scalar(&buf[simd_size], buf_size - simd_size);
+}
+
+static uint32_t checksum_xor(const uint8_t* buf, uint32_t buf_size)
+{
+    __m128i acc[2] = { _mm_setzero_si128(), _mm_setzero_si128() };
+    uint32_t i, simd_size = buf_size & ~0x1f;
+
+    // Since XOR works on individual bytes, we don't need to byte swap each lane,
+    // and the NOT of each word can also be applied once, on the final value.
+    for (i = 0; i < simd_size; i += 32) {
+        acc[0] = _mm_xor_si128(acc[0], _mm_loadu_si128((const __m128i*)&buf[i]));
+        acc[1] = _mm_xor_si128(acc[1], _mm_loadu_si128((const __m128i*)&buf[i + 16]));
+    }
+    uint32_t checksum = hxor_m128i_32(_mm_xor_si128(acc[0], acc[1]));
+    if (is_big_endian)
+        checksum = bswap_uint32(checksum);
+    // simd_size / 4 is always even, so the NOTs cancel out
+    return checksum ^ checksum_xor_scalar(&buf[simd_size], buf_size - simd_size);
+}
+#else
+#define checksum_sub checksum_sub_scalar
+#define checksum_xor checksum_xor_scalar
+#endif
+
+#if defined(BENCHMARK_CHECKSUMS)
+// Micro-benchmark of the scalar vs SIMD checksums, which is built as gust_enc_bench
+static double benchmark_checksum(uint32_t (*checksum)(const uint8_t*, uint32_t),
+                                 const uint8_t* buf, uint32_t buf_size, uint32_t* result)
+{
+    const int nb_runs = 16;
+    // Prevent the compiler from inlining the call and hoisting it out of the loop
+    uint32_t (* volatile func)(const uint8_t*, uint32_t) = checksum;
+    clock_t start = clock();
+    for (int i = 0; i < nb_runs; i++)
+        *result = func(buf, buf_size);
+    double duration = (double)(clock() - start) / CLOCKS_PER_SEC;
+    return (duration == 0.0) ? 0.0 : ((double)nb_runs * buf_size / MB) / duration;
+}
+
+static int benchmark_checksums(void)
+{
+    const uint32_t buf_size = 64 * MB + 3;
+    uint32_t r[2];
+    uint8_t* buf = malloc(buf_size);
+    if (buf == NULL)
+        return -1;
+    random_ctx rnd;
+    init_random(&rnd, 0, RANDOM_INCREMENT);
+    for (uint32_t i = 0; i < buf_size; i++)
+        buf[i] = (uint8_t)get_random_u16(&rnd);
+
+    for (int be = 0; be < 2; be++) {
+        is_big_endian = (be != 0);
+        printf("%s endian data:\n", is_big_endian ? "Big" : "Little");
+        double scalar_rate = benchmark_checksum(checksum_sub_scalar, buf, buf_size, &r[0]);
+        double simd_rate = benchmark_checksum(checksum_sub, buf, buf_size, &r[1]);
+        printf("  checksum_sub: %8.1f MB/s (scalar) %8.1f MB/s (SIMD) %s\n",
+            scalar_rate, simd_rate, (r[0] == r[1]) ? "" : "[MISMATCH]");
+        scalar_rate = benchmark_checksum(checksum_xor_scalar, buf, buf_size, &r[0]);
+        simd_rate = benchmark_checksum(checksum_xor, buf, buf_size, &r[1]);
+        printf("  checksum_xor: %8.1f MB/s (scalar) %8.1f MB/s (SIMD) %s\n",
+            scalar_rate, simd_rate, (r[0] == r[1]) ? "" : "[MISMATCH]");
+    }
+    free(buf);
+    return 0;
+}
+#endif
+
+// Scramble a payload in place and write it out. Note that the payload buffer must
+// have room for at least E_TRAILER_MAX bytes beyond payload_size.
 static bool scramble(uint8_t* payload, uint32_t payload_size, char* path, seed_data* seeds,
                      uint32_t working_size, uint32_t version)
 {
     bool r = false;
     uint32_t adler_sum, checksum[3] = { 0, 0, 0 };
+    uint8_t header[E_HEADER_SIZE] = { 0 };
+    random_ctx rnd_fenced;
+    rotating_ctx rotating;
 
     // Align the size (plus an extra byte for the end marker) to 16-bytes
     uint32_t main_payload_size = (payload_size + 1 + 0xf) & ~0xf;
-    uint8_t* buf = calloc((size_t)main_payload_size + E_HEADER_SIZE + E_FOOTER_SIZE, 1);
-    if (buf == NULL)
-        return false;
-    uint8_t* main_payload = &buf[E_HEADER_SIZE];
-    memcpy(main_payload, payload, payload_size);
+    memset(&payload[payload_size], 0, (size_t)main_payload_size + E_FOOTER_SIZE - payload_size);
     adler_sum = adler32(payload, payload_size);
 
     // Optionally scramble the beginning of the file
     if (version == 2) {
-        init_random(adler_sum, seeds->main[2]);
-        if (!bit_scrambler(main_payload, min(payload_size, 0x800), 0x80, false))
-            goto out;
+        random_ctx rnd;
+        init_random(&rnd, adler_sum, seeds->main[2]);
+        if (!bit_scrambler(&rnd, payload, min(payload_size, 0x800), 0x80, false))
+            return false;
     }
 
-    // Compute the checksums
-    checksum[0] = checksum_sub(main_payload, payload_size);
-    checksum[1] = checksum_xor(main_payload, payload_size);
     switch (version) {
     case 2:
 #if !defined(VALIDATE_CHECKSUM)
@@ -567,49 +837,68 @@ static bool scramble(uint8_t* payload, uint32_t payload_size, char* path, seed_d
         checksum[2] = seeds->main[0];
         break;
     default:
-        goto out;
+        return false;
     }
 
-    // Write the checksums
-    setdata32(&main_payload[(size_t)main_payload_size + 4], checksum[0]);
-    setdata32(&main_payload[(size_t)main_payload_size + 8], checksum[1]);
-    setdata32(&main_payload[(size_t)main_payload_size + 12], checksum[2]);
+    // Compute the checksums, and apply the main and first scramblers, in a single pass.
+    // The fenced scrambler works on 16-bit words, so it lags behind on an odd block end.
+    init_rotating(&rotating, checksum[2], seeds);
+    init_random(&rnd_fenced, 0, seeds->main[1]);
+    uint32_t fenced_pos = 0;
+    for (uint32_t pos = 0; pos < payload_size; pos += SCRAMBLE_BLOCK_SIZE) {
+        uint8_t* block = &payload[pos];
+        uint32_t block_size = min(payload_size - pos, SCRAMBLE_BLOCK_SIZE);
+        checksum[0] += checksum_sub(block, block_size);
+        checksum[1] ^= checksum_xor(block, block_size);
+        if (!rotating_scrambler(&rotating, block, block_size, seeds))
+            return false;
+        uint32_t fenced_end = (pos + block_size) & ~1;
+        if (!fenced_scrambler(&rnd_fenced, &payload[fenced_pos], fenced_end - fenced_pos,
+            seeds->fence, false, (version == 3)))
+            return false;
+        fenced_pos = fenced_end;
+    }
 
-    // Call the main scrambler
-    init_random(checksum[2], seeds->table[0]);
-    if (!rotating_scrambler(main_payload, payload_size, seeds))
-        goto out;
+    // Write the checksums
+    setdata32(&payload[(size_t)main_payload_size + 4], checksum[0]);
+    setdata32(&payload[(size_t)main_payload_size + 8], checksum[1]);
+    setdata32(&payload[(size_t)main_payload_size + 12], checksum[2]);
 
     // Add the end of payload marker
-    main_payload[payload_size] = 0xff;
+    payload[payload_size] = 0xff;
 
     // From now on, we'll scramble the footer as well
     main_payload_size += E_FOOTER_SIZE;
 
-    // Call first scrambler
-    init_random(0, seeds->main[1]);
-    if (!fenced_scrambler(main_payload, main_payload_size, seeds->fence, false, (version == 3)))
-        goto out;
+    // Complete the first scrambler
+    if (!fenced_scrambler(&rnd_fenced, &payload[fenced_pos], main_payload_size - fenced_pos,
+        seeds->fence, false, (version == 3)))
+        return false;
 
     // Apply optional extra scrambling to the end of the file
     if (version == 2) {
-        init_random(0, seeds->main[0]);
-        uint8_t* chunk = &main_payload[main_payload_size - min(main_payload_size, 0x800)];
-        if (!bit_scrambler(chunk, min(main_payload_size, 0x800), 0x100, false))
-            goto out;
+        random_ctx rnd;
+        init_random(&rnd, 0, seeds->main[0]);
+        uint8_t* chunk = &payload[main_payload_size - min(main_payload_size, 0x800)];
+        if (!bit_scrambler(&rnd, chunk, min(main_payload_size, 0x800), 0x100, false))
+            return false;
     }
 
     // Populate the header data
-    setdata32(buf, version);
-    setdata32(&buf[4], working_size);
-
-    if (!write_file(buf, main_payload_size + E_HEADER_SIZE, path, true))
-        goto out;
-
-    r = true;
+    setdata32(header, version);
+    setdata32(&header[4], working_size);
 
-out:
-    free(buf);
+    create_backup(path);
+    FILE* file = fopen_utf8(path, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "ERROR: Can't create file '%s'\n", path);
+        return false;
+    }
+    r = (fwrite(header, 1, E_HEADER_SIZE, file) == E_HEADER_SIZE) &&
+        (fwrite(payload, 1, main_payload_size, file) == main_payload_size);
+    fclose(file);
+    if (!r)
+        fprintf(stderr, "ERROR: Can't write file '%s'\n", path);
     return r;
 }
 
@@ -636,18 +925,21 @@ static uint32_t unscramble(uint8_t* payload, uint32_t payload_size, seed_data* s
     }
     payload = &payload[E_HEADER_SIZE];
     payload_size -= E_HEADER_SIZE;
+    random_ctx rnd;
+    rotating_ctx rotating;
 
     // Revert the optional bit scrambling applied to the end of the file
     if (version == 2) {
         uint8_t* chunk = &payload[payload_size - min(payload_size, 0x800)];
-        init_random(0, seeds->main[0]);
-        if (!bit_scrambler(chunk, min(payload_size, 0x800), 0x100, true))
+        init_random(&rnd, 0, seeds->main[0]);
+        if (!bit_scrambler(&rnd, chunk, min(payload_size, 0x800), 0x100, true))
             return 0;
     }
 
-    // Now call the fenced scrambler on the whole payload
-    init_random(0, seeds->main[1]);
-    if (!fenced_scrambler(payload, payload_size, seeds->fence, true, (version == 3)))
+    // Now call the fenced scrambler on the whole payload. This needs to be done in
+    // a separate pass, since the footer must be descrambled to get the other seeds.
+    init_random(&rnd, 0, seeds->main[1]);
+    if (!fenced_scrambler(&rnd, payload, payload_size, seeds->fence, true, (version == 3)))
         return 0;
 
     // Read the descrambled checksums footer (16 bytes)
@@ -677,14 +969,19 @@ static uint32_t unscramble(uint8_t* payload, uint32_t payload_size, seed_data* s
         return 0;
     }
 
-    // Now call the rotating scrambler on the actual payload
-    init_random(checksum[2], seeds->table[0]);
-    if (!rotating_scrambler(payload, payload_size, seeds))
-        return 0;
+    // Now call the rotating scrambler on the actual payload and compute the checksums
+    // while each block is still in cache
+    init_rotating(&rotating, checksum[2], seeds);
+    for (uint32_t pos = 0; pos < payload_size; pos += SCRAMBLE_BLOCK_SIZE) {
+        uint8_t* block = &payload[pos];
+        uint32_t block_size = min(payload_size - pos, SCRAMBLE_BLOCK_SIZE);
+        if (!rotating_scrambler(&rotating, block, block_size, seeds))
+            return 0;
+        checksum[0] -= checksum_sub(block, block_size);
+        checksum[1] ^= checksum_xor(block, block_size);
+    }
 
     // Validate the checksums
-    checksum[0] -= checksum_sub(payload, payload_size);
-    checksum[1] ^= checksum_xor(payload, payload_size);
     if ((checksum[0] != 0) || (checksum[1] != 0)) {
         fprintf(stderr, "ERROR: Descrambler checksum mismatch\n");
         return 0;
@@ -696,199 +993,338 @@ static uint32_t unscramble(uint8_t* payload, uint32_t payload_size, seed_data* s
 
     // Revert the optional bit scrambling applied to the start of the file
     if (version == 2) {
-        init_random(checksum[2], seeds->main[2]);
-        if (!bit_scrambler(payload, min(payload_size, 0x800), 0x80, true))
+        init_random(&rnd, checksum[2], seeds->main[2]);
+        if (!bit_scrambler(&rnd, payload, min(payload_size, 0x800), 0x80, true))
             return 0;
     }
 
     return payload_size;
 }
 
-// Returns the truncated integer square root of y using the Babylonian
-// iterative approximation method, derived from Newton's method.
-// This public domain function was written by George Gesslein II.
-static inline uint32_t lsqrt(uint32_t y)
+// Modular multiplication and exponentiation, for the Miller-Rabin test below.
+static __inline uint32_t mul_mod(uint32_t a, uint32_t b, uint32_t m)
 {
-    uint32_t x_old, x_new, testy;
-    int i, nbits;
+    return (uint32_t)(((uint64_t)a * b) % m);
+}
 
-    if (y == 0)
-        return 0;
+static uint32_t pow_mod(uint32_t b, uint32_t e, uint32_t m)
+{
+    uint32_t r = 1;
+    for (b %= m; e != 0; e >>= 1) {
+        if (e & 1)
+            r = mul_mod(r, b, m);
+        b = mul_mod(b, b, m);
+    }
+    return r;
+}
 
-    // Select a good starting value using binary logarithms
-    nbits = sizeof(y) * 8;
-    for (i = 4, testy = 16; ; i += 2, testy <<= 2) {
-        if (i >= nbits || y <= testy) {
-            x_old = (1 << (i / 2));	/* x_old = sqrt(testy) */
-            break;
+// Returns true if 'n' is prime, using a deterministic Miller-Rabin test.
+// Bases 2, 7 and 61 are sufficient for every 32-bit value, so we only ever
+// need to check the handful of seeds we use, rather than build a prime table.
+// Note that 0 and 1 are treated as prime, since unused seeds are set to 0.
+static bool is_prime(uint32_t n)
+{
+    static const uint32_t bases[] = { 2, 7, 61 };
+
+    if (n < 4)
+        return true;
+    if ((n & 1) == 0)
+        return false;
+
+    // Write n - 1 as d * 2^s with d odd
+    uint32_t d = n - 1, s = 0;
+    for (; (d & 1) == 0; d >>= 1, s++);
+
+    for (size_t i = 0; i < array_size(bases); i++) {
+        if (bases[i] % n == 0)
+            continue;
+        uint32_t x = pow_mod(bases[i], d, n);
+        if ((x == 1) || (x == n - 1))
+            continue;
+        uint32_t r;
+        for (r = 1; r < s; r++) {
+            x = mul_mod(x, x, n);
+            if (x == n - 1)
+                break;
         }
+        if (r >= s)
+            return false;
     }
-    // x_old >= sqrt(y)
-    // Use the Babylonian method to arrive at the integer square root
-    for (;;) {
-        x_new = (y / x_old + x_old) / 2;
-        if (x_old <= x_new)
-            break;
-        x_old = x_new;
+    return true;
+}
+
+static bool validate_seeds(const seed_data* seeds)
+{
+    for (size_t i = 0; i < array_size(seeds->main); i++) {
+        if (!is_prime(seeds->main[i])) {
+            printf("ERROR: main[%d] (0x%04x) is not prime!\n", (uint32_t)i, seeds->main[i]);
+            return false;
+        }
+        if (!is_prime(seeds->table[i])) {
+            printf("ERROR: table[%d] (0x%04x) is not prime!\n", (uint32_t)i, seeds->table[i]);
+            return false;
+        }
+        if (!is_prime(seeds->length[i])) {
+            printf("ERROR: length[%d] (0x%02x) is not prime!\n", (uint32_t)i, seeds->length[i]);
+            return false;
+        }
     }
-    return x_old;
+    if (!is_prime(seeds->fence)) {
+        printf("ERROR: fence (0x%04x) is not prime!\n", seeds->fence);
+        return false;
+    }
+    return true;
 }
 
-// Returns true if 'n' is a prime number recorded in the table
-static inline int is_prime (uint32_t n)
+// Note that the strings from the entry are only valid for the lifetime of the JSON value
+static void get_seeds_from_json(JSON_Object* seeds_entry, seed_entry* entry)
 {
-    uint16_t bit = (uint16_t)n & 0x07;
-    return prime_list[n >> 3] & (1 << bit);
+    entry->id = json_object_get_string(seeds_entry, "id");
+    entry->name = json_object_get_string(seeds_entry, "name");
+    entry->version = json_object_get_uint32(seeds_entry, "version");
+    for (size_t i = 0; i < array_size(entry->seeds.main); i++) {
+        entry->seeds.main[i] = (uint32_t)json_array_get_number(json_object_get_array(seeds_entry, "main"), i);
+        entry->seeds.table[i] = (uint32_t)json_array_get_number(json_object_get_array(seeds_entry, "table"), i);
+        entry->seeds.length[i] = (uint32_t)json_array_get_number(json_object_get_array(seeds_entry, "length"), i);
+    }
+    entry->seeds.fence = (uint16_t)json_object_get_number(seeds_entry, "fence");
 }
 
-// Record 'n' as a prime number in the table
-static inline void set_prime (uint32_t n)
+// FNV-1a hash of a seeds id, used for the perfect hash table of the built-in seeds
+static uint32_t seeds_id_hash(const char* id, uint32_t hash_seed)
 {
-    uint16_t bit = (uint16_t)n & 0x07;
-    prime_list[n >> 3] |= (1 << bit);
+    uint32_t h = 0x811c9dc5 ^ hash_seed;
+    for (; *id != 0; id++)
+        h = (h ^ (uint8_t)*id) * 0x01000193;
+    return h ^ (h >> 16);
 }
 
-// Check whether 'n' is a prime number.
-static bool check_for_prime(uint32_t n)
+#if defined(GENERATE_SEEDS)
+static void fprint_c_string(FILE* file, const char* str)
 {
-    uint32_t i = 0;
-    uint8_t* p;
-    uint32_t last_value;
-    bool small_n = ((n & 0xffff0000) == 0);
-
-    // We can stop when we have checked all prime numbers below sqrt(n)
-    last_value = lsqrt(n);
-
-    // Scan the bitmap of prime numbers and divide 'n' by the corresponding
-    // prime to see if it's a multiple of it.
-    p = prime_list;
-    do {
-        uint8_t val = *p++;
-        if (val) {
-            uint16_t q = (uint16_t)i;
-            for (uint16_t j = 1; val && j <= 0x80; j <<= 1, q++) {
-                if (val & j) {
-                    val &= ~j;
-                    // Use 16-bit division if 'n' is small enough.
-                    if (small_n) {
-                        uint16_t r = (uint16_t)n % (uint16_t)q;
-                        if (r == 0)
-                            return false;
-                    } else {
-                        uint32_t r = n % q;
-                        if (r == 0)
-                            return false;
-                    }
-                }
-            }
-        }
-        i += 8;
-    } while (i < last_value);
-    return true;
+    fputc('"', file);
+    for (; *str != 0; str++) {
+        if ((*str == '"') || (*str == '\\'))
+            fputc('\\', file);
+        fputc(*str, file);
+    }
+    fputc('"', file);
 }
 
-static void compute_prime_list(uint32_t max_value)
+// Compile the seeds from the JSON file into a C header, along with a perfect hash
+// table to look them up, so that gust_enc doesn't need to parse JSON at runtime.
+// Since this is done at build time, the primes are always validated here.
+static int generate_seeds_header(const char* json_path, const char* header_path)
 {
-    uint32_t i, cnt = 2;
+    int r = -1;
+    uint32_t hash_seed, table_size = 1;
+    uint8_t* table = NULL;
+    seed_entry entry;
+    FILE* file = NULL;
+
+    JSON_Value* json = json_parse_file_with_comments(json_path);
+    if (json == NULL) {
+        fprintf(stderr, "ERROR: Can't parse JSON data from '%s'\n", json_path);
+        return -1;
+    }
+    const char* seeds_id = json_object_get_string(json_object(json), "seeds_id");
+    JSON_Array* seeds_array = json_object_get_array(json_object(json), "seeds");
+    size_t nb_seeds = json_array_get_count(seeds_array);
+    if ((seeds_id == NULL) || (nb_seeds == 0) || (nb_seeds >= UINT8_MAX)) {
+        fprintf(stderr, "ERROR: Invalid seeds data in '%s'\n", json_path);
+        goto out;
+    }
+    for (size_t i = 0; i < nb_seeds; i++) {
+        get_seeds_from_json(json_array_get_object(seeds_array, i), &entry);
+        if (entry.id == NULL || entry.name == NULL) {
+            fprintf(stderr, "ERROR: Missing id or name for seeds #%d\n", (int)i);
+            goto out;
+        }
+        if (!validate_seeds(&entry.seeds)) {
+            fprintf(stderr, "ERROR: Invalid seeds for \"%s\"\n", entry.id);
+            goto out;
+        }
+    }
 
-    prime_list = calloc((max_value + 7) / 8, 1);
-    for (i = 2; i <= max_value; i++) {
-        if (check_for_prime(i)) {
-            set_prime(i);
-            cnt++;
+    // Look for a hash seed that gives us no collisions, with a table that is at
+    // least twice the number of entries, with 0 being used for empty slots.
+    while (table_size < 2 * nb_seeds)
+        table_size <<= 1;
+    table = malloc(table_size);
+    if (table == NULL)
+        goto out;
+    for (hash_seed = 0; hash_seed < 0x100000; hash_seed++) {
+        size_t i;
+        memset(table, 0, table_size);
+        for (i = 0; i < nb_seeds; i++) {
+            const char* id = json_object_get_string(json_array_get_object(seeds_array, i), "id");
+            uint32_t slot = seeds_id_hash(id, hash_seed) & (table_size - 1);
+            if (table[slot] != 0)
+                break;
+            table[slot] = (uint8_t)(i + 1);
         }
+        if (i == nb_seeds)
+            break;
     }
-    set_prime(0);
-    set_prime(1);
+    if (hash_seed >= 0x100000) {
+        fprintf(stderr, "ERROR: Can't find a perfect hash for the seeds (duplicate ids?)\n");
+        goto out;
+    }
+
+    file = fopen_utf8(header_path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "ERROR: Can't create '%s'\n", header_path);
+        goto out;
+    }
+    fprintf(file, "/*\n  Built-in scrambling seeds for gust_enc.\n\n"
+        "  This file was generated from '%s' - DO NOT EDIT!\n*/\n\n#pragma once\n\n", _basename(json_path));
+    fprintf(file, "#define DEFAULT_SEEDS_ID    ");
+    fprint_c_string(file, seeds_id);
+    fprintf(file, "\n#define SEEDS_HASH_SEED     0x%08x\n\n", hash_seed);
+    fprintf(file, "static const seed_entry builtin_seeds[] = {\n");
+    for (size_t i = 0; i < nb_seeds; i++) {
+        get_seeds_from_json(json_array_get_object(seeds_array, i), &entry);
+        fprintf(file, "    { ");
+        fprint_c_string(file, entry.id);
+        fprintf(file, ", ");
+        fprint_c_string(file, entry.name);
+        fprintf(file, ", %d,\n      { { 0x%04x, 0x%04x, 0x%04x }, { 0x%04x, 0x%04x, 0x%04x }, "
+            "{ 0x%02x, 0x%02x, 0x%02x }, 0x%04x } },\n", entry.version,
+            entry.seeds.main[0], entry.seeds.main[1], entry.seeds.main[2],
+            entry.seeds.table[0], entry.seeds.table[1], entry.seeds.table[2],
+            entry.seeds.length[0], entry.seeds.length[1], entry.seeds.length[2], entry.seeds.fence);
+    }
+    fprintf(file, "};\n\nstatic const uint8_t builtin_seeds_hash[%d] = {", table_size);
+    for (uint32_t i = 0; i < table_size; i++)
+        fprintf(file, "%s%d", (i == 0) ? " " : ", ", table[i]);
+    fprintf(file, " };\n");
+    r = ferror(file) ? -1 : 0;
+    fclose(file);
+    if (r == 0)
+        printf("Generated '%s' with %d seeds\n", header_path, (int)nb_seeds);
+
+out:
+    free(table);
+    json_value_free(json);
+    return r;
 }
+#endif
 
+static const seed_entry* find_builtin_seeds(const char* id)
+{
+    uint32_t slot = seeds_id_hash(id, SEEDS_HASH_SEED) & (array_size(builtin_seeds_hash) - 1);
+    uint8_t i = builtin_seeds_hash[slot];
+    if ((i == 0) || (strcmp(builtin_seeds[i - 1].id, id) != 0))
+        return NULL;
+    return &builtin_seeds[i - 1];
+}
+
+#if defined(GENERATE_SEEDS)
 int main_utf8(int argc, char** argv)
 {
-    seed_data seeds;
+    if (argc != 3) {
+        printf("Usage: %s <seeds.json> <seeds.h>\n", _appname(argv[0]));
+        return 0;
+    }
+    return generate_seeds_header(argv[1], argv[2]);
+}
+#elif defined(BENCHMARK_CHECKSUMS)
+int main_utf8(int argc, char** argv)
+{
+    (void)argc;
+    (void)argv;
+    return benchmark_checksums();
+}
+#else
+int main_utf8(int argc, char** argv)
+{
+    seed_entry entry;
     char path[256];
     uint32_t src_size, dst_size;
     uint8_t *src = NULL, *dst = NULL;
     int r = -1;
     const char* app_name = _appname(argv[0]);
-    if ((argc < 2) || ((argc == 3) && (*argv[1] != '-'))) {
-        printf("%s %s (c) 2019-2021 VitaSmith\n\nUsage: %s [-GAME_ID] <file>\n\n"
+    const char* seeds_id = NULL;
+    bool use_json = false;
+    int argi;
+
+    for (argi = 1; argi < argc - 1 && argv[argi][0] == '-'; argi++) {
+        if (strcmp(argv[argi], "--json") == 0)
+            use_json = true;
+        else if (seeds_id == NULL)
+            seeds_id = &argv[argi][1];
+        else
+            break;
+    }
+    if ((argc < 2) || (argi != argc - 1)) {
+        printf("%s %s (c) 2019-2021 VitaSmith\n\nUsage: %s [--json] [-GAME_ID] <file>\n\n"
             "Encode or decode a Gust .e file.\n\n"
             "If GAME_ID is not provided, then the default game ID from '%s.json' is used.\n"
+            "The seeds of the games listed in '%s.json' at build time are built-in.\n"
+            "With --json, '%s.json' is read at runtime instead, and its default game ID\n"
+            "and seeds take precedence over the built-in ones.\n"
             "Note: A backup (.bak) of the original is automatically created, when the target\n"
             "is being overwritten for the first time.\n",
-            app_name, GUST_TOOLS_VERSION_STR, app_name, app_name);
+            app_name, GUST_TOOLS_VERSION_STR, app_name, app_name, app_name, app_name);
         return 0;
     }
 
-    // Populate the descrambling seeds from the JSON file
+    // The seeds for known games are built-in, but with --json, gust_enc.json overrides them:
+    // the built-in seeds are then only used for the ids that the JSON file doesn't list.
     snprintf(path, sizeof(path), "%s.json", app_name);
-    JSON_Value* json = json_parse_file_with_comments(path);
-    if (json == NULL) {
-        fprintf(stderr, "ERROR: Can't parse JSON data from '%s'\n", path);
-        goto out;
-    }
-    const char* seeds_id = (argc == 3) ? &argv[1][1] : json_object_get_string(json_object(json), "seeds_id");
-    JSON_Array* seeds_array = json_object_get_array(json_object(json), "seeds");
+    const bool default_id = (seeds_id == NULL);
+    JSON_Value* json = NULL;
     JSON_Object* seeds_entry = NULL;
-    for (size_t i = 0; i < json_array_get_count(seeds_array); i++) {
-        seeds_entry = json_array_get_object(seeds_array, i);
-        if (strcmp(seeds_id, json_object_get_string(seeds_entry, "id")) == 0)
-            break;
-        seeds_entry = NULL;
+    if (use_json) {
+        json = json_parse_file_with_comments(path);
+        if (json == NULL) {
+            fprintf(stderr, "ERROR: Can't parse JSON data from '%s'\n", path);
+            goto out;
+        }
+        if (seeds_id == NULL)
+            seeds_id = json_object_get_string(json_object(json), "seeds_id");
+        JSON_Array* seeds_array = json_object_get_array(json_object(json), "seeds");
+        for (size_t i = 0; (seeds_id != NULL) && (i < json_array_get_count(seeds_array)); i++) {
+            seeds_entry = json_array_get_object(seeds_array, i);
+            if (strcmp(seeds_id, json_object_get_string(seeds_entry, "id")) == 0)
+                break;
+            seeds_entry = NULL;
+        }
     }
-    if (seeds_entry == NULL) {
-        fprintf(stderr, "ERROR: Can't find the seeds for \"%s\" in '%s'\n", seeds_id, path);
+    if (seeds_id == NULL)
+        seeds_id = DEFAULT_SEEDS_ID;
+
+    if (seeds_entry != NULL) {
+        get_seeds_from_json(seeds_entry, &entry);
+        printf("Using the scrambling seeds for %s from '%s'", entry.name, path);
+        if (default_id)
+            printf(" (edit to change)\n");
+        else
+            printf("\n");
+        bool validate_primes = json_object_get_boolean(json_object(json), "validate_primes");
         json_value_free(json);
-        goto out;
-    }
+        entry.id = NULL;
+        entry.name = NULL;
 
-    printf("Using the scrambling seeds for %s", json_object_get_string(seeds_entry, "name"));
-    if (argc < 3)
-        printf(" (edit '%s' to change)\n", path);
-    else
-        printf("\n");
+        // Validate the primes. You can disable this check by setting validate_primes to false in JSON.
+        if (validate_primes && !validate_seeds(&entry.seeds))
+            goto out;
+    } else {
+        const seed_entry* builtin_entry = find_builtin_seeds(seeds_id);
+        if (builtin_entry == NULL) {
+            fprintf(stderr, "ERROR: Can't find the seeds for \"%s\"\n", seeds_id);
+            json_value_free(json);
+            goto out;
+        }
+        entry = *builtin_entry;
+        json_value_free(json);
+        printf("Using the scrambling seeds for %s\n", entry.name);
+    }
 
     // Get the scrambler version to use
-    uint32_t version = json_object_get_uint32(seeds_entry, "version");
+    uint32_t version = entry.version;
     if (version == 3)
         is_big_endian = false;
-    uint32_t max_seed_value = 0;
-    for (size_t i = 0; i < array_size(seeds.main); i++) {
-        seeds.main[i] = (uint32_t)json_array_get_number(json_object_get_array(seeds_entry, "main"), i);
-        if (seeds.main[i] > max_seed_value)
-            max_seed_value = seeds.main[i];
-        seeds.table[i] = (uint32_t)json_array_get_number(json_object_get_array(seeds_entry, "table"), i);
-        if (seeds.table[i] > max_seed_value)
-            max_seed_value = seeds.table[i];
-        seeds.length[i] = (uint32_t)json_array_get_number(json_object_get_array(seeds_entry, "length"), i);
-    }
-    seeds.fence = (uint16_t)json_object_get_number(seeds_entry, "fence");
-    bool validate_primes = json_object_get_boolean(json_object(json), "validate_primes");
-    json_value_free(json);
-
-    // Validate the primes. You can disable this check by setting validate_primes to false in JSON.
-    if (validate_primes) {
-        compute_prime_list(max_seed_value);
-        for (size_t i = 0; i < array_size(seeds.main); i++) {
-            if (!is_prime(seeds.main[i])) {
-                printf("ERROR: main[%d] (0x%04x) is not prime!\n", (uint32_t)i, seeds.main[i]);
-                goto out;
-            }
-            if (!is_prime(seeds.table[i])) {
-                printf("ERROR: table[%d] (0x%04x) is not prime!\n", (uint32_t)i, seeds.table[i]);
-                goto out;
-            }
-            if (!is_prime(seeds.length[i])) {
-                printf("ERROR: length[%d] (0x%02x) is not prime!\n", (uint32_t)i, seeds.length[i]);
-                goto out;
-            }
-            if (!is_prime(seeds.fence)) {
-                printf("ERROR: fence (0x%04x) is not prime!\n", seeds.fence);
-                goto out;
-            }
-        }
-    }
-
     // Read the source file
     src_size = read_file(argv[argc - 1], &src);
     if (src_size == UINT32_MAX)
@@ -899,7 +1335,9 @@ int main_utf8(int argc, char** argv)
         printf("Encoding '%s'...\n", _basename(argv[argc - 1]));
         // Compress and scramble a file
 #if defined(USE_GLAZED)
-        dst = malloc(src_size);
+        dst = malloc((size_t)src_size + E_TRAILER_MAX);
+        if (dst == NULL)
+            goto out;
         memcpy(dst, src, src_size);
         dst_size = src_size;
 #else
@@ -925,7 +1363,7 @@ int main_utf8(int argc, char** argv)
         // plus the size of the bytecode table once decompression is complete).
         uint32_t working_size = max(src_size, dst_size + getdata32(&dst[2 * sizeof(uint32_t)]));
         snprintf(path, sizeof(path), "%s.e", argv[argc - 1]);
-        if (!scramble(dst, dst_size, path, &seeds, working_size, version))
+        if (!scramble(dst, dst_size, path, &entry.seeds, working_size, version))
             goto out;
 
         r = 0;
@@ -939,7 +1377,7 @@ int main_utf8(int argc, char** argv)
 
         // Descramble the data
         uint32_t working_size = 0;
-        uint32_t payload_size = unscramble(src, src_size, &seeds, &working_size, version);
+        uint32_t payload_size = unscramble(src, src_size, &entry.seeds, &working_size, version);
         if ((payload_size == 0) || (working_size == 0))
             goto out;
 
@@ -950,8 +1388,15 @@ int main_utf8(int argc, char** argv)
 
 #if defined(VALIDATE_CHECKSUM)
         // "We can rebuild (it), we have the technology."
+        // Since we scramble in place, we need to work on a copy
         snprintf(path, sizeof(path), "%s.rebuilt", argv[argc - 1]);
-        scramble(&src[E_HEADER_SIZE], payload_size, path, &seeds, working_size, version);
+        dst = malloc((size_t)payload_size + E_TRAILER_MAX);
+        if (dst == NULL)
+            goto out;
+        memcpy(dst, &src[E_HEADER_SIZE], payload_size);
+        scramble(dst, payload_size, path, &entry.seeds, working_size, version);
+        free(dst);
+        dst = NULL;
 #endif
 
         // Uncompress descrambled data
@@ -973,7 +1418,6 @@ int main_utf8(int argc, char** argv)
     // even more interesting than playing your games! :)))
 
 out:
-    free(prime_list);
     free(dst);
     free(src);
 
@@ -985,5 +1429,6 @@ out:
 
     return r;
 }
+#endif
 
 CALL_MAIN
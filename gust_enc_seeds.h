@@ -0,0 +1,35 @@
+/*
+  Built-in scrambling seeds for gust_enc.
+
+  This file was generated from 'gust_enc.json' - DO NOT EDIT!
+*/
+
+#pragma once
+
+#define DEFAULT_SEEDS_ID    "A21"
+#define SEEDS_HASH_SEED     0x00000001
+
+static const seed_entry builtin_seeds[] = {
+    { "A16", "Atelier Shallie", 2,
+      { { 0x6df7, 0xc953, 0x72ef }, { 0xaa83, 0xac8b, 0x89cf }, { 0x1d, 0x13, 0x0b }, 0x09fd } },
+    { "A17", "Atelier Sophie", 2,
+      { { 0x6e45, 0xc9af, 0x7525 }, { 0xa9d9, 0xae8f, 0x89f5 }, { 0x1d, 0x13, 0x0b }, 0x0a99 } },
+    { "A18", "Atelier Firis", 2,
+      { { 0x69b5, 0xd069, 0x7577 }, { 0xa80b, 0xb3c5, 0x8c89 }, { 0x1d, 0x13, 0x0b }, 0x0aed } },
+    { "A19", "Atelier Lydie & Suelle", 2,
+      { { 0x6d7b, 0xcac3, 0x747b }, { 0xa8e5, 0xb0b1, 0x8a5b }, { 0x1d, 0x13, 0x0b }, 0x0ab5 } },
+    { "A20", "Atelier Lulua", 2,
+      { { 0x6d7b, 0xcac3, 0x747b }, { 0xa8e5, 0xb0b1, 0x8a5b }, { 0x1d, 0x13, 0x0b }, 0x0ab5 } },
+    { "A21", "Atelier Ryza", 2,
+      { { 0x6d3f, 0xcb53, 0x74b9 }, { 0xa83b, 0xb11d, 0x88a5 }, { 0x1d, 0x13, 0x0b }, 0x0a31 } },
+    { "ANW", "Ateliers of the New World (Nelke & the Legendary Alchemists)", 2,
+      { { 0x6d7b, 0xcac3, 0x747b }, { 0xa8e5, 0xb0b1, 0x8a5b }, { 0x1d, 0x13, 0x0b }, 0x0ab5 } },
+    { "NOA", "Nights of Azure / Nights of Azure 2", 2,
+      { { 0x6d73, 0xc979, 0x728f }, { 0xa9bb, 0x892d, 0x8939 }, { 0x1f, 0x1d, 0x17 }, 0x09a9 } },
+    { "BR", "Blue Reflection", 2,
+      { { 0x6947, 0xcb63, 0x7597 }, { 0xa829, 0xb047, 0x8af5 }, { 0x1d, 0x13, 0x0b }, 0x0b23 } },
+    { "FT", "Fairy Tail", 3,
+      { { 0x3e87, 0xcac3, 0x0000 }, { 0xa8e5, 0xb0b1, 0x8a5b }, { 0x11, 0x0b, 0x13 }, 0x0755 } },
+};
+
+static const uint8_t builtin_seeds_hash[32] = { 4, 0, 0, 5, 0, 8, 0, 10, 0, 0, 0, 0, 0, 0, 2, 0, 0, 0, 0, 0, 6, 0, 0, 0, 0, 9, 0, 0, 0, 1, 7, 3 };
@@ -26,6 +26,8 @@
 #include "util.h"
 #include "parson.h"
 #include "dds.h"
+#include "bcn.h"
+#include "gust_g1t.h"
 
 #define JSON_VERSION            2
 #define G1TG_MAGIC              0x47315447        // 'G1TG'
@@ -91,6 +93,10 @@ typedef struct {
 // Same order as enum DDS_FORMAT
 const char* argb_name[] = { NULL, "ABGR", "ARGB", "GRAB", "RGBA",
                                   "ABGR", "ARGB", "GRAB", "RGBA" };
+const char* format_name[] = { "UNKNOWN", "ABGR4", "ARGB4", "GRAB4", "RGBA4", "ABGR8", "ARGB8",
+    "GRAB8", "RGBA8", "ARGB16", "ARGB32", "RXGB8", "BGR8", "R8", "UVER", "DXT1", "DXT2", "DXT3",
+    "DXT4", "DXT5", "DX10", "BC4", "BC5", "BC6", "BC7", "BC6H", "BC7L", "ATI1", "ATI2", "A2XY",
+    "DDS", "NVTT" };
 
 static inline const char* platform_to_name(uint32_t platform)
 {
@@ -229,10 +235,12 @@ static JSON_Value* flags_to_json(uint64_t* flags)
     return json_flags_array;
 }
 
-static size_t write_dds_header(FILE* fd, enum DDS_FORMAT format, uint32_t width,
-                               uint32_t height, uint32_t mipmaps, uint64_t* flags)
+// Fill buf with the DDS header of a texture, followed by its DX10 header if needed,
+// and return the total size, or 0 on error.
+static size_t get_dds_header(uint8_t* buf, enum DDS_FORMAT format, uint32_t width,
+                             uint32_t height, uint32_t mipmaps, uint64_t* flags)
 {
-    if ((fd == NULL) || (width == 0) || (height == 0))
+    if ((width == 0) || (height == 0))
         return 0;
 
     DDS_HEADER header = { 0 };
@@ -331,9 +339,7 @@ static size_t write_dds_header(FILE* fd, enum DDS_FORMAT format, uint32_t width,
     }
     if (flags[0] & G1T_FLAG_NORMAL_MAP)
         header.ddspf.flags |= DDS_NORMAL;
-    size_t r = fwrite(&header, sizeof(DDS_HEADER), 1, fd);
-    if (r != 1)
-        return r;
+    memcpy(buf, &header, sizeof(DDS_HEADER));
     if (use_dx10) {
         DDS_HEADER_DXT10 dxt10_hdr = { 0 };
         dxt10_hdr.resourceDimension = D3D10_RESOURCE_DIMENSION_TEXTURE2D;
@@ -354,6 +360,9 @@ static size_t write_dds_header(FILE* fd, enum DDS_FORMAT format, uint32_t width,
         case DDS_FORMAT_BC4:
             dxt10_hdr.dxgiFormat = (flags[0] & G1T_FLAG_SRGB) ? DXGI_FORMAT_BC4_SNORM : DXGI_FORMAT_BC4_UNORM;
             break;
+        case DDS_FORMAT_BC5:
+            dxt10_hdr.dxgiFormat = DXGI_FORMAT_BC5_UNORM;
+            break;
         case DDS_FORMAT_BC7:
         case DDS_FORMAT_DX10:
             dxt10_hdr.dxgiFormat = (flags[0] & G1T_FLAG_SRGB) ? DXGI_FORMAT_BC7_UNORM_SRGB : DXGI_FORMAT_BC7_UNORM;
@@ -369,50 +378,135 @@ static size_t write_dds_header(FILE* fd, enum DDS_FORMAT format, uint32_t width,
             assert(false);
             break;
         }
-        r = fwrite(&dxt10_hdr, sizeof(DDS_HEADER_DXT10), 1, fd);
+        memcpy(&buf[sizeof(DDS_HEADER)], &dxt10_hdr, sizeof(DDS_HEADER_DXT10));
+        return sizeof(DDS_HEADER) + sizeof(DDS_HEADER_DXT10);
     }
-    return r;
+    return sizeof(DDS_HEADER);
 }
 
-static void rgba_convert(const enum DDS_FORMAT format, const char* in,
-                         const char* out, uint8_t* buf, const uint32_t size)
+static size_t write_dds_header(FILE* fd, enum DDS_FORMAT format, uint32_t width,
+                               uint32_t height, uint32_t mipmaps, uint64_t* flags)
 {
-    uint32_t bits_per_pixel = dds_bpp(format);
-    assert(bits_per_pixel % 8 == 0);
+    uint8_t buf[sizeof(DDS_HEADER) + sizeof(DDS_HEADER_DXT10)];
+    size_t size = get_dds_header(buf, format, width, height, mipmaps, flags);
+    if ((fd == NULL) || (size == 0))
+        return 0;
+    return fwrite(buf, size, 1, fd);
+}
+
+// Conversion between two of the channel orders from argb_name[]. Each channel is isolated
+// with a mask and moved with a shift, within little-endian 32-bit pixels for 8-bit
+// channels or 16-bit pixels for 4-bit channels, so that whole rows can be converted
+// 16 bytes at a time.
+typedef struct {
+    uint32_t bits_per_pixel;
+    uint32_t mask[4];
+    uint32_t lshift[4];
+    uint32_t rshift[4];
+} rgba_shuffle;
+
+// Returns false if there is nothing to convert
+static bool get_rgba_shuffle(rgba_shuffle* sh, const enum DDS_FORMAT format,
+                             const char* in, const char* out)
+{
+    const uint32_t bits_per_pixel = dds_bpp(format);
+    assert(bits_per_pixel == 16 || bits_per_pixel == 32);
     assert(format >= DDS_FORMAT_ABGR4 && format <= DDS_FORMAT_RGBA8);
 
     const int rgba[4] = { 'R', 'G', 'B', 'A' };
     if (strcmp(in, out) == 0)
-        return;
+        return false;
 
-    uint32_t mask[4];
-    int rot[4];
+    sh->bits_per_pixel = bits_per_pixel;
     for (uint32_t i = 0; i < 4; i++) {
-        uint32_t pos_in = 3 - (uint32_t)((uintptr_t)strchr(in, rgba[i]) - (uintptr_t)in);
-        uint32_t pos_out = 3 - (uint32_t)((uintptr_t)strchr(out, rgba[i]) - (uintptr_t)out);
-        mask[i] = ((1 << (bits_per_pixel / 4)) - 1) << (pos_in * 8);
-        rot[i] = (pos_out - pos_in) * 8;
+        // Index of the channel in the in/out names, which is also the order in memory
+        uint32_t k_in = (uint32_t)((uintptr_t)strchr(in, rgba[i]) - (uintptr_t)in);
+        uint32_t k_out = (uint32_t)((uintptr_t)strchr(out, rgba[i]) - (uintptr_t)out);
+        uint32_t pos_in, pos_out;
+        if (bits_per_pixel == 32) {
+            pos_in = 8 * k_in;
+            pos_out = 8 * k_out;
+        } else {
+            // The first nibble of each byte is the high one
+            pos_in = (k_in / 2) * 8 + (1 - k_in % 2) * 4;
+            pos_out = (k_out / 2) * 8 + (1 - k_out % 2) * 4;
+        }
+        sh->mask[i] = ((1U << (bits_per_pixel / 4)) - 1) << pos_in;
+        sh->lshift[i] = (pos_out > pos_in) ? pos_out - pos_in : 0;
+        sh->rshift[i] = (pos_in > pos_out) ? pos_in - pos_out : 0;
     }
+    return true;
+}
 
-    for (uint32_t j = 0; j < size; j += 4) {
-        uint32_t s;
-        switch (bits_per_pixel) {
-        case 16: s = getbe16(&buf[j]); break;
-        case 24: s = getbe24(&buf[j]); break;
-        default: s = getbe32(&buf[j]); break;
+static void apply_rgba_shuffle(const rgba_shuffle* sh, uint8_t* buf, const uint32_t size)
+{
+    const uint32_t bits_per_pixel = sh->bits_per_pixel;
+    uint32_t j = 0;
+#if defined(USE_SSE2)
+    __m128i vmask[4], vlshift[4], vrshift[4];
+    for (uint32_t i = 0; i < 4; i++) {
+        vmask[i] = (bits_per_pixel == 32) ? _mm_set1_epi32((int)sh->mask[i]) : _mm_set1_epi16((short)sh->mask[i]);
+        vlshift[i] = _mm_cvtsi32_si128((int)sh->lshift[i]);
+        vrshift[i] = _mm_cvtsi32_si128((int)sh->rshift[i]);
+    }
+    if (bits_per_pixel == 32) {
+        for (; j + 16 <= size; j += 16) {
+            __m128i s = _mm_loadu_si128((const __m128i*)&buf[j]), d = _mm_setzero_si128();
+            for (uint32_t i = 0; i < 4; i++)
+                d = _mm_or_si128(d, _mm_srl_epi32(_mm_sll_epi32(_mm_and_si128(s, vmask[i]), vlshift[i]), vrshift[i]));
+            _mm_storeu_si128((__m128i*)&buf[j], d);
         }
+    } else {
+        for (; j + 16 <= size; j += 16) {
+            __m128i s = _mm_loadu_si128((const __m128i*)&buf[j]), d = _mm_setzero_si128();
+            for (uint32_t i = 0; i < 4; i++)
+                d = _mm_or_si128(d, _mm_srl_epi16(_mm_sll_epi16(_mm_and_si128(s, vmask[i]), vlshift[i]), vrshift[i]));
+            _mm_storeu_si128((__m128i*)&buf[j], d);
+        }
+    }
+#endif
+    for (; j + bits_per_pixel / 8 <= size; j += bits_per_pixel / 8) {
+        uint32_t s = (bits_per_pixel == 32) ? getle32(&buf[j]) : getle16(&buf[j]);
         uint32_t d = 0;
         for (uint32_t i = 0; i < 4; i++)
-            d |= (rot[i] > 0) ? ((s & mask[i]) << rot[i]) : ((s & mask[i]) >> -rot[i]);
-        switch (bits_per_pixel) {
-        case 16: setbe16(&buf[j], (uint16_t)d); break;
-        case 24: setbe24(&buf[j], d); break;
-        default: setbe32(&buf[j], d); break;
-        }
+            d |= ((s & sh->mask[i]) << sh->lshift[i]) >> sh->rshift[i];
+        if (bits_per_pixel == 32)
+            setle32(&buf[j], d);
+        else
+            setle16(&buf[j], (uint16_t)d);
+    }
+}
+
+static void rgba_convert(const enum DDS_FORMAT format, const char* in,
+                         const char* out, uint8_t* buf, const uint32_t size)
+{
+    rgba_shuffle sh;
+    if (get_rgba_shuffle(&sh, format, in, out))
+        apply_rgba_shuffle(&sh, buf, size);
+}
+
+// Swizzle engines.
+// A swizzled surface is described by the byte offset of each of its element columns and
+// rows, so that element (x,y) is stored at x[x] + y[y]. This holds for the Morton layouts
+// we use, and means that we only need to compute width + height offsets, rather than one
+// per element.
+typedef struct {
+    uint32_t* x;
+    uint32_t* y;
+    uint32_t size;      // Size of the swizzled surface, including any padding
+} address_table;
+
+static bool alloc_address_table(address_table* t, uint32_t width, uint32_t height)
+{
+    t->x = (uint32_t*)malloc(((size_t)width + height) * sizeof(uint32_t));
+    if (t->x == NULL) {
+        fprintf(stderr, "ERROR: Can't allocate address table\n");
+        return false;
     }
+    t->y = &t->x[width];
+    return true;
 }
 
-// "Inflate" a 32 bit value by interleaving 0 bits at odd positions.
 static __inline uint32_t inflate_bits(uint32_t x)
 {
     x &= 0x0000FFFF;
@@ -423,83 +517,95 @@ static __inline uint32_t inflate_bits(uint32_t x)
     return x;
 }
 
-// "Deflate" a 32-bit value by deinterleaving all odd bits.
-static __inline uint32_t deflate_bits(uint32_t x)
+// Morton layout, a.k.a. Z-order curve, over 2^k x 2^k tiles that are laid out in row
+// order, so that moving one tile right adds a tile and moving one tile down adds a full
+// row of tiles.
+static bool build_morton_table(address_table* t, uint32_t width, uint32_t height,
+                               uint32_t bytes_per_element, uint32_t k)
 {
-    x &= 0x55555555;
-    x = (x | (x >> 1))  & 0x33333333;
-    x = (x | (x >> 2))  & 0x0F0F0F0F;
-    x = (x | (x >> 4))  & 0x00FF00FF;
-    x = (x | (x >> 8))  & 0x0000FFFF;
-    return x;
+    // Only deal with texture that are smaller than 64k*64k
+    assert((width < 0x10000) && (height < 0x10000));
+    // Ensure that width and height are an exact multiple of 2^k
+    assert(width % (1 << k) == 0);
+    assert(height % (1 << k) == 0);
+    // Ensure that we won't produce x or y that are larger than the maximum dimension
+    assert(k <= log2(max(width, height)));
+    const uint32_t tile_width = 1 << k;
+    const uint32_t tile_size = tile_width * tile_width;
+    const uint32_t mask = tile_width - 1;
+    if (!alloc_address_table(t, width, height))
+        return false;
+    t->size = width * height * bytes_per_element;
+    for (uint32_t x = 0, tile_offset = 0; x < width; x++) {
+        t->x[x] = ((inflate_bits(x & mask) << 1) + tile_offset) * bytes_per_element;
+        if ((x & mask) == mask)
+            tile_offset += tile_size;
+    }
+    for (uint32_t y = 0, tile_offset = 0; y < height; y++) {
+        t->y[y] = (inflate_bits(y & mask) + tile_offset) * bytes_per_element;
+        if ((y & mask) == mask)
+            tile_offset += width * tile_width;
+    }
+    return true;
 }
 
-// From two 32-bit (x,y) coordinates, compute the 64-bit Morton (or Z-order) value.
-static __inline uint32_t xy_to_morton(uint32_t x, uint32_t y)
-{
-    return (inflate_bits(x) << 1) | (inflate_bits(y) << 0);
+// Swizzle kernels, specialized on the element size so that each element is moved with a
+// single fixed size copy. Only rows [y_start, y_end) of the linear surface are processed.
+#define SWIZZLE_KERNEL(name, size)                                                      \
+static void name(uint8_t* dst, const uint8_t* src, const address_table* t,              \
+                 uint32_t width, uint32_t y_start, uint32_t y_end, bool reverse)        \
+{                                                                                       \
+    for (uint32_t y = y_start; y < y_end; y++) {                                        \
+        if (reverse) {                                                                  \
+            uint8_t* d = &dst[(size_t)y * width * size];                                \
+            const uint8_t* s = &src[t->y[y]];                                           \
+            for (uint32_t x = 0; x < width; x++)                                        \
+                memcpy(&d[x * size], &s[t->x[x]], size);                                \
+        } else {                                                                        \
+            uint8_t* d = &dst[t->y[y]];                                                 \
+            const uint8_t* s = &src[(size_t)y * width * size];                          \
+            for (uint32_t x = 0; x < width; x++)                                        \
+                memcpy(&d[t->x[x]], &s[x * size], size);                                \
+        }                                                                               \
+    }                                                                                   \
 }
 
-// Fom a 32-bit Morton (Z-order) value, recover two 32-bit (x,y) coordinates.
-static __inline void morton_to_xy(uint32_t z, uint32_t* x, uint32_t* y)
+SWIZZLE_KERNEL(swizzle_4, 4)
+SWIZZLE_KERNEL(swizzle_8, 8)
+SWIZZLE_KERNEL(swizzle_16, 16)
+
+// Apply the layout from an address table to rows [y_start, y_end) of a linear surface,
+// or restore these rows if reverse is set. src and dst must not overlap.
+static void swizzle_rows(const address_table* t, uint32_t width, uint32_t y_start, uint32_t y_end,
+                         uint32_t bytes_per_element, uint8_t* dst, const uint8_t* src, bool reverse)
 {
-    *x = deflate_bits(z >> 1);
-    *y = deflate_bits(z >> 0);
+    switch (bytes_per_element) {
+    case 4: swizzle_4(dst, src, t, width, y_start, y_end, reverse); break;
+    case 8: swizzle_8(dst, src, t, width, y_start, y_end, reverse); break;
+    case 16: swizzle_16(dst, src, t, width, y_start, y_end, reverse); break;
+    default:
+        for (uint32_t y = y_start; y < y_end; y++) {
+            for (uint32_t x = 0; x < width; x++) {
+                size_t i = ((size_t)y * width + x) * bytes_per_element;
+                size_t j = (size_t)t->x[x] + t->y[y];
+                if (reverse)
+                    memcpy(&dst[i], &src[j], bytes_per_element);
+                else
+                    memcpy(&dst[j], &src[i], bytes_per_element);
+            }
+        }
+        break;
+    }
 }
 
-// Apply or reverse a Morton transformation, a.k.a. a Z-order curve, to a texture.
-// If morton_order is negative, a reverse Morton transformation is applied.
-static void mortonize(const enum DDS_FORMAT format, const int16_t morton_order,
-                      uint32_t width, uint32_t height, uint8_t* buf, const uint32_t size, uint32_t wf)
+static void swizzle(const address_table* t, uint32_t width, uint32_t height,
+                    uint32_t bytes_per_element, uint8_t* dst, const uint8_t* src, bool reverse)
 {
-    const uint32_t bits_per_element = dds_bpp(format) * dds_bwh(format) * dds_bwh(format) * wf;
-    const uint32_t bytes_per_element = bits_per_element / 8;
-    width /= dds_bwh(format) * wf;
-    height /= dds_bwh(format);
-    uint32_t num_elements = size / bytes_per_element;
-    uint16_t k = (uint16_t)abs(morton_order);
-    bool reverse = (morton_order != (int16_t)k);
-
-    // Only deal with elements that are multiple of one byte in size
-    assert(bits_per_element % 8 == 0);
-    // Validate that the size of the buffer matches the dimensions provided
-    assert(bytes_per_element * width * height == size);
-    // Only deal with texture that are smaller than 64k*64k
-    assert((width < 0x10000) && (height < 0x10000));
-    // Ensure that width and height are an exact multiple of 2^k
-    assert(width % (1 << k) == 0);
-    assert(height % (1 << k) == 0);
-    // Ensure that we won't produce x or y that are larger than the maximum dimension
-    assert(k <= log2(max(width, height)));
-    uint32_t tile_width = 1 << k;
-    uint32_t tile_size = tile_width * tile_width;
-    uint32_t mask = tile_size - 1;
-    uint8_t* tmp_buf = (uint8_t*)malloc(size);
-    for (uint32_t i = 0; i < num_elements; i++) {
-        uint32_t j, x, y;
-        if (reverse) {  // Morton value to an (x,y) pair
-            // Recover (x,y) for the Morton tile
-            morton_to_xy(i & mask, &x, &y);
-            // Now apply untiling by offsetting (x,y) with the tile positiom
-            x += ((i / tile_size) % (width / tile_width)) * tile_width;
-            y += ((i / tile_size) / (width / tile_width)) * tile_width;
-            j = y * width + x;
-        } else {        // Morton value from an (x,y) pair
-            x = i % width; y = i / width;
-            j = xy_to_morton(x, y) & mask;
-            // Now, apply tiling. This is accomplished by offseting our value
-            // with the current tile position multiplied by the tile size.
-            j += ((y / tile_width) * (width / tile_width) + (x / tile_width)) * tile_size;
-        }
-        assert(j < num_elements);
-        memcpy(&tmp_buf[j * bytes_per_element], &buf[i * bytes_per_element], bytes_per_element);
-    }
-    memcpy(buf, tmp_buf, size);
-    free(tmp_buf);
+    swizzle_rows(t, width, 0, height, bytes_per_element, dst, src, reverse);
 }
 
 static void tile(const enum DDS_FORMAT format, uint32_t tile_size, uint32_t width,
-                 uint8_t* buf, const uint32_t size)
+                 uint8_t* dst, const uint8_t* src, const uint32_t size)
 {
     const uint32_t bytes_per_element = dds_bpb(format);
     assert(tile_size % dds_bwh(format) == 0);
@@ -511,25 +617,20 @@ static void tile(const enum DDS_FORMAT format, uint32_t tile_size, uint32_t widt
     assert(size % (tile_size * tile_size) == 0);
     assert(width % tile_size == 0);
 
-    uint8_t* tmp_buf = (uint8_t*)malloc(size);
-
     for (uint32_t i = 0; i < size / bytes_per_element / tile_size / tile_size; i++) {
         uint32_t tile_row = i / (width / tile_size);
         uint32_t tile_column = i % (width / tile_size);
         uint32_t tile_start = tile_row * width * tile_size + tile_column * tile_size;
         for (uint32_t j = 0; j < tile_size; j++) {
-            memcpy(&tmp_buf[bytes_per_element * (i * tile_size * tile_size + j * tile_size)],
-                &buf[bytes_per_element * (tile_start + j * width)],
+            memcpy(&dst[bytes_per_element * (i * tile_size * tile_size + j * tile_size)],
+                &src[bytes_per_element * (tile_start + j * width)],
                 (size_t)tile_size * bytes_per_element);
         }
     }
-
-    memcpy(buf, tmp_buf, size);
-    free(tmp_buf);
 }
 
 static void untile(const enum DDS_FORMAT format, uint32_t tile_size, uint32_t width,
-                   uint8_t* buf, const uint32_t size)
+                   uint8_t* dst, const uint8_t* src, const uint32_t size)
 {
     const uint32_t bytes_per_element = dds_bpb(format);
     assert(tile_size % dds_bwh(format) == 0);
@@ -541,588 +642,1991 @@ static void untile(const enum DDS_FORMAT format, uint32_t tile_size, uint32_t wi
     assert(size % (tile_size * tile_size) == 0);
     assert(width % tile_size == 0);
 
-    uint8_t* tmp_buf = (uint8_t*)malloc(size);
-
     for (uint32_t i = 0; i < size / bytes_per_element / tile_size / tile_size; i++) {
         uint32_t tile_row = i / (width / tile_size);
         uint32_t tile_column = i % (width / tile_size);
         uint32_t tile_start = tile_row * width * tile_size + tile_column * tile_size;
         for (uint32_t j = 0; j < tile_size; j++) {
-            memcpy(&tmp_buf[bytes_per_element * (tile_start + j * width)],
-                &buf[bytes_per_element * (i * tile_size * tile_size + j * tile_size)],
+            memcpy(&dst[bytes_per_element * (tile_start + j * width)],
+                &src[bytes_per_element * (i * tile_size * tile_size + j * tile_size)],
                 (size_t)tile_size * bytes_per_element);
         }
     }
-
-    memcpy(buf, tmp_buf, size);
-    free(tmp_buf);
 }
 
-static void flip(uint32_t bits_per_pixel, uint8_t* buf, const uint32_t size, uint32_t width)
+// Flip an image vertically. This can be done in place, in which case lines are swapped.
+static void flip(uint32_t bits_per_pixel, uint8_t* dst, const uint8_t* src,
+                 const uint32_t size, uint32_t width)
 {
     assert(bits_per_pixel % 8 == 0);
     const uint32_t line_size = width * (bits_per_pixel / 8);
     assert(size % line_size == 0);
     const uint32_t max_line = (size / line_size) - 1;
 
-    uint8_t* tmp_buf = (uint8_t*)malloc(size);
+    if (dst != src) {
+        for (uint32_t i = 0; i <= max_line; i++)
+            memcpy(&dst[i * line_size], &src[(max_line - i) * line_size], line_size);
+        return;
+    }
+    uint8_t tmp[256];
+    for (uint32_t i = 0; i < (max_line + 1) / 2; i++) {
+        uint8_t* a = &dst[i * line_size];
+        uint8_t* b = &dst[(max_line - i) * line_size];
+        for (uint32_t j = 0; j < line_size; j += sizeof(tmp)) {
+            uint32_t n = min(line_size - j, (uint32_t)sizeof(tmp));
+            memcpy(tmp, &a[j], n);
+            memcpy(&a[j], &b[j], n);
+            memcpy(&b[j], tmp, n);
+        }
+    }
+}
 
-    for (uint32_t i = 0; i <= max_line; i++)
-        memcpy(&tmp_buf[i * line_size], &buf[(max_line - i) * line_size], line_size);
+// Scratch buffers, for the few transforms that can't go straight from source to
+// destination. These are reused across all the mipmaps of a texture.
+#define NB_SCRATCH_BUFFERS      3
+typedef struct {
+    uint8_t* buf[NB_SCRATCH_BUFFERS];
+    uint32_t size[NB_SCRATCH_BUFFERS];
+} scratch_arena;
 
-    memcpy(buf, tmp_buf, size);
-    free(tmp_buf);
+static uint8_t* get_scratch(scratch_arena* arena, uint32_t index, uint32_t size)
+{
+    assert(index < NB_SCRATCH_BUFFERS);
+    if (arena->size[index] < size) {
+        free(arena->buf[index]);
+        arena->buf[index] = malloc(size);
+        arena->size[index] = (arena->buf[index] == NULL) ? 0 : size;
+        if (arena->buf[index] == NULL)
+            fprintf(stderr, "ERROR: Can't allocate scratch buffer\n");
+    }
+    return arena->buf[index];
 }
 
-int main_utf8(int argc, char** argv)
+static void free_scratch(scratch_arena* arena)
 {
-    int r = -1;
-    FILE *file = NULL;
-    uint8_t* buf = NULL;
-    uint32_t *offset_table = NULL, *flag_table = NULL;
-    uint32_t magic;
-    char path[256], *dir = NULL;
-    JSON_Value* json = NULL;
-    bool list_only = (argc == 3) && (argv[1][0] == '-') && (argv[1][1] == 'l');
-    bool flip_image = (argc == 3) && (argv[1][0] == '-') && (argv[1][1] == 'f');
-    bool no_prompt = (argc == 3) && (argv[1][0] == '-') && (argv[1][1] == 'y');
+    for (uint32_t i = 0; i < NB_SCRATCH_BUFFERS; i++)
+        free(arena->buf[i]);
+}
 
-    if ((argc != 2) && !list_only && !flip_image && !no_prompt) {
-        printf("%s %s (c) 2019-2022 VitaSmith\n\n"
-            "Usage: %s [-l] [-f] [-y] <file or directory>\n\n"
-            "Extracts (file) or recreates (directory) a Gust .g1t texture archive.\n\n"
-            "Note: A backup (.bak) of the original is automatically created, when the target\n"
-            "is being overwritten for the first time.\n",
-            _appname(argv[0]), GUST_TOOLS_VERSION_STR, _appname(argv[0]));
-        return 0;
+// Return the size a mipmap level occupies in a G1T, including any padding.
+static uint32_t get_stored_mipmap_size(uint32_t platform, const enum DDS_FORMAT format,
+                                       uint32_t level, uint32_t width, uint32_t height)
+{
+    // The Wii U pads small mipmaps to 8x8 blocks
+    uint32_t min_mipmap_size = dds_bpb(format);
+    if (platform == NINTENDO_WIIU)
+        min_mipmap_size = 0x40 * dds_bpb(format);
+    return max(MIPMAP_SIZE(format, level, width, height), min_mipmap_size);
+}
+
+// Return the Morton order of a swizzled mipmap level, which is 0 or less if the level is
+// not swizzled, along with the width factor, i.e. the number of elements that are moved
+// together as a single one.
+static int get_morton_order(uint32_t platform, const enum DDS_FORMAT format, uint32_t width,
+                            uint32_t height, uint32_t level, uint32_t* wf)
+{
+    *wf = 1;
+    switch (platform) {
+    case SONY_PS4:
+    case NINTENDO_3DS:
+        *wf = 2;
+        return 3 - (int)level;
+    case NINTENDO_WIIU:
+        *wf = 16 / dds_bpb(format);
+        return 1;       // Same for all mipmaps
+    default:
+        width = min(width / dds_bwh(format), height / dds_bwh(format));
+        return (width == 0) ? 0 : (int)find_msb(width) - (int)level;
     }
+}
 
-    if (is_directory(argv[argc - 1])) {
-        if (list_only) {
-            fprintf(stderr, "ERROR: Option -l is not supported when creating an archive\n");
-            goto out;
-        }
-        snprintf(path, sizeof(path), "%s%cg1t.json", argv[argc - 1], PATH_SEP);
-        if (!is_file(path)) {
-            fprintf(stderr, "ERROR: '%s' does not exist\n", path);
-            goto out;
-        }
-        json = json_parse_file_with_comments(path);
-        if (json == NULL) {
-            fprintf(stderr, "ERROR: Can't parse JSON data from '%s'\n", path);
-            goto out;
-        }
-        const uint32_t json_version = json_object_get_uint32(json_object(json), "json_version");
-        if (json_version != JSON_VERSION) {
-            fprintf(stderr, "ERROR: This utility is not compatible with the JSON file provided.\n"
-                "You need to (re)extract the '.g1t' using this application.\n");
-            goto out;
-        }
-        const char* filename = json_object_get_string(json_object(json), "name");
-        uint32_t version = json_object_get_uint32(json_object(json), "version");
-        if ((filename == NULL) || (version == 0) || (version > 10000))
-            goto out;
-        JSON_Array* json_textures_array = json_object_get_array(json_object(json), "textures");
-        if (json_textures_array == NULL) {
-            fprintf(stderr, "ERROR: Invalid or missing JSON texture array\n");
-            goto out;
+// Layout of a swizzled mipmap level, as an address table over width x height elements
+// of bytes_per_element bytes. t.x is NULL if the level is stored linearly.
+typedef struct {
+    address_table t;
+    uint32_t width;
+    uint32_t height;
+    uint32_t bytes_per_element;
+    uint32_t padded_width;  // Non zero if the level is tiled within a larger (Wii U) surface
+} mipmap_layout;
+
+static bool get_mipmap_layout(uint32_t platform, const enum DDS_FORMAT format, uint32_t width,
+                              uint32_t height, uint32_t level, mipmap_layout* m)
+{
+    memset(m, 0, sizeof(*m));
+    m->bytes_per_element = dds_bpb(format);
+
+    uint32_t wf;
+    int mo = get_morton_order(platform, format, width, height, level, &wf);
+    if (mo <= 0)
+        return true;
+    // The Wii U pads small mipmaps to 8x8 blocks
+    const uint32_t awf = (platform == NINTENDO_WIIU) ? 8 : 1;
+    uint32_t mw = max(awf * dds_bwh(format), width / (1 << level));
+    uint32_t mh = max(awf * dds_bwh(format), height / (1 << level));
+    m->width = mw / dds_bwh(format);
+    m->height = mh / dds_bwh(format);
+    if (width / (1 << level) < mw)
+        m->padded_width = mw;
+    m->bytes_per_element *= wf;
+    m->width /= wf;
+    return build_morton_table(&m->t, m->width, m->height, m->bytes_per_element, (uint32_t)mo);
+}
+
+// Get the layouts of all the mipmap levels of a swizzled texture, which are shared by all
+// its frames. With fold_flip, the rows of the levels that can be gathered directly are
+// reversed, so that flipping is applied as part of deswizzling.
+static bool get_mipmap_layouts(uint32_t platform, const enum DDS_FORMAT format, uint32_t width,
+                               uint32_t height, uint32_t mipmaps, bool fold_flip, mipmap_layout* m)
+{
+    for (uint32_t l = 0; l < mipmaps; l++) {
+        if (!get_mipmap_layout(platform, format, width, height, l, &m[l]))
+            return false;
+        if (!fold_flip || m[l].t.x == NULL || m[l].padded_width != 0)
+            continue;
+        for (uint32_t y = 0; y < m[l].height / 2; y++) {
+            uint32_t tmp = m[l].t.y[y];
+            m[l].t.y[y] = m[l].t.y[m[l].height - 1 - y];
+            m[l].t.y[m[l].height - 1 - y] = tmp;
         }
-        JSON_Array* json_extra_data_array = json_object_get_array(json_object(json), "extra_data");
+    }
+    return true;
+}
 
-        strcpy(path, argv[argc - 1]);
-        if (get_trailing_slash(path) != 0)
-            path[get_trailing_slash(path)] = 0;
-        else
-            path[0] = 0;
-        strcat(path, filename);
-        path[sizeof(path) - 1] = 0;
-        printf("Creating '%s'...\n", path);
-        create_backup(path);
-        file = fopen_utf8(path, "wb+");
-        if (file == NULL) {
-            fprintf(stderr, "ERROR: Can't create file '%s'\n", path);
-            goto out;
+static void free_mipmap_layouts(mipmap_layout* m, uint32_t mipmaps)
+{
+    for (uint32_t l = 0; m != NULL && l < mipmaps; l++)
+        free(m[l].t.x);
+    free(m);
+}
+
+// Swizzle a single mipmap level from a linear src into its stored layout m in dst, or
+// deswizzle it if reverse is set. The stored layout may be padded, in which case dst
+// must have been zeroed when swizzling.
+static bool swizzle_mipmap(uint32_t platform, const enum DDS_FORMAT format, uint32_t width,
+                           uint32_t height, uint32_t level, const mipmap_layout* m, uint8_t* dst,
+                           const uint8_t* src, scratch_arena* arena, bool reverse)
+{
+    if (m->t.x == NULL) {
+        memcpy(dst, src, MIPMAP_SIZE(format, level, width, height));
+        return true;
+    }
+    if (m->padded_width != 0) {
+        // Padded mipmaps are tiled within the padded surface, which requires scratch space
+        uint32_t mipmap_size = MIPMAP_SIZE(format, level, width, height);
+        uint32_t stored_size = get_stored_mipmap_size(platform, format, level, width, height);
+        uint8_t* tmp0 = get_scratch(arena, 0, stored_size);
+        uint8_t* tmp1 = get_scratch(arena, 1, stored_size);
+        if (tmp0 == NULL || tmp1 == NULL)
+            return false;
+        if (reverse) {
+            swizzle(&m->t, m->width, m->height, m->bytes_per_element, tmp0, src, true);
+            tile(format, width / (1 << level), m->padded_width, tmp1, tmp0, stored_size);
+            memcpy(dst, tmp1, mipmap_size);
+        } else {
+            memcpy(tmp0, src, mipmap_size);
+            memset(&tmp0[mipmap_size], 0, stored_size - mipmap_size);
+            untile(format, width / (1 << level), m->padded_width, tmp1, tmp0, stored_size);
+            swizzle(&m->t, m->width, m->height, m->bytes_per_element, dst, tmp1, false);
         }
-        g1t_header hdr = { 0 };
-        if (name_to_platform(json_object_get_string(json_object(json), "platform")) == UINT32_MAX)
-            hdr.platform = json_object_get_uint32(json_object(json), "platform");
-        else
-            hdr.platform = name_to_platform(json_object_get_string(json_object(json), "platform"));
-        if (hdr.platform == SONY_PS3 || hdr.platform == NINTENDO_WII || hdr.platform == NINTENDO_WIIU)
-            data_endianness = big_endian;
-        hdr.magic = G1TG_MAGIC;
-        char version_string[6] = { 0 };
-        snprintf(version_string, sizeof(version_string), "%04d", version);
-        hdr.version = getbe32(version_string);
-        hdr.total_size = 0;  // To be rewritten when we're done
-        hdr.nb_textures = (uint32_t)json_array_get_count(json_textures_array);
-
-        hdr.extra_size = (uint32_t)json_array_get_count(json_extra_data_array) * sizeof(uint16_t);
-        hdr.header_size = sizeof(hdr) + hdr.nb_textures * sizeof(uint32_t);
-        fix_endian32(&hdr, sizeof(hdr) / sizeof(uint32_t));
-        if (fwrite(&hdr, sizeof(uint32_t), sizeof(hdr) / sizeof(uint32_t), file) != sizeof(hdr) / sizeof(uint32_t)) {
-            fprintf(stderr, "ERROR: Can't write header\n");
-            goto out;
+    } else {
+        swizzle(&m->t, m->width, m->height, m->bytes_per_element, dst, src, reverse);
+    }
+    return true;
+}
+
+// Location of each subresource, i.e. (frame or cubemap face, mipmap level) image, of a
+// texture. A G1T stores all the frames of a level together, whereas a DDS stores all the
+// levels of a frame together. Subresources are listed in DDS order.
+typedef struct {
+    uint32_t frame;
+    uint32_t level;
+    uint32_t g1t_offset;
+    uint32_t dds_offset;
+} subresource;
+
+// dds_mipmaps is the number of levels that each frame has in the DDS, which may be more
+// than the mipmaps we use.
+static subresource* get_subresources(uint32_t platform, const enum DDS_FORMAT format, uint32_t width,
+                                     uint32_t height, uint32_t mipmaps, uint32_t dds_mipmaps,
+                                     uint32_t nb_frames)
+{
+    subresource* s = malloc((size_t)nb_frames * mipmaps * sizeof(subresource));
+    if (s == NULL) {
+        fprintf(stderr, "ERROR: Can't allocate subresource table\n");
+        return NULL;
+    }
+    uint32_t frame_size = 0;
+    for (uint32_t l = 0; l < max(mipmaps, dds_mipmaps); l++)
+        frame_size += MIPMAP_SIZE(format, l, width, height);
+    for (uint32_t l = 0, g1t_offset = 0, dds_offset = 0; l < mipmaps; l++) {
+        const uint32_t stored_size = get_stored_mipmap_size(platform, format, l, width, height);
+        for (uint32_t f = 0; f < nb_frames; f++) {
+            subresource* r = &s[f * mipmaps + l];
+            r->frame = f;
+            r->level = l;
+            r->g1t_offset = g1t_offset + f * stored_size;
+            r->dds_offset = dds_offset + f * frame_size;
         }
-        fix_endian32(&hdr, sizeof(hdr) / sizeof(uint32_t));
+        g1t_offset += nb_frames * stored_size;
+        dds_offset += MIPMAP_SIZE(format, l, width, height);
+    }
+    return s;
+}
 
-        if (!flip_image)
-            flip_image = json_object_get_boolean(json_object(json), "flip");
+// Options for exporting textures as decoded 32-bit RGBA images
+typedef struct {
+    bool tga;
+    bool top_mip;
+    uint32_t thumbnail_size;
+} export_options;
 
-        // Create the placeholders for the global flags and offset table
-        flag_table = calloc(hdr.nb_textures, sizeof(uint32_t));
-        if (fwrite(flag_table, sizeof(uint32_t), hdr.nb_textures, file) != hdr.nb_textures) {
-            fprintf(stderr, "ERROR: Can't write global flags\n");
-            goto out;
+// Everything we need to convert a texture, once the G1T tables have been parsed.
+// This allows textures to be converted in parallel.
+typedef struct {
+    char path[256];
+    uint8_t* data;
+    uint32_t platform;
+    enum DDS_FORMAT format;
+    uint32_t width;
+    uint32_t height;
+    uint32_t mipmaps;
+    uint32_t nb_frames;
+    uint32_t size;
+    uint64_t flags[2];
+    bool swizzled;
+    bool flip;
+    const export_options* rgba_export;
+    uint32_t nb_threads;    // Threads for the subresources of this texture
+    bool success;
+} g1t_texture;
+
+// Rows are converted in strips that fit in the L1 cache
+#define STRIP_SIZE              0x4000
+
+// Flipping can only be folded into the gather when the rows of elements are also the
+// lines of the image, i.e. for uncompressed formats
+#define FOLD_FLIP(t) ((t)->flip && dds_bwh((t)->format) == 1)
+
+// Produce a DDS mipmap from its G1T counterpart in a single pass: each strip of rows is
+// gathered from its swizzled and/or flipped location, and has its channels converted
+// while still in cache. m is the layout from get_mipmap_layouts(), or NULL if the
+// texture isn't swizzled, and sh may be NULL if there is no channel conversion to apply.
+static bool convert_mipmap(const g1t_texture* t, uint32_t level, const mipmap_layout* m,
+                           const rgba_shuffle* sh, uint8_t* dst, const uint8_t* src,
+                           scratch_arena* arena)
+{
+    const uint32_t mipmap_size = MIPMAP_SIZE(t->format, level, t->width, t->height);
+    const bool fold_flip = FOLD_FLIP(t);
+
+    if ((m != NULL && m->t.x != NULL && m->padded_width != 0) || (t->flip && !fold_flip)) {
+        // Separate passes, for the odd cases that can't be gathered directly
+        if (m != NULL) {
+            if (!swizzle_mipmap(t->platform, t->format, t->width, t->height, level, m, dst, src, arena, true))
+                return false;
+        } else {
+            memcpy(dst, src, mipmap_size);
         }
+        if (t->flip)
+            flip(dds_bpp(t->format), dst, dst, mipmap_size, max(1, t->width >> level));
+        if (sh != NULL)
+            apply_rgba_shuffle(sh, dst, mipmap_size);
+        return true;
+    }
 
-        offset_table = calloc(hdr.nb_textures, sizeof(uint32_t));
-        offset_table[0] = hdr.nb_textures * sizeof(uint32_t);
-        if (fwrite(offset_table, sizeof(uint32_t), hdr.nb_textures, file) != hdr.nb_textures) {
-            fprintf(stderr, "ERROR: Can't write texture offsets\n");
-            goto out;
+    if (m != NULL && m->t.x != NULL) {
+        // The rows of the layout have already been reversed if we flip
+        const uint32_t row_size = m->width * m->bytes_per_element;
+        const uint32_t nb_rows = max(1, STRIP_SIZE / row_size);
+        for (uint32_t y = 0; y < m->height; y += nb_rows) {
+            uint32_t n = min(nb_rows, m->height - y);
+            swizzle_rows(&m->t, m->width, y, y + n, m->bytes_per_element, dst, src, true);
+            if (sh != NULL)
+                apply_rgba_shuffle(sh, &dst[(size_t)y * row_size], n * row_size);
         }
+        return true;
+    }
 
-        // Deal with the global extra data array
-        for (size_t i = 0; i < json_array_get_count(json_extra_data_array); i++) {
-            uint16_t extra_data = getv16(json_array_get_uint16(json_extra_data_array, i));
-            if (fwrite(&extra_data, 1, sizeof(uint16_t), file) != sizeof(uint16_t)) {
-                fprintf(stderr, "ERROR: Can't write global extra data\n");
-                goto out;
-            }
+    const uint32_t line_size = MIPMAP_SIZE(t->format, level, t->width, 1);
+    const uint32_t nb_lines = mipmap_size / line_size;
+    const uint32_t nb_rows = max(1, STRIP_SIZE / line_size);
+    for (uint32_t y = 0; y < nb_lines; y += nb_rows) {
+        uint32_t n = min(nb_rows, nb_lines - y);
+        if (fold_flip) {
+            for (uint32_t i = y; i < y + n; i++)
+                memcpy(&dst[(size_t)i * line_size], &src[(size_t)(nb_lines - 1 - i) * line_size], line_size);
+        } else {
+            memcpy(&dst[(size_t)y * line_size], &src[(size_t)y * line_size], (size_t)n * line_size);
         }
+        if (sh != NULL)
+            apply_rgba_shuffle(sh, &dst[(size_t)y * line_size], n * line_size);
+    }
+    return true;
+}
 
-        printf("TYPE OFFSET     SIZE       NAME");
-        dir = strdup(argv[argc - 1]);
-        if (dir == NULL) {
-            fprintf(stderr, "ERROR: Alloc error\n");
-            goto out;
+// Filters that can be used to generate mipmaps and thumbnails
+typedef enum {
+    FILTER_BOX,
+    FILTER_KAISER
+} mip_filter;
+
+#define KAISER_RADIUS   2.0f    // In destination pixels
+#define KAISER_ALPHA    4.0f
+#define PI              3.14159265f
+
+// Zeroth order modified Bessel function of the first kind, for the Kaiser window
+static float bessel_i0(float x)
+{
+    float sum = 1.0f, term = 1.0f;
+    for (int k = 1; k < 16; k++) {
+        term *= (x / (2.0f * k)) * (x / (2.0f * k));
+        sum += term;
+    }
+    return sum;
+}
+
+static float kaiser(float x)
+{
+    if (fabsf(x) >= KAISER_RADIUS)
+        return 0.0f;
+    const float sinc = (x == 0.0f) ? 1.0f : sinf(PI * x) / (PI * x);
+    const float r = x / KAISER_RADIUS;
+    return sinc * bessel_i0(KAISER_ALPHA * sqrtf(1.0f - r * r)) / bessel_i0(KAISER_ALPHA);
+}
+
+// The source pixels and weights that make each destination pixel along one axis
+typedef struct {
+    uint32_t nb_taps;
+    uint32_t* index;
+    float* weight;
+} filter_taps;
+
+static bool get_filter_taps(filter_taps* t, mip_filter filter, uint32_t src_size, uint32_t dst_size)
+{
+    const float scale = max(1.0f, (float)src_size / (float)dst_size);
+    const float radius = (filter == FILTER_BOX) ? 0.5f * scale : KAISER_RADIUS * scale;
+    t->nb_taps = (uint32_t)ceilf(2.0f * radius) + 1;
+    t->index = malloc((size_t)dst_size * t->nb_taps * sizeof(uint32_t));
+    t->weight = malloc((size_t)dst_size * t->nb_taps * sizeof(float));
+    if (t->index == NULL || t->weight == NULL)
+        return false;
+    for (uint32_t d = 0; d < dst_size; d++) {
+        uint32_t* index = &t->index[d * t->nb_taps];
+        float* weight = &t->weight[d * t->nb_taps];
+        const float center = (d + 0.5f) * (float)src_size / (float)dst_size;
+        const int32_t first = (int32_t)floorf(center - radius);
+        float sum = 0.0f;
+        for (uint32_t i = 0; i < t->nb_taps; i++) {
+            const int32_t s = first + (int32_t)i;
+            // Clamp to the edges of the image
+            index[i] = (uint32_t)min(max(s, 0), (int32_t)src_size - 1);
+            if (filter == FILTER_BOX)
+                weight[i] = max(0.0f, min(s + 1.0f, center + radius) - max((float)s, center - radius));
+            else
+                weight[i] = kaiser((s + 0.5f - center) / scale);
+            sum += weight[i];
         }
-        dir[get_trailing_slash(dir)] = 0;
-        for (size_t i = 0; i < strlen(_basename(argv[argc - 1])); i++)
-            putchar(' ');
-        printf("     DIMENSIONS MIPMAPS PROPS\n");
-        for (uint32_t i = 0; i < hdr.nb_textures; i++) {
-            offset_table[i] = ftell(file) - hdr.header_size;
-            JSON_Object* texture_entry = json_array_get_object(json_textures_array, i);
-            g1t_tex_header tex = { 0 };
-            tex.type = json_object_get_uint8(texture_entry, "type");
-            tex.z_mipmaps = json_object_get_uint8(texture_entry, "z_mipmaps");
-            const char* depth_str = json_object_get_string(texture_entry, "depth");
-            float depth = (depth_str == NULL) ? 0.0f : (float)atof(depth_str);
-            uint64_t flags[2];
-            json_to_flags(flags, json_object_get_array(texture_entry, "flags"));
-            for (size_t j = 0; j < array_size(tex.flags); j++)
-                tex.flags[array_size(tex.flags) - j - 1] = (uint8_t)(flags[0] >> (8 * j));
-            flag_table[i] = (uint32_t)(flags[0] >> 40);
-            uint32_t nb_frames = json_object_get_uint32(texture_entry, "nb_frames");
-            flags[1] |= ((uint64_t)nb_frames & 0x0f) << 28 | ((uint64_t)nb_frames & 0xf0) << 12;
-            if (nb_frames == 0)
-                nb_frames = 1;
-            // Read the DDS file
-            snprintf(path, sizeof(path), "%s%s%c%s", dir, _basename(argv[argc - 1]), PATH_SEP,
-                json_object_get_string(texture_entry, "name"));
-            uint32_t texture_size = read_file(path, &buf);
-            if (texture_size == UINT32_MAX)
-                goto out;
-            if (texture_size <= sizeof(DDS_HEADER)) {
-                fprintf(stderr, "ERROR: '%s' is too small\n", path);
-                goto out;
-            }
-            if (*((uint32_t*)buf) != DDS_MAGIC) {
-                fprintf(stderr, "ERROR: '%s' is not a DDS file\n", path);
-                goto out;
-            }
-            DDS_HEADER* dds_header = (DDS_HEADER*)&buf[sizeof(uint32_t)];
-            texture_size -= sizeof(uint32_t) + sizeof(DDS_HEADER);
-            uint8_t* dds_payload = (uint8_t*)&buf[sizeof(uint32_t) + sizeof(DDS_HEADER)];
-            // We may have a DXT10 additional header
-            if (dds_header->ddspf.fourCC == get_fourCC(DDS_FORMAT_DX10)) {
-                texture_size -= sizeof(DDS_HEADER_DXT10);
-                dds_payload = &dds_payload[sizeof(DDS_HEADER_DXT10)];
-            }
-            tex.mipmaps = json_object_get_uint8(texture_entry, "mipmaps");
-            if (tex.mipmaps == 0) {
-                tex.mipmaps = (uint8_t)dds_header->mipMapCount;
-            } else if ((uint8_t)dds_header->mipMapCount < tex.mipmaps) {
-                fprintf(stderr, "WARNING: Number of mipmaps from imported texture is smaller than original\n");
-                tex.mipmaps = (uint8_t)dds_header->mipMapCount;
-            } else if ((uint8_t)dds_header->mipMapCount > tex.mipmaps) {
-                fprintf(stderr, "NOTE: Truncating number of mipmaps from %d to %d\n", dds_header->mipMapCount, tex.mipmaps);
-            }
-            // Are both width and height a power of two?
-            // TODO: Also check if height/width are larger than what we can represent with dx/dy
-            bool po2_sizes = is_power_of_2(dds_header->width) && is_power_of_2(dds_header->height);
-            if (!po2_sizes && !(flags[0] & G1T_FLAG_EXTENDED_DATA)) {
-                fprintf(stderr, "ERROR: Extended data flag must be set for textures with dimensions that aren't a power of two\n");
-                goto out;
-            }
-            if (po2_sizes) {
-                tex.dx = (uint8_t)find_msb(dds_header->width);
-                tex.dy = (uint8_t)find_msb(dds_header->height);
-            }
-            if (data_endianness == big_endian) {
-                uint8_t swap_tmp = tex.dx;
-                tex.dx = tex.dy;
-                tex.dy = swap_tmp;
-                swap_tmp = tex.z_mipmaps;
-                tex.z_mipmaps = tex.mipmaps;
-                tex.mipmaps = swap_tmp;
-            } else {
-                for (size_t j = 0; j < array_size(tex.flags); j++)
-                    tex.flags[j] = tex.flags[j] >> 4 | tex.flags[j] << 4;
-            }
-            // Write texture header
-            if (fwrite(&tex, sizeof(tex), 1, file) != 1) {
-                fprintf(stderr, "ERROR: Can't write texture header\n");
-                goto out;
-            }
-            // Swap back tex.mipmaps for the rest of our processing
-            if (data_endianness != platform_endianness) {
-                uint8_t swap_tmp = tex.z_mipmaps;
-                tex.z_mipmaps = tex.mipmaps;
-                tex.mipmaps = swap_tmp;
-            }
-            // Write data
-            if (flags[0] & G1T_FLAG_EXTENDED_DATA) {
-                uint32_t data[5], data_size;
-                data[1] = getv32(*((uint32_t*)&depth));
-                setbe32(&data[2], (uint32_t)flags[1]);
-                data[3] = getv32(dds_header->width);
-                data[4] = getv32(dds_header->height);
-                if (!is_power_of_2(dds_header->width) || !is_power_of_2(dds_header->height))
-                    data_size = 5;
-                else
-                    data_size = 3;
-                data[0] = getv32(data_size * sizeof(uint32_t));
-                if (fwrite(data, sizeof(uint32_t), data_size, file) != data_size) {
-                    fprintf(stderr, "ERROR: Can't write extended data\n");
-                    goto out;
-                }
-            }
+        for (uint32_t i = 0; i < t->nb_taps; i++)
+            weight[i] /= sum;
+    }
+    return true;
+}
 
-            // Set the default ARGB format for the platform
-            uint32_t default_texture_format;
-            switch (hdr.platform) {
-            case NINTENDO_DS:
-            case NINTENDO_3DS:
-            case SONY_PS4:
-                default_texture_format = DDS_FORMAT_GRAB8;
-                break;
-            case SONY_PSV:
-            case NINTENDO_SWITCH:
-                default_texture_format = DDS_FORMAT_ARGB8;
-                break;
-            default:    // PC and other platforms
-                default_texture_format = DDS_FORMAT_RGBA8;
-                break;
-            }
-            uint32_t texture_format = default_texture_format;
-            bool swizzled = false;
-            switch (tex.type) {
-            case 0x00: break;   // ???
-            case 0x01: break;   // ???
-            case 0x02: break;   // ???
-            case 0x03: texture_format = DDS_FORMAT_ARGB16; break;
-            case 0x04: texture_format = DDS_FORMAT_ARGB32; break;
-            case 0x06: texture_format = DDS_FORMAT_DXT1; break; // PS2??, PS3
-            case 0x07: texture_format = DDS_FORMAT_DXT3; break;
-            case 0x08: texture_format = DDS_FORMAT_DXT5; break; // PS3
-            case 0x09: swizzled = true; break;  // PS4
-//            case 0x0A: swizzled = true; break;
-            case 0x10: texture_format = DDS_FORMAT_DXT1; swizzled = true; break;    // PSV
-            case 0x11: texture_format = DDS_FORMAT_DXT3; swizzled = true; break;    // PSV
-            case 0x12: texture_format = DDS_FORMAT_DXT5; swizzled = true; break;    // PSV
-            case 0x21: break;   // Switch
-            // 0x3C and 0x3D are definitely 16bpp, but after that...
-            case 0x3C: texture_format = DDS_FORMAT_ARGB4; break; // 3DS
-            case 0x3D: texture_format = DDS_FORMAT_ARGB4; break; // 3DS
-            case 0x45: texture_format = DDS_FORMAT_BGR8; swizzled = true; break; // 3DS
-            case 0x59: texture_format = DDS_FORMAT_DXT1; break; // Win
-            case 0x5A: texture_format = DDS_FORMAT_DXT3; break; // Win
-            case 0x5B: texture_format = DDS_FORMAT_DXT5; break; // Win
-            case 0x5C: texture_format = DDS_FORMAT_BC4; break;  // Win
-//            case 0x5D: texture_format = DDS_FORMAT_ATI1; break;
-            case 0x5E: texture_format = DDS_FORMAT_BC6H; break; // Win
-            case 0x5F: texture_format = DDS_FORMAT_BC7; break;  // Win
-            case 0x60: texture_format = DDS_FORMAT_DXT1; swizzled = true; break;    // PS4
-            case 0x61: texture_format = DDS_FORMAT_DXT3; swizzled = true; break;    // PS4
-            case 0x62: texture_format = DDS_FORMAT_DXT5; swizzled = true; break;    // PS4
-//            case 0x63: texture_format = DDS_FORMAT_BC4; swizzled = true; break;
-//            case 0x64: texture_format = DDS_FORMAT_BC5; swizzled = true; break;
-//            case 0x65: texture_format = DDS_FORMAT_BC6; swizzled = true; break;
-//            case 0x66: texture_format = DDS_FORMAT_BC7; swizzled = true; break;
-            case 0x72: texture_format = DDS_FORMAT_BC7; break;   // Win
-            default:
-                fprintf(stderr, "ERROR: Unsupported texture type 0x%02x\n", tex.type);
-                goto out;
-            }
+// Resample an RGBA image to a smaller size. With srgb, colors are filtered in linear space.
+static bool resample(const uint8_t* src, uint32_t src_width, uint32_t src_height, uint8_t* dst,
+                     uint32_t dst_width, uint32_t dst_height, mip_filter filter, bool srgb)
+{
+    bool r = false;
+    float to_linear[256], *line = NULL, *row = NULL;
+    uint8_t from_linear[4096];
+    filter_taps h = { 0 }, v = { 0 };
+
+    for (uint32_t i = 0; i < array_size(to_linear); i++) {
+        const float c = i / 255.0f;
+        to_linear[i] = !srgb ? c : ((c <= 0.04045f) ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f));
+    }
+    for (uint32_t i = 0; i < array_size(from_linear); i++) {
+        const float c = i / 4095.0f;
+        from_linear[i] = (uint8_t)(255.0f * ((c <= 0.0031308f) ? 12.92f * c :
+            1.055f * powf(c, 1.0f / 2.4f) - 0.055f) + 0.5f);
+    }
+    line = malloc((size_t)src_width * 4 * sizeof(float));
+    row = malloc((size_t)src_width * 4 * sizeof(float));
+    if (line == NULL || row == NULL || !get_filter_taps(&h, filter, src_width, dst_width) ||
+        !get_filter_taps(&v, filter, src_height, dst_height)) {
+        fprintf(stderr, "ERROR: Can't allocate resampling buffers\n");
+        goto out;
+    }
 
-            uint32_t expected_texture_size = 0;
-            uint32_t min_mipmap_size = dds_bpb(texture_format);
-            if (hdr.platform == NINTENDO_WIIU)
-                min_mipmap_size = 0x40 * dds_bpb(texture_format);
-            for (int j = 0; j < tex.mipmaps; j++)
-                expected_texture_size += MIPMAP_SIZE(texture_format, j, dds_header->width, dds_header->height);
-            expected_texture_size *= nb_frames;
-            bool cubemap = dds_header->caps & DDS_SURFACE_FLAGS_CUBEMAP && dds_header->caps2 & DDS_CUBEMAP_ALLFACES;
-            if (cubemap) {
-                if ((dds_header->caps2 & DDS_CUBEMAP_ALLFACES) != DDS_CUBEMAP_ALLFACES) {
-                    fprintf(stderr, "ERROR: Cannot handle cube maps with missing faces\n");
-                    goto out;
-                }
-                expected_texture_size *= 6;
-            }
-            if (expected_texture_size > texture_size) {
-                fprintf(stderr, "ERROR: expected_texture_size %8x > %8x\n", expected_texture_size, texture_size);
-                goto out;
-            }
-            if ((texture_size * 8) % dds_bpp(texture_format) != 0) {
-                fprintf(stderr, "ERROR: Texture size should be a multiple of %d bits\n", dds_bpp(texture_format));
-                goto out;
-            }
-            if (expected_texture_size < texture_size) {
-                // Only display the warning if we aren't truncating mipmaps
-                if ((uint8_t)dds_header->mipMapCount <= tex.mipmaps)
-                    fprintf(stderr, "WARNING: Reducing texture size\n");
-                texture_size = expected_texture_size;
+    for (uint32_t y = 0; y < dst_height; y++) {
+        // Vertical pass, into a row of linear RGBA floats
+        memset(row, 0, (size_t)src_width * 4 * sizeof(float));
+        for (uint32_t i = 0; i < v.nb_taps; i++) {
+            const float w = v.weight[y * v.nb_taps + i];
+            if (w == 0.0f)
+                continue;
+            const uint8_t* s = &src[(size_t)v.index[y * v.nb_taps + i] * src_width * 4];
+            for (uint32_t x = 0; x < src_width * 4; x += 4) {
+                line[x + 0] = to_linear[s[x + 0]];
+                line[x + 1] = to_linear[s[x + 1]];
+                line[x + 2] = to_linear[s[x + 2]];
+                line[x + 3] = s[x + 3] / 255.0f;    // Alpha is always linear
             }
+            uint32_t x = 0;
+#if defined(USE_SSE2)
+            const __m128 w4 = _mm_set1_ps(w);
+            for (; x < src_width * 4; x += 4)
+                _mm_storeu_ps(&row[x], _mm_add_ps(_mm_loadu_ps(&row[x]), _mm_mul_ps(w4, _mm_loadu_ps(&line[x]))));
+#endif
+            for (; x < src_width * 4; x++)
+                row[x] += w * line[x];
+        }
+        // Horizontal pass, one RGBA pixel at a time
+        uint8_t* d = &dst[(size_t)y * dst_width * 4];
+        for (uint32_t x = 0; x < dst_width; x++) {
+            float p[4];
+#if defined(USE_SSE2)
+            __m128 acc = _mm_setzero_ps();
+            for (uint32_t i = 0; i < h.nb_taps; i++)
+                acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(h.weight[x * h.nb_taps + i]),
+                    _mm_loadu_ps(&row[h.index[x * h.nb_taps + i] * 4])));
+            // Kaiser lobes can overshoot
+            _mm_storeu_ps(p, _mm_min_ps(_mm_max_ps(acc, _mm_setzero_ps()), _mm_set1_ps(1.0f)));
+#else
+            p[0] = p[1] = p[2] = p[3] = 0.0f;
+            for (uint32_t i = 0; i < h.nb_taps; i++)
+                for (uint32_t c = 0; c < 4; c++)
+                    p[c] += h.weight[x * h.nb_taps + i] * row[h.index[x * h.nb_taps + i] * 4 + c];
+            // Kaiser lobes can overshoot
+            for (uint32_t c = 0; c < 4; c++)
+                p[c] = min(max(p[c], 0.0f), 1.0f);
+#endif
+            for (uint32_t c = 0; c < 4; c++)
+                d[4 * x + c] = (srgb && c < 3) ? from_linear[(uint32_t)(p[c] * 4095.0f + 0.5f)] :
+                    (uint8_t)(p[c] * 255.0f + 0.5f);
+        }
+    }
+    r = true;
 
-            switch (dds_header->ddspf.flags & (DDS_ALPHAPIXELS | DDS_FOURCC | DDS_RGB)) {
-            case DDS_RGBA:
-                if ((dds_header->ddspf.RGBBitCount != 16) && (dds_header->ddspf.RGBBitCount != 32) &&
-                    (dds_header->ddspf.RGBBitCount != 64) && (dds_header->ddspf.RGBBitCount != 128)) {
-                    fprintf(stderr, "ERROR: '%s' is not an ARGB texture we support\n", path);
-                    goto out;
-                }
-                break;
-            case DDS_RGB:
-                if ((dds_header->ddspf.RGBBitCount != 24) ||
-                    (dds_header->ddspf.RBitMask != 0x00ff0000) || (dds_header->ddspf.GBitMask != 0x0000ff00) ||
-                    (dds_header->ddspf.BBitMask != 0x000000ff) || (dds_header->ddspf.ABitMask != 0x00000000)) {
-                    fprintf(stderr, "ERROR: '%s' is not an RGB texture we support\n", path);
-                    goto out;
-                }
-            case DDS_FOURCC:
-                break;
-            default:
-                fprintf(stderr, "ERROR: '%s' is not a texture we support\n", path);
-                goto out;
-            }
+out:
+    free(h.index);
+    free(h.weight);
+    free(v.index);
+    free(v.weight);
+    free(line);
+    free(row);
+    return r;
+}
+
+// Whether the color channels of a texture are sRGB encoded. For BC4 and BC6H,
+// the sRGB flag is used to indicate signed data instead.
+static bool is_srgb(const enum DDS_FORMAT format, uint64_t flags)
+{
+    return (flags & G1T_FLAG_SRGB) && (format != DDS_FORMAT_BC4) && (format != DDS_FORMAT_BC6H);
+}
 
-            if (flip_image || ((hdr.platform == NINTENDO_3DS) && (tex.type == 0x09 || tex.type == 0x45)))
-                flip(dds_bpp(texture_format), dds_payload, texture_size, dds_header->width);
-
-            if (swizzled) {
-                int16_t mo = 0;     // Morton order
-                uint32_t wf = 1;    // Width factor
-                uint32_t awf = 1;   // Additional width factor
-                switch (hdr.platform) {
-                case SONY_PS4:
-                case NINTENDO_3DS:
-                    mo = 3;
-                    wf = 2;
-                    break;
-                case NINTENDO_WIIU:
-                    mo = 1;        // Same for all mipmaps
-                    wf = 16 / dds_bpb(texture_format);
-                    awf = 8;
-                    break;
-                default:
-                    mo = (int16_t)log2(min(dds_header->width / dds_bwh(texture_format) / wf,
-                            dds_header->height / dds_bwh(texture_format)));
-                    break;
-                }
-                uint32_t offset = 0;
-                assert(mo != 0);
-                // TODO: We'll need to handle morton for texture arrays & cubemaps
-                for (int j = 0; j < tex.mipmaps && mo != 0; j++) {
-                    uint32_t mipmap_size = MIPMAP_SIZE(texture_format, j, dds_header->width, dds_header->height);
-                    uint32_t mw = max(awf * dds_bwh(texture_format), dds_header->width / (1 << j));
-                    uint32_t mh = max(awf * dds_bwh(texture_format), dds_header->height / (1 << j));
-                    uint8_t* mipmap_buf = calloc(max(mipmap_size, min_mipmap_size), 1);
-                    if (mipmap_buf == NULL)
-                        goto out;
-                    memcpy(mipmap_buf, &dds_payload[offset], mipmap_size);
-                    if (dds_header->width / (1 << j) < mw)
-                        untile(texture_format, dds_header->width / (1 << j), mw, mipmap_buf, max(min_mipmap_size, mipmap_size));
-                    mortonize(texture_format, mo, mw, mh, mipmap_buf, max(mipmap_size, min_mipmap_size), wf);
-                    memcpy(&dds_payload[offset], mipmap_buf, mipmap_size);
-                    free(mipmap_buf);
-                    offset += mipmap_size;
-                    if (hdr.platform != NINTENDO_WIIU)
-                        mo += (mo > 0) ? -1 : +1;
-                }
+// Decode a mipmap, as laid out in the DDS we would otherwise create, to 8-bit RGBA
+static bool decode_mipmap(const g1t_texture* t, const uint8_t* src, uint32_t width,
+                          uint32_t height, uint8_t* rgba)
+{
+    const size_t nb_pixels = (size_t)width * height;
+    if (bcn_can_decode(t->format)) {
+        // The sRGB flag is what makes us flag BC6H textures as signed in the DDS header
+        bcn_decode(t->format, src, width, height, rgba, (t->flags[0] & G1T_FLAG_SRGB) != 0);
+    } else if (t->format >= DDS_FORMAT_ABGR4 && t->format <= DDS_FORMAT_RGBA8) {
+        // These have already been converted to ARGB
+        if (dds_bpp(t->format) == 16) {
+            for (size_t i = 0; i < nb_pixels; i++) {
+                uint16_t v = getle16(&src[2 * i]);
+                rgba[4 * i + 0] = (uint8_t)(((v >> 8) & 0x0f) * 0x11);
+                rgba[4 * i + 1] = (uint8_t)(((v >> 4) & 0x0f) * 0x11);
+                rgba[4 * i + 2] = (uint8_t)((v & 0x0f) * 0x11);
+                rgba[4 * i + 3] = (uint8_t)((v >> 12) * 0x11);
             }
-            if (texture_format >= DDS_FORMAT_ABGR4 && texture_format <= DDS_FORMAT_RGBA8)
-                rgba_convert(texture_format, "ARGB", argb_name[texture_format], dds_payload, texture_size);
-
-            char dims[16] = { 0 }, props[8] = { 0 };
-            snprintf(dims, sizeof(dims), "%dx%d", dds_header->width, dds_header->height);
-            if (nb_frames > 1)
-                strcat(props, "A");     // Array
-            if (data_endianness == big_endian)
-                strcat(props, "B");
-            if (cubemap)
-                strcat(props, "C");     // Cubemap
-            if (depth != 0.0f)
-                strcat(props, "D");
-            if (props[0] == 0)
-                props[0] = '-';
-            printf("0x%02x 0x%08x 0x%08x %s %-10s %-7d %s\n", tex.type, getv32(hdr.header_size) + offset_table[i],
-                (uint32_t)ftell(file) - offset_table[i] - getv32(hdr.header_size) - (uint32_t)sizeof(g1t_tex_header),
-                path, dims, tex.mipmaps, props);
-
-            if (cubemap)
-                nb_frames *= 6;     // Adjust effective nb_frames for cubemaps
-            // Inverse operation from the one we carry when extracting DDS
-            uint32_t f_size = texture_size / nb_frames;
-            for (uint32_t l = 0, offset = 0; l < tex.mipmaps; l++) {
-                uint32_t mipmap_size = MIPMAP_SIZE(texture_format, l, dds_header->width, dds_header->height);
-                for (uint32_t f = 0; f < nb_frames; f++) {
-                    if (fwrite(&dds_payload[f * f_size + offset], mipmap_size, 1, file) != 1) {
-                        fprintf(stderr, "ERROR: Can't write DDS data\n");
-                        goto out;
-                    }
-                    if (mipmap_size < min_mipmap_size) {
-                        uint8_t* completion_buf = calloc(min_mipmap_size - mipmap_size, 1);
-                        if (completion_buf == NULL)
-                            goto out;
-                        if (fwrite(completion_buf, min_mipmap_size - mipmap_size, 1, file) != 1) {
-                            fprintf(stderr, "ERROR: Can't write DDS data\n");
-                            goto out;
-                        }
-                        free(completion_buf);
-                    }
-                }
-                offset += mipmap_size;
+        } else {
+            for (size_t i = 0; i < nb_pixels; i++) {
+                rgba[4 * i + 0] = src[4 * i + 2];
+                rgba[4 * i + 1] = src[4 * i + 1];
+                rgba[4 * i + 2] = src[4 * i + 0];
+                rgba[4 * i + 3] = src[4 * i + 3];
             }
-            free(buf);
-            buf = NULL;
-        }
-        // Update total size
-        uint32_t total_size = getv32(ftell(file));
-        fseek(file, 2 * sizeof(uint32_t), SEEK_SET);
-        if (fwrite(&total_size, sizeof(uint32_t), 1, file) != 1) {
-            fprintf(stderr, "ERROR: Can't update total size\n");
-            goto out;
         }
-        // Update flag and offset tables
-        fseek(file, sizeof(hdr), SEEK_SET);
-        fix_endian32(flag_table, hdr.nb_textures);
-        if (fwrite(flag_table, sizeof(uint32_t), hdr.nb_textures, file) != hdr.nb_textures) {
-            fprintf(stderr, "ERROR: Can't update global flags\n");
-            goto out;
+    } else if (t->format == DDS_FORMAT_BGR8) {
+        for (size_t i = 0; i < nb_pixels; i++) {
+            rgba[4 * i + 0] = src[3 * i + 2];
+            rgba[4 * i + 1] = src[3 * i + 1];
+            rgba[4 * i + 2] = src[3 * i + 0];
+            rgba[4 * i + 3] = 0xff;
         }
-        fix_endian32(offset_table, hdr.nb_textures);
-        if (fwrite(offset_table, sizeof(uint32_t), hdr.nb_textures, file) != hdr.nb_textures) {
-            fprintf(stderr, "ERROR: Can't update texture offsets\n");
-            goto out;
+    } else if (t->format == DDS_FORMAT_R8) {
+        for (size_t i = 0; i < nb_pixels; i++) {
+            rgba[4 * i + 0] = rgba[4 * i + 1] = rgba[4 * i + 2] = src[i];
+            rgba[4 * i + 3] = 0xff;
         }
-        r = 0;
     } else {
-        printf("%s '%s'...\n", list_only ? "Listing" : "Extracting", argv[argc - 1]);
-        size_t len = strlen(argv[argc - 1]);
-        if ((len < 4) || (argv[argc - 1][len - 4] != '.') || (argv[argc - 1][len - 3] != 'g') ||
-            ((argv[argc - 1][len - 2] != '1') && (argv[argc - 1][len - 2] != 't')) ||
-            ((argv[argc - 1][len - 1] != '1') && (argv[argc - 1][len - 1] != 't')) ) {
-            fprintf(stderr, "ERROR: File should have a '.g1t' or 'gt1' extension\n");
-            goto out;
-        }
-        char* g1t_pos = &argv[argc - 1][len - 4];
-        file = fopen_utf8(argv[argc - 1], "rb");
-        if (file == NULL) {
-            fprintf(stderr, "ERROR: Can't open file '%s'\n", argv[argc - 1]);
-            goto out;
-        }
+        return false;
+    }
+    return true;
+}
 
-        if (fread(&magic, sizeof(magic), 1, file) != 1) {
-            fprintf(stderr, "ERROR: Can't read from '%s'\n", argv[argc - 1]);
-            goto out;
+static bool can_export(const g1t_texture* t)
+{
+    return bcn_can_decode(t->format) || (t->format >= DDS_FORMAT_ABGR4 && t->format <= DDS_FORMAT_RGBA8) ||
+        (t->format == DDS_FORMAT_BGR8) || (t->format == DDS_FORMAT_R8);
+}
+
+// Get the range of mipmaps that an export uses. For thumbnails, this is the largest
+// mipmap that fits, or the smallest one if none do, which then gets downsampled.
+static void get_export_levels(const g1t_texture* t, uint32_t* first_level, uint32_t* nb_levels)
+{
+    const export_options* e = t->rgba_export;
+    *first_level = 0;
+    *nb_levels = (e->tga || e->top_mip || e->thumbnail_size != 0) ? 1 : t->mipmaps;
+    while (e->thumbnail_size != 0 && *first_level + 1 < t->mipmaps &&
+        max(t->width >> *first_level, t->height >> *first_level) > e->thumbnail_size)
+        (*first_level)++;
+}
+
+// Save a texture, from the mipmaps we would otherwise write to a DDS, as a decoded
+// 32-bit uncompressed DDS or as a TGA (which only gets the first frame).
+static bool export_texture(const g1t_texture* t, uint32_t nb_frames, const uint8_t* const* mipmaps)
+{
+    const export_options* e = t->rgba_export;
+    bool r = false;
+    FILE* dst = NULL;
+    uint8_t *payload = NULL, *buf[2] = { NULL, NULL };
+    uint8_t header[sizeof(uint32_t) + sizeof(DDS_HEADER) + sizeof(DDS_HEADER_DXT10)] = { 0 };
+    size_t header_size;
+    char path[sizeof(t->path)];
+    uint32_t first_level, nb_levels;
+
+    get_export_levels(t, &first_level, &nb_levels);
+    if (e->tga)
+        nb_frames = 1;
+    const uint32_t width = max(1, t->width >> first_level), height = max(1, t->height >> first_level);
+    uint32_t out_width = width, out_height = height;
+    while (e->thumbnail_size != 0 && max(out_width, out_height) > e->thumbnail_size) {
+        out_width = max(1, out_width / 2);
+        out_height = max(1, out_height / 2);
+    }
+
+    size_t payload_size = 0;
+    for (uint32_t l = 0; l < nb_levels; l++)
+        payload_size += (size_t)max(1, out_width >> l) * max(1, out_height >> l) * 4;
+    payload_size *= nb_frames;
+    payload = malloc(payload_size);
+    buf[0] = malloc((size_t)width * height * 4);
+    buf[1] = malloc((size_t)width * height * 4);
+    if (payload == NULL || buf[0] == NULL || buf[1] == NULL) {
+        fprintf(stderr, "ERROR: Can't allocate export buffers\n");
+        goto out;
+    }
+
+    uint8_t* p = payload;
+    for (uint32_t f = 0; f < nb_frames; f++) {
+        for (uint32_t l = first_level; l < first_level + nb_levels; l++) {
+            uint32_t w = max(1, t->width >> l), h = max(1, t->height >> l), i = 0;
+            if (!decode_mipmap(t, mipmaps[f * t->mipmaps + l], w, h, buf[0]))
+                goto out;
+            // Thumbnails that are smaller than all the mipmaps we have
+            if (w > out_width || h > out_height) {
+                if (!resample(buf[0], w, h, buf[1], out_width, out_height, FILTER_KAISER,
+                    is_srgb(t->format, t->flags[0])))
+                    goto out;
+                w = out_width;
+                h = out_height;
+                i = 1;
+            }
+            // Both the DDS we create and TGA use BGRA
+            for (size_t j = 0; j < (size_t)w * h; j++) {
+                p[4 * j + 0] = buf[i][4 * j + 2];
+                p[4 * j + 1] = buf[i][4 * j + 1];
+                p[4 * j + 2] = buf[i][4 * j + 0];
+                p[4 * j + 3] = buf[i][4 * j + 3];
+            }
+            p += (size_t)w * h * 4;
         }
-        if ((magic != G1TG_MAGIC) && (magic != bswap_uint32(G1TG_MAGIC))) {
-            fprintf(stderr, "ERROR: Not a G1T file (bad magic) or unsupported platform\n");
+    }
+
+    strcpy(path, t->path);
+    if (e->tga) {
+        strcpy(&path[strlen(path) - 3], "tga");
+        header[2] = 2;      // Uncompressed true-color
+        setle16(&header[12], (uint16_t)out_width);
+        setle16(&header[14], (uint16_t)out_height);
+        header[16] = 32;
+        header[17] = 0x28;  // 8-bit alpha, top-left origin
+        header_size = 18;
+    } else {
+        setle32(header, DDS_MAGIC);
+        header_size = get_dds_header(&header[sizeof(uint32_t)], DDS_FORMAT_ARGB8, out_width, out_height,
+            nb_levels, (uint64_t*)t->flags);
+        if (header_size == 0) {
+            fprintf(stderr, "ERROR: Can't create DDS header\n");
             goto out;
         }
-        if (magic == bswap_uint32(G1TG_MAGIC))
-            data_endianness = !platform_endianness;
-        fseek(file, 0L, SEEK_END);
-        uint32_t g1t_size = (uint32_t)ftell(file);
-        fseek(file, 0L, SEEK_SET);
+        header_size += sizeof(uint32_t);
+    }
+    dst = fopen_utf8(path, "wb");
+    if (dst == NULL) {
+        fprintf(stderr, "ERROR: Can't create file '%s'\n", path);
+        goto out;
+    }
+    const io_chunk chunks[2] = { { header, header_size }, { payload, payload_size } };
+    if (!write_chunks(dst, chunks, 2)) {
+        fprintf(stderr, "ERROR: Can't write '%s'\n", path);
+        goto out;
+    }
+    r = true;
 
-        buf = malloc(g1t_size);
-        if (buf == NULL)
+out:
+    if (dst != NULL)
+        fclose(dst);
+    free(payload);
+    free(buf[0]);
+    free(buf[1]);
+    return r;
+}
+
+// The conversion of the subresources of a texture, with one job per subresource
+typedef struct {
+    const g1t_texture* t;
+    const subresource* subs;
+    const mipmap_layout* layouts;   // NULL if the texture isn't swizzled
+    const rgba_shuffle* sh;
+    uint32_t* index;                // Subresource of each job, when extracting
+    uint8_t** dst;                  // Destination of each subresource, when extracting
+    uint8_t* dds;                   // DDS payload, when recreating
+    bool* success;
+} subresource_jobs;
+
+static void extract_subresource(void* ctx, uint32_t index)
+{
+    subresource_jobs* j = (subresource_jobs*)ctx;
+    const subresource* s = &j->subs[j->index[index]];
+    scratch_arena arena = { 0 };
+    j->success[index] = convert_mipmap(j->t, s->level, (j->layouts == NULL) ? NULL : &j->layouts[s->level],
+        j->sh, j->dst[j->index[index]], &j->t->data[s->g1t_offset], &arena);
+    free_scratch(&arena);
+}
+
+static void extract_texture(void* ctx, uint32_t index)
+{
+    g1t_texture* t = &((g1t_texture*)ctx)[index];
+    uint8_t* payload = NULL;
+    uint8_t** mipmaps = NULL;
+    io_chunk* chunks = NULL;
+    FILE* dst = NULL;
+    subresource* subs = NULL;
+    mipmap_layout* layouts = NULL;
+    subresource_jobs jobs = { 0 };
+
+    // Non ARGB textures require conversion to be applied, since
+    // tools like Visual Studio or PhotoShop can't be bothered
+    // to honour the pixel format from the DDS header and instead
+    // insist on using ARGB always...
+    rgba_shuffle shuffle, *sh = NULL;
+    if (t->format >= DDS_FORMAT_ABGR4 && t->format <= DDS_FORMAT_RGBA8 &&
+        get_rgba_shuffle(&shuffle, t->format, argb_name[t->format], "ARGB"))
+        sh = &shuffle;
+    uint32_t nb_frames = t->nb_frames;
+    if (t->flags[1] & G1T_FLAG_CUBE_MAP)
+        nb_frames *= 6;     // Adjust effective nb_frames for cubemaps
+    const bool transformed = (sh != NULL) || t->flip || t->swizzled;
+    const bool rgba_export = (t->rgba_export != NULL) && can_export(t);
+    if (t->rgba_export != NULL && !rgba_export)
+        fprintf(stderr, "WARNING: Can't decode '%s', so it is kept in its original format\n", t->path);
+    // Exports only need some of the mipmaps
+    uint32_t first_level = 0, nb_levels = t->mipmaps, nb_used_frames = nb_frames;
+    if (rgba_export) {
+        get_export_levels(t, &first_level, &nb_levels);
+        if (t->rgba_export->tga)
+            nb_used_frames = 1;
+    }
+
+    // DDS expects the mipmaps of a texture array or cubemap to immediately follow
+    // the main one, but G1T instead stores all mains, then all L1 mipmaps, then
+    // all L2 mipmaps and so on... Rather than copying the data in DDS order, we
+    // get the location of each mipmap in DDS order: mipmaps that don't need any
+    // transformation are used straight from the G1T data, and the others are
+    // produced into the payload buffer, with each frame and level as its own job.
+    size_t payload_size = 0;
+    for (uint32_t l = first_level; transformed && l < first_level + nb_levels; l++)
+        payload_size += (size_t)MIPMAP_SIZE(t->format, l, t->width, t->height) * nb_used_frames;
+    subs = get_subresources(t->platform, t->format, t->width, t->height, t->mipmaps, t->mipmaps, nb_frames);
+    mipmaps = calloc((size_t)nb_frames * t->mipmaps, sizeof(uint8_t*));
+    chunks = malloc((size_t)nb_frames * t->mipmaps * sizeof(io_chunk));
+    jobs.index = malloc((size_t)nb_frames * t->mipmaps * sizeof(uint32_t));
+    jobs.success = malloc((size_t)nb_frames * t->mipmaps * sizeof(bool));
+    payload = malloc(max(payload_size, 1));
+    if (subs == NULL || mipmaps == NULL || chunks == NULL || jobs.index == NULL ||
+        jobs.success == NULL || payload == NULL) {
+        fprintf(stderr, "ERROR: Can't allocate DDS payload\n");
+        goto out;
+    }
+    if (t->swizzled) {
+        layouts = calloc(t->mipmaps, sizeof(mipmap_layout));
+        if (layouts == NULL || !get_mipmap_layouts(t->platform, t->format, t->width, t->height,
+            t->mipmaps, FOLD_FLIP(t), layouts))
             goto out;
-        if (fread(buf, 1, g1t_size, file) != g1t_size) {
-            fprintf(stderr, "ERROR: Can't read file\n");
+    }
+    uint8_t* p = payload;
+    uint32_t nb_jobs = 0;
+    for (uint32_t f = 0; f < nb_used_frames; f++) {
+        for (uint32_t l = first_level; l < first_level + nb_levels; l++) {
+            const uint32_t i = f * t->mipmaps + l;
+            if (transformed) {
+                mipmaps[i] = p;
+                p += MIPMAP_SIZE(t->format, l, t->width, t->height);
+                jobs.index[nb_jobs++] = i;
+            } else {
+                mipmaps[i] = &t->data[subs[i].g1t_offset];
+            }
+        }
+    }
+    jobs.t = t;
+    jobs.subs = subs;
+    jobs.layouts = layouts;
+    jobs.sh = sh;
+    jobs.dst = mipmaps;
+    run_jobs(extract_subresource, &jobs, nb_jobs, t->nb_threads);
+    for (uint32_t i = 0; i < nb_jobs; i++) {
+        if (!jobs.success[i])
             goto out;
+    }
+
+    if (rgba_export) {
+        t->success = export_texture(t, nb_frames, (const uint8_t* const*)mipmaps);
+        goto out;
+    }
+
+    dst = fopen_utf8(t->path, "wb");
+    if (dst == NULL) {
+        fprintf(stderr, "ERROR: Can't create file '%s'\n", t->path);
+        goto out;
+    }
+    uint32_t dds_magic = DDS_MAGIC;
+    if (fwrite(&dds_magic, sizeof(dds_magic), 1, dst) != 1) {
+        fprintf(stderr, "ERROR: Can't write magic\n");
+        goto out;
+    }
+    if (write_dds_header(dst, t->format, t->width, t->height, t->mipmaps, t->flags) != 1) {
+        fprintf(stderr, "ERROR: Can't write DDS header\n");
+        goto out;
+    }
+    uint32_t nb_chunks = 0;
+    for (uint32_t i = 0; i < nb_frames * t->mipmaps; i++) {
+        uint32_t mipmap_size = MIPMAP_SIZE(t->format, i % t->mipmaps, t->width, t->height);
+        // Coalesce with the previous chunk if contiguous
+        if (nb_chunks > 0 && (const uint8_t*)chunks[nb_chunks - 1].data +
+            chunks[nb_chunks - 1].size == mipmaps[i]) {
+            chunks[nb_chunks - 1].size += mipmap_size;
+        } else {
+            chunks[nb_chunks].data = mipmaps[i];
+            chunks[nb_chunks++].size = mipmap_size;
         }
+    }
+    if (!write_chunks(dst, chunks, nb_chunks)) {
+        fprintf(stderr, "ERROR: Can't write DDS data\n");
+        goto out;
+    }
+    t->success = true;
+
+out:
+    free(chunks);
+    free(mipmaps);
+    free(payload);
+    free(subs);
+    free(jobs.index);
+    free(jobs.success);
+    free_mipmap_layouts(layouts, t->mipmaps);
+    if (dst != NULL)
+        fclose(dst);
+}
 
-        g1t_header* hdr = (g1t_header*)buf;
-        fix_endian32(hdr, sizeof(g1t_header) / sizeof(uint32_t));
-        if (hdr->total_size != g1t_size) {
-            fprintf(stderr, "ERROR: File size mismatch\n");
+static void store_subresource(void* ctx, uint32_t index)
+{
+    subresource_jobs* j = (subresource_jobs*)ctx;
+    const subresource* s = &j->subs[index];
+    const g1t_texture* t = j->t;
+    const uint32_t mipmap_size = MIPMAP_SIZE(t->format, s->level, t->width, t->height);
+    uint8_t* mipmap = &j->dds[s->dds_offset];
+    scratch_arena arena = { 0 };
+    if (t->flip)
+        flip(dds_bpp(t->format), mipmap, mipmap, mipmap_size, max(1, t->width >> s->level));
+    if (j->layouts != NULL) {
+        j->success[index] = swizzle_mipmap(t->platform, t->format, t->width, t->height, s->level,
+            &j->layouts[s->level], &t->data[s->g1t_offset], mipmap, &arena, false);
+    } else {
+        memcpy(&t->data[s->g1t_offset], mipmap, mipmap_size);
+        j->success[index] = true;
+    }
+    free_scratch(&arena);
+}
+
+// Size of the data of a texture in G1T layout
+static uint32_t get_stored_size(const g1t_texture* t)
+{
+    uint32_t size = 0;
+    for (uint32_t l = 0; l < t->mipmaps; l++)
+        size += t->nb_frames * get_stored_mipmap_size(t->platform, t->format, l, t->width, t->height);
+    return size;
+}
+
+// Convert the data of a texture to G1T layout, from the payload of a DDS that has
+// dds_mipmaps levels per frame, which gets altered if the texture is flipped. dst
+// must hold get_stored_size() bytes and be zeroed, for the padding. Each frame and
+// level is converted as its own job.
+static bool store_texture(const g1t_texture* t, uint8_t* dds, uint32_t dds_mipmaps,
+                          uint8_t* dst, uint32_t nb_threads)
+{
+    bool r = false;
+    mipmap_layout* layouts = NULL;
+    subresource_jobs jobs = { 0 };
+    g1t_texture st = *t;
+    const uint32_t nb_subs = t->nb_frames * t->mipmaps;
+
+    jobs.subs = get_subresources(t->platform, t->format, t->width, t->height, t->mipmaps,
+        dds_mipmaps, t->nb_frames);
+    jobs.success = calloc(max(nb_subs, 1), sizeof(bool));
+    if (jobs.subs == NULL || jobs.success == NULL) {
+        fprintf(stderr, "ERROR: Can't allocate texture data\n");
+        goto out;
+    }
+    if (t->swizzled) {
+        layouts = calloc(t->mipmaps, sizeof(mipmap_layout));
+        if (layouts == NULL || !get_mipmap_layouts(t->platform, t->format, t->width, t->height,
+            t->mipmaps, false, layouts))
             goto out;
+    }
+    st.data = dst;
+    jobs.t = &st;
+    jobs.layouts = layouts;
+    jobs.dds = dds;
+    run_jobs(store_subresource, &jobs, nb_subs, nb_threads);
+    for (uint32_t i = 0; i < nb_subs; i++) {
+        if (!jobs.success[i])
+            goto out;
+    }
+    r = true;
+
+out:
+    free((void*)jobs.subs);
+    free(jobs.success);
+    free_mipmap_layouts(layouts, t->mipmaps);
+    return r;
+}
+
+// Fill the header of the uncompressed 32-bit ARGB DDS that a TGA image converts to,
+// from the first 18 bytes of the TGA
+static bool get_tga_header(const uint8_t* tga, uint32_t size, const char* path, DDS_HEADER* header,
+                           job_log* log)
+{
+    if (size < 18) {
+        log_printf(log, stderr, "ERROR: '%s' is too small\n", path);
+        return false;
+    }
+    const uint32_t width = getle16(&tga[12]), height = getle16(&tga[14]);
+    if ((tga[1] != 0) || (tga[2] != 2 && tga[2] != 10) || (tga[16] != 24 && tga[16] != 32) ||
+        (width == 0) || (height == 0)) {
+        log_printf(log, stderr, "ERROR: '%s' is not a TGA image we support\n", path);
+        return false;
+    }
+    memset(header, 0, sizeof(DDS_HEADER));
+    header->size = 124;
+    header->flags = DDS_HEADER_FLAGS_TEXTURE;
+    header->width = width;
+    header->height = height;
+    header->mipMapCount = 1;
+    header->ddspf.size = 32;
+    header->ddspf.flags = DDS_RGBA;
+    header->ddspf.RGBBitCount = 32;
+    header->ddspf.RBitMask = 0x00ff0000;
+    header->ddspf.GBitMask = 0x0000ff00;
+    header->ddspf.BBitMask = 0x000000ff;
+    header->ddspf.ABitMask = 0xff000000;
+    header->caps = DDS_SURFACE_FLAGS_TEXTURE;
+    return true;
+}
+
+// Read a TGA image as an uncompressed 32-bit ARGB DDS, so that it can be imported
+// the same way as a DDS file.
+static uint32_t read_tga(const char* path, uint8_t** buf)
+{
+    uint8_t* tga = NULL;
+    DDS_HEADER dds_header;
+    uint32_t size = read_file(path, &tga), r = UINT32_MAX;
+    if (size == UINT32_MAX)
+        return UINT32_MAX;
+    *buf = NULL;
+    if (!get_tga_header(tga, size, path, &dds_header, NULL))
+        goto out;
+    const uint32_t width = dds_header.width, height = dds_header.height;
+    const uint32_t bytes_per_pixel = tga[16] / 8;
+    const bool rle = (tga[2] == 10), top_down = (tga[17] & 0x20), right_left = (tga[17] & 0x10);
+
+    const uint32_t dds_size = sizeof(uint32_t) + sizeof(DDS_HEADER) + width * height * 4;
+    *buf = calloc(dds_size, 1);
+    if (*buf == NULL) {
+        fprintf(stderr, "ERROR: Can't allocate DDS data\n");
+        goto out;
+    }
+    setle32(*buf, DDS_MAGIC);
+    memcpy(&(*buf)[sizeof(uint32_t)], &dds_header, sizeof(DDS_HEADER));
+
+    // TGA pixels are stored as B, G, R[, A], which is also the DDS ARGB order
+    uint8_t* payload = &(*buf)[sizeof(uint32_t) + sizeof(DDS_HEADER)];
+    uint32_t pos = 18 + tga[0];
+    uint8_t pixel[4] = { 0, 0, 0, 0xff };
+    for (uint32_t i = 0; i < width * height; ) {
+        // RLE packets are either a pixel repeated count times or count raw pixels
+        uint32_t count = 1;
+        bool repeat = false;
+        if (rle) {
+            if (pos >= size)
+                goto truncated;
+            repeat = (tga[pos] & 0x80);
+            count = (tga[pos++] & 0x7f) + 1;
+        }
+        for (uint32_t j = 0; j < count && i < width * height; j++, i++) {
+            if (j == 0 || !repeat) {
+                if (pos + bytes_per_pixel > size)
+                    goto truncated;
+                memcpy(pixel, &tga[pos], bytes_per_pixel);
+                pos += bytes_per_pixel;
+            }
+            uint32_t x = i % width, y = i / width;
+            if (right_left)
+                x = width - 1 - x;
+            if (!top_down)
+                y = height - 1 - y;
+            memcpy(&payload[((size_t)y * width + x) * 4], pixel, 4);
         }
-        char version_string[5] = { 0 };
-        setbe32(version_string, hdr->version);
-        version_string[4] = 0;
-        if (hdr->version >> 16 != 0x3030 && hdr->version >> 16 != 0x3031)
-            fprintf(stderr, "WARNING: Potentially unsupported G1T version %s\n", version_string);
-        int version = atoi(version_string);
-        if (version == 0 || version > 10000) {
-            fprintf(stderr, "ERROR: Unexpected G1T version %s\n", version_string);
+    }
+    r = dds_size;
+    goto out;
+
+truncated:
+    fprintf(stderr, "ERROR: '%s' is truncated\n", path);
+
+out:
+    free(tga);
+    if (r == UINT32_MAX) {
+        free(*buf);
+        *buf = NULL;
+    }
+    return r;
+}
+
+// Check whether a DDS holds 32-bit uncompressed pixels that we can compress
+static bool is_uncompressed_dds(const DDS_HEADER* header)
+{
+    return (header->ddspf.RGBBitCount == 32) && (header->ddspf.RBitMask != 0) &&
+        ((header->ddspf.flags & DDS_RGB) || (header->ddspf.fourCC == get_fourCC(DDS_FORMAT_DX10)));
+}
+
+// Check whether we can generate the mipmaps that a DDS is missing for format
+static bool can_generate_mipmaps(enum DDS_FORMAT format, const DDS_HEADER* header)
+{
+    if (format >= DDS_FORMAT_ABGR8 && format <= DDS_FORMAT_RGBA8)
+        return is_uncompressed_dds(header);
+    return bcn_can_encode(format) && bcn_can_decode(format) && (header->ddspf.flags & DDS_FOURCC);
+}
+
+// The conversion of a DDS into one with all the mipmaps of a texture, with a job per
+// frame for the top level, and a job per frame and mipmap for the output.
+typedef struct {
+    enum DDS_FORMAT format;     // Format of the source mipmaps, or of the output if compressing
+    bool compress;              // Whether the 32-bit source mipmaps get compressed to format
+    const uint8_t* src;
+    uint32_t src_mipmaps;
+    uint32_t src_frame_size;
+    uint8_t* dst;
+    uint32_t mipmaps;
+    uint32_t dst_frame_size;
+    uint32_t width;
+    uint32_t height;
+    uint32_t masks[4];
+    uint32_t shifts[4];
+    uint8_t** top;              // Top level of each frame, as RGBA
+    mip_filter filter;
+    bool srgb;
+    bool high_quality;
+    uint32_t nb_threads;        // Threads for each compression job
+    bool* success;
+} mipmap_builder;
+
+// Convert between the 32-bit pixels of the source DDS and RGBA
+static void unpack_pixels(const mipmap_builder* b, const uint8_t* src, uint8_t* rgba, uint32_t nb_pixels)
+{
+    for (uint32_t i = 0; i < nb_pixels; i++, src += 4) {
+        const uint32_t p = getle32(src);
+        for (uint32_t c = 0; c < 4; c++)
+            rgba[4 * i + c] = (b->masks[c] == 0) ? 0xff : (uint8_t)((p & b->masks[c]) >> b->shifts[c]);
+    }
+}
+
+static void pack_pixels(const mipmap_builder* b, const uint8_t* rgba, uint8_t* dst, uint32_t nb_pixels)
+{
+    for (uint32_t i = 0; i < nb_pixels; i++, dst += 4) {
+        uint32_t p = 0;
+        for (uint32_t c = 0; c < 4; c++)
+            p |= ((uint32_t)rgba[4 * i + c] << b->shifts[c]) & b->masks[c];
+        setle32(dst, p);
+    }
+}
+
+static void get_top_mipmap(void* ctx, uint32_t f)
+{
+    mipmap_builder* b = (mipmap_builder*)ctx;
+    const uint8_t* src = &b->src[(size_t)f * b->src_frame_size];
+    if (!b->compress && b->format >= DDS_FORMAT_DXT1)
+        bcn_decode(b->format, src, b->width, b->height, b->top[f], false);
+    else
+        unpack_pixels(b, src, b->top[f], b->width * b->height);
+}
+
+static void build_mipmap(void* ctx, uint32_t index)
+{
+    mipmap_builder* b = (mipmap_builder*)ctx;
+    const uint32_t f = index / b->mipmaps, l = index % b->mipmaps;
+    const uint32_t w = max(1, b->width >> l), h = max(1, b->height >> l);
+    const enum DDS_FORMAT src_format = b->compress ? DDS_FORMAT_ARGB8 : b->format;
+    uint32_t src_offset = f * b->src_frame_size, dst_offset = f * b->dst_frame_size;
+    for (uint32_t i = 0; i < l; i++) {
+        src_offset += MIPMAP_SIZE(src_format, i, b->width, b->height);
+        dst_offset += MIPMAP_SIZE(b->format, i, b->width, b->height);
+    }
+    uint8_t* dst = &b->dst[dst_offset];
+
+    // Mipmaps we have and don't need to convert are copied as is
+    if (l < b->src_mipmaps && !b->compress) {
+        memcpy(dst, &b->src[src_offset], MIPMAP_SIZE(b->format, l, b->width, b->height));
+        b->success[index] = true;
+        return;
+    }
+    uint8_t* rgba = (l == 0) ? b->top[f] : malloc((size_t)w * h * 4);
+    if (rgba == NULL) {
+        fprintf(stderr, "ERROR: Can't allocate mipmap\n");
+        return;
+    }
+    if (l >= b->src_mipmaps) {
+        if (!resample(b->top[f], b->width, b->height, rgba, w, h, b->filter, b->srgb))
+            goto out;
+    } else if (l != 0) {
+        unpack_pixels(b, &b->src[src_offset], rgba, w * h);
+    }
+    if (b->format >= DDS_FORMAT_DXT1)
+        bcn_encode(b->format, rgba, w, h, dst, b->high_quality, b->nb_threads);
+    else
+        pack_pixels(b, rgba, dst, w * h);
+    b->success[index] = true;
+
+out:
+    if (l != 0)
+        free(rgba);
+}
+// Fill buf with the DDS header, followed by its DX10 header if needed, that build_dds()
+// produces from header, which must itself be followed by its DX10 header if it has one.
+// Returns the size of the headers, or 0 on error.
+static uint32_t get_built_dds_header(uint8_t* buf, const DDS_HEADER* header, enum DDS_FORMAT format,
+                                     uint64_t* flags, uint32_t mipmaps)
+{
+    if (mipmaps == 0)
+        mipmaps = max(1, header->mipMapCount);
+    if (bcn_can_encode(format) && is_uncompressed_dds(header))
+        return (uint32_t)get_dds_header(buf, format, header->width, header->height, mipmaps, flags);
+    // Keep the original header, unless we change the format
+    uint32_t header_size = sizeof(DDS_HEADER);
+    if (header->ddspf.fourCC == get_fourCC(DDS_FORMAT_DX10))
+        header_size += sizeof(DDS_HEADER_DXT10);
+    memcpy(buf, header, header_size);
+    DDS_HEADER* new_header = (DDS_HEADER*)buf;
+    new_header->mipMapCount = mipmaps;
+    if (mipmaps > 1) {
+        new_header->flags |= DDS_HEADER_FLAGS_MIPMAP;
+        new_header->caps |= DDS_SURFACE_FLAGS_MIPMAP;
+    }
+    return header_size;
+}
+
+// Convert a DDS so that it has the requested number of mipmaps, which are generated from
+// its top level when missing, compressing it to format if it is 32-bit uncompressed.
+// On success, *buf is replaced with the new DDS.
+static uint32_t build_dds(uint8_t** buf, uint32_t size, enum DDS_FORMAT format, uint64_t* flags,
+                          uint32_t nb_frames, uint32_t mipmaps, mip_filter filter, bool high_quality,
+                          uint32_t nb_threads)
+{
+    uint32_t r = UINT32_MAX;
+    uint8_t* dds = NULL;
+    const DDS_HEADER* header = (const DDS_HEADER*)&(*buf)[sizeof(uint32_t)];
+    uint32_t offset = sizeof(uint32_t) + sizeof(DDS_HEADER);
+    if (header->ddspf.fourCC == get_fourCC(DDS_FORMAT_DX10))
+        offset += sizeof(DDS_HEADER_DXT10);
+    mipmap_builder b = { 0 };
+    b.compress = bcn_can_encode(format) && is_uncompressed_dds(header);
+    b.format = (b.compress || format >= DDS_FORMAT_DXT1) ? format : DDS_FORMAT_ARGB8;
+    b.width = header->width;
+    b.height = header->height;
+    b.src_mipmaps = max(1, header->mipMapCount);
+    b.mipmaps = (mipmaps == 0) ? b.src_mipmaps : mipmaps;
+    b.filter = filter;
+    b.srgb = is_srgb(format, flags[0]);
+    b.high_quality = high_quality;
+    if (header->caps & DDS_SURFACE_FLAGS_CUBEMAP && header->caps2 & DDS_CUBEMAP_ALLFACES)
+        nb_frames *= 6;
+    const uint32_t nb_jobs = nb_frames * b.mipmaps;
+    b.nb_threads = max(1, nb_threads / nb_jobs);
+
+    const uint32_t masks[4] = { header->ddspf.RBitMask, header->ddspf.GBitMask,
+        header->ddspf.BBitMask, header->ddspf.ABitMask };
+    for (uint32_t c = 0; c < 4; c++) {
+        b.masks[c] = masks[c];
+        b.shifts[c] = (masks[c] == 0) ? 0 : find_lsb(masks[c]);
+    }
+    for (uint32_t l = 0; l < b.src_mipmaps; l++)
+        b.src_frame_size += MIPMAP_SIZE(b.compress ? DDS_FORMAT_ARGB8 : b.format, l, b.width, b.height);
+    for (uint32_t l = 0; l < b.mipmaps; l++)
+        b.dst_frame_size += MIPMAP_SIZE(b.format, l, b.width, b.height);
+    if ((size < offset) || ((size - offset) / nb_frames < b.src_frame_size)) {
+        fprintf(stderr, "ERROR: DDS is too small\n");
+        return UINT32_MAX;
+    }
+    b.src = &(*buf)[offset];
+
+    uint8_t header_buf[sizeof(DDS_HEADER) + sizeof(DDS_HEADER_DXT10)];
+    const uint32_t header_size = get_built_dds_header(header_buf, header, format, flags, b.mipmaps);
+    if (header_size == 0)
+        return UINT32_MAX;
+    const uint32_t dds_size = sizeof(uint32_t) + header_size + nb_frames * b.dst_frame_size;
+    dds = malloc(dds_size);
+    b.top = calloc(nb_frames, sizeof(uint8_t*));
+    b.success = calloc(nb_jobs, sizeof(bool));
+    if (dds == NULL || b.top == NULL || b.success == NULL) {
+        fprintf(stderr, "ERROR: Can't allocate DDS data\n");
+        goto out;
+    }
+    for (uint32_t f = 0; f < nb_frames; f++) {
+        b.top[f] = malloc((size_t)b.width * b.height * 4);
+        if (b.top[f] == NULL) {
+            fprintf(stderr, "ERROR: Can't allocate DDS data\n");
             goto out;
         }
-        if (hdr->extra_size % sizeof(uint32_t)) {
-            fprintf(stderr, "ERROR: Can't handle G1T files with global extra data that's not a multiple of %d\n",
-                (int)sizeof(uint32_t));
+    }
+    setle32(dds, DDS_MAGIC);
+    memcpy(&dds[sizeof(uint32_t)], header_buf, header_size);
+    b.dst = &dds[sizeof(uint32_t) + header_size];
+
+    // All the frames and levels are independent, once we have the top levels
+    run_jobs(get_top_mipmap, &b, nb_frames, nb_threads);
+    run_jobs(build_mipmap, &b, nb_jobs, nb_threads);
+    for (uint32_t i = 0; i < nb_jobs; i++) {
+        if (!b.success[i])
             goto out;
+    }
+    free(*buf);
+    *buf = dds;
+    dds = NULL;
+    r = dds_size;
+
+out:
+    free(dds);
+    for (uint32_t f = 0; b.top != NULL && f < nb_frames; f++)
+        free(b.top[f]);
+    free(b.top);
+    free(b.success);
+    return r;
+}
+
+// Cache of the converted textures from the last time an archive was recreated, so
+// that the ones that haven't changed can be copied as is. It consists of a header
+// followed, for each texture, by its key, sizes and the data we wrote for it.
+#define G1T_CACHE_NAME          "g1t.cache"
+#define G1T_CACHE_MAGIC         0x43543147        // 'G1TC'
+#define G1T_CACHE_VERSION       1
+
+typedef struct {
+    uint64_t key;               // Hash of the source image and of its JSON settings
+    uint32_t size;              // Size of the texture header, extended data and payload
+    uint32_t mipmaps;           // Number of mipmaps, for the texture listing
+    const uint8_t* data;
+} cache_entry;
+
+typedef struct {
+    uint8_t* buf;
+    uint32_t nb_entries;
+    cache_entry* entries;
+} texture_cache;
+
+// Load a texture cache. A cache that is missing or invalid is just empty.
+static void load_cache(texture_cache* c, const char* path, job_log* log)
+{
+    memset(c, 0, sizeof(*c));
+    if (!is_file(path))
+        return;
+    uint32_t size = read_file(path, &c->buf);
+    if (size == UINT32_MAX || size < 3 * sizeof(uint32_t) || getle32(c->buf) != G1T_CACHE_MAGIC ||
+        getle32(&c->buf[4]) != G1T_CACHE_VERSION)
+        goto invalid;
+    const uint32_t nb_entries = getle32(&c->buf[8]);
+    c->entries = calloc(nb_entries, sizeof(cache_entry));
+    if (c->entries == NULL)
+        goto invalid;
+    for (uint32_t pos = 3 * sizeof(uint32_t); c->nb_entries < nb_entries; c->nb_entries++) {
+        cache_entry* e = &c->entries[c->nb_entries];
+        if (size - pos < 16)
+            goto invalid;
+        // Entries are only 4-byte aligned
+        e->key = getle32(&c->buf[pos]) | (uint64_t)getle32(&c->buf[pos + 4]) << 32;
+        e->size = getle32(&c->buf[pos + 8]);
+        e->mipmaps = getle32(&c->buf[pos + 12]);
+        pos += 16;
+        if (size - pos < e->size)
+            goto invalid;
+        e->data = &c->buf[pos];
+        pos += e->size;
+    }
+    return;
+
+invalid:
+    log_printf(log, stderr, "WARNING: Ignoring invalid texture cache '%s'\n", path);
+    free(c->buf);
+    free(c->entries);
+    memset(c, 0, sizeof(*c));
+}
+
+static const cache_entry* find_cache_entry(const texture_cache* c, uint64_t key)
+{
+    for (uint32_t i = 0; i < c->nb_entries; i++)
+        if (c->entries[i].key == key)
+            return &c->entries[i];
+    return NULL;
+}
+
+static void free_cache(texture_cache* c)
+{
+    free(c->buf);
+    free(c->entries);
+}
+
+// Save a texture cache, from the data of the nb_textures we just wrote
+static bool save_cache(const char* path, uint32_t nb_textures, const uint64_t* keys,
+                       const uint32_t* mipmaps, const uint8_t* data, const uint32_t* offsets,
+                       uint32_t data_size)
+{
+    bool r = false;
+    uint8_t* headers = malloc(3 * sizeof(uint32_t) + (size_t)nb_textures * 16);
+    io_chunk* chunks = malloc((2 * (size_t)nb_textures + 1) * sizeof(io_chunk));
+    FILE* file = NULL;
+    if (headers == NULL || chunks == NULL)
+        goto out;
+    setle32(headers, G1T_CACHE_MAGIC);
+    setle32(&headers[4], G1T_CACHE_VERSION);
+    setle32(&headers[8], nb_textures);
+    chunks[0].data = headers;
+    chunks[0].size = 3 * sizeof(uint32_t);
+    for (uint32_t i = 0; i < nb_textures; i++) {
+        uint8_t* h = &headers[3 * sizeof(uint32_t) + i * 16];
+        const uint32_t end = (i + 1 < nb_textures) ? offsets[i + 1] : data_size;
+        setle32(h, (uint32_t)keys[i]);
+        setle32(&h[4], (uint32_t)(keys[i] >> 32));
+        setle32(&h[8], end - offsets[i]);
+        setle32(&h[12], mipmaps[i]);
+        chunks[2 * i + 1].data = h;
+        chunks[2 * i + 1].size = 16;
+        chunks[2 * i + 2].data = &data[offsets[i]];
+        chunks[2 * i + 2].size = end - offsets[i];
+    }
+    file = fopen_utf8(path, "wb");
+    r = (file != NULL) && write_chunks(file, chunks, 2 * nb_textures + 1);
+
+out:
+    if (!r)
+        fprintf(stderr, "WARNING: Can't save texture cache '%s'\n", path);
+    if (file != NULL)
+        fclose(file);
+    free(headers);
+    free(chunks);
+    return r;
+}
+
+// Print the listing line of a texture that is being added to an archive
+static void print_texture(const char* path, uint8_t type, uint32_t offset, uint32_t size,
+                          const DDS_HEADER* dds_header, uint32_t mipmaps, uint32_t nb_frames, float depth,
+                          endianness endian, job_log* log)
+{
+    char dims[16] = { 0 }, props[8] = { 0 };
+    snprintf(dims, sizeof(dims), "%dx%d", dds_header->width, dds_header->height);
+    if (nb_frames > 1)
+        strcat(props, "A");     // Array
+    if (endian == big_endian)
+        strcat(props, "B");
+    if (dds_header->caps & DDS_SURFACE_FLAGS_CUBEMAP && dds_header->caps2 & DDS_CUBEMAP_ALLFACES)
+        strcat(props, "C");     // Cubemap
+    if (depth != 0.0f)
+        strcat(props, "D");
+    if (props[0] == 0)
+        props[0] = '-';
+    log_printf(log, stdout, "0x%02x 0x%08x 0x%08x %s %-10s %-7d %s\n", type, offset, size, path, dims, mipmaps, props);
+}
+
+// Everything we need to write a texture when recreating a G1T archive. This is planned
+// from g1t.json and from the header of the source image alone, so that the offsets of
+// all the textures are known before any of them gets converted.
+typedef struct {
+    g1t_texture t;              // Source image path and G1T layout of the texture
+    uint8_t header[sizeof(g1t_tex_header) + 5 * sizeof(uint32_t)];  // Texture header and extended data
+    uint32_t header_size;
+    uint32_t offset;            // Offset of the texture in the archive
+    uint32_t size;              // Size of the texture, including its header
+    uint32_t nb_frames;         // Number of frames, not counting the faces of cubemaps
+    uint32_t mipmaps;           // Number of mipmaps for build_dds()
+    bool build;                 // Whether the source image must go through build_dds()
+    uint64_t seed;              // Cache key seed, from the JSON settings of the texture
+    uint64_t key;               // Cache key, once the source image has been read
+} texture_plan;
+
+typedef struct {
+    texture_plan* plans;
+    const texture_cache* cache;
+    FILE* file;
+    uint8_t* data;              // Used instead of file, when recreating an archive in memory
+    mip_filter filter;
+    bool high_quality;
+} repack_jobs;
+
+static bool write_archive_data(const repack_jobs* j, const void* buf, uint32_t size, uint32_t offset)
+{
+    if (j->data == NULL)
+        return write_at(j->file, buf, size, offset);
+    memcpy(&j->data[offset], buf, size);
+    return true;
+}
+
+// Read, convert and write a planned texture
+static void write_texture(void* ctx, uint32_t index)
+{
+    repack_jobs* j = (repack_jobs*)ctx;
+    texture_plan* p = &j->plans[index];
+    g1t_texture* t = &p->t;
+    uint8_t *buf = NULL, *data = NULL;
+
+    const char* ext = strrchr(t->path, '.');
+    uint32_t size = (ext != NULL && stricmp(ext, ".tga") == 0) ?
+        read_tga(t->path, &buf) : read_file(t->path, &buf);
+    if (size == UINT32_MAX)
+        goto out;
+    // Textures that haven't changed since the last time are copied from the cache
+    p->key = hash64(buf, size, p->seed);
+    const cache_entry* cached = find_cache_entry(j->cache, p->key);
+    if (cached != NULL && cached->size == p->size) {
+        t->success = write_archive_data(j, cached->data, cached->size, p->offset);
+        goto write_check;
+    }
+    if (p->build) {
+        size = build_dds(&buf, size, t->format, t->flags, p->nb_frames, p->mipmaps, j->filter,
+            j->high_quality, t->nb_threads);
+        if (size == UINT32_MAX)
+            goto out;
+    }
+    const DDS_HEADER* dds_header = (const DDS_HEADER*)&buf[sizeof(uint32_t)];
+    uint32_t offset = sizeof(uint32_t) + sizeof(DDS_HEADER), payload_size = 0;
+    if (size >= offset && dds_header->ddspf.fourCC == get_fourCC(DDS_FORMAT_DX10))
+        offset += sizeof(DDS_HEADER_DXT10);
+    for (uint32_t l = 0; l < t->mipmaps; l++)
+        payload_size += MIPMAP_SIZE(t->format, l, t->width, t->height);
+    payload_size *= t->nb_frames;
+    // The source may have been altered since we planned the archive
+    if (size < offset || size - offset < payload_size || getle32(buf) != DDS_MAGIC ||
+        dds_header->width != t->width || dds_header->height != t->height) {
+        fprintf(stderr, "ERROR: '%s' was modified while the archive was being created\n", t->path);
+        goto out;
+    }
+    uint8_t* payload = &buf[offset];
+    if (t->format >= DDS_FORMAT_ABGR4 && t->format <= DDS_FORMAT_RGBA8)
+        rgba_convert(t->format, "ARGB", argb_name[t->format], payload, payload_size);
+
+    // Inverse operation from the one we carry when extracting DDS
+    data = calloc(p->size, 1);
+    if (data == NULL) {
+        fprintf(stderr, "ERROR: Can't allocate texture data\n");
+        goto out;
+    }
+    memcpy(data, p->header, p->header_size);
+    if (!store_texture(t, payload, max(t->mipmaps, dds_header->mipMapCount), &data[p->header_size],
+        t->nb_threads))
+        goto out;
+    t->success = write_archive_data(j, data, p->size, p->offset);
+
+write_check:
+    if (!t->success)
+        fprintf(stderr, "ERROR: Can't write texture data\n");
+
+out:
+    free(buf);
+    free(data);
+}
+
+// Options that apply to the extraction of a G1T archive
+typedef struct {
+    bool list_only;
+    bool flip_image;
+    uint32_t nb_threads;
+    const export_options* rgba_export;
+} extract_options;
+
+// Options that apply to the recreation of a G1T archive
+typedef struct {
+    bool flip_image;
+    bool high_quality;
+    bool use_cache;
+    mip_filter filter;
+    uint32_t nb_threads;
+} repack_options;
+
+// A G1T archive being recreated, once its layout has been planned and its tables
+// written, and until its textures have been written
+typedef struct {
+    FILE* file;
+    uint8_t* data;              // Set by the caller for an archive recreated in memory
+    bool in_memory;
+    job_log* log;               // Set by the caller to keep the output, rather than print it
+    uint32_t header_size;
+    uint32_t total_size;
+    uint32_t nb_textures;
+    texture_plan* plans;
+    uint32_t* offset_table;
+    uint32_t* mipmaps_table;
+    texture_cache cache;
+    char cache_path[256];       // Empty if the cache isn't used
+    repack_jobs jobs;
+} g1t_repack;
+
+// A G1T archive being extracted, once its tables have been parsed, and until its
+// textures have been converted
+typedef struct {
+    uint8_t* buf;               // Mapped archive, if it was read from a file
+    uint32_t size;
+    g1t_texture* textures;
+    uint32_t nb_textures;
+    JSON_Value* json;
+    char json_path[256];
+    job_log* log;               // Set by the caller to keep the output, rather than print it
+} g1t_extraction;
+
+// Same as _basename(), for a path that doesn't end with a separator, but safe to call
+// from different threads, since it doesn't use a static buffer
+static const char* get_name(const char* path)
+{
+    return &path[get_trailing_slash(path)];
+}
+
+static bool has_g1t_extension(const char* path, job_log* log)
+{
+    size_t len = strlen(path);
+    if ((len < 4) || (path[len - 4] != '.') || (path[len - 3] != 'g') ||
+        ((path[len - 2] != '1') && (path[len - 2] != 't')) ||
+        ((path[len - 1] != '1') && (path[len - 1] != 't')) ) {
+        log_printf(log, stderr, "ERROR: File should have a '.g1t' or 'gt1' extension\n");
+        return false;
+    }
+    return true;
+}
+
+// Parse a G1T archive and set up the conversion of its textures, which is left for
+// the caller to run, before calling end_extraction() in all cases. The textures are
+// extracted into a directory bearing the same name as the archive (g1t_path is altered
+// to get it). buf, which is also altered, must hold the whole archive, unless we are
+// listing, in which case it only needs the tables, as the rest is read from file.
+// The caller remains the owner of buf.
+static int parse_g1t(uint8_t* buf, uint32_t g1t_size, FILE* file, char* g1t_path,
+    const extract_options* opts, g1t_extraction* x)
+{
+    int r = -1;
+    char path[256], *dir = NULL;
+    JSON_Value* json = NULL;
+    g1t_texture* textures = NULL;
+    job_log* log = x->log;
+    endianness endian = little_endian;
+    uint32_t magic;
+
+    if (g1t_size < sizeof(g1t_header)) {
+        log_printf(log, stderr, "ERROR: Not a G1T file (too small)\n");
+        goto out;
+    }
+    memcpy(&magic, buf, sizeof(magic));
+    if ((magic != G1TG_MAGIC) && (magic != bswap_uint32(G1TG_MAGIC))) {
+        log_printf(log, stderr, "ERROR: Not a G1T file (bad magic) or unsupported platform\n");
+        goto out;
+    }
+    if (magic == bswap_uint32(G1TG_MAGIC))
+        endian = !platform_endianness;
+    g1t_header* hdr = (g1t_header*)buf;
+    fix_endian32_e(hdr, sizeof(g1t_header) / sizeof(uint32_t), endian);
+    if (hdr->total_size != g1t_size) {
+        log_printf(log, stderr, "ERROR: File size mismatch\n");
+        goto out;
+    }
+    char* g1t_pos = &g1t_path[strlen(g1t_path) - 4];
+
+    char version_string[5] = { 0 };
+    setbe32(version_string, hdr->version);
+    version_string[4] = 0;
+    if (hdr->version >> 16 != 0x3030 && hdr->version >> 16 != 0x3031)
+        log_printf(log, stderr, "WARNING: Potentially unsupported G1T version %s\n", version_string);
+    int version = atoi(version_string);
+    if (version == 0 || version > 10000) {
+        log_printf(log, stderr, "ERROR: Unexpected G1T version %s\n", version_string);
+        goto out;
+    }
+    if (hdr->extra_size % sizeof(uint32_t)) {
+        log_printf(log, stderr, "ERROR: Can't handle G1T files with global extra data that's not a multiple of %d\n",
+            (int)sizeof(uint32_t));
+        goto out;
+    }
+    if (hdr->extra_size > 0xFFFF) {
+        log_printf(log, stderr, "ERROR: Can't handle G1T files with more than 64 KB of global extra data\n");
+        goto out;
+    }
+
+    uint32_t* x_offset_table = (uint32_t*)&buf[hdr->header_size];
+
+    // Keep the information required to recreate the archive in a JSON file
+    json = json_value_init_object();
+    json_object_set_number(json_object(json), "json_version", JSON_VERSION);
+    json_object_set_string(json_object(json), "name", get_name(g1t_path));
+    json_object_set_number(json_object(json), "version", version);
+    if (platform_to_name(hdr->platform) != NULL)
+        json_object_set_string(json_object(json), "platform", platform_to_name(hdr->platform));
+    else
+        json_object_set_number(json_object(json), "platform", hdr->platform);
+    if (opts->flip_image)
+        json_object_set_boolean(json_object(json), "flip", true);
+
+    g1t_pos[0] = 0;
+    if (!opts->list_only && !create_path(g1t_path))
+        goto out;
+
+    JSON_Value* json_extra_data_array = json_value_init_array();
+    JSON_Value* json_textures_array = json_value_init_array();
+
+    for (uint16_t i = 0; i < hdr->extra_size; i += sizeof(uint16_t))
+        json_array_append_number(json_array(json_extra_data_array),
+            getp16_e(&buf[hdr->header_size + hdr->nb_textures * sizeof(uint32_t) + i], endian));
+
+    log_printf(log, stdout, "TYPE OFFSET     SIZE       NAME%*s     DIMENSIONS MIPMAPS PROPS\n",
+        (int)strlen(get_name(g1t_path)), "");
+    dir = strdup(g1t_path);
+    if (dir == NULL) {
+        log_printf(log, stderr, "ERROR: Alloc error\n");
+        goto out;
+    }
+    dir[get_trailing_slash(dir)] = 0;
+
+    // Set the default RGBA texture format for the platform
+    uint32_t default_texture_format;
+    switch (hdr->platform) {
+    case NINTENDO_DS:
+    case NINTENDO_3DS:
+    case SONY_PS4:
+        default_texture_format = DDS_FORMAT_GRAB8;
+        break;
+    case SONY_PSV:
+    case NINTENDO_SWITCH:
+        default_texture_format = DDS_FORMAT_ARGB8;
+        break;
+    default:    // PC and other platforms
+        default_texture_format = DDS_FORMAT_RGBA8;
+        break;
+    }
+
+    textures = calloc(hdr->nb_textures, sizeof(g1t_texture));
+    if (textures == NULL) {
+        log_printf(log, stderr, "ERROR: Alloc error\n");
+        goto out;
+    }
+    uint32_t i;
+    for (i = 0; i < hdr->nb_textures; i++) {
+        uint32_t nb_frames = 0, pos = hdr->header_size + getv32_e(x_offset_table[i], endian);
+        uint8_t tex_buf[sizeof(g1t_tex_header) + 0x14] = { 0 }, *tex_data = tex_buf;
+        if (!opts->list_only) {
+            tex_data = &buf[pos];
+        } else if (pos >= g1t_size || fseek(file, pos, SEEK_SET) != 0 ||
+            fread(tex_buf, 1, min(sizeof(tex_buf), g1t_size - pos), file) == 0) {
+            log_printf(log, stderr, "ERROR: Can't read texture header\n");
+            break;
+        }
+        g1t_tex_header* tex = (g1t_tex_header*)tex_data;
+        float depth = 0.0f;
+        if (endian == big_endian) {
+            uint8_t swap_tmp = tex->dx;
+            tex->dx = tex->dy;
+            tex->dy = swap_tmp;
+            swap_tmp = tex->z_mipmaps;
+            tex->z_mipmaps = tex->mipmaps;
+            tex->mipmaps = swap_tmp;
+        } else {
+            for (size_t j = 0; j < array_size(tex->flags); j++)
+                tex->flags[j] = tex->flags[j] >> 4 | tex->flags[j] << 4;
+        }
+        if (tex->mipmaps == 0) {
+            log_printf(log, stderr, "ERROR: Number of mipmaps is 0\n");
+            log_printf(log, stderr, "Please report this error to %s.\n", REPORT_URL);
+            break;
+        }
+        // We're going to assume that the global flags (the ones after the G1T global header)
+        // never see a value higher than 0x00ffffff, so that we can concatenate all the main
+        // texture flags together. We're also going to assume that the 4 bytes in the extra
+        // data (after the extra data size and the depth) are additionnal flags in big-endian.
+        uint64_t flags[2] = { 0 };
+        flags[0] = (uint64_t)getp32_e(&buf[(uint32_t)sizeof(g1t_header) + 4 * i], endian);
+        if (flags[0] & 0xff000000ULL) {
+            log_printf(log, stderr, "ERROR: Global flags 0x%08x don't match our assertion\n", (uint32_t)flags[0]);
+            log_printf(log, stderr, "Please report this error to %s.\n", REPORT_URL);
+            break;
+        }
+        for (size_t j = 0; j < array_size(tex->flags); j++)
+            flags[0] = flags[0] << 8 | (uint64_t)tex->flags[j];
+        pos += sizeof(g1t_tex_header);
+        const uint8_t* extended_data = &tex_data[sizeof(g1t_tex_header)];
+        uint32_t width = 1 << tex->dx;
+        uint32_t height = 1 << tex->dy;
+        uint32_t data_size = (flags[0] & G1T_FLAG_EXTENDED_DATA) ? getp32_e(extended_data, endian) : 0;
+        if (data_size != 0 && data_size != 0x0c && data_size != 0x10 && data_size != 0x14) {
+            log_printf(log, stderr, "ERROR: Extra flags size of 0x%x doesn't match our assertion\n", data_size);
+            log_printf(log, stderr, "Please report this error to %s.\n", REPORT_URL);
+            break;
         }
-        if (hdr->extra_size > 0xFFFF) {
-            fprintf(stderr, "ERROR: Can't handle G1T files with more than 64 KB of global extra data\n");
+        // Extra flags, including the number of frames, may be provided
+        if (data_size >= 0x0c) {
+            uint32_t _depth = getp32_e(&extended_data[4], endian);
+            depth = *((float*)&_depth);
+            flags[1] = getbe32(&extended_data[8]);
+            nb_frames = GET_NB_FRAMES(flags[1]);
+        }
+        if (nb_frames == 0)
+            nb_frames = 1;
+        // Non power-of-two width and height may be provided in the data
+        if (data_size >= 0x10)
+            width = getp32_e(&extended_data[0x0c], endian);
+        if (data_size >= 0x14)
+            height = getp32_e(&extended_data[0x10], endian);
+
+        JSON_Value* json_texture = json_value_init_object();
+        snprintf(path, sizeof(path), "%03d.dds", i);
+        json_object_set_string(json_object(json_texture), "name", path);
+        json_object_set_number(json_object(json_texture), "type", tex->type);
+        if (tex->mipmaps != 1)
+            json_object_set_number(json_object(json_texture), "mipmaps", tex->mipmaps);
+        if (tex->z_mipmaps != 0)
+            json_object_set_number(json_object(json_texture), "z_mipmaps", tex->z_mipmaps);
+        if (nb_frames > 1)
+            json_object_set_number(json_object(json_texture), "nb_frames", nb_frames);
+        if (depth != 0.0f) {
+            char depth_str[16];
+            snprintf(depth_str, sizeof(depth_str), "%f", depth);
+            json_object_set_string(json_object(json_texture), "depth", depth_str);
+        }
+        uint32_t texture_format = default_texture_format;
+        bool swizzled = false;
+        switch (tex->type) {
+        case 0x00: break;
+        case 0x01: break;
+        case 0x02: break;
+        case 0x03: texture_format = DDS_FORMAT_ARGB16; break;
+        case 0x04: texture_format = DDS_FORMAT_ARGB32; break;
+        case 0x06: texture_format = DDS_FORMAT_DXT1; break;
+//        case 0x07: texture_format = DDS_FORMAT_DXT3; break;
+        case 0x08: texture_format = DDS_FORMAT_DXT5; break;
+        case 0x09: swizzled = true; break;
+//        case 0x0A: swizzled = true; break;
+        case 0x10: texture_format = DDS_FORMAT_DXT1; swizzled = true; break;
+        case 0x12: texture_format = DDS_FORMAT_DXT5; swizzled = true; break;
+        case 0x21: break;
+        case 0x3C: texture_format = DDS_FORMAT_ARGB4; break;
+        case 0x3D: texture_format = DDS_FORMAT_ARGB4; break;
+        case 0x45: texture_format = DDS_FORMAT_BGR8; swizzled = true; break;
+        case 0x59: texture_format = DDS_FORMAT_DXT1; break;
+        case 0x5B: texture_format = DDS_FORMAT_DXT5; break;
+        case 0x5C: texture_format = DDS_FORMAT_BC4; break;
+//        case 0x5D: texture_format = DDS_FORMAT_ATI1; break;
+        case 0x5E: texture_format = DDS_FORMAT_BC6H; break;
+        case 0x5F: texture_format = DDS_FORMAT_BC7; break;
+        case 0x60: texture_format = DDS_FORMAT_DXT1; swizzled = true; break;
+        case 0x62: texture_format = DDS_FORMAT_DXT5; swizzled = true; break;
+//        case 0x63: texture_format = DDS_FORMAT_BC4; swizzled = true; break;
+//        case 0x64: texture_format = DDS_FORMAT_BC5; swizzled = true; break;
+//        case 0x65: texture_format = DDS_FORMAT_BC6; swizzled = true; break;
+//        case 0x66: texture_format = DDS_FORMAT_BC7; swizzled = true; break;
+        // 0x72 is not actually BC7, but that's the closest we get to semi-recognizable output
+        case 0x72: texture_format = DDS_FORMAT_BC7; break;
+        default:
+            log_printf(log, stderr, "ERROR: Unsupported texture type (0x%02X)\n", tex->type);
+            log_printf(log, stderr, "Please visit: https://github.com/VitaSmith/gust_tools/issues/51\n");
             goto out;
         }
+        uint32_t expected_texture_size = 0;
+        for (int j = 0; j < tex->mipmaps; j++)
+            expected_texture_size += nb_frames * get_stored_mipmap_size(hdr->platform, texture_format, j, width, height);
+        uint32_t texture_size = ((i + 1 == hdr->nb_textures) ?
+            g1t_size - hdr->header_size : getv32_e(x_offset_table[i + 1], endian)) -
+            getv32_e(x_offset_table[i], endian);
+        texture_size -= (uint32_t)sizeof(g1t_tex_header);
+        if (flags[0] & G1T_FLAG_EXTENDED_DATA) {
+            assert(pos + data_size < g1t_size);
+            if ((data_size != 0x0c) && (data_size != 0x10) && (data_size != 0x14)) {
+                log_printf(log, stderr, "ERROR: Can't handle local extra_data of size 0x%08x\n", data_size);
+                break;
+            }
+            pos += data_size;
+            texture_size -= data_size;
+        }
+        if (texture_size < expected_texture_size) {
+            log_printf(log, stderr, "ERROR: Actual texture size is smaller than expected size\n");
+            break;
+        } else if (texture_size > expected_texture_size) {
+            if (texture_size % expected_texture_size != 0) {
+                log_printf(log, stderr, "WARNING: Actual texture size is larger than expected size by 0x%x\n",
+                    texture_size - expected_texture_size);
+            } else if (texture_size / expected_texture_size == 6) {
+                // A cubemap is composed of one texture for each face
+                flags[1] |= G1T_FLAG_CUBE_MAP;
+            } else {
+                log_printf(log, stderr, "ERROR: Texture array with a factor of %d doesn't match our assertion\n",
+                    texture_size / expected_texture_size);
+                log_printf(log, stderr, "Please report this error to %s.\n", REPORT_URL);
+                break;
+            }
+            expected_texture_size = texture_size;
+        }
+        json_object_set_value(json_object(json_texture), "flags", flags_to_json(flags));
+
+        snprintf(path, sizeof(path), "%s%s%c%03d.dds", dir, get_name(g1t_path), PATH_SEP, i);
+        char dims[16] = { 0 }, props[8] = { 0 };
+        snprintf(dims, sizeof(dims), "%dx%d", width, height);
+        if (flags[1] & G1T_FLAG_TEXTURE_ARRAY)
+            strcat(props, "A");
+        if (endian == big_endian)
+            strcat(props, "B");
+        if (flags[1] & G1T_FLAG_CUBE_MAP)
+            strcat(props, "C");
+        if (depth != 0)
+            strcat(props, "D");
+        if (props[0] == 0)
+            props[0] = '-';
+        log_printf(log, stdout, "0x%02x 0x%08x 0x%08x %s %-10s %-7d %s\n", tex->type,
+            hdr->header_size + hdr->extra_size + getv32_e(x_offset_table[i], endian),
+            texture_size, &path[strlen(dir)], dims, tex->mipmaps, props);
+        if (opts->list_only) {
+            json_value_free(json_texture);
+            continue;
+        }
+        json_array_append_value(json_array(json_textures_array), json_texture);
+        g1t_texture* t = &textures[i];
+        strcpy(t->path, path);
+        t->data = &buf[pos];
+        t->platform = hdr->platform;
+        t->format = texture_format;
+        t->width = width;
+        t->height = height;
+        t->mipmaps = tex->mipmaps;
+        t->nb_frames = nb_frames;
+        t->size = expected_texture_size;
+        t->flags[0] = flags[0];
+        t->flags[1] = flags[1];
+        t->swizzled = swizzled;
+        t->flip = opts->flip_image || ((hdr->platform == NINTENDO_3DS) && (tex->type == 0x09 || tex->type == 0x45));
+        t->rgba_export = opts->rgba_export;
+        // Threads that aren't needed for the textures themselves go to their subresources
+        t->nb_threads = max(1, opts->nb_threads / hdr->nb_textures);
+    }
+    r = (i == hdr->nb_textures) ? 0 : -1;
+    x->size = g1t_size;
+    if (r == 0 && !opts->list_only) {
+        x->textures = textures;
+        x->nb_textures = hdr->nb_textures;
+        textures = NULL;
+    }
 
-        uint32_t* x_offset_table = (uint32_t*)&buf[hdr->header_size];
+    json_object_set_value(json_object(json), "textures", json_textures_array);
+    if (hdr->extra_size)
+        json_object_set_value(json_object(json), "extra_data", json_extra_data_array);
+    else
+        json_value_free(json_extra_data_array);
+    if (!opts->list_only) {
+        snprintf(x->json_path, sizeof(x->json_path), "%s%cg1t.json", g1t_path, PATH_SEP);
+        x->json = json;
+        json = NULL;
+    }
 
-        // Keep the information required to recreate the archive in a JSON file
-        json = json_value_init_object();
-        json_object_set_number(json_object(json), "json_version", JSON_VERSION);
-        json_object_set_string(json_object(json), "name", _basename(argv[argc - 1]));
-        json_object_set_number(json_object(json), "version", version);
-        if (platform_to_name(hdr->platform) != NULL)
-            json_object_set_string(json_object(json), "platform", platform_to_name(hdr->platform));
-        else
-            json_object_set_number(json_object(json), "platform", hdr->platform);
-        if (flip_image)
-            json_object_set_boolean(json_object(json), "flip", true);
+out:
+    json_value_free(json);
+    free(dir);
+    free(textures);
+    return r;
+}
 
-        g1t_pos[0] = 0;
-        if (!list_only && !create_path(argv[argc - 1]))
-            goto out;
+// Write the JSON of an archive once its textures have been converted, and release it
+static int end_extraction(g1t_extraction* x)
+{
+    int r = 0;
+    for (uint32_t i = 0; i < x->nb_textures; i++) {
+        if (!x->textures[i].success)
+            r = -1;
+    }
+    if (x->json != NULL)
+        json_serialize_to_file_pretty(x->json, x->json_path);
+    json_value_free(x->json);
+    unmap_file(x->buf, x->size);
+    free(x->textures);
+    memset(x, 0, sizeof(*x));
+    return r;
+}
 
-        JSON_Value* json_extra_data_array = json_value_init_array();
-        JSON_Value* json_textures_array = json_value_init_array();
+int extract_g1t_buffer(uint8_t* buf, uint32_t size, const char* g1t_path, uint32_t nb_threads)
+{
+    const extract_options opts = { false, false, nb_threads, NULL };
+    g1t_extraction x = { 0 };
+    char path[256];
+
+    printf("Extracting '%s'...\n", g1t_path);
+    if (!has_g1t_extension(g1t_path, NULL))
+        return -1;
+    snprintf(path, sizeof(path), "%s", g1t_path);
+    int r = parse_g1t(buf, size, NULL, path, &opts, &x);
+    run_jobs(extract_texture, x.textures, x.nb_textures, nb_threads);
+    if (end_extraction(&x) != 0)
+        r = -1;
+    return r;
+}
+
+// Plan the recreation of a G1T archive from a directory, and write its tables, leaving
+// the textures for the caller to write, before calling end_repack() in all cases.
+// If rp->in_memory is set, the archive goes to a buffer that the caller takes from
+// rp->data, rather than to the file named in the JSON.
+static int begin_repack(const char* dir_path, const repack_options* opts, g1t_repack* rp)
+{
+    int r = -1;
+    const bool in_memory = rp->in_memory;
+    FILE* file = NULL;
+    uint8_t *buf = NULL, *tables = NULL, *data = NULL;
+    uint32_t *offset_table = NULL, *flag_table = NULL, *mipmaps_table = NULL;
+    texture_plan* plans = NULL;
+    char path[256], *dir = NULL;
+    JSON_Value* json = NULL;
+    bool flip_image = opts->flip_image;
+    job_log* log = rp->log;
+    endianness endian = little_endian;
+
+    snprintf(path, sizeof(path), "%s%cg1t.json", dir_path, PATH_SEP);
+    if (!is_file(path)) {
+        log_printf(log, stderr, "ERROR: '%s' does not exist\n", path);
+        goto out;
+    }
+    json = json_parse_file_with_comments(path);
+    if (json == NULL) {
+        log_printf(log, stderr, "ERROR: Can't parse JSON data from '%s'\n", path);
+        goto out;
+    }
+    const uint32_t json_version = json_object_get_uint32(json_object(json), "json_version");
+    if (json_version != JSON_VERSION) {
+        log_printf(log, stderr, "ERROR: This utility is not compatible with the JSON file provided.\n"
+            "You need to (re)extract the '.g1t' using this application.\n");
+        goto out;
+    }
+    const char* filename = json_object_get_string(json_object(json), "name");
+    uint32_t version = json_object_get_uint32(json_object(json), "version");
+    if ((filename == NULL) || (version == 0) || (version > 10000))
+        goto out;
+    JSON_Array* json_textures_array = json_object_get_array(json_object(json), "textures");
+    if (json_textures_array == NULL) {
+        log_printf(log, stderr, "ERROR: Invalid or missing JSON texture array\n");
+        goto out;
+    }
+    JSON_Array* json_extra_data_array = json_object_get_array(json_object(json), "extra_data");
 
-        for (uint16_t i = 0; i < hdr->extra_size; i += sizeof(uint16_t))
-            json_array_append_number(json_array(json_extra_data_array),
-                getp16(&buf[hdr->header_size + hdr->nb_textures * sizeof(uint32_t) + i]));
+    if (opts->use_cache) {
+        snprintf(rp->cache_path, sizeof(rp->cache_path), "%s%c%s", dir_path, PATH_SEP, G1T_CACHE_NAME);
+        load_cache(&rp->cache, rp->cache_path, log);
+    }
 
-        printf("TYPE OFFSET     SIZE       NAME");
-        for (size_t i = 0; i < strlen(_basename(argv[argc - 1])); i++)
-            putchar(' ');
-        printf("     DIMENSIONS MIPMAPS PROPS\n");
-        dir = strdup(argv[argc - 1]);
-        if (dir == NULL) {
-            fprintf(stderr, "ERROR: Alloc error\n");
+    strcpy(path, dir_path);
+    if (get_trailing_slash(path) != 0)
+        path[get_trailing_slash(path)] = 0;
+    else
+        path[0] = 0;
+    strcat(path, filename);
+    path[sizeof(path) - 1] = 0;
+    if (!in_memory) {
+        log_printf(log, stdout, "Creating '%s'...\n", path);
+        create_backup_log(path, log);
+        file = fopen_utf8(path, "wb+");
+        if (file == NULL) {
+            log_printf(log, stderr, "ERROR: Can't create file '%s'\n", path);
             goto out;
         }
-        dir[get_trailing_slash(dir)] = 0;
+    }
+    g1t_header hdr = { 0 };
+    if (name_to_platform(json_object_get_string(json_object(json), "platform")) == UINT32_MAX)
+        hdr.platform = json_object_get_uint32(json_object(json), "platform");
+    else
+        hdr.platform = name_to_platform(json_object_get_string(json_object(json), "platform"));
+    if (hdr.platform == SONY_PS3 || hdr.platform == NINTENDO_WII || hdr.platform == NINTENDO_WIIU)
+        endian = big_endian;
+    hdr.magic = G1TG_MAGIC;
+    char version_string[6] = { 0 };
+    snprintf(version_string, sizeof(version_string), "%04d", version);
+    hdr.version = getbe32(version_string);
+    hdr.nb_textures = (uint32_t)json_array_get_count(json_textures_array);
+    hdr.extra_size = (uint32_t)json_array_get_count(json_extra_data_array) * sizeof(uint16_t);
+    hdr.header_size = sizeof(hdr) + hdr.nb_textures * sizeof(uint32_t);
+
+    if (!flip_image)
+        flip_image = json_object_get_boolean(json_object(json), "flip");
+
+    flag_table = calloc(hdr.nb_textures, sizeof(uint32_t));
+    offset_table = calloc(hdr.nb_textures, sizeof(uint32_t));
+    mipmaps_table = calloc(hdr.nb_textures, sizeof(uint32_t));
+    plans = calloc(hdr.nb_textures, sizeof(texture_plan));
+    if (flag_table == NULL || offset_table == NULL || mipmaps_table == NULL || plans == NULL) {
+        log_printf(log, stderr, "ERROR: Alloc error\n");
+        goto out;
+    }
 
-        // Set the default RGBA texture format for the platform
+    dir = strdup(dir_path);
+    if (dir == NULL) {
+        log_printf(log, stderr, "ERROR: Alloc error\n");
+        goto out;
+    }
+    dir[get_trailing_slash(dir)] = 0;
+    log_printf(log, stdout, "TYPE OFFSET     SIZE       NAME%*s     DIMENSIONS MIPMAPS PROPS\n",
+        (int)strlen(get_name(dir_path)), "");
+    // Anything that alters the conversion of the textures must be part of the cache keys
+    const uint32_t cache_settings[4] = { hdr.platform, flip_image, opts->high_quality, opts->filter };
+    const uint64_t cache_seed = hash64(cache_settings, sizeof(cache_settings), G1T_CACHE_VERSION);
+    // Plan the layout of the archive from the headers of the source images, so that
+    // the textures can then be converted and written in parallel
+    uint32_t texture_offset = hdr.header_size + hdr.nb_textures * sizeof(uint32_t) + hdr.extra_size;
+    for (uint32_t i = 0; i < hdr.nb_textures; i++) {
+        texture_plan* p = &plans[i];
+        JSON_Object* texture_entry = json_array_get_object(json_textures_array, i);
+        g1t_tex_header tex = { 0 };
+        tex.type = json_object_get_uint8(texture_entry, "type");
+        tex.z_mipmaps = json_object_get_uint8(texture_entry, "z_mipmaps");
+        const char* depth_str = json_object_get_string(texture_entry, "depth");
+        float depth = (depth_str == NULL) ? 0.0f : (float)atof(depth_str);
+        uint64_t* flags = p->t.flags;
+        json_to_flags(flags, json_object_get_array(texture_entry, "flags"));
+        for (size_t j = 0; j < array_size(tex.flags); j++)
+            tex.flags[array_size(tex.flags) - j - 1] = (uint8_t)(flags[0] >> (8 * j));
+        flag_table[i] = (uint32_t)(flags[0] >> 40);
+        uint32_t nb_frames = json_object_get_uint32(texture_entry, "nb_frames");
+        flags[1] |= ((uint64_t)nb_frames & 0x0f) << 28 | ((uint64_t)nb_frames & 0xf0) << 12;
+        if (nb_frames == 0)
+            nb_frames = 1;
+        // Set the default ARGB format for the platform
         uint32_t default_texture_format;
-        switch (hdr->platform) {
+        switch (hdr.platform) {
         case NINTENDO_DS:
         case NINTENDO_3DS:
         case SONY_PS4:
@@ -1136,277 +2640,779 @@ int main_utf8(int argc, char** argv)
             default_texture_format = DDS_FORMAT_RGBA8;
             break;
         }
-
-        uint32_t i;
-        for (i = 0; i < hdr->nb_textures; i++) {
-            uint32_t nb_frames = 0, pos = hdr->header_size + getv32(x_offset_table[i]);
-            g1t_tex_header* tex = (g1t_tex_header*)&buf[pos];
-            float depth = 0.0f;
-            if (data_endianness == big_endian) {
-                uint8_t swap_tmp = tex->dx;
-                tex->dx = tex->dy;
-                tex->dy = swap_tmp;
-                swap_tmp = tex->z_mipmaps;
-                tex->z_mipmaps = tex->mipmaps;
-                tex->mipmaps = swap_tmp;
-            } else {
-                for (size_t j = 0; j < array_size(tex->flags); j++)
-                    tex->flags[j] = tex->flags[j] >> 4 | tex->flags[j] << 4;
-            }
-            if (tex->mipmaps == 0) {
-                fprintf(stderr, "ERROR: Number of mipmaps is 0\n");
-                fprintf(stderr, "Please report this error to %s.\n", REPORT_URL);
-                break;
-            }
-            // We're going to assume that the global flags (the ones after the G1T global header)
-            // never see a value higher than 0x00ffffff, so that we can concatenate all the main
-            // texture flags together. We're also going to assume that the 4 bytes in the extra
-            // data (after the extra data size and the depth) are additionnal flags in big-endian.
-            uint64_t flags[2] = { 0 };
-            flags[0] = (uint64_t)getp32(&buf[(uint32_t)sizeof(g1t_header) + 4 * i]);
-            if (flags[0] & 0xff000000ULL) {
-                fprintf(stderr, "ERROR: Global flags 0x%08x don't match our assertion\n", (uint32_t)flags[0]);
-                fprintf(stderr, "Please report this error to %s.\n", REPORT_URL);
-                break;
-            }
-            for (size_t j = 0; j < array_size(tex->flags); j++)
-                flags[0] = flags[0] << 8 | (uint64_t)tex->flags[j];
-            pos += sizeof(g1t_tex_header);
-            uint32_t width = 1 << tex->dx;
-            uint32_t height = 1 << tex->dy;
-            uint32_t data_size = (flags[0] & G1T_FLAG_EXTENDED_DATA) ? getp32(&buf[pos]) : 0;
-            if (data_size != 0 && data_size != 0x0c && data_size != 0x10 && data_size != 0x14) {
-                fprintf(stderr, "ERROR: Extra flags size of 0x%x doesn't match our assertion\n", data_size);
-                fprintf(stderr, "Please report this error to %s.\n", REPORT_URL);
-                break;
-            }
-            // Extra flags, including the number of frames, may be provided
-            if (data_size >= 0x0c) {
-                uint32_t _depth = getp32(&buf[pos + 4]);
-                depth = *((float*)&_depth);
-                flags[1] = getbe32(&buf[pos + 8]);
-                nb_frames = GET_NB_FRAMES(flags[1]);
-            }
-            if (nb_frames == 0)
-                nb_frames = 1;
-            // Non power-of-two width and height may be provided in the data
-            if (data_size >= 0x10)
-                width = getp32(&buf[pos + 0x0c]);
-            if (data_size >= 0x14)
-                height = getp32(&buf[pos + 0x10]);
-
-            JSON_Value* json_texture = json_value_init_object();
-            snprintf(path, sizeof(path), "%03d.dds", i);
-            json_object_set_string(json_object(json_texture), "name", path);
-            json_object_set_number(json_object(json_texture), "type", tex->type);
-            if (tex->mipmaps != 1)
-                json_object_set_number(json_object(json_texture), "mipmaps", tex->mipmaps);
-            if (tex->z_mipmaps != 0)
-                json_object_set_number(json_object(json_texture), "z_mipmaps", tex->z_mipmaps);
-            if (nb_frames > 1)
-                json_object_set_number(json_object(json_texture), "nb_frames", nb_frames);
-            if (depth != 0.0f) {
-                char depth_str[16];
-                snprintf(depth_str, sizeof(depth_str), "%f", depth);
-                json_object_set_string(json_object(json_texture), "depth", depth_str);
-            }
-            uint32_t texture_format = default_texture_format;
-            bool swizzled = false;
-            switch (tex->type) {
-            case 0x00: break;
-            case 0x01: break;
-            case 0x02: break;
-            case 0x03: texture_format = DDS_FORMAT_ARGB16; break;
-            case 0x04: texture_format = DDS_FORMAT_ARGB32; break;
-            case 0x06: texture_format = DDS_FORMAT_DXT1; break;
-//            case 0x07: texture_format = DDS_FORMAT_DXT3; break;
-            case 0x08: texture_format = DDS_FORMAT_DXT5; break;
-            case 0x09: swizzled = true; break;
+        uint32_t texture_format = default_texture_format;
+        bool swizzled = false;
+        switch (tex.type) {
+        case 0x00: break;   // ???
+        case 0x01: break;   // ???
+        case 0x02: break;   // ???
+        case 0x03: texture_format = DDS_FORMAT_ARGB16; break;
+        case 0x04: texture_format = DDS_FORMAT_ARGB32; break;
+        case 0x06: texture_format = DDS_FORMAT_DXT1; break; // PS2??, PS3
+        case 0x07: texture_format = DDS_FORMAT_DXT3; break;
+        case 0x08: texture_format = DDS_FORMAT_DXT5; break; // PS3
+        case 0x09: swizzled = true; break;  // PS4
 //            case 0x0A: swizzled = true; break;
-            case 0x10: texture_format = DDS_FORMAT_DXT1; swizzled = true; break;
-            case 0x12: texture_format = DDS_FORMAT_DXT5; swizzled = true; break;
-            case 0x21: break;
-            case 0x3C: texture_format = DDS_FORMAT_ARGB4; break;
-            case 0x3D: texture_format = DDS_FORMAT_ARGB4; break;
-            case 0x45: texture_format = DDS_FORMAT_BGR8; swizzled = true; break;
-            case 0x59: texture_format = DDS_FORMAT_DXT1; break;
-            case 0x5B: texture_format = DDS_FORMAT_DXT5; break;
-            case 0x5C: texture_format = DDS_FORMAT_BC4; break;
+        case 0x10: texture_format = DDS_FORMAT_DXT1; swizzled = true; break;    // PSV
+        case 0x11: texture_format = DDS_FORMAT_DXT3; swizzled = true; break;    // PSV
+        case 0x12: texture_format = DDS_FORMAT_DXT5; swizzled = true; break;    // PSV
+        case 0x21: break;   // Switch
+        // 0x3C and 0x3D are definitely 16bpp, but after that...
+        case 0x3C: texture_format = DDS_FORMAT_ARGB4; break; // 3DS
+        case 0x3D: texture_format = DDS_FORMAT_ARGB4; break; // 3DS
+        case 0x45: texture_format = DDS_FORMAT_BGR8; swizzled = true; break; // 3DS
+        case 0x59: texture_format = DDS_FORMAT_DXT1; break; // Win
+        case 0x5A: texture_format = DDS_FORMAT_DXT3; break; // Win
+        case 0x5B: texture_format = DDS_FORMAT_DXT5; break; // Win
+        case 0x5C: texture_format = DDS_FORMAT_BC4; break;  // Win
 //            case 0x5D: texture_format = DDS_FORMAT_ATI1; break;
-            case 0x5E: texture_format = DDS_FORMAT_BC6H; break;
-            case 0x5F: texture_format = DDS_FORMAT_BC7; break;
-            case 0x60: texture_format = DDS_FORMAT_DXT1; swizzled = true; break;
-            case 0x62: texture_format = DDS_FORMAT_DXT5; swizzled = true; break;
-//            case 0x63: texture_format = DDS_FORMAT_BC4; swizzled = true; break;
-//            case 0x64: texture_format = DDS_FORMAT_BC5; swizzled = true; break;
-//            case 0x65: texture_format = DDS_FORMAT_BC6; swizzled = true; break;
-//            case 0x66: texture_format = DDS_FORMAT_BC7; swizzled = true; break;
-            // 0x72 is not actually BC7, but that's the closest we get to semi-recognizable output
-            case 0x72: texture_format = DDS_FORMAT_BC7; break;
-            default:
-                fprintf(stderr, "ERROR: Unsupported texture type (0x%02X)\n", tex->type);
-                fprintf(stderr, "Please visit: https://github.com/VitaSmith/gust_tools/issues/51\n");
+        case 0x5E: texture_format = DDS_FORMAT_BC6H; break; // Win
+        case 0x5F: texture_format = DDS_FORMAT_BC7; break;  // Win
+        case 0x60: texture_format = DDS_FORMAT_DXT1; swizzled = true; break;    // PS4
+        case 0x61: texture_format = DDS_FORMAT_DXT3; swizzled = true; break;    // PS4
+        case 0x62: texture_format = DDS_FORMAT_DXT5; swizzled = true; break;    // PS4
+//        case 0x63: texture_format = DDS_FORMAT_BC4; swizzled = true; break;
+//        case 0x64: texture_format = DDS_FORMAT_BC5; swizzled = true; break;
+//        case 0x65: texture_format = DDS_FORMAT_BC6; swizzled = true; break;
+//        case 0x66: texture_format = DDS_FORMAT_BC7; swizzled = true; break;
+        case 0x72: texture_format = DDS_FORMAT_BC7; break;   // Win
+        default:
+            log_printf(log, stderr, "ERROR: Unsupported texture type 0x%02x\n", tex.type);
+            goto out;
+        }
+
+        // Read the header of the DDS file
+        snprintf(p->t.path, sizeof(p->t.path), "%s%s%c%s", dir, get_name(dir_path), PATH_SEP,
+            json_object_get_string(texture_entry, "name"));
+        strcpy(path, p->t.path);
+        // A TGA may be provided instead of the DDS
+        char* ext = strrchr(path, '.');
+        if (!is_file(path) && ext != NULL && strlen(ext) == 4) {
+            char dds_ext[5];
+            strcpy(dds_ext, ext);
+            strcpy(ext, ".tga");
+            if (!is_file(path))
+                strcpy(ext, dds_ext);
+        }
+        strcpy(p->t.path, path);
+        uint32_t src_header[(sizeof(DDS_HEADER) + sizeof(DDS_HEADER_DXT10)) / sizeof(uint32_t)] = { 0 };
+        uint32_t texture_size, header_size;
+        if (ext != NULL && stricmp(ext, ".tga") == 0) {
+            header_size = read_file_max(path, &buf, 18);
+            if (header_size == UINT32_MAX || !get_tga_header(buf, header_size, path, (DDS_HEADER*)src_header, log))
+                goto out;
+            texture_size = (uint32_t)(sizeof(uint32_t) + sizeof(DDS_HEADER) +
+                ((DDS_HEADER*)src_header)->width * ((DDS_HEADER*)src_header)->height * 4);
+        } else {
+            header_size = read_file_max(path, &buf, sizeof(uint32_t) + sizeof(src_header));
+            if (header_size == UINT32_MAX)
+                goto out;
+            texture_size = (uint32_t)get_file_size(path);
+            if (header_size < sizeof(uint32_t) + sizeof(DDS_HEADER)) {
+                log_printf(log, stderr, "ERROR: '%s' is too small\n", path);
                 goto out;
             }
-            uint32_t expected_texture_size = 0;
-            uint32_t min_mipmap_size = dds_bpb(texture_format);
-            if (hdr->platform == NINTENDO_WIIU)
-                min_mipmap_size = 0x40 * dds_bpb(texture_format);
-            for (int j = 0; j < tex->mipmaps; j++)
-                expected_texture_size += nb_frames * max(MIPMAP_SIZE(texture_format, j, width, height), min_mipmap_size);
-            uint32_t texture_size = ((i + 1 == hdr->nb_textures) ?
-                g1t_size - hdr->header_size : getv32(x_offset_table[i + 1])) - getv32(x_offset_table[i]);
-            texture_size -= (uint32_t)sizeof(g1t_tex_header);
-            if (flags[0] & G1T_FLAG_EXTENDED_DATA) {
-                assert(pos + data_size < g1t_size);
-                if ((data_size != 0x0c) && (data_size != 0x10) && (data_size != 0x14)) {
-                    fprintf(stderr, "ERROR: Can't handle local extra_data of size 0x%08x\n", data_size);
-                    break;
-                }
-                pos += data_size;
-                texture_size -= data_size;
-            }
-            if (texture_size < expected_texture_size) {
-                fprintf(stderr, "ERROR: Actual texture size is smaller than expected size\n");
-                break;
-            } else if (texture_size > expected_texture_size) {
-                if (texture_size % expected_texture_size != 0) {
-                    fprintf(stderr, "WARNING: Actual texture size is larger than expected size by 0x%x\n",
-                        texture_size - expected_texture_size);
-                } else if (texture_size / expected_texture_size == 6) {
-                    // A cubemap is composed of one texture for each face
-                    flags[1] |= G1T_FLAG_CUBE_MAP;
-                } else {
-                    fprintf(stderr, "ERROR: Texture array with a factor of %d doesn't match our assertion\n",
-                        texture_size / expected_texture_size);
-                    fprintf(stderr, "Please report this error to %s.\n", REPORT_URL);
-                    break;
-                }
-                expected_texture_size = texture_size;
-            }
-            json_object_set_value(json_object(json_texture), "flags", flags_to_json(flags));
-
-            snprintf(path, sizeof(path), "%s%s%c%03d.dds", dir, _basename(argv[argc - 1]), PATH_SEP, i);
-            char dims[16] = { 0 }, props[8] = { 0 };
-            snprintf(dims, sizeof(dims), "%dx%d", width, height);
-            if (flags[1] & G1T_FLAG_TEXTURE_ARRAY)
-                strcat(props, "A");
-            if (data_endianness == big_endian)
-                strcat(props, "B");
-            if (flags[1] & G1T_FLAG_CUBE_MAP)
-                strcat(props, "C");
-            if (depth != 0)
-                strcat(props, "D");
-            if (props[0] == 0)
-                props[0] = '-';
-            printf("0x%02x 0x%08x 0x%08x %s %-10s %-7d %s\n", tex->type,
-                hdr->header_size + hdr->extra_size + getv32(x_offset_table[i]),
-                texture_size, &path[strlen(dir)], dims, tex->mipmaps, props);
-            if (list_only) {
-                json_value_free(json_texture);
-                continue;
-            }
-            FILE* dst = fopen_utf8(path, "wb");
-            if (dst == NULL) {
-                fprintf(stderr, "ERROR: Can't create file '%s'\n", path);
-                break;
-            }
-            uint32_t dds_magic = DDS_MAGIC;
-            if (fwrite(&dds_magic, sizeof(dds_magic), 1, dst) != 1) {
-                fprintf(stderr, "ERROR: Can't write magic\n");
-                fclose(dst);
-                r = -1;
-                break;
-            }
-            if (write_dds_header(dst, texture_format, width, height,
-                                 tex->mipmaps, flags) != 1) {
-                fprintf(stderr, "ERROR: Can't write DDS header\n");
-                fclose(dst);
-                break;
+            if (*((uint32_t*)buf) != DDS_MAGIC) {
+                log_printf(log, stderr, "ERROR: '%s' is not a DDS file\n", path);
+                goto out;
             }
+            memcpy(src_header, &buf[sizeof(uint32_t)], header_size - sizeof(uint32_t));
+        }
+        free(buf);
+        buf = NULL;
+        char* entry_string = json_serialize_to_string(json_array_get_value(json_textures_array, i));
+        if (entry_string == NULL) {
+            log_printf(log, stderr, "ERROR: Alloc error\n");
+            goto out;
+        }
+        p->seed = hash64(entry_string, strlen(entry_string), cache_seed);
+        json_free_serialized_string(entry_string);
+        // Uncompressed images are compressed to the format of the texture, and
+        // missing mipmaps are generated when we can
+        const DDS_HEADER* src = (const DDS_HEADER*)src_header;
+        const uint32_t json_mipmaps = json_object_get_uint8(texture_entry, "mipmaps");
+        uint32_t built_header[array_size(src_header)];
+        const DDS_HEADER* dds_header = src;
+        p->build = (bcn_can_encode(texture_format) && is_uncompressed_dds(src)) ||
+            (json_mipmaps > max(1, src->mipMapCount) && can_generate_mipmaps(texture_format, src));
+        if (p->build) {
+            if (get_built_dds_header((uint8_t*)built_header, src, texture_format, flags, json_mipmaps) == 0)
+                goto out;
+            dds_header = (const DDS_HEADER*)built_header;
+            texture_size = 0;
+            for (uint32_t j = 0; j < dds_header->mipMapCount; j++)
+                texture_size += MIPMAP_SIZE(texture_format, j, dds_header->width, dds_header->height);
+            texture_size *= nb_frames;
+            if (src->caps & DDS_SURFACE_FLAGS_CUBEMAP && src->caps2 & DDS_CUBEMAP_ALLFACES)
+                texture_size *= 6;
+        } else {
+            texture_size -= sizeof(uint32_t) + sizeof(DDS_HEADER);
+            // We may have a DXT10 additional header
+            if (dds_header->ddspf.fourCC == get_fourCC(DDS_FORMAT_DX10))
+                texture_size -= sizeof(DDS_HEADER_DXT10);
+        }
+        tex.mipmaps = (uint8_t)json_mipmaps;
+        if (tex.mipmaps == 0) {
+            tex.mipmaps = (uint8_t)dds_header->mipMapCount;
+        } else if ((uint8_t)dds_header->mipMapCount < tex.mipmaps) {
+            log_printf(log, stderr, "WARNING: Number of mipmaps from imported texture is smaller than original\n");
+            tex.mipmaps = (uint8_t)dds_header->mipMapCount;
+        } else if ((uint8_t)dds_header->mipMapCount > tex.mipmaps) {
+            log_printf(log, stderr, "NOTE: Truncating number of mipmaps from %d to %d\n", dds_header->mipMapCount, tex.mipmaps);
+        }
+        // Are both width and height a power of two?
+        // TODO: Also check if height/width are larger than what we can represent with dx/dy
+        bool po2_sizes = is_power_of_2(dds_header->width) && is_power_of_2(dds_header->height);
+        if (!po2_sizes && !(flags[0] & G1T_FLAG_EXTENDED_DATA)) {
+            log_printf(log, stderr, "ERROR: Extended data flag must be set for textures with dimensions that aren't a power of two\n");
+            goto out;
+        }
+        if (po2_sizes) {
+            tex.dx = (uint8_t)find_msb(dds_header->width);
+            tex.dy = (uint8_t)find_msb(dds_header->height);
+        }
+        const uint8_t mipmaps = tex.mipmaps;
+        if (endian == big_endian) {
+            uint8_t swap_tmp = tex.dx;
+            tex.dx = tex.dy;
+            tex.dy = swap_tmp;
+            swap_tmp = tex.z_mipmaps;
+            tex.z_mipmaps = tex.mipmaps;
+            tex.mipmaps = swap_tmp;
+        } else {
+            for (size_t j = 0; j < array_size(tex.flags); j++)
+                tex.flags[j] = tex.flags[j] >> 4 | tex.flags[j] << 4;
+        }
+        memcpy(p->header, &tex, sizeof(tex));
+        p->header_size = sizeof(tex);
+        if (flags[0] & G1T_FLAG_EXTENDED_DATA) {
+            uint32_t data[5], data_size;
+            data[1] = getv32_e(*((uint32_t*)&depth), endian);
+            setbe32(&data[2], (uint32_t)flags[1]);
+            data[3] = getv32_e(dds_header->width, endian);
+            data[4] = getv32_e(dds_header->height, endian);
+            if (!is_power_of_2(dds_header->width) || !is_power_of_2(dds_header->height))
+                data_size = 5;
+            else
+                data_size = 3;
+            data[0] = getv32_e(data_size * sizeof(uint32_t), endian);
+            memcpy(&p->header[p->header_size], data, data_size * sizeof(uint32_t));
+            p->header_size += data_size * sizeof(uint32_t);
+        }
 
-            // Non ARGB textures require conversion to be applied, since
-            // tools like Visual Studio or PhotoShop can't be bothered
-            // to honour the pixel format from the DDS header and instead
-            // insist on using ARGB always...
-            if (texture_format >= DDS_FORMAT_ABGR4 && texture_format <= DDS_FORMAT_RGBA8)
-                rgba_convert(texture_format, argb_name[texture_format], "ARGB", &buf[pos], expected_texture_size);
-            if (swizzled) {
-                int16_t mo = 0;     // Morton order
-                uint32_t wf = 1;    // Width factor
-                uint32_t awf = 1;   // Additional width factor
-                switch (hdr->platform) {
-                case SONY_PS4:
-                case NINTENDO_3DS:
-                    mo = -3;
-                    wf = 2;
-                    break;
-                case NINTENDO_WIIU:
-                    mo = -1;        // Same for all mipmaps
-                    wf = 16 / dds_bpb(texture_format);
-                    awf = 8;
-                    break;
-                default:
-                    mo = -1 * (int16_t)log2(min(width / dds_bwh(texture_format) / wf,
-                        height / dds_bwh(texture_format)));
-                    break;
-                }
-                uint32_t offset = 0;
-                assert(mo != 0);
-                for (int j = 0; j < tex->mipmaps && mo != 0; j++) {
-                    uint32_t mipmap_size = max(MIPMAP_SIZE(texture_format, j, width, height), min_mipmap_size);
-                    uint32_t mw = max(awf * dds_bwh(texture_format), width / (1 << j));
-                    uint32_t mh = max(awf * dds_bwh(texture_format), height / (1 << j));
-                    mortonize(texture_format, mo, mw, mh, &buf[pos + offset], mipmap_size, wf);
-                    if (width / (1 << j) < mw)
-                        tile(texture_format, width / (1 << j), mw, &buf[pos + offset], mipmap_size);
-                    offset += mipmap_size;
-                    if (hdr->platform != NINTENDO_WIIU)
-                        mo += (mo > 0) ? -1 : +1;
-                }
+        uint32_t expected_texture_size = 0;
+        for (int j = 0; j < mipmaps; j++)
+            expected_texture_size += MIPMAP_SIZE(texture_format, j, dds_header->width, dds_header->height);
+        expected_texture_size *= nb_frames;
+        bool cubemap = dds_header->caps & DDS_SURFACE_FLAGS_CUBEMAP && dds_header->caps2 & DDS_CUBEMAP_ALLFACES;
+        if (cubemap) {
+            if ((dds_header->caps2 & DDS_CUBEMAP_ALLFACES) != DDS_CUBEMAP_ALLFACES) {
+                log_printf(log, stderr, "ERROR: Cannot handle cube maps with missing faces\n");
+                goto out;
             }
-            if (flip_image || ((hdr->platform == NINTENDO_3DS) && (tex->type == 0x09 || tex->type == 0x45)))
-                flip(dds_bpp(texture_format), &buf[pos], expected_texture_size, width);
-            // DDS expects the mipmaps of a texture array or cubemap to immediately follow
-            // the main one, but G1T instead stores all mains, then all L1 mipmaps, then
-            // all L2 mipmaps and so on... Thus we need to manually reorder the mipmaps.
-            if (flags[1] & G1T_FLAG_CUBE_MAP)
-                nb_frames *= 6;     // Adjust effective nb_frames for cubemaps
-            for (uint32_t f = 0; f < nb_frames; f++) {
-                for (uint32_t l = 0, offset = 0; l < tex->mipmaps; l++) {
-                    uint32_t mipmap_size = max(MIPMAP_SIZE(texture_format, l, width, height), min_mipmap_size);
-                    offset += f * mipmap_size;
-                    if (fwrite(&buf[pos + offset], MIPMAP_SIZE(texture_format, l, width, height), 1, dst) != 1) {
-                        fprintf(stderr, "ERROR: Can't write DDS data\n");
-                        goto out;
-                    }
-                    offset += (nb_frames - f) * mipmap_size;
-                }
+            expected_texture_size *= 6;
+        }
+        if (expected_texture_size > texture_size) {
+            log_printf(log, stderr, "ERROR: expected_texture_size %8x > %8x\n", expected_texture_size, texture_size);
+            goto out;
+        }
+        if ((texture_size * 8) % dds_bpp(texture_format) != 0) {
+            log_printf(log, stderr, "ERROR: Texture size should be a multiple of %d bits\n", dds_bpp(texture_format));
+            goto out;
+        }
+        // Only display the warning if we aren't truncating mipmaps
+        if (expected_texture_size < texture_size && (uint8_t)dds_header->mipMapCount <= mipmaps)
+            log_printf(log, stderr, "WARNING: Reducing texture size\n");
+
+        switch (dds_header->ddspf.flags & (DDS_ALPHAPIXELS | DDS_FOURCC | DDS_RGB)) {
+        case DDS_RGBA:
+            if ((dds_header->ddspf.RGBBitCount != 16) && (dds_header->ddspf.RGBBitCount != 32) &&
+                (dds_header->ddspf.RGBBitCount != 64) && (dds_header->ddspf.RGBBitCount != 128)) {
+                log_printf(log, stderr, "ERROR: '%s' is not an ARGB texture we support\n", path);
+                goto out;
             }
-            fclose(dst);
-            json_array_append_value(json_array(json_textures_array), json_texture);
+            break;
+        case DDS_RGB:
+            if ((dds_header->ddspf.RGBBitCount != 24) ||
+                (dds_header->ddspf.RBitMask != 0x00ff0000) || (dds_header->ddspf.GBitMask != 0x0000ff00) ||
+                (dds_header->ddspf.BBitMask != 0x000000ff) || (dds_header->ddspf.ABitMask != 0x00000000)) {
+                log_printf(log, stderr, "ERROR: '%s' is not an RGB texture we support\n", path);
+                goto out;
+            }
+        case DDS_FOURCC:
+            break;
+        default:
+            log_printf(log, stderr, "ERROR: '%s' is not a texture we support\n", path);
+            goto out;
         }
-        r = (i == hdr->nb_textures) ? 0 : -1;
 
-        json_object_set_value(json_object(json), "textures", json_textures_array);
-        if (hdr->extra_size)
-            json_object_set_value(json_object(json), "extra_data", json_extra_data_array);
-        else
-            json_value_free(json_extra_data_array);
-        snprintf(path, sizeof(path), "%s%cg1t.json", argv[argc - 1], PATH_SEP);
-        if (!list_only)
-            json_serialize_to_file_pretty(json, path);
+        p->t.platform = hdr.platform;
+        p->t.format = texture_format;
+        p->t.width = dds_header->width;
+        p->t.height = dds_header->height;
+        p->t.mipmaps = mipmaps;
+        p->t.nb_frames = cubemap ? nb_frames * 6 : nb_frames;
+        p->t.swizzled = swizzled;
+        p->t.flip = flip_image ||
+            ((hdr.platform == NINTENDO_3DS) && (tex.type == 0x09 || tex.type == 0x45));
+        p->t.nb_threads = max(1, opts->nb_threads / hdr.nb_textures);
+        p->nb_frames = nb_frames;
+        p->mipmaps = json_mipmaps;
+        p->offset = texture_offset;
+        p->t.size = get_stored_size(&p->t);
+        p->size = p->header_size + p->t.size;
+        offset_table[i] = texture_offset - hdr.header_size;
+        mipmaps_table[i] = mipmaps;
+        print_texture(path, tex.type, texture_offset, p->header_size - (uint32_t)sizeof(g1t_tex_header),
+            dds_header, mipmaps, nb_frames, depth, endian, log);
+        if ((uint64_t)texture_offset + p->size > UINT32_MAX) {
+            log_printf(log, stderr, "ERROR: Archive is too large\n");
+            goto out;
+        }
+        texture_offset += p->size;
     }
+    hdr.total_size = texture_offset;
+
+    // Write the headers and tables, then have the textures written at their offsets
+    const uint32_t tables_size = hdr.header_size + hdr.nb_textures * sizeof(uint32_t) + hdr.extra_size;
+    tables = malloc(tables_size);
+    if (tables == NULL) {
+        log_printf(log, stderr, "ERROR: Alloc error\n");
+        goto out;
+    }
+    fix_endian32_e(&hdr, sizeof(hdr) / sizeof(uint32_t), endian);
+    memcpy(tables, &hdr, sizeof(hdr));
+    fix_endian32_e(&hdr, sizeof(hdr) / sizeof(uint32_t), endian);
+    fix_endian32_e(flag_table, hdr.nb_textures, endian);
+    memcpy(&tables[sizeof(hdr)], flag_table, hdr.nb_textures * sizeof(uint32_t));
+    fix_endian32_e(offset_table, hdr.nb_textures, endian);
+    memcpy(&tables[hdr.header_size], offset_table, hdr.nb_textures * sizeof(uint32_t));
+    fix_endian32_e(offset_table, hdr.nb_textures, endian);
+    for (size_t i = 0; i < json_array_get_count(json_extra_data_array); i++) {
+        uint16_t extra_data = getv16_e(json_array_get_uint16(json_extra_data_array, i), endian);
+        memcpy(&tables[hdr.header_size + hdr.nb_textures * sizeof(uint32_t) + i * sizeof(uint16_t)],
+            &extra_data, sizeof(uint16_t));
+    }
+    if (in_memory) {
+        data = calloc(hdr.total_size, 1);
+        if (data == NULL) {
+            log_printf(log, stderr, "ERROR: Alloc error\n");
+            goto out;
+        }
+        memcpy(data, tables, tables_size);
+    } else {
+        if (!preallocate_file(file, hdr.total_size)) {
+            log_printf(log, stderr, "ERROR: Can't allocate '%s'\n", path);
+            goto out;
+        }
+        if (!write_at(file, tables, tables_size, 0)) {
+            log_printf(log, stderr, "ERROR: Can't write header\n");
+            goto out;
+        }
+    }
+    rp->file = file;
+    rp->data = data;
+    rp->header_size = hdr.header_size;
+    rp->total_size = hdr.total_size;
+    rp->nb_textures = hdr.nb_textures;
+    rp->plans = plans;
+    rp->offset_table = offset_table;
+    rp->mipmaps_table = mipmaps_table;
+    rp->jobs.plans = plans;
+    rp->jobs.cache = &rp->cache;
+    rp->jobs.file = file;
+    rp->jobs.data = data;
+    rp->jobs.filter = opts->filter;
+    rp->jobs.high_quality = opts->high_quality;
+    file = NULL;
+    data = NULL;
+    plans = NULL;
+    offset_table = NULL;
+    mipmaps_table = NULL;
+    r = 0;
 
 out:
     json_value_free(json);
     free(buf);
     free(dir);
-    free(offset_table);
+    free(tables);
     free(flag_table);
+    free(offset_table);
+    free(mipmaps_table);
+    free(plans);
+    free(data);
     if (file != NULL)
         fclose(file);
+    if (r != 0) {
+        free_cache(&rp->cache);
+        memset(rp, 0, sizeof(*rp));
+    }
+    return r;
+}
 
+// Save the texture cache once the textures of an archive have been written, and release
+// it, apart from the data of an archive recreated in memory, which the caller must free.
+static int end_repack(g1t_repack* rp)
+{
+    int r = -1;
+    uint8_t* buf = NULL;
+    uint64_t* keys = NULL;
+    if (rp->file == NULL && rp->data == NULL)
+        return 0;
+    keys = calloc(max(rp->nb_textures, 1), sizeof(uint64_t));
+    if (keys == NULL) {
+        fprintf(stderr, "ERROR: Alloc error\n");
+        goto out;
+    }
+    for (uint32_t i = 0; i < rp->nb_textures; i++) {
+        if (!rp->plans[i].t.success)
+            goto out;
+        keys[i] = rp->plans[i].key;
+    }
+    if (rp->cache_path[0] != 0) {
+        const uint32_t data_size = rp->total_size - rp->header_size;
+        if (rp->data != NULL) {
+            save_cache(rp->cache_path, rp->nb_textures, keys, rp->mipmaps_table, &rp->data[rp->header_size],
+                rp->offset_table, data_size);
+        } else {
+            buf = malloc(data_size);
+            fseek(rp->file, rp->header_size, SEEK_SET);
+            if (buf == NULL || fread(buf, 1, data_size, rp->file) != data_size)
+                fprintf(stderr, "WARNING: Can't read back textures for the cache\n");
+            else
+                save_cache(rp->cache_path, rp->nb_textures, keys, rp->mipmaps_table, buf, rp->offset_table, data_size);
+        }
+    }
+    r = 0;
+
+out:
+    free(buf);
+    free(keys);
+    if (rp->file != NULL)
+        fclose(rp->file);
+    free(rp->plans);
+    free(rp->offset_table);
+    free(rp->mipmaps_table);
+    free_cache(&rp->cache);
+    memset(rp, 0, sizeof(*rp));
+    return r;
+}
+
+uint32_t recreate_g1t_buffer(const char* dir_path, uint32_t nb_threads, uint8_t** buf)
+{
+    const repack_options opts = { false, false, true, FILTER_KAISER, nb_threads };
+    g1t_repack rp = { 0 };
+    rp.in_memory = true;
+    int r = begin_repack(dir_path, &opts, &rp);
+    uint32_t size = rp.total_size;
+    *buf = rp.data;
+    run_jobs(write_texture, &rp.jobs, rp.nb_textures, nb_threads);
+    if (end_repack(&rp) != 0 || r != 0) {
+        free(*buf);
+        *buf = NULL;
+        return UINT32_MAX;
+    }
+    return size;
+}
+
+#if !defined(G1T_LIBRARY)
+// The rest is only needed by the gust_g1t tool itself
+
+// Read a G1T archive and call parse_g1t() on it, with the same requirements
+static int begin_extraction(char* g1t_path, const extract_options* opts, g1t_extraction* x)
+{
+    int r = -1;
+    FILE* file = NULL;
+    uint8_t* buf = NULL;
+    uint32_t magic, g1t_size = 0, mapped_size = 0;
+    job_log* log = x->log;
+
+    log_printf(log, stdout, "%s '%s'...\n", opts->list_only ? "Listing" : "Extracting", g1t_path);
+    if (!has_g1t_extension(g1t_path, log))
+        goto out;
+    file = fopen_utf8(g1t_path, "rb");
+    if (file == NULL) {
+        log_printf(log, stderr, "ERROR: Can't open file '%s'\n", g1t_path);
+        goto out;
+    }
+
+    if (fread(&magic, sizeof(magic), 1, file) != 1) {
+        log_printf(log, stderr, "ERROR: Can't read from '%s'\n", g1t_path);
+        goto out;
+    }
+    if ((magic != G1TG_MAGIC) && (magic != bswap_uint32(G1TG_MAGIC))) {
+        log_printf(log, stderr, "ERROR: Not a G1T file (bad magic) or unsupported platform\n");
+        goto out;
+    }
+    const endianness endian = (magic == bswap_uint32(G1TG_MAGIC)) ? !platform_endianness : little_endian;
+    fseek(file, 0L, SEEK_END);
+    g1t_size = (uint32_t)ftell(file);
+    fseek(file, 0L, SEEK_SET);
+
+    // When listing, we only read the global header and tables here, and then
+    // the header and extended data of each texture, rather than the whole file.
+    g1t_header g1t_hdr;
+    if (fread(&g1t_hdr, sizeof(g1t_hdr), 1, file) != 1) {
+        log_printf(log, stderr, "ERROR: Can't read file\n");
+        goto out;
+    }
+    fix_endian32_e(&g1t_hdr, sizeof(g1t_header) / sizeof(uint32_t), endian);
+    if (g1t_hdr.total_size != g1t_size) {
+        log_printf(log, stderr, "ERROR: File size mismatch\n");
+        goto out;
+    }
+    uint32_t read_size = g1t_size;
+    if (opts->list_only) {
+        read_size = g1t_hdr.header_size + g1t_hdr.nb_textures * sizeof(uint32_t) + g1t_hdr.extra_size;
+        if ((g1t_hdr.header_size < sizeof(g1t_header)) || (read_size > g1t_size)) {
+            log_printf(log, stderr, "ERROR: Invalid G1T header\n");
+            goto out;
+        }
+    }
+    if (opts->list_only) {
+        buf = malloc(read_size);
+        if (buf == NULL)
+            goto out;
+        fseek(file, 0L, SEEK_SET);
+        if (fread(buf, 1, read_size, file) != read_size) {
+            log_printf(log, stderr, "ERROR: Can't read file\n");
+            goto out;
+        }
+    } else {
+        // Map the archive rather than read it, since we only patch its headers
+        mapped_size = map_file(g1t_path, &buf, true);
+        if (mapped_size != g1t_size) {
+            if (mapped_size != UINT32_MAX)
+                log_printf(log, stderr, "ERROR: '%s' was modified while being read\n", g1t_path);
+            goto out;
+        }
+    }
+    r = parse_g1t(buf, g1t_size, file, g1t_path, opts, x);
+    if (r == 0 && !opts->list_only) {
+        x->buf = buf;
+        buf = NULL;
+    }
+
+out:
+    if (opts->list_only)
+        free(buf);
+    else
+        unmap_file(buf, mapped_size);
+    if (file != NULL)
+        fclose(file);
+    return r;
+}
+
+static int extract_g1t(char* g1t_path, const extract_options* opts)
+{
+    g1t_extraction x = { 0 };
+    int r = begin_extraction(g1t_path, opts, &x);
+    run_jobs(extract_texture, x.textures, x.nb_textures, opts->nb_threads);
+    if (end_extraction(&x) != 0)
+        r = -1;
+    return r;
+}
+
+static int recreate_g1t(const char* dir_path, const repack_options* opts)
+{
+    g1t_repack rp = { 0 };
+    int r = begin_repack(dir_path, opts, &rp);
+    run_jobs(write_texture, &rp.jobs, rp.nb_textures, opts->nb_threads);
+    if (end_repack(&rp) != 0)
+        r = -1;
+    return r;
+}
+
+// Batch processing of all the archives found under a directory. The archives are set
+// up in parallel, with their output kept until they are all set up, and then the
+// textures of all of them are converted by the same threads. This is done in batches
+// of archives, so that we don't hold too much data or too many open files at once.
+#define BATCH_MAX_SIZE          (256 * 1024 * 1024)
+#define BATCH_MAX_ARCHIVES      128
+
+typedef struct {
+    char* path;                 // .g1t to extract or directory to recreate
+    bool recreate;
+    g1t_extraction x;
+    g1t_repack rp;
+    job_log log;
+    int r;
+} batch_item;
+
+typedef struct {
+    batch_item* items;
+    const extract_options* xopts;
+    const repack_options* ropts;
+} batch_setup;
+
+typedef struct {
+    job_function fn;
+    void* ctx;
+    uint32_t index;
+    g1t_texture* t;
+    double time;
+} batch_job;
+
+static void setup_batch_item(void* ctx, uint32_t index)
+{
+    const batch_setup* s = (const batch_setup*)ctx;
+    batch_item* item = &s->items[index];
+    if (item->recreate) {
+        item->rp.log = &item->log;
+        item->r = begin_repack(item->path, s->ropts, &item->rp);
+    } else {
+        item->x.log = &item->log;
+        item->r = begin_extraction(item->path, s->xopts, &item->x);
+    }
+}
+
+static void run_batch_job(void* ctx, uint32_t index)
+{
+    batch_job* j = &((batch_job*)ctx)[index];
+    const double start = get_time();
+    j->fn(j->ctx, j->index);
+    j->time = get_time() - start;
+}
+
+static int compare_batch_items(const void* a, const void* b)
+{
+    return strcmp(((const batch_item*)a)->path, ((const batch_item*)b)->path);
+}
+
+// Largest textures first, so that the smaller ones even out the load at the end
+static int compare_batch_jobs(const void* a, const void* b)
+{
+    const uint32_t size_a = ((const batch_job*)a)->t->size, size_b = ((const batch_job*)b)->t->size;
+    return (size_a < size_b) - (size_a > size_b);
+}
+
+// Recreate the archives of all the directories that hold a g1t.json under root, and
+// extract all the other .g1t files
+static int process_tree(const char* root, const extract_options* xopts, const repack_options* ropts)
+{
+    int r = -1;
+    char **g1t_files = NULL, **json_files = NULL;
+    uint32_t nb_g1t_files = 0, nb_json_files = 0, nb_items = 0;
+    batch_item* items = NULL;
+    batch_job* jobs = NULL;
+    struct { uint32_t nb_textures; uint64_t size; double time; } stats[DDS_FORMAT_NVTT + 1] = { { 0 } };
+    uint64_t total_size = 0;
+    const double start = get_time();
+
+    if (!is_directory(root)) {
+        fprintf(stderr, "ERROR: '%s' is not a directory\n", root);
+        return -1;
+    }
+    nb_g1t_files = find_files(root, ".g1t", &g1t_files);
+    nb_json_files = find_files(root, ".json", &json_files);
+    if (nb_g1t_files == UINT32_MAX || nb_json_files == UINT32_MAX)
+        goto out;
+    items = calloc(max(nb_g1t_files + nb_json_files, 1), sizeof(batch_item));
+    if (items == NULL) {
+        fprintf(stderr, "ERROR: Alloc error\n");
+        goto out;
+    }
+    for (uint32_t i = 0; i < nb_json_files; i++) {
+        size_t len = strlen(json_files[i]);
+        if (len <= 9 || stricmp(&json_files[i][len - 8], "g1t.json") != 0 ||
+            (json_files[i][len - 9] != '/' && json_files[i][len - 9] != '\\'))
+            continue;
+        json_files[i][len - 9] = 0;
+        items[nb_items].path = json_files[i];
+        items[nb_items++].recreate = true;
+        json_files[i] = NULL;
+    }
+    for (uint32_t i = 0; i < nb_g1t_files; i++) {
+        // Archives that have been extracted get recreated instead
+        char json_path[PATH_MAX];
+        snprintf(json_path, sizeof(json_path), "%.*s%cg1t.json", (int)strlen(g1t_files[i]) - 4,
+            g1t_files[i], PATH_SEP);
+        if (is_file(json_path))
+            continue;
+        items[nb_items++].path = g1t_files[i];
+        g1t_files[i] = NULL;
+    }
+    if (nb_items == 0) {
+        fprintf(stderr, "ERROR: No .g1t file or g1t.json found in '%s'\n", root);
+        goto out;
+    }
+    qsort(items, nb_items, sizeof(batch_item), compare_batch_items);
+
+    r = 0;
+    for (uint32_t first = 0, last, nb_setup = 0; first < nb_items; first = last) {
+        // Once the archives that were set up have all been processed, set up the next ones
+        if (first == nb_setup) {
+            batch_setup setup = { &items[first], xopts, ropts };
+            nb_setup = first + min(nb_items - first, BATCH_MAX_ARCHIVES);
+            run_jobs(setup_batch_item, &setup, nb_setup - first, ropts->nb_threads);
+            for (uint32_t i = first; i < nb_setup; i++) {
+                print_log(&items[i].log);
+                if (items[i].r != 0)
+                    r = -1;
+            }
+        }
+        uint64_t batch_size = 0;
+        uint32_t nb_jobs = 0;
+        for (last = first; last < nb_setup && batch_size < BATCH_MAX_SIZE; last++) {
+            batch_item* item = &items[last];
+            batch_size += item->recreate ? item->rp.total_size : item->x.size;
+            nb_jobs += item->recreate ? item->rp.nb_textures : item->x.nb_textures;
+        }
+        total_size += batch_size;
+        jobs = calloc(max(nb_jobs, 1), sizeof(batch_job));
+        if (jobs == NULL) {
+            fprintf(stderr, "ERROR: Alloc error\n");
+            nb_jobs = 0;
+        }
+        for (uint32_t i = first, k = 0; i < last && jobs != NULL; i++) {
+            for (uint32_t j = 0; j < items[i].rp.nb_textures; j++, k++) {
+                jobs[k].fn = write_texture;
+                jobs[k].ctx = &items[i].rp.jobs;
+                jobs[k].index = j;
+                jobs[k].t = &items[i].rp.plans[j].t;
+            }
+            for (uint32_t j = 0; j < items[i].x.nb_textures; j++, k++) {
+                jobs[k].fn = extract_texture;
+                jobs[k].ctx = items[i].x.textures;
+                jobs[k].index = j;
+                jobs[k].t = &items[i].x.textures[j];
+            }
+        }
+        // Threads that aren't needed for the textures themselves go to their subresources
+        for (uint32_t k = 0; k < nb_jobs; k++)
+            jobs[k].t->nb_threads = max(1, ropts->nb_threads / nb_jobs);
+        qsort(jobs, nb_jobs, sizeof(batch_job), compare_batch_jobs);
+        run_jobs(run_batch_job, jobs, nb_jobs, ropts->nb_threads);
+        for (uint32_t k = 0; k < nb_jobs; k++) {
+            stats[jobs[k].t->format].nb_textures++;
+            stats[jobs[k].t->format].size += jobs[k].t->size;
+            stats[jobs[k].t->format].time += jobs[k].time;
+        }
+        free(jobs);
+        jobs = NULL;
+        for (uint32_t i = first; i < last; i++) {
+            if ((items[i].recreate ? end_repack(&items[i].rp) : end_extraction(&items[i].x)) != 0)
+                r = -1;
+        }
+    }
+
+    // Texture times are the sum of the time each thread spent on them
+    const double elapsed = max(get_time() - start, 1e-6);
+    printf("\nProcessed %d archive(s), %.1f MB in %.2f s (%.1f MB/s)\n", nb_items,
+        total_size / 1048576.0, elapsed, total_size / 1048576.0 / elapsed);
+    printf("FORMAT   TEXTURES SIZE (MB) TIME (s)  MB/s\n");
+    for (uint32_t f = 0; f < array_size(stats); f++) {
+        if (stats[f].nb_textures == 0)
+            continue;
+        printf("%-8s %-8d %-9.1f %-9.3f %.1f\n", format_name[f], stats[f].nb_textures,
+            stats[f].size / 1048576.0, stats[f].time,
+            stats[f].size / 1048576.0 / max(stats[f].time, 1e-6));
+    }
+
+out:
+    for (uint32_t i = 0; i < nb_items; i++)
+        free(items[i].path);
+    free(items);
+    for (uint32_t i = 0; nb_g1t_files != UINT32_MAX && i < nb_g1t_files; i++)
+        free(g1t_files[i]);
+    free(g1t_files);
+    for (uint32_t i = 0; nb_json_files != UINT32_MAX && i < nb_json_files; i++)
+        free(json_files[i]);
+    free(json_files);
+    return r;
+}
+
+int main_utf8(int argc, char** argv)
+{
+    int r = -1;
+    bool list_only = false, flip_image = false, no_prompt = false, high_quality = false;
+    bool rgba_export = false, use_cache = true, recursive = false;
+    export_options export_opts = { 0 };
+    mip_filter filter = FILTER_KAISER;
+    uint32_t nb_threads = 1;
+    int argi;
+
+    for (argi = 1; argi < argc - 1 && argv[argi][0] == '-'; argi++) {
+        if (strcmp(argv[argi], "--export-rgba") == 0)
+            rgba_export = true;
+        else if (strcmp(argv[argi], "--tga") == 0)
+            rgba_export = export_opts.tga = true;
+        else if (strcmp(argv[argi], "--top-mip") == 0)
+            rgba_export = export_opts.top_mip = true;
+        else if (strcmp(argv[argi], "--thumbnail") == 0 && argi + 1 < argc - 1)
+            rgba_export = ((export_opts.thumbnail_size = (uint32_t)atoi(argv[++argi])) != 0);
+        else if (strcmp(argv[argi], "--no-cache") == 0)
+            use_cache = false;
+        else if (strcmp(argv[argi], "--box-filter") == 0)
+            filter = FILTER_BOX;
+        else if (argv[argi][1] == 'l')
+            list_only = true;
+        else if (argv[argi][1] == 'f')
+            flip_image = true;
+        else if (argv[argi][1] == 'y')
+            no_prompt = true;
+        else if (argv[argi][1] == 'q')
+            high_quality = true;
+        else if (argv[argi][1] == 'r')
+            recursive = no_prompt = true;
+        else if (argv[argi][1] == 'j' && argi + 1 < argc - 1)
+            nb_threads = (uint32_t)atoi(argv[++argi]);
+        else
+            break;
+    }
+    if (nb_threads == 0)
+        nb_threads = get_nb_cpus();
+
+    if (argc < 2 || argi != argc - 1) {
+        printf("%s %s (c) 2019-2022 VitaSmith\n\n"
+            "Usage: %s [-l] [-f] [-y] [-q] [-r] [-j N] [--box-filter] [--no-cache] [--export-rgba]\n"
+            "       [--tga] [--top-mip] [--thumbnail N] <file or directory>\n\n"
+            "Extracts (file) or recreates (directory) a Gust .g1t texture archive.\n"
+            "-j N converts up to N textures in parallel (0 = one per CPU).\n"
+            "-r recreates all the archives of the directories holding a g1t.json found in\n"
+            "a directory, and extracts all the other .g1t files, without prompting.\n"
+            "-q uses slower, higher quality compression for uncompressed source images,\n"
+            "which, for BC7, also tries modes 1, 3 and 5 on top of mode 6 (modes 0, 2, 4\n"
+            "and 7 are never used).\n"
+            "--box-filter generates missing mipmaps with a box rather than Kaiser filter.\n"
+            "--no-cache disables the cache (g1t.cache) of the textures converted when\n"
+            "recreating an archive, which is otherwise used to skip the unchanged ones.\n"
+            "--export-rgba extracts decoded textures as uncompressed 32-bit DDS, or as TGA\n"
+            "with --tga (first frame only). --top-mip only keeps the main mipmap, and\n"
+            "--thumbnail N scales it down to at most NxN. With a directory, these options,\n"
+            "as well as -l, apply to all the .g1t files found in it.\n\n"
+            "Note: A backup (.bak) of the original is automatically created, when the target\n"
+            "is being overwritten for the first time.\n",
+            _appname(argv[0]), GUST_TOOLS_VERSION_STR, _appname(argv[0]));
+        return 0;
+    }
+
+    const extract_options opts = { list_only, flip_image, nb_threads, rgba_export ? &export_opts : NULL };
+    const repack_options ropts = { flip_image, high_quality, use_cache, filter, nb_threads };
+    if ((rgba_export || list_only) && is_directory(argv[argc - 1])) {
+        char** files = NULL;
+        uint32_t nb_files = find_files(argv[argc - 1], ".g1t", &files);
+        if (nb_files == UINT32_MAX)
+            goto out;
+        if (nb_files == 0)
+            fprintf(stderr, "ERROR: No .g1t file found in '%s'\n", argv[argc - 1]);
+        // Files are processed one at a time, so that their listings don't get mixed up
+        r = (nb_files == 0) ? -1 : 0;
+        for (uint32_t i = 0; i < nb_files; i++) {
+            if (extract_g1t(files[i], &opts) != 0)
+                r = -1;
+            free(files[i]);
+        }
+        free(files);
+    } else if (recursive) {
+        r = process_tree(argv[argc - 1], &opts, &ropts);
+    } else if (is_directory(argv[argc - 1])) {
+        r = recreate_g1t(argv[argc - 1], &ropts);
+    } else {
+        r = extract_g1t(argv[argc - 1], &opts);
+    }
+
+out:
     if (r != 0 && !no_prompt) {
         fflush(stdin);
         printf("\nPress any key to continue...");
@@ -1417,3 +3423,4 @@ out:
 }
 
 CALL_MAIN
+#endif
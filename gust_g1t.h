@@ -0,0 +1,32 @@
+/*
+  gust_g1t - DDS texture unpacker for Gust (Koei/Tecmo) .g1t files
+  Copyright © 2019-2022 VitaSmith
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+
+#pragma once
+
+// G1T processing for the other tools, which get it by building gust_g1t.c
+// with G1T_LIBRARY defined.
+
+// Extract a G1T archive that is held in memory, as if it had been read from g1t_path,
+// into a directory bearing the same name. buf is altered in the process.
+int extract_g1t_buffer(uint8_t* buf, uint32_t size, const char* g1t_path, uint32_t nb_threads);
+
+// Recreate the G1T archive of a directory (holding a g1t.json) into a newly allocated
+// buffer. Returns the size of the archive, or UINT32_MAX on error.
+uint32_t recreate_g1t_buffer(const char* dir_path, uint32_t nb_threads, uint8_t** buf);
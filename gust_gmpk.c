@@ -25,6 +25,7 @@
 #include "utf8.h"
 #include "util.h"
 #include "parson.h"
+#include "gust_g1t.h"
 
 #define JSON_VERSION            2
 #define GMPK_MAGIC              0x4B504D47  // 'GMPK'
@@ -370,29 +371,105 @@ JSON_Value* read_sdp(uint8_t* buf, uint32_t size)
     return json_sdp;
 }
 
-uint16_t get_fragment(uint8_t* fragments, uint16_t *fragments_size, char* str, uint16_t str_len)
+// Hash set of the length-prefixed string fragments of a NameMap, so that we can
+// look them up without rescanning the whole pool every time
+typedef struct {
+    uint8_t*    pool;
+    uint32_t    size;
+    uint32_t    max_size;
+    uint32_t    mask;
+    uint32_t*   slots;          // 1 + offset of a fragment in the pool, or 0 if unused
+} fragment_set;
+
+static uint32_t* find_fragment(fragment_set* fs, const char* str, uint32_t str_len)
+{
+    uint32_t i = (uint32_t)hash64(str, str_len, 0) & fs->mask;
+    for (; fs->slots[i] != 0; i = (i + 1) & fs->mask) {
+        const uint8_t* f = &fs->pool[fs->slots[i] - 1];
+        if (f[0] == str_len && memcmp(&f[1], str, str_len) == 0)
+            break;
+    }
+    return &fs->slots[i];
+}
+
+// Returns the offset of a fragment in the pool, after inserting it if needed
+uint32_t get_fragment(fragment_set* fs, const char* str, uint32_t str_len)
+{
+    uint32_t* slot = find_fragment(fs, str, str_len);
+    if (*slot != 0)
+        return *slot - 1;
+    if (str_len > UINT8_MAX || fs->size + 1 + str_len > fs->max_size)
+        return UINT32_MAX;
+    *slot = fs->size + 1;
+    fs->pool[fs->size++] = (uint8_t)str_len;
+    memcpy(&fs->pool[fs->size], str, str_len);
+    fs->size += str_len;
+    return *slot - 1;
+}
+
+typedef struct {
+    const char* name;
+    uint32_t    index;
+} sorted_name;
+
+static int compare_names(const void* a, const void* b)
 {
-    uint16_t pos = 0;
-    while (pos < *fragments_size) {
-        bool match = (str_len == (uint16_t)fragments[pos]);
-        for (uint16_t i = 0; match && i < str_len; i++)
-            match = (fragments[pos + i + 1] == str[i]);
-        if (match)
-            return pos;
-        pos += (uint16_t)fragments[pos] + 1;
-    }
-    // Fragment was not found => insert it
-    pos = *fragments_size;
-    fragments[(*fragments_size)++] = (uint8_t)str_len;
-    memcpy(&fragments[*fragments_size], str, str_len);
-    *fragments_size += str_len;
-    return pos;
+    return strcmp(((const sorted_name*)a)->name, ((const sorted_name*)b)->name);
+}
+
+// Get the length of the longest prefix that each name shares with another one,
+// which, once the names are sorted, is the one it shares with either neighbour
+static uint32_t* get_shared_prefixes(JSON_Array* json_names_array, uint32_t count)
+{
+    uint32_t* shared = calloc(count, sizeof(uint32_t));
+    sorted_name* names = calloc(count, sizeof(sorted_name));
+    if (shared == NULL || names == NULL) {
+        free(shared);
+        free(names);
+        return NULL;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        names[i].name = json_object_get_string(json_array_get_object(json_names_array, i), "name");
+        names[i].index = i;
+        if (names[i].name == NULL)
+            names[i].name = "";
+    }
+    qsort(names, count, sizeof(sorted_name), compare_names);
+    for (uint32_t i = 1; i < count; i++) {
+        uint32_t len = 0;
+        while (names[i].name[len] != 0 && names[i].name[len] == names[i - 1].name[len])
+            len++;
+        shared[names[i].index] = max(shared[names[i].index], len);
+        shared[names[i - 1].index] = max(shared[names[i - 1].index], len);
+    }
+    free(names);
+    return shared;
+}
+
+// Split a name after the prefix it shares with other names, so that this prefix gets
+// reused, or else at the position that adds the least data to the pool
+static uint32_t get_best_split(fragment_set* fs, const char* name, uint32_t len, uint32_t shared_len)
+{
+    if (shared_len > 0 && shared_len < len)
+        return shared_len;
+    uint32_t best_split = len, best_cost = UINT32_MAX;
+    // A split of 0 is what we use for "no split" so don't produce it
+    for (uint32_t split = len; split >= 1; split--) {
+        uint32_t cost = ((*find_fragment(fs, name, split) == 0) ? split + 1 : 0) +
+            ((*find_fragment(fs, &name[split], len - split) == 0) ? len - split + 1 : 0);
+        if (cost < best_cost) {
+            best_cost = cost;
+            best_split = split;
+        }
+    }
+    return best_split;
 }
 
 uint32_t write_nid(JSON_Object* json_nid, uint8_t* buf, uint32_t size)
 {
-    uint32_t *data, written = 0;
+    uint32_t *data, *shared = NULL, written = 0, r = 0;
     nid1_header* hdr = (nid1_header*)buf;
+    fragment_set fs = { 0 };
 
     if (json_nid == NULL || buf == NULL || size < sizeof_32(nid1_header)) {
         fprintf(stderr, "ERROR: Invalid NID parameters\n");
@@ -419,36 +496,63 @@ uint32_t write_nid(JSON_Object* json_nid, uint8_t* buf, uint32_t size)
         return 0;
     }
 
+    // Each name has 2 fragments at most, so this keeps the hash set at most half full
+    fs.mask = 0x10;
+    while (fs.mask < 4 * hdr->count)
+        fs.mask <<= 1;
+    fs.slots = calloc(fs.mask--, sizeof(uint32_t));
+    if (fs.slots == NULL) {
+        fprintf(stderr, "ERROR: Alloc error\n");
+        return 0;
+    }
+
     // Write the name entries
     data = (uint32_t*)&buf[written];
-    uint8_t* fragments = (uint8_t*)&buf[written + 3 * hdr->count * sizeof_32(uint32_t)];
-    uint16_t pos, fragments_size = 0;
-    uint32_t split, len;
+    fs.pool = (uint8_t*)&buf[written + 3 * hdr->count * sizeof_32(uint32_t)];
+    fs.max_size = (size - written - 3 * hdr->count * sizeof_32(uint32_t)) & ~0x3;
+    // Fragment positions are 16-bit offsets from the start of the second table
+    fs.max_size = min(fs.max_size, 0x10000 - hdr->count * sizeof_32(uint32_t));
+    uint32_t pos[2], split, len;
     for (uint32_t i = 0; i < hdr->count; i++) {
         JSON_Object* json_name = json_array_get_object(json_names_array, i);
         data[2 * i] = json_object_get_uint32(json_name, "index");
         data[2 * i + 1] = json_object_get_uint32(json_name, "flags");
-        split = json_object_get_uint32(json_name, "split");
-        char c, *name = strdup(json_object_get_string(json_name, "name"));
-        if (name == NULL)
-            return 0xffff;
+        const char* name = json_object_get_string(json_name, "name");
+        if (name == NULL) {
+            fprintf(stderr, "ERROR: Missing NID name\n");
+            goto out;
+        }
         len = (uint32_t)strlen(name);
-        if (split == 0)
-            split = len;
-        assert(name && split <= len);
+        // Names that were added manually may not have a split, in which case we find one
+        if (json_object_has_value(json_name, "split")) {
+            split = json_object_get_uint32(json_name, "split");
+            if (split == 0)
+                split = len;
+        } else {
+            if (shared == NULL)
+                shared = get_shared_prefixes(json_names_array, hdr->count);
+            if (shared == NULL) {
+                fprintf(stderr, "ERROR: Alloc error\n");
+                goto out;
+            }
+            split = get_best_split(&fs, name, len, shared[i]);
+        }
+        if (split > len) {
+            fprintf(stderr, "ERROR: Invalid split for NID name '%s'\n", name);
+            goto out;
+        }
         hdr->max_name_len = max(hdr->max_name_len, len);
-        c = name[split];
-        name[split] = 0;
-        pos = get_fragment(fragments, &fragments_size, name, (uint16_t)split);
-        data[2 * hdr->count + i] = pos + hdr->count * sizeof_32(uint32_t);
-        name[split] = c;
-        pos = get_fragment(fragments, &fragments_size, &name[split], (uint16_t)(len - split));
-        data[2 * hdr->count + i] <<= 16;
-        data[2 * hdr->count + i] |= pos + hdr->count * sizeof_32(uint32_t);
+        pos[0] = get_fragment(&fs, name, split);
+        pos[1] = get_fragment(&fs, &name[split], len - split);
+        if (pos[0] == UINT32_MAX || pos[1] == UINT32_MAX) {
+            fprintf(stderr, "ERROR: Can't add NID name '%s'\n", name);
+            goto out;
+        }
+        data[2 * hdr->count + i] = (pos[0] + hdr->count * sizeof_32(uint32_t)) << 16;
+        data[2 * hdr->count + i] |= pos[1] + hdr->count * sizeof_32(uint32_t);
         data[2 * hdr->count + i] = getv32(data[2 * hdr->count + i]);
-        free(name);
     }
-    written += 3 * hdr->count * sizeof_32(uint32_t) + fragments_size;
+    written += 3 * hdr->count * sizeof_32(uint32_t) + fs.size;
     written = align_to_4(written);
     hdr->size = written;
     if (data_endianness != platform_endianness) {
@@ -457,7 +561,12 @@ uint32_t write_nid(JSON_Object* json_nid, uint8_t* buf, uint32_t size)
         BSWAP_UINT32(hdr->count);
         BSWAP_UINT32(hdr->max_name_len);
     }
-    return written;
+    r = written;
+
+out:
+    free(shared);
+    free(fs.slots);
+    return r;
 }
 
 uint32_t write_sdp(JSON_Object* json_sdp, uint8_t* buf, uint32_t size)
@@ -591,6 +700,50 @@ uint32_t write_sdp(JSON_Object* json_sdp, uint8_t* buf, uint32_t size)
     return written;
 }
 
+// A .g1m/.g1t/.g1h component, which gets written (unpack) or read (repack) by a job
+typedef struct {
+    char        path[256];
+    uint32_t    offset;         // absolute offset of the data in the archive
+    uint32_t    size;
+    uint8_t*    data;           // .g1t recreated in memory, rather than read from path
+    bool        nested;         // .g1t that also goes through the G1T extraction
+    bool        success;
+} gmpk_component;
+
+typedef struct {
+    FILE*           file;       // archive file, read (unpack) or written (repack)
+    gmpk_component* components;
+} component_jobs;
+
+static void write_component(void* ctx, uint32_t index)
+{
+    component_jobs* j = (component_jobs*)ctx;
+    gmpk_component* c = &j->components[index];
+    // Nested .g1t files are written too, so that the pack can be recreated without --deep
+    c->success = copy_to_file(j->file, c->offset, c->size, c->path);
+}
+
+static void add_component(void* ctx, uint32_t index)
+{
+    component_jobs* j = (component_jobs*)ctx;
+    gmpk_component* c = &j->components[index];
+    if (c->data != NULL) {
+        if (!(c->success = write_at(j->file, c->data, c->size, c->offset)))
+            fprintf(stderr, "ERROR: Can't add data from '%s'\n", c->path);
+        return;
+    }
+    uint8_t* src_buf = NULL;
+    uint32_t size = read_file(c->path, &src_buf);
+    if (size == UINT32_MAX)
+        return;
+    // The offsets were computed from the file sizes we got when planning the archive
+    if (size != c->size)
+        fprintf(stderr, "ERROR: '%s' was modified while the archive was being created\n", c->path);
+    else if (!(c->success = write_at(j->file, src_buf, size, c->offset)))
+        fprintf(stderr, "ERROR: Can't add data from '%s'\n", c->path);
+    free(src_buf);
+}
+
 int main_utf8(int argc, char** argv)
 {
     char path[256], *dir = NULL;
@@ -598,13 +751,34 @@ int main_utf8(int argc, char** argv)
     JSON_Value* json = NULL;
     FILE *file = NULL;
     uint8_t* buf = NULL;
-    bool list_only = (argc == 3) && (argv[1][0] == '-') && (argv[1][1] == 'l');
-    bool no_prompt = (argc == 3) && (argv[1][0] == '-') && (argv[1][1] == 'y');
+    uint32_t mapped_size = 0;
+    gmpk_component* components = NULL;
+    bool list_only = false, no_prompt = false, deep = false;
+    uint32_t nb_threads = 1;
+    int argi;
+
+    for (argi = 1; argi < argc - 1 && argv[argi][0] == '-'; argi++) {
+        if (strcmp(argv[argi], "--deep") == 0)
+            deep = true;
+        else if (argv[argi][1] == 'l')
+            list_only = true;
+        else if (argv[argi][1] == 'y')
+            no_prompt = true;
+        else if (argv[argi][1] == 'j' && argi + 1 < argc - 1)
+            nb_threads = (uint32_t)atoi(argv[++argi]);
+        else
+            break;
+    }
+    if (nb_threads == 0)
+        nb_threads = get_nb_cpus();
 
-    if ((argc != 2) && !list_only && !no_prompt) {
+    if (argc < 2 || argi != argc - 1) {
         printf("%s %s (c) 2021 VitaSmith\n\n"
-            "Usage: %s [-l] [-y] <file or directory>\n\n"
-            "Extracts (file) or recreates (directory) a Gust .gmpk model pack.\n\n"
+            "Usage: %s [-l] [-y] [-j N] [--deep] <file or directory>\n\n"
+            "Extracts (file) or recreates (directory) a Gust .gmpk model pack.\n"
+            "-j N reads or writes up to N component files in parallel (0 = one per CPU).\n"
+            "--deep also extracts the textures of the .g1t files of the pack, or recreates\n"
+            "these .g1t from the directories holding a g1t.json, where there is one.\n\n"
             "Note: A backup (.bak) of the original is automatically created, when the target\n"
             "is being overwritten for the first time.\n",
             _appname(argv[0]), GUST_TOOLS_VERSION_STR, _appname(argv[0]));
@@ -621,11 +795,22 @@ int main_utf8(int argc, char** argv)
         }
         char* gmpk_pos = &argv[argc - 1][len - 5];
 
-        uint32_t file_size = read_file(argv[argc - 1], &buf);
+        // The headers get patched (for endianness) but the components are copied as is,
+        // so we map the archive instead of reading it
+        uint32_t file_size = map_file(argv[argc - 1], &buf, true);
         if (file_size == UINT32_MAX)
             goto out;
+        mapped_size = file_size;
+        // Plain components are copied straight from the archive file
+        if (!list_only) {
+            file = fopen_utf8(argv[argc - 1], "rb");
+            if (file == NULL) {
+                fprintf(stderr, "ERROR: Can't open '%s'\n", argv[argc - 1]);
+                goto out;
+            }
+        }
 
-        if (getle32(buf) != GMPK_MAGIC) {
+        if (file_size < sizeof(sdp1_header) || getle32(buf) != GMPK_MAGIC) {
             fprintf(stderr, "ERROR: Not a GMPK file (bad magic) or unsupported platform\n");
             goto out;
         }
@@ -672,6 +857,12 @@ int main_utf8(int argc, char** argv)
             goto out;
         }
 
+        components = calloc((size_t)files_count + 1, sizeof(gmpk_component));
+        if (components == NULL) {
+            fprintf(stderr, "ERROR: Alloc error\n");
+            goto out;
+        }
+
         printf("OFFSET   SIZE     NAME\n");
         uint32_t extracted_files = 0, num_extensions_to_check = entrymap_sdp->entry_record_size / 2;
         if (entrymap_sdp->entry_count > 1 && getp32(&fp[0]) == 1)
@@ -695,8 +886,6 @@ int main_utf8(int argc, char** argv)
                     }
                     uint32_t fe_offset = getp32(&fe[index].offset);
                     uint32_t fe_size = getp32(&fe[index].size);
-                    snprintf(path, sizeof(path), "%s%s%c%s%s", dir,
-                       _basename(argv[argc - 1]), PATH_SEP, name, extension[j]);
                     printf("%08x %08x %s%s\n", offset + fe_offset, fe_size, name, extension[j]);
                     // More sanity checks
                     if (offset + fe_offset + fe_size > file_size) {
@@ -707,23 +896,29 @@ int main_utf8(int argc, char** argv)
                         fprintf(stderr, "ERROR: Invalid number of files\n");
                         goto out;
                     }
-                    extracted_files++;
-                    if (list_only)
-                        continue;
-                    FILE* dst = fopen_utf8(path, "wb");
-                    if (dst == NULL) {
-                        fprintf(stderr, "ERROR: Can't create file '%s'\n", path);
-                        goto out;
-                    }
-                    if (fwrite(&buf[offset + fe_offset], 1, fe_size, dst) != fe_size) {
-                        fprintf(stderr, "ERROR: Can't write file '%s'\n", path);
-                        fclose(dst);
-                        goto out;
-                    }
-                    fclose(dst);
+                    gmpk_component* c = &components[extracted_files++];
+                    snprintf(c->path, sizeof(c->path), "%s%s%c%s%s", dir,
+                       _basename(argv[argc - 1]), PATH_SEP, name, extension[j]);
+                    c->offset = offset + fe_offset;
+                    c->size = fe_size;
+                    c->nested = deep && (strcmp(extension[j], ".g1t") == 0);
                 }
             }
         }
+        if (!list_only) {
+            // Now that we know where everything goes, write the components in parallel
+            component_jobs jobs = { file, components };
+            run_jobs(write_component, &jobs, extracted_files, nb_threads);
+            // The G1T extractions print a listing, so they are run one at a time
+            for (uint32_t i = 0; i < extracted_files; i++) {
+                if (components[i].nested && components[i].success)
+                    components[i].success = (extract_g1t_buffer(&buf[components[i].offset],
+                        components[i].size, components[i].path, nb_threads) == 0);
+            }
+            for (uint32_t i = 0; i < extracted_files; i++)
+                if (!components[i].success)
+                    goto out;
+        }
         if (getp32(&fe[files_count].offset) != file_size) {
             fprintf(stderr, "WARNING: The last file offset doesn't match the total file size\n");
             goto out;
@@ -802,7 +997,8 @@ int main_utf8(int argc, char** argv)
         files_count = 0;
         entry_data_count = 0;
         entry_data = calloc(names_count * sizeof(model_entry), 1);
-        if (entry_data == NULL)
+        components = calloc((size_t)names_count * array_size(extension), sizeof(gmpk_component));
+        if (entry_data == NULL || components == NULL)
             goto out;
         // Note: We expect the EntryMap entry data to be as follows:
         // If we only have one set of .g1m/.g1t/.g1h, there is a single model_entry
@@ -820,9 +1016,30 @@ int main_utf8(int argc, char** argv)
             const char* name = json_object_get_string(json_array_get_object(json_names_array, i), "name");
             model_entry* me = (model_entry*)&entry_data[entry_data_count];
             for (size_t j = 0; j < array_size(extension); j++) {
+                gmpk_component* c = &components[files_count];
+                if (deep && strcmp(extension[j], ".g1t") == 0) {
+                    // Use the directory that a .g1t was extracted into, if there is one
+                    snprintf(path, sizeof(path), "%s%s%c%s%cg1t.json", dir,
+                        _basename(argv[argc - 1]), PATH_SEP, name, PATH_SEP);
+                    if (is_file(path)) {
+                        snprintf(c->path, sizeof(c->path), "%s%s%c%s", dir,
+                            _basename(argv[argc - 1]), PATH_SEP, name);
+                        c->size = recreate_g1t_buffer(c->path, nb_threads, &c->data);
+                        if (c->size == UINT32_MAX)
+                            goto out;
+                        me->component[j].has_component = 1;
+                        me->component[j].file_index = files_count++;
+                        continue;
+                    }
+                }
                 snprintf(path, sizeof(path), "%s%s%c%s%s", dir,
                     _basename(argv[argc - 1]), PATH_SEP, name, extension[j]);
                 if (is_file(path)) {
+                    uint64_t size = get_file_size(path);
+                    if (size >= UINT32_MAX)
+                        goto out;
+                    strcpy(c->path, path);
+                    c->size = (uint32_t)size;
                     me->component[j].has_component = 1;
                     me->component[j].file_index = files_count++;
                 }
@@ -842,62 +1059,60 @@ int main_utf8(int argc, char** argv)
         if (header_size == 0)
             goto out;
 
-        // Create the file entry data section (we will fill the offsets/sizes later)
+        // Create the file entry data section, with the 16-byte aligned offsets of the components
         file_entry* fe = (file_entry*)&buf[header_size];
         uint32_t fe_size = align_to_16((files_count + 1) * (uint32_t)sizeof(file_entry));
-        fwrite(buf, 1, (size_t)header_size + fe_size, file);
-
-        // Add file content to the GMPK
+        uint64_t offset = (uint64_t)header_size + fe_size;
         printf("OFFSET   SIZE     NAME\n");
         uint32_t index = 0;
-        uint8_t padding_buf[0x10] = { 0 };
         for (size_t i = 0; i < json_array_get_count(json_names_array); i++) {
             const char* name = json_object_get_string(json_array_get_object(json_names_array, i), "name");
+            model_entry* me = (model_entry*)&entry_data[i * 2 * entry_data_size];
             for (size_t j = 0; j < array_size(extension); j++) {
-                snprintf(path, sizeof(path), "%s%s%c%s%s", dir,
-                    _basename(argv[argc - 1]), PATH_SEP, name, extension[j]);
-                if (is_file(path)) {
-                    snprintf(path, sizeof(path), "%s%s%c%s%s", dir,
-                        _basename(argv[argc - 1]), PATH_SEP, name, extension[j]);
-                    uint8_t* src_buf = NULL;
-                    fe[index].offset = ftell(file) - header_size;
-                    assert(fe[index].offset % 0x10 == 0);
-                    fe[index].size = read_file(path, &src_buf);
-                    if (fe[index].size == UINT32_MAX)
-                        goto out;
-                    printf("%08x %08x %s%s\n", (uint32_t)ftell(file), fe[index].size, name, extension[j]);
-                    if (fwrite(src_buf, 1, fe[index].size, file) != fe[index].size) {
-                        fprintf(stderr, "ERROR: Can't add data from '%s'\n", path);
-                        free(src_buf);
-                        goto out;
-                    }
-                    free(src_buf);
-                    // Pad to 16 bytes
-                    if (fe[index].size % 0x10 != 0)
-                        fwrite(padding_buf, 1, 0x10 - (fe[index].size % 0x10), file);
-                    index++;
+                if (me->component[j].has_component != 1)
+                    continue;
+                gmpk_component* c = &components[index];
+                if (offset + c->size > UINT32_MAX) {
+                    fprintf(stderr, "ERROR: Archive is too large\n");
+                    goto out;
                 }
+                c->offset = (uint32_t)offset;
+                fe[index].offset = c->offset - header_size;
+                fe[index].size = c->size;
+                printf("%08x %08x %s%s\n", c->offset, c->size, name, extension[j]);
+                offset = align_to_16(offset + c->size);
+                index++;
             }
         }
-
-        // Now overwrite the file entry data
-        fe[files_count].offset = ftell(file);
-        assert(fe[files_count].offset % 0x10 == 0);
+        assert(index == files_count);
+        fe[files_count].offset = (uint32_t)offset;
         for (uint32_t i = 0; i <= 2 * files_count; i++)
             ((uint32_t*)fe)[i] = getv32(((uint32_t*)fe)[i]);
-        fseek(file, header_size, SEEK_SET);
-        if (fwrite(fe, 1, fe_size, file) != fe_size) {
-            fprintf(stderr, "ERROR: Can't write file entry data section\n");
+
+        // Set the final size, so that the padding is zeroed, then add the file content in parallel
+        if (!preallocate_file(file, offset) || !write_at(file, buf, (size_t)header_size + fe_size, 0)) {
+            fprintf(stderr, "ERROR: Can't write GMPK header\n");
             goto out;
         }
+        component_jobs jobs = { file, components };
+        run_jobs(add_component, &jobs, files_count, nb_threads);
+        for (uint32_t i = 0; i < files_count; i++)
+            if (!components[i].success)
+                goto out;
         r = 0;
     }
 
 out:
     json_value_free(json);
-    free(buf);
+    if (mapped_size != 0)
+        unmap_file(buf, mapped_size);
+    else
+        free(buf);
     free(dir);
     free(entry_data);
+    for (uint32_t i = 0; components != NULL && i < files_count; i++)
+        free(components[i].data);
+    free(components);
     if (file != NULL)
         fclose(file);
 
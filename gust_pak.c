@@ -412,6 +412,12 @@ int main_utf8(int argc, char** argv)
                 fprintf(stderr, "ERROR: Can't create path '%s'\n", _dirname(path));
                 goto out;
             }
+            // Entries that aren't encrypted are copied straight from the archive
+            if (skip_decode) {
+                if (!copy_to_file(file, entry(i, data_offset) + file_data_offset, entry(i, size), path))
+                    goto out;
+                continue;
+            }
             fseek64(file, entry(i, data_offset) + file_data_offset, SEEK_SET);
             buf = malloc(entry(i, size));
             if (buf == NULL) {
@@ -422,8 +428,7 @@ int main_utf8(int argc, char** argv)
                 fprintf(stderr, "ERROR: Can't read archive\n");
                 goto out;
             }
-            if (!skip_decode)
-                decode(buf, entry(i, key), entry(i, size), CURRENT_KEY_SIZE);
+            decode(buf, entry(i, key), entry(i, size), CURRENT_KEY_SIZE);
             if (!write_file(buf, entry(i, size), path, false))
                 goto out;
             free(buf);
@@ -16,13 +16,30 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 
 #include "utf8.h"
 #include "util.h"
 
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#endif
+#endif
+
 // Flags to indicate the endianness of the data being processed as well as the platform
 endianness data_endianness = little_endian;
 const endianness platform_endianness = little_endian;
@@ -200,6 +217,64 @@ out:
     return size;
 }
 
+uint32_t map_file_max(const char* path, uint8_t** buf, uint32_t max_size, bool writable)
+{
+    *buf = NULL;
+    FILE* file = fopen_utf8(path, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "ERROR: Can't open '%s'\n", path);
+        return UINT32_MAX;
+    }
+
+    fseek64(file, 0L, SEEK_END);
+    uint64_t file_size = ftell64(file);
+    uint32_t size = (uint32_t)((max_size != 0) ? min(file_size, max_size) : file_size);
+    if (max_size == 0 && file_size >= UINT32_MAX) {
+        fprintf(stderr, "ERROR: '%s' is too large\n", path);
+        size = UINT32_MAX;
+        goto out;
+    }
+    // Empty files can't be mapped, and there's nothing to read from them anyway
+    if (size == 0)
+        goto out;
+#if defined(_WIN32)
+    HANDLE mapping = CreateFileMappingW((HANDLE)_get_osfhandle(_fileno(file)), NULL,
+        writable ? PAGE_WRITECOPY : PAGE_READONLY, 0, 0, NULL);
+    if (mapping != NULL) {
+        *buf = MapViewOfFile(mapping, writable ? FILE_MAP_COPY : FILE_MAP_READ, 0, 0, size);
+        // The view keeps its own reference to the mapping
+        CloseHandle(mapping);
+    }
+#else
+    // A private mapping means that altering the data, which only happens when writable
+    // is set, gets the pages that are modified copied rather than written to the file.
+    void* addr = mmap(NULL, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_PRIVATE,
+        fileno(file), 0);
+    if (addr != MAP_FAILED) {
+        *buf = addr;
+        madvise(addr, size, MADV_SEQUENTIAL);
+    }
+#endif
+    if (*buf == NULL) {
+        fprintf(stderr, "ERROR: Can't map '%s'\n", path);
+        size = UINT32_MAX;
+    }
+out:
+    fclose(file);
+    return size;
+}
+
+void unmap_file(uint8_t* buf, uint32_t size)
+{
+    if (buf == NULL || size == 0 || size == UINT32_MAX)
+        return;
+#if defined(_WIN32)
+    UnmapViewOfFile(buf);
+#else
+    munmap(buf, size);
+#endif
+}
+
 uint64_t get_file_size(const char* path)
 {
     FILE* file = fopen_utf8(path, "rb");
@@ -215,6 +290,11 @@ uint64_t get_file_size(const char* path)
 }
 
 void create_backup(const char* path)
+{
+    create_backup_log(path, NULL);
+}
+
+void create_backup_log(const char* path, job_log* log)
 {
     struct stat64_t st;
     if (stat64_utf8(path, &st) == 0) {
@@ -225,9 +305,9 @@ void create_backup(const char* path)
         strcat(backup_path, ".bak");
         if (stat64_utf8(backup_path, &st) != 0) {
             if (rename_utf8(path, backup_path) == 0)
-                printf("Saved backup as '%s'\n", backup_path);
+                log_printf(log, stdout, "Saved backup as '%s'\n", backup_path);
             else
-                fprintf(stderr, "WARNING: Could not create backup file '%s\n", backup_path);
+                log_printf(log, stderr, "WARNING: Could not create backup file '%s\n", backup_path);
         }
         free(backup_path);
     }
@@ -248,3 +328,413 @@ bool write_file(const uint8_t* buf, const uint32_t size, const char* path, const
         fprintf(stderr, "ERROR: Can't write file '%s'\n", path);
     return r;
 }
+
+bool copy_to_file(FILE* src, uint64_t offset, uint64_t size, const char* path)
+{
+    FILE* file = fopen_utf8(path, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "ERROR: Can't create file '%s'\n", path);
+        return false;
+    }
+    uint8_t* buf = NULL;
+#if defined(_WIN32)
+    HANDLE h = (HANDLE)_get_osfhandle(_fileno(src));
+#else
+    int in = fileno(src), out = fileno(file);
+#if defined(__linux__)
+    // Let the kernel do the copy, which also shares the blocks on file systems that
+    // support reflinks, and fall back to sendfile() if that fails (e.g. on older kernels
+    // or across file systems). Both leave the file position of src alone.
+    loff_t in_off = (loff_t)offset;
+    while (size > 0) {
+        ssize_t n = copy_file_range(in, &in_off, out, NULL, (size_t)min(size, 0x40000000), 0);
+        if (n <= 0)
+            break;
+        size -= (uint64_t)n;
+    }
+    off_t sf_off = (off_t)in_off;
+    while (size > 0) {
+        ssize_t n = sendfile(out, in, &sf_off, (size_t)min(size, 0x40000000));
+        if (n <= 0)
+            break;
+        size -= (uint64_t)n;
+    }
+    offset = (uint64_t)sf_off;
+#endif
+#endif
+    // Whatever is left goes through a buffer
+    if (size > 0) {
+        buf = malloc((size_t)min(size, 0x100000));
+        if (buf == NULL)
+            goto out;
+    }
+    while (size > 0) {
+        size_t chunk_size = (size_t)min(size, 0x100000);
+#if defined(_WIN32)
+        // The offset makes the read independent of the file pointer, but since src is not
+        // opened for overlapped I/O, the file pointer still ends up after the data read.
+        OVERLAPPED ov = { 0 };
+        DWORD n;
+        ov.Offset = (DWORD)offset;
+        ov.OffsetHigh = (DWORD)(offset >> 32);
+        if (!ReadFile(h, buf, (DWORD)chunk_size, &n, &ov) || n == 0)
+            break;
+        if (fwrite(buf, 1, n, file) != n)
+            break;
+#else
+        ssize_t n = pread(in, buf, chunk_size, (off_t)offset);
+        if (n <= 0 || write(out, buf, (size_t)n) != n)
+            break;
+#endif
+        offset += (uint64_t)n;
+        size -= (uint64_t)n;
+    }
+
+out:
+    free(buf);
+    if (fclose(file) != 0)
+        size = 1;
+    if (size != 0)
+        fprintf(stderr, "ERROR: Can't copy data to '%s'\n", path);
+    return (size == 0);
+}
+
+bool write_chunks(FILE* file, const io_chunk* chunks, uint32_t nb_chunks)
+{
+#if defined(_WIN32)
+    for (uint32_t i = 0; i < nb_chunks; i++)
+        if (chunks[i].size != 0 && fwrite(chunks[i].data, 1, chunks[i].size, file) != chunks[i].size)
+            return false;
+    return true;
+#else
+#if !defined(IOV_MAX)
+#define IOV_MAX 1024
+#endif
+    // Whatever was buffered by stdio must go first
+    if (fflush(file) != 0)
+        return false;
+    int fd = fileno(file);
+    struct iovec iov[64];
+    uint32_t i = 0;
+    size_t done = 0;    // Bytes already written from chunks[i]
+    while (i < nb_chunks) {
+        int n = 0;
+        for (uint32_t j = i; j < nb_chunks && n < (int)min(array_size(iov), IOV_MAX); j++, n++) {
+            size_t skip = (j == i) ? done : 0;
+            iov[n].iov_base = (uint8_t*)chunks[j].data + skip;
+            iov[n].iov_len = chunks[j].size - skip;
+        }
+        ssize_t r = writev(fd, iov, n);
+        if (r < 0)
+            return false;
+        // Short writes are legitimate, so skip past whatever made it to the file
+        size_t left = (size_t)r;
+        for (; i < nb_chunks && left >= chunks[i].size - done; i++) {
+            left -= chunks[i].size - done;
+            done = 0;
+        }
+        done += left;
+    }
+    return true;
+#endif
+}
+
+bool write_at(FILE* file, const void* buf, size_t size, uint64_t offset)
+{
+#if defined(_WIN32)
+    HANDLE h = (HANDLE)_get_osfhandle(_fileno(file));
+    while (size > 0) {
+        OVERLAPPED ov = { 0 };
+        DWORD written;
+        ov.Offset = (DWORD)offset;
+        ov.OffsetHigh = (DWORD)(offset >> 32);
+        if (!WriteFile(h, buf, (DWORD)min(size, 0x40000000), &written, &ov) || written == 0)
+            return false;
+        buf = (const uint8_t*)buf + written;
+        size -= written;
+        offset += written;
+    }
+#else
+    int fd = fileno(file);
+    while (size > 0) {
+        ssize_t r = pwrite(fd, buf, size, (off_t)offset);
+        if (r <= 0)
+            return false;
+        buf = (const uint8_t*)buf + r;
+        size -= (size_t)r;
+        offset += (uint64_t)r;
+    }
+#endif
+    return true;
+}
+
+bool preallocate_file(FILE* file, uint64_t size)
+{
+    if (fflush(file) != 0)
+        return false;
+#if defined(_WIN32)
+    return (_chsize_s(_fileno(file), (__int64)size) == 0);
+#else
+    int fd = fileno(file);
+#if defined(__linux__)
+    // Reserve the blocks up front, when the file system allows it
+    if (fallocate(fd, 0, 0, (off_t)size) == 0)
+        return true;
+#endif
+    return (ftruncate(fd, (off_t)size) == 0);
+#endif
+}
+
+uint64_t hash64(const void* data, size_t size, uint64_t seed)
+{
+    const uint8_t* p = (const uint8_t*)data;
+    uint64_t h = (0xcbf29ce484222325ULL ^ seed) + size * 0x9e3779b97f4a7c15ULL;
+    // Process 8 bytes at a time, with a shift to fold the high bits back in
+    for (; size >= 8; size -= 8, p += 8) {
+        // The data doesn't have to be aligned
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        h = (h ^ getle64(&v)) * 0x100000001b3ULL;
+        h ^= h >> 29;
+    }
+    for (; size > 0; size--, p++)
+        h = (h ^ *p) * 0x100000001b3ULL;
+    // Final avalanche, from MurmurHash3
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static bool find_files_in(const char* dir, const char* extension, char*** files, uint32_t* nb_files);
+
+// Add a directory entry to the list if it has the extension we want, or look into it if
+// it's a directory.
+static bool add_entry(const char* dir, const char* name, const char* extension,
+                      char*** files, uint32_t* nb_files)
+{
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+        return true;
+    size_t len = strlen(dir) + strlen(name) + 2;
+    char* path = malloc(len);
+    if (path == NULL)
+        return false;
+    if (get_trailing_slash(dir) == strlen(dir))
+        snprintf(path, len, "%s%s", dir, name);
+    else
+        snprintf(path, len, "%s%c%s", dir, PATH_SEP, name);
+    if (is_directory(path)) {
+        bool r = find_files_in(path, extension, files, nb_files);
+        free(path);
+        return r;
+    }
+    size_t name_len = strlen(name), ext_len = strlen(extension);
+    if (name_len <= ext_len || stricmp(&name[name_len - ext_len], extension) != 0) {
+        free(path);
+        return true;
+    }
+    if (is_power_of_2(*nb_files)) {
+        char** new_files = realloc(*files, max(16, 2 * (size_t)*nb_files) * sizeof(char*));
+        if (new_files == NULL) {
+            free(path);
+            return false;
+        }
+        *files = new_files;
+    }
+    (*files)[(*nb_files)++] = path;
+    return true;
+}
+
+static bool find_files_in(const char* dir, const char* extension, char*** files, uint32_t* nb_files)
+{
+    bool r = true;
+#if defined(_WIN32)
+    WIN32_FIND_DATAW fd;
+    char* pattern = malloc(strlen(dir) + 3);
+    if (pattern == NULL)
+        return false;
+    sprintf(pattern, "%s%c*", dir, PATH_SEP);
+    wchar_t* pattern16 = utf8_to_utf16(pattern);
+    HANDLE h = FindFirstFileW(pattern16, &fd);
+    free(pattern16);
+    free(pattern);
+    if (h == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "ERROR: Can't list directory '%s'\n", dir);
+        return false;
+    }
+    do {
+        char* name = utf16_to_utf8(fd.cFileName);
+        r = (name != NULL) && add_entry(dir, name, extension, files, nb_files);
+        free(name);
+    } while (r && FindNextFileW(h, &fd));
+    FindClose(h);
+#else
+    DIR* d = opendir(dir);
+    if (d == NULL) {
+        fprintf(stderr, "ERROR: Can't list directory '%s'\n", dir);
+        return false;
+    }
+    struct dirent* entry;
+    while (r && (entry = readdir(d)) != NULL)
+        r = add_entry(dir, entry->d_name, extension, files, nb_files);
+    closedir(d);
+#endif
+    return r;
+}
+
+static int compare_paths(const void* a, const void* b)
+{
+    return strcmp(*(const char* const*)a, *(const char* const*)b);
+}
+
+uint32_t find_files(const char* dir, const char* extension, char*** files)
+{
+    uint32_t nb_files = 0;
+    *files = NULL;
+    if (!find_files_in(dir, extension, files, &nb_files)) {
+        for (uint32_t i = 0; i < nb_files; i++)
+            free((*files)[i]);
+        free(*files);
+        *files = NULL;
+        return UINT32_MAX;
+    }
+    if (nb_files > 1)
+        qsort(*files, nb_files, sizeof(char*), compare_paths);
+    return nb_files;
+}
+
+
+typedef struct {
+    job_function fn;
+    void* ctx;
+    uint32_t nb_jobs;
+#if defined(_WIN32)
+    volatile LONG next;
+#else
+    uint32_t next;
+#endif
+} job_queue;
+
+// Keep picking jobs from the queue until there are none left
+static void process_jobs(job_queue* q)
+{
+    while (true) {
+#if defined(_WIN32)
+        uint32_t i = (uint32_t)InterlockedIncrement(&q->next) - 1;
+#else
+        uint32_t i = __atomic_fetch_add(&q->next, 1, __ATOMIC_RELAXED);
+#endif
+        if (i >= q->nb_jobs)
+            break;
+        q->fn(q->ctx, i);
+    }
+}
+
+#if defined(_WIN32)
+static DWORD WINAPI job_thread(LPVOID param)
+{
+    process_jobs((job_queue*)param);
+    return 0;
+}
+#else
+static void* job_thread(void* param)
+{
+    process_jobs((job_queue*)param);
+    return NULL;
+}
+#endif
+
+void run_jobs(job_function fn, void* ctx, uint32_t nb_jobs, uint32_t nb_threads)
+{
+    job_queue q = { fn, ctx, nb_jobs, 0 };
+    uint32_t nb_started = 0;
+    nb_threads = min(nb_threads, nb_jobs);
+    // The calling thread also processes jobs, so we only need nb_threads - 1 extra threads
+#if defined(_WIN32)
+    HANDLE* threads = (nb_threads > 1) ? calloc(nb_threads - 1, sizeof(HANDLE)) : NULL;
+    for (; threads != NULL && nb_started < nb_threads - 1; nb_started++) {
+        threads[nb_started] = CreateThread(NULL, 0, job_thread, &q, 0, NULL);
+        if (threads[nb_started] == NULL)
+            break;
+    }
+#else
+    pthread_t* threads = (nb_threads > 1) ? calloc(nb_threads - 1, sizeof(pthread_t)) : NULL;
+    for (; threads != NULL && nb_started < nb_threads - 1; nb_started++) {
+        if (pthread_create(&threads[nb_started], NULL, job_thread, &q) != 0)
+            break;
+    }
+#endif
+    // If we couldn't create some of the threads, the remaining ones just get more work
+    process_jobs(&q);
+    for (uint32_t i = 0; i < nb_started; i++) {
+#if defined(_WIN32)
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+#else
+        pthread_join(threads[i], NULL);
+#endif
+    }
+    free(threads);
+}
+
+double get_time(void)
+{
+#if defined(_WIN32)
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+#endif
+}
+
+uint32_t get_nb_cpus(void)
+{
+#if defined(_WIN32)
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    return (uint32_t)si.dwNumberOfProcessors;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return (n > 0) ? (uint32_t)n : 1;
+#endif
+}
+
+void log_printf(job_log* log, FILE* stream, const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    if (log == NULL) {
+        vfprintf(stream, format, args);
+    } else {
+        char** text = (stream == stderr) ? &log->err : &log->out;
+        const size_t len = (*text == NULL) ? 0 : strlen(*text);
+        va_list args_copy;
+        va_copy(args_copy, args);
+        const int size = vsnprintf(NULL, 0, format, args_copy);
+        va_end(args_copy);
+        char* new_text = (size < 0) ? NULL : realloc(*text, len + size + 1);
+        if (new_text != NULL) {
+            vsnprintf(&new_text[len], (size_t)size + 1, format, args);
+            *text = new_text;
+        }
+    }
+    va_end(args);
+}
+
+void print_log(job_log* log)
+{
+    if (log->out != NULL)
+        fputs(log->out, stdout);
+    if (log->err != NULL)
+        fputs(log->err, stderr);
+    free(log->out);
+    free(log->err);
+    log->out = NULL;
+    log->err = NULL;
+}
@@ -26,6 +26,7 @@
 #include <libgen.h>
 #endif
 #include <stdbool.h>
+#include <stdio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
@@ -123,6 +124,12 @@ char* _dirname_unix(const char* path);
 #define bswap_uint64 __builtin_bswap64
 #endif
 
+// SSE2 is always available on x86_64 and is the MSVC default for x86
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define USE_SSE2
+#include <emmintrin.h>
+#endif
+
 #define BSWAP_UINT16(x) x = bswap_uint16(x)
 #define BSWAP_UINT32(x) x = bswap_uint32(x)
 #define BSWAP_UINT64(x) x = bswap_uint64(x)
@@ -281,6 +288,35 @@ static __inline void fix_endian32(void* buffer, size_t nb_elts)
             BSWAP_UINT32(((uint32_t*)buffer)[i]);
 }
 
+// Same as getv16(), getv32() and fix_endian32(), for data of a given endianness rather
+// than of data_endianness, so that data of different endianness can be processed at once
+static __inline uint16_t getv16_e(uint16_t v, endianness e)
+{
+    return (platform_endianness == e) ? v : bswap_uint16(v);
+}
+
+static __inline uint16_t getp16_e(const void* p, endianness e)
+{
+    return getv16_e(*(const uint16_t*)(const uint8_t*)(p), e);
+}
+
+static __inline uint32_t getv32_e(uint32_t v, endianness e)
+{
+    return (platform_endianness == e) ? v : bswap_uint32(v);
+}
+
+static __inline uint32_t getp32_e(const void* p, endianness e)
+{
+    return getv32_e(*(const uint32_t*)(const uint8_t*)(p), e);
+}
+
+static __inline void fix_endian32_e(void* buffer, size_t nb_elts, endianness e)
+{
+    if (platform_endianness != e)
+        for (size_t i = 0; i < nb_elts; i++)
+            BSWAP_UINT32(((uint32_t*)buffer)[i]);
+}
+
 static __inline uint64_t getle64(const void* p)
 {
     uint64_t v = *(const uint64_t*)(const uint8_t*)(p);
@@ -328,6 +364,61 @@ bool is_directory(const char* path);
 
 uint32_t read_file_max(const char* path, uint8_t** buf, uint32_t max_size);
 #define read_file(path, buf) read_file_max(path, buf, 0)
+// Same as read_file_max(), except that the file is mapped into memory rather than read,
+// so that its pages only get loaded when accessed. The mapping is private, and, if
+// writable is set, can be altered without affecting the file. The buffer, which is NULL
+// for an empty file, must be released with unmap_file().
+uint32_t map_file_max(const char* path, uint8_t** buf, uint32_t max_size, bool writable);
+#define map_file(path, buf, writable) map_file_max(path, buf, 0, writable)
+void unmap_file(uint8_t* buf, uint32_t size);
 uint64_t get_file_size(const char* path);
 void create_backup(const char* path);
 bool write_file(const uint8_t* buf, const uint32_t size, const char* path, const bool backup);
+// Create a file from the size bytes found at offset in src. Every read is done at an explicit
+// offset, so that separate parts of src can be copied concurrently. Where the platform allows
+// it, the copy is done by the kernel, without the data ever going through user space.
+// On Windows, the file pointer of src is still moved by the reads, so callers must seek
+// before reading src again.
+bool copy_to_file(FILE* src, uint64_t offset, uint64_t size, const char* path);
+
+// Write a set of buffers to a file in order, with vectored writes where available
+typedef struct {
+    const void* data;
+    size_t size;
+} io_chunk;
+bool write_chunks(FILE* file, const io_chunk* chunks, uint32_t nb_chunks);
+
+// Write a buffer at a given offset of a file, without using the file position, so that
+// separate parts of a file can be written concurrently. Don't mix with buffered writes.
+bool write_at(FILE* file, const void* buf, size_t size, uint64_t offset);
+// Set the size of a file ahead of writing it, with its blocks allocated where supported
+bool preallocate_file(FILE* file, uint64_t size);
+
+// Non-cryptographic 64-bit hash of a buffer, for content comparison
+uint64_t hash64(const void* data, size_t size, uint64_t seed);
+
+// Recursively look for the files under dir that have the given extension (case insensitive).
+// Returns the number of files found, or UINT32_MAX on error, with the sorted paths in *files.
+// The caller must free *files as well as each of its entries.
+uint32_t find_files(const char* dir, const char* extension, char*** files);
+
+// Run fn(ctx, i) for i in [0, nb_jobs), using up to nb_threads threads
+typedef void (*job_function)(void* ctx, uint32_t index);
+void run_jobs(job_function fn, void* ctx, uint32_t nb_jobs, uint32_t nb_threads);
+uint32_t get_nb_cpus(void);
+
+// Text printed by a job, which the main thread prints once the job is done, so that
+// the output of concurrent jobs doesn't get mixed up
+typedef struct {
+    char* out;
+    char* err;
+} job_log;
+// Same as fprintf(stream, ...) if log is NULL, else append the text to log
+void log_printf(job_log* log, FILE* stream, const char* format, ...);
+// Print the text of a log to stdout and stderr, and release it
+void print_log(job_log* log);
+// Same as create_backup(), with the text going through log_printf()
+void create_backup_log(const char* path, job_log* log);
+
+// Monotonic time, in seconds, for measuring durations
+double get_time(void);